@@ -567,6 +567,39 @@ static void kvm_slot_reset_dirty_pages(KVMSlot *slot)
     memset(slot->dirty_bmap, 0, slot->dirty_bmap_size);
 }
 
+/*
+ * The dirty ring marks pages in chunks of the slot bitmap, so that only
+ * those have to be synced and reset.  This makes collecting the ring scale
+ * with the number of dirtied pages instead of the size of the slot.
+ */
+#define KVM_DIRTY_CHUNK_PAGES (64 * BITS_PER_LONG)
+
+static unsigned long kvm_slot_dirty_chunks(KVMSlot *slot)
+{
+    return DIV_ROUND_UP(slot->memory_size / qemu_real_host_page_size(),
+                        KVM_DIRTY_CHUNK_PAGES);
+}
+
+/* sync and reset the chunks of the slot bitmap the dirty ring marked */
+static void kvm_slot_sync_dirty_chunks(KVMSlot *slot)
+{
+    ram_addr_t pages = slot->memory_size / qemu_real_host_page_size();
+    unsigned long chunks = kvm_slot_dirty_chunks(slot);
+    unsigned long chunk;
+
+    for (chunk = find_first_bit(slot->dirty_chunks, chunks); chunk < chunks;
+         chunk = find_next_bit(slot->dirty_chunks, chunks, chunk + 1)) {
+        ram_addr_t first = chunk * KVM_DIRTY_CHUNK_PAGES;
+        ram_addr_t num = MIN(KVM_DIRTY_CHUNK_PAGES, pages - first);
+        unsigned long *bmap = slot->dirty_bmap + BIT_WORD(first);
+
+        cpu_physical_memory_set_dirty_lebitmap(bmap,
+            slot->ram_start_offset + first * qemu_real_host_page_size(), num);
+        memset(bmap, 0, BITS_TO_LONGS(num) * sizeof(unsigned long));
+    }
+    bitmap_zero(slot->dirty_chunks, chunks);
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /* Allocate the dirty bitmap for a slot  */
@@ -597,6 +630,7 @@ static void kvm_slot_init_dirty_bitmap(KVMSlot *mem)
                                         /*HOST_LONG_BITS*/ 64) / 8;
     mem->dirty_bmap = g_malloc0(bitmap_size);
     mem->dirty_bmap_size = bitmap_size;
+    mem->dirty_chunks = bitmap_new(kvm_slot_dirty_chunks(mem));
 }
 
 /*
@@ -643,6 +677,7 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
     }
 
     set_bit(offset, mem->dirty_bmap);
+    set_bit(offset / KVM_DIRTY_CHUNK_PAGES, mem->dirty_chunks);
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -1374,6 +1409,8 @@ static void kvm_set_phys_mem(KVMMemoryListener *kml,
             /* unregister the slot */
             g_free(mem->dirty_bmap);
             mem->dirty_bmap = NULL;
+            g_free(mem->dirty_chunks);
+            mem->dirty_chunks = NULL;
             mem->memory_size = 0;
             mem->flags = 0;
             err = kvm_set_user_memory_region(kml, mem, false);
@@ -1648,19 +1685,19 @@ static void kvm_log_sync_global(MemoryListener *l, bool last_stage)
     for (i = 0; i < s->nr_slots; i++) {
         mem = &kml->slots[i];
         if (mem->memory_size && mem->flags & KVM_MEM_LOG_DIRTY_PAGES) {
-            kvm_slot_sync_dirty_pages(mem);
+            kvm_slot_sync_dirty_chunks(mem);
 
             if (s->kvm_dirty_ring_with_bitmap && last_stage &&
                 kvm_slot_get_dirty_log(s, mem)) {
                 kvm_slot_sync_dirty_pages(mem);
-            }
 
-            /*
-             * This is not needed by KVM_GET_DIRTY_LOG because the
-             * ioctl will unconditionally overwrite the whole region.
-             * However kvm dirty ring has no such side effect.
-             */
-            kvm_slot_reset_dirty_pages(mem);
+                /*
+                 * This is not needed by KVM_GET_DIRTY_LOG because the
+                 * ioctl will unconditionally overwrite the whole region.
+                 * However kvm dirty ring has no such side effect.
+                 */
+                kvm_slot_reset_dirty_pages(mem);
+            }
         }
     }
     kvm_slots_unlock();
@@ -0,0 +1,375 @@
+/*
+ * In-memory overlay for block replication
+ *
+ * Holds the active and hidden disk of the secondary in RAM.  Writes are
+ * kept in clusters in memory, reads of sectors that were never written
+ * go to the backing file.  Emptying the overlay at a checkpoint swaps in
+ * an empty map and frees the old one in the thread pool, so it takes
+ * constant time and doesn't touch any disk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu/bitmap.h"
+#include "qemu/hbitmap.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+
+#define OVERLAY_CLUSTER_BITS 16
+#define OVERLAY_CLUSTER_SIZE (1 << OVERLAY_CLUSTER_BITS)
+#define OVERLAY_CLUSTER_SECTORS (OVERLAY_CLUSTER_SIZE >> BDRV_SECTOR_BITS)
+
+/* Maps with fewer clusters are freed right away */
+#define OVERLAY_FREE_ASYNC_CLUSTERS 64
+
+typedef struct OverlayCluster {
+    uint64_t index;
+    /* Sectors of @data that were written */
+    unsigned long valid[BITS_TO_LONGS(OVERLAY_CLUSTER_SECTORS)];
+    uint8_t data[];
+} OverlayCluster;
+
+typedef struct OverlayMap {
+    /* Cluster index -> OverlayCluster */
+    GHashTable *clusters;
+    /* Clusters in @clusters, to skip unallocated areas quickly */
+    HBitmap *allocated;
+} OverlayMap;
+
+typedef struct BDRVReplicationOverlayState {
+    int64_t length;
+    OverlayMap *map;
+} BDRVReplicationOverlayState;
+
+static QemuOptsList runtime_opts = {
+    .name = "replication-overlay",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the overlay",
+        },
+        { /* end of list */ }
+    },
+};
+
+static OverlayMap *overlay_map_new(int64_t length)
+{
+    OverlayMap *map = g_new0(OverlayMap, 1);
+
+    map->clusters = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                          NULL, g_free);
+    map->allocated = hbitmap_alloc(DIV_ROUND_UP(length, OVERLAY_CLUSTER_SIZE),
+                                   0);
+    return map;
+}
+
+static int overlay_map_free(void *opaque)
+{
+    OverlayMap *map = opaque;
+
+    g_hash_table_destroy(map->clusters);
+    hbitmap_free(map->allocated);
+    g_free(map);
+    return 0;
+}
+
+static OverlayCluster *overlay_lookup(OverlayMap *map, uint64_t index)
+{
+    return g_hash_table_lookup(map->clusters, &index);
+}
+
+/*
+ * Return the number of bytes from @offset on, up to @bytes, that are not
+ * in any cluster of @map.
+ */
+static int64_t overlay_unallocated(OverlayMap *map, int64_t offset,
+                                   int64_t bytes)
+{
+    uint64_t first = offset >> OVERLAY_CLUSTER_BITS;
+    uint64_t last = (offset + bytes - 1) >> OVERLAY_CLUSTER_BITS;
+    int64_t next;
+
+    next = hbitmap_next_dirty(map->allocated, first, last - first + 1);
+    if (next < 0) {
+        return bytes;
+    }
+    return MIN(((int64_t)next << OVERLAY_CLUSTER_BITS) - offset, bytes);
+}
+
+/*
+ * Return the number of bytes from @offset on, up to @bytes, that are the
+ * same as the first in whether they were written.  Sets @cluster to the
+ * cluster holding them if they were, NULL otherwise.
+ */
+static int64_t overlay_extent(OverlayMap *map, int64_t offset, int64_t bytes,
+                              OverlayCluster **cluster)
+{
+    uint64_t start = offset & (OVERLAY_CLUSTER_SIZE - 1);
+    unsigned long first, last, end;
+
+    *cluster = overlay_lookup(map, offset >> OVERLAY_CLUSTER_BITS);
+    if (!*cluster) {
+        return overlay_unallocated(map, offset, bytes);
+    }
+
+    bytes = MIN(bytes, OVERLAY_CLUSTER_SIZE - start);
+    first = start >> BDRV_SECTOR_BITS;
+    last = first + (bytes >> BDRV_SECTOR_BITS);
+
+    if (test_bit(first, (*cluster)->valid)) {
+        end = find_next_zero_bit((*cluster)->valid, last, first);
+    } else {
+        end = find_next_bit((*cluster)->valid, last, first);
+        *cluster = NULL;
+    }
+    return (int64_t)(end - first) << BDRV_SECTOR_BITS;
+}
+
+static int replication_overlay_open(BlockDriverState *bs, QDict *options,
+                                    int flags, Error **errp)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+    QemuOpts *opts;
+    int ret = 0;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->length = qemu_opt_get_size(opts, BLOCK_OPT_SIZE, 0);
+    if (!s->length || !QEMU_IS_ALIGNED(s->length, BDRV_SECTOR_SIZE)) {
+        error_setg(errp, "The option " BLOCK_OPT_SIZE " must be a non-zero "
+                   "multiple of %u", BDRV_SECTOR_SIZE);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    s->map = overlay_map_new(s->length);
+    bs->supported_write_flags = BDRV_REQ_FUA;
+
+out:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void replication_overlay_close(BlockDriverState *bs)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+
+    overlay_map_free(s->map);
+}
+
+static void replication_overlay_refresh_limits(BlockDriverState *bs,
+                                               Error **errp)
+{
+    bs->bl.request_alignment = BDRV_SECTOR_SIZE;
+}
+
+static int replication_overlay_reopen_prepare(BDRVReopenState *reopen_state,
+                                              BlockReopenQueue *queue,
+                                              Error **errp)
+{
+    return 0;
+}
+
+static int64_t coroutine_fn
+replication_overlay_co_getlength(BlockDriverState *bs)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+
+    return s->length;
+}
+
+static int64_t coroutine_fn
+replication_overlay_co_get_allocated_file_size(BlockDriverState *bs)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+
+    return (int64_t)g_hash_table_size(s->map->clusters) * OVERLAY_CLUSTER_SIZE;
+}
+
+static int coroutine_fn
+replication_overlay_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    bdi->cluster_size = OVERLAY_CLUSTER_SIZE;
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+replication_overlay_co_preadv_part(BlockDriverState *bs,
+                                   int64_t offset, int64_t bytes,
+                                   QEMUIOVector *qiov, size_t qiov_offset,
+                                   BdrvRequestFlags flags)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+    OverlayCluster *cluster;
+    int64_t n;
+    int ret;
+
+    while (bytes) {
+        /* The map may be swapped while reading the backing file */
+        n = overlay_extent(s->map, offset, bytes, &cluster);
+
+        if (cluster) {
+            qemu_iovec_from_buf(qiov, qiov_offset,
+                                cluster->data +
+                                (offset & (OVERLAY_CLUSTER_SIZE - 1)), n);
+        } else if (bs->backing) {
+            ret = bdrv_co_preadv_part(bs->backing, offset, n, qiov,
+                                      qiov_offset, 0);
+            if (ret < 0) {
+                return ret;
+            }
+        } else {
+            qemu_iovec_memset(qiov, qiov_offset, 0, n);
+        }
+
+        offset += n;
+        qiov_offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Write @bytes from @qiov at @offset to the overlay, or zeroes if @qiov is
+ * NULL.  This doesn't yield, so it is atomic against other requests and
+ * against emptying the overlay.
+ */
+static int overlay_write(BDRVReplicationOverlayState *s,
+                         int64_t offset, int64_t bytes,
+                         QEMUIOVector *qiov, size_t qiov_offset)
+{
+    OverlayMap *map = s->map;
+    OverlayCluster *cluster;
+    uint64_t index, start;
+    int64_t n;
+
+    while (bytes) {
+        index = offset >> OVERLAY_CLUSTER_BITS;
+        start = offset & (OVERLAY_CLUSTER_SIZE - 1);
+        n = MIN(bytes, OVERLAY_CLUSTER_SIZE - start);
+
+        cluster = overlay_lookup(map, index);
+        if (!cluster) {
+            cluster = g_try_malloc(sizeof(*cluster) + OVERLAY_CLUSTER_SIZE);
+            if (!cluster) {
+                return -ENOMEM;
+            }
+            cluster->index = index;
+            bitmap_zero(cluster->valid, OVERLAY_CLUSTER_SECTORS);
+            g_hash_table_insert(map->clusters, &cluster->index, cluster);
+            hbitmap_set(map->allocated, index, 1);
+        }
+
+        if (qiov) {
+            qemu_iovec_to_buf(qiov, qiov_offset, cluster->data + start, n);
+            qiov_offset += n;
+        } else {
+            memset(cluster->data + start, 0, n);
+        }
+        bitmap_set(cluster->valid, start >> BDRV_SECTOR_BITS,
+                   n >> BDRV_SECTOR_BITS);
+
+        offset += n;
+        bytes -= n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn
+replication_overlay_co_pwritev_part(BlockDriverState *bs,
+                                    int64_t offset, int64_t bytes,
+                                    QEMUIOVector *qiov, size_t qiov_offset,
+                                    BdrvRequestFlags flags)
+{
+    return overlay_write(bs->opaque, offset, bytes, qiov, qiov_offset);
+}
+
+static int coroutine_fn
+replication_overlay_co_pwrite_zeroes(BlockDriverState *bs,
+                                     int64_t offset, int64_t bytes,
+                                     BdrvRequestFlags flags)
+{
+    return overlay_write(bs->opaque, offset, bytes, NULL, 0);
+}
+
+static int coroutine_fn
+replication_overlay_co_block_status(BlockDriverState *bs,
+                                    bool want_zero, int64_t offset,
+                                    int64_t bytes, int64_t *pnum,
+                                    int64_t *map, BlockDriverState **file)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+    OverlayCluster *cluster;
+
+    *pnum = overlay_extent(s->map, offset, bytes, &cluster);
+    return cluster ? BDRV_BLOCK_DATA : 0;
+}
+
+static int replication_overlay_make_empty(BlockDriverState *bs)
+{
+    BDRVReplicationOverlayState *s = bs->opaque;
+    OverlayMap *old = s->map;
+
+    s->map = overlay_map_new(s->length);
+
+    if (g_hash_table_size(old->clusters) < OVERLAY_FREE_ASYNC_CLUSTERS) {
+        overlay_map_free(old);
+    } else {
+        thread_pool_submit(overlay_map_free, old);
+    }
+    return 0;
+}
+
+static const char *const replication_overlay_strong_runtime_opts[] = {
+    BLOCK_OPT_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_replication_overlay = {
+    .format_name                = "replication-overlay",
+    .instance_size              = sizeof(BDRVReplicationOverlayState),
+
+    .bdrv_open                  = replication_overlay_open,
+    .bdrv_close                 = replication_overlay_close,
+    .bdrv_child_perm            = bdrv_default_perms,
+    .bdrv_refresh_limits        = replication_overlay_refresh_limits,
+    .bdrv_reopen_prepare        = replication_overlay_reopen_prepare,
+
+    .bdrv_co_getlength          = replication_overlay_co_getlength,
+    .bdrv_co_get_allocated_file_size =
+                        replication_overlay_co_get_allocated_file_size,
+    .bdrv_co_get_info           = replication_overlay_co_get_info,
+
+    .bdrv_co_preadv_part        = replication_overlay_co_preadv_part,
+    .bdrv_co_pwritev_part       = replication_overlay_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = replication_overlay_co_pwrite_zeroes,
+    .bdrv_co_block_status       = replication_overlay_co_block_status,
+    .bdrv_make_empty            = replication_overlay_make_empty,
+
+    .is_format                  = true,
+    .supports_backing           = true,
+
+    .strong_runtime_opts        = replication_overlay_strong_runtime_opts,
+};
+
+static void bdrv_replication_overlay_init(void)
+{
+    bdrv_register(&bdrv_replication_overlay);
+}
+
+block_init(bdrv_replication_overlay_init);
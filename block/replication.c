@@ -634,15 +634,17 @@ static void replication_start(ReplicationState *rs, ReplicationMode mode,
     aio_context_release(aio_context);
 }
 
+/*
+ * Called in a coroutine of the main loop by replication_do_checkpoint_all().
+ * The AioContext of bs is not acquired: emptying the overlays yields, and
+ * the lock must not be held across a yield while other coroutines and the
+ * iothread of bs keep running.
+ */
 static void replication_do_checkpoint(ReplicationState *rs, Error **errp)
 {
     BlockDriverState *bs = rs->opaque;
-    BDRVReplicationState *s;
-    AioContext *aio_context;
+    BDRVReplicationState *s = bs->opaque;
 
-    aio_context = bdrv_get_aio_context(bs);
-    aio_context_acquire(aio_context);
-    s = bs->opaque;
     s->bytes_written = 0;
 
     if (s->stage == BLOCK_REPLICATION_DONE ||
@@ -652,14 +654,12 @@ static void replication_do_checkpoint(ReplicationState *rs, Error **errp)
          * Ignore the request because the secondary side of replication
          * doesn't have to do anything anymore.
          */
-        aio_context_release(aio_context);
         return;
     }
 
     if (s->mode == REPLICATION_MODE_SECONDARY) {
         secondary_do_checkpoint(bs, errp);
     }
-    aio_context_release(aio_context);
 }
 
 static void replication_get_error(ReplicationState *rs, Error **errp)
@@ -104,7 +104,9 @@ struct ReplicationState {
  * ReplicationOps:
  * @start: callback to start replication
  * @stop: callback to stop replication
- * @checkpoint: callback to do checkpoint
+ * @checkpoint: callback to do checkpoint, called in a coroutine of the
+ *     main loop, concurrently with the checkpoints of the other instances.
+ *     It must not hold an AioContext lock across a yield
  * @get_error: callback to check if error occurred during replication
  */
 struct ReplicationOps {
@@ -151,6 +153,9 @@ void replication_start_all(ReplicationMode mode, Error **errp);
  * @errp: returns an error if this function fails
  *
  * This interface is called after all VM state is transferred to Secondary QEMU
+ *
+ * The checkpoints of all instances are done concurrently, each in its own
+ * coroutine, so that their I/O overlaps.  Returns once all are done.
  */
 void replication_do_checkpoint_all(Error **errp);
 
@@ -29,6 +29,8 @@ struct RAMBlock {
     struct MemoryRegion *mr;
     uint8_t *host;
     uint8_t *colo_cache; /* For colo, VM's ram cache */
+    /* For colo lazy cache, pages present in colo_cache */
+    unsigned long *colo_cache_present;
     ram_addr_t offset;
     ram_addr_t used_length;
     ram_addr_t max_length;
@@ -74,6 +76,14 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+
+    /*
+     * With the mapped-ram capability, the pages that are saved in the
+     * file, and where the bitmap and the pages of this block are in it.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
@@ -0,0 +1,123 @@
+/*
+ * QEMU I/O channels tee driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef QIO_CHANNEL_TEE_H
+#define QIO_CHANNEL_TEE_H
+
+#include "io/channel.h"
+#include "qom/object.h"
+
+#define TYPE_QIO_CHANNEL_TEE "qio-channel-tee"
+OBJECT_DECLARE_SIMPLE_TYPE(QIOChannelTee, QIO_CHANNEL_TEE)
+
+typedef struct QIOChannelTeeChild QIOChannelTeeChild;
+
+/**
+ * QIOChannelTee:
+ *
+ * The QIOChannelTee object provides a write-only channel
+ * implementation that writes the same data to each of a
+ * list of child channels.  A child that fails a write is
+ * dropped and not written to anymore, writes only fail once
+ * no child is left.  Dropped children keep their index.
+ */
+
+struct QIOChannelTee {
+    QIOChannel parent;
+    /* Element type: QIOChannelTeeChild */
+    GPtrArray *children;
+};
+
+
+/**
+ * qio_channel_tee_new:
+ *
+ * Create a new IO channel object that writes to the
+ * channels added with qio_channel_tee_add()
+ *
+ * Returns: the new channel object
+ */
+QIOChannelTee *
+qio_channel_tee_new(void);
+
+
+/**
+ * qio_channel_tee_add:
+ * @tioc: the tee channel object
+ * @ioc: the channel to add
+ *
+ * Add @ioc to the channels @tioc writes to, taking a
+ * reference on it.  It gets the next free index.  This
+ * must not be called concurrently with writes on @tioc.
+ */
+void
+qio_channel_tee_add(QIOChannelTee *tioc,
+                    QIOChannel *ioc);
+
+
+/**
+ * qio_channel_tee_get_count:
+ * @tioc: the tee channel object
+ *
+ * Returns: the number of channels added to @tioc,
+ * including the dropped ones
+ */
+unsigned int
+qio_channel_tee_get_count(QIOChannelTee *tioc);
+
+
+/**
+ * qio_channel_tee_get_child:
+ * @tioc: the tee channel object
+ * @index: the index of the channel
+ *
+ * Returns: the channel added at @index, without a
+ * reference taken on it
+ */
+QIOChannel *
+qio_channel_tee_get_child(QIOChannelTee *tioc,
+                          unsigned int index);
+
+
+/**
+ * qio_channel_tee_drop:
+ * @tioc: the tee channel object
+ * @index: the index of the channel
+ *
+ * Stop writing to the channel at @index and shut it
+ * down in both directions, so that nothing stays blocked
+ * on it.  It is kept until @tioc is closed.
+ */
+void
+qio_channel_tee_drop(QIOChannelTee *tioc,
+                     unsigned int index);
+
+
+/**
+ * qio_channel_tee_is_dropped:
+ * @tioc: the tee channel object
+ * @index: the index of the channel
+ *
+ * Returns: true if the channel at @index failed a write
+ * or was dropped with qio_channel_tee_drop()
+ */
+bool
+qio_channel_tee_is_dropped(QIOChannelTee *tioc,
+                           unsigned int index);
+
+#endif /* QIO_CHANNEL_TEE_H */
@@ -44,6 +44,7 @@ enum QIOChannelFeature {
     QIO_CHANNEL_FEATURE_LISTEN,
     QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY,
     QIO_CHANNEL_FEATURE_READ_MSG_PEEK,
+    QIO_CHANNEL_FEATURE_SEEKABLE,
 };
 
 
@@ -146,6 +147,16 @@ struct QIOChannelClass {
                                   void *opaque);
     int (*io_flush)(QIOChannel *ioc,
                     Error **errp);
+    ssize_t (*io_pwritev)(QIOChannel *ioc,
+                          const struct iovec *iov,
+                          size_t niov,
+                          off_t offset,
+                          Error **errp);
+    ssize_t (*io_preadv)(QIOChannel *ioc,
+                         const struct iovec *iov,
+                         size_t niov,
+                         off_t offset,
+                         Error **errp);
 };
 
 /* General I/O handling functions */
@@ -612,6 +623,46 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
                           int whence,
                           Error **errp);
 
+/**
+ * qio_channel_pwritev:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to write data from
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to write at
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Write data to the channel at @offset, without moving the
+ * current I/O position.  Unlike qio_channel_writev(), this
+ * may be called from several threads at once.
+ *
+ * Only channels that advertise QIO_CHANNEL_FEATURE_SEEKABLE
+ * support this facility.
+ *
+ * Returns: the number of bytes written, or -1 on error
+ */
+ssize_t qio_channel_pwritev(QIOChannel *ioc, const struct iovec *iov,
+                            size_t niov, off_t offset, Error **errp);
+
+/**
+ * qio_channel_preadv:
+ * @ioc: the channel object
+ * @iov: the array of memory regions to read data into
+ * @niov: the length of the @iov array
+ * @offset: the position in the channel to read from
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Read data from the channel at @offset, without moving the
+ * current I/O position.  Unlike qio_channel_readv(), this
+ * may be called from several threads at once.
+ *
+ * Only channels that advertise QIO_CHANNEL_FEATURE_SEEKABLE
+ * support this facility.
+ *
+ * Returns: the number of bytes read, or -1 on error
+ */
+ssize_t qio_channel_preadv(QIOChannel *ioc, const struct iovec *iov,
+                           size_t niov, off_t offset, Error **errp);
+
 
 /**
  * qio_channel_create_watch:
@@ -22,6 +22,11 @@ enum colo_event {
 };
 
 void migrate_start_colo_process(MigrationState *s);
+/*
+ * Connect to the secondaries of x-colo-secondaries, called from the
+ * migration thread before the stream starts.
+ */
+bool colo_connect_secondaries(MigrationState *s, Error **errp);
 bool migration_in_colo_state(void);
 
 /* loadvm */
@@ -30,6 +35,11 @@ bool migration_incoming_in_colo_state(void);
 COLOMode get_colo_mode(void);
 
 void colo_checkpoint_notify(void);
+/*
+ * colo_divergence_notify: Request a checkpoint because the outputs of the
+ * primary and secondary diverged.
+ */
+void colo_divergence_notify(void);
 
 /* failover */
 void colo_do_failover(void);
@@ -32,6 +32,15 @@ uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf);
 void net_checksum_calculate(uint8_t *data, int length, int csum_flag);
 
+/**
+ * net_checksum_update_32: update a checksum after a word it covers changed
+ *
+ * @csum: the checksum in network byte order, updated in place
+ * @old: the old value of the word in host byte order
+ * @new: the new value of the word in host byte order
+ */
+void net_checksum_update_32(uint8_t *csum, uint32_t old, uint32_t new);
+
 static inline uint32_t
 net_checksum_add(int len, uint8_t *buf)
 {
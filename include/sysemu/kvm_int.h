@@ -26,6 +26,8 @@ typedef struct KVMSlot
     /* Dirty bitmap cache for the slot */
     unsigned long *dirty_bmap;
     unsigned long dirty_bmap_size;
+    /* Chunks of dirty_bmap the dirty ring has set bits in */
+    unsigned long *dirty_chunks;
     /* Cache of the address space ID */
     int as_id;
     /* Cache of the offset in ram address space */
@@ -0,0 +1,356 @@
+/*
+ * QEMU I/O channels tee driver
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "io/channel-tee.h"
+#include "qapi/error.h"
+#include "qemu/atomic.h"
+#include "qemu/iov.h"
+#include "trace.h"
+
+struct QIOChannelTeeChild {
+    QIOChannel *ioc;
+    /* Set once a write failed or the child was dropped, atomic */
+    bool dropped;
+};
+
+
+static void
+qio_channel_tee_child_free(gpointer data)
+{
+    QIOChannelTeeChild *child = data;
+
+    object_unref(OBJECT(child->ioc));
+    g_free(child);
+}
+
+
+static QIOChannelTeeChild *
+qio_channel_tee_child(QIOChannelTee *tioc,
+                      unsigned int index)
+{
+    assert(index < tioc->children->len);
+    return g_ptr_array_index(tioc->children, index);
+}
+
+
+QIOChannelTee *
+qio_channel_tee_new(void)
+{
+    QIOChannelTee *tioc;
+
+    tioc = QIO_CHANNEL_TEE(object_new(TYPE_QIO_CHANNEL_TEE));
+
+    trace_qio_channel_tee_new(tioc);
+
+    return tioc;
+}
+
+
+void
+qio_channel_tee_add(QIOChannelTee *tioc,
+                    QIOChannel *ioc)
+{
+    QIOChannelTeeChild *child = g_new0(QIOChannelTeeChild, 1);
+
+    trace_qio_channel_tee_add(tioc, ioc, tioc->children->len);
+
+    object_ref(OBJECT(ioc));
+    child->ioc = ioc;
+    g_ptr_array_add(tioc->children, child);
+}
+
+
+unsigned int
+qio_channel_tee_get_count(QIOChannelTee *tioc)
+{
+    return tioc->children->len;
+}
+
+
+QIOChannel *
+qio_channel_tee_get_child(QIOChannelTee *tioc,
+                          unsigned int index)
+{
+    return qio_channel_tee_child(tioc, index)->ioc;
+}
+
+
+void
+qio_channel_tee_drop(QIOChannelTee *tioc,
+                     unsigned int index)
+{
+    QIOChannelTeeChild *child = qio_channel_tee_child(tioc, index);
+
+    if (qatomic_xchg(&child->dropped, true)) {
+        return;
+    }
+
+    trace_qio_channel_tee_drop(tioc, index);
+
+    qio_channel_shutdown(child->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+}
+
+
+bool
+qio_channel_tee_is_dropped(QIOChannelTee *tioc,
+                           unsigned int index)
+{
+    return qatomic_read(&qio_channel_tee_child(tioc, index)->dropped);
+}
+
+
+static void
+qio_channel_tee_init(Object *obj)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(obj);
+
+    tioc->children = g_ptr_array_new_with_free_func(qio_channel_tee_child_free);
+}
+
+
+static void
+qio_channel_tee_finalize(Object *obj)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(obj);
+
+    g_ptr_array_free(tioc->children, true);
+}
+
+
+static ssize_t
+qio_channel_tee_readv(QIOChannel *ioc,
+                      const struct iovec *iov,
+                      size_t niov,
+                      int **fds G_GNUC_UNUSED,
+                      size_t *nfds G_GNUC_UNUSED,
+                      int flags G_GNUC_UNUSED,
+                      Error **errp)
+{
+    error_setg_errno(errp, EINVAL,
+                     "Cannot read from a tee channel");
+    return -1;
+}
+
+
+static ssize_t
+qio_channel_tee_writev(QIOChannel *ioc,
+                       const struct iovec *iov,
+                       size_t niov,
+                       int *fds,
+                       size_t nfds,
+                       int flags,
+                       Error **errp)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    Error *last_err = NULL;
+    bool written = false;
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+        Error *local_err = NULL;
+
+        if (qatomic_read(&child->dropped)) {
+            continue;
+        }
+
+        /*
+         * Each child gets all of the data before the next one, so a
+         * slow child holds up the others.
+         */
+        if (qio_channel_writev_full_all(child->ioc, iov, niov, fds, nfds,
+                                        flags, &local_err) < 0) {
+            trace_qio_channel_tee_write_fail(tioc, i,
+                                             error_get_pretty(local_err));
+            qio_channel_tee_drop(tioc, i);
+            error_free(last_err);
+            last_err = local_err;
+            continue;
+        }
+        written = true;
+    }
+
+    if (!written) {
+        if (last_err) {
+            error_propagate(errp, last_err);
+        } else {
+            error_setg_errno(errp, EPIPE,
+                             "No channel left to write to");
+        }
+        return -1;
+    }
+
+    error_free(last_err);
+    return iov_size(iov, niov);
+}
+
+
+static int
+qio_channel_tee_set_blocking(QIOChannel *ioc,
+                             bool enabled,
+                             Error **errp)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    int ret = 0;
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        if (qio_channel_set_blocking(child->ioc, enabled,
+                                     ret ? NULL : errp) < 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+static void
+qio_channel_tee_set_delay(QIOChannel *ioc,
+                          bool enabled)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        qio_channel_set_delay(child->ioc, enabled);
+    }
+}
+
+
+static void
+qio_channel_tee_set_cork(QIOChannel *ioc,
+                         bool enabled)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        qio_channel_set_cork(child->ioc, enabled);
+    }
+}
+
+
+static int
+qio_channel_tee_shutdown(QIOChannel *ioc,
+                         QIOChannelShutdown how,
+                         Error **errp)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    int ret = 0;
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        if (qio_channel_shutdown(child->ioc, how, ret ? NULL : errp) < 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+static int
+qio_channel_tee_close(QIOChannel *ioc,
+                      Error **errp)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    int ret = 0;
+    unsigned int i;
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        if (qio_channel_close(child->ioc, ret ? NULL : errp) < 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+
+/*
+ * Only the first child that is still written to is watched.  That is
+ * enough for the blocking writes of migration, which is the only user.
+ */
+static GSource *
+qio_channel_tee_create_watch(QIOChannel *ioc,
+                             GIOCondition condition)
+{
+    QIOChannelTee *tioc = QIO_CHANNEL_TEE(ioc);
+    unsigned int i;
+
+    assert(tioc->children->len);
+
+    for (i = 0; i < tioc->children->len; i++) {
+        QIOChannelTeeChild *child = g_ptr_array_index(tioc->children, i);
+
+        if (!qatomic_read(&child->dropped)) {
+            return qio_channel_create_watch(child->ioc, condition);
+        }
+    }
+
+    return qio_channel_create_watch(qio_channel_tee_get_child(tioc, 0),
+                                    condition);
+}
+
+
+static void
+qio_channel_tee_class_init(ObjectClass *klass,
+                           void *class_data G_GNUC_UNUSED)
+{
+    QIOChannelClass *ioc_klass = QIO_CHANNEL_CLASS(klass);
+
+    ioc_klass->io_writev = qio_channel_tee_writev;
+    ioc_klass->io_readv = qio_channel_tee_readv;
+    ioc_klass->io_set_blocking = qio_channel_tee_set_blocking;
+    ioc_klass->io_set_delay = qio_channel_tee_set_delay;
+    ioc_klass->io_set_cork = qio_channel_tee_set_cork;
+    ioc_klass->io_shutdown = qio_channel_tee_shutdown;
+    ioc_klass->io_close = qio_channel_tee_close;
+    ioc_klass->io_create_watch = qio_channel_tee_create_watch;
+}
+
+
+static const TypeInfo qio_channel_tee_info = {
+    .parent = TYPE_QIO_CHANNEL,
+    .name = TYPE_QIO_CHANNEL_TEE,
+    .instance_size = sizeof(QIOChannelTee),
+    .instance_init = qio_channel_tee_init,
+    .instance_finalize = qio_channel_tee_finalize,
+    .class_init = qio_channel_tee_class_init,
+};
+
+
+static void
+qio_channel_tee_register_types(void)
+{
+    type_register_static(&qio_channel_tee_info);
+}
+
+type_init(qio_channel_tee_register_types);
@@ -15,10 +15,12 @@
 #include "tls.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "options.h"
 #include "trace.h"
 #include "qapi/error.h"
 #include "io/channel-tls.h"
 #include "io/channel-socket.h"
+#include "io/channel-tee.h"
 #include "qemu/yank.h"
 #include "yank_functions.h"
 
@@ -80,9 +82,24 @@ void migration_channel_connect(MigrationState *s,
                 return;
             }
         } else {
-            QEMUFile *f = qemu_file_new_output(ioc);
+            QEMUFile *f;
 
+            if (migrate_colo() && migrate_colo_secondaries()) {
+                /*
+                 * Write the stream to every COLO secondary, the further
+                 * ones are added by colo_connect_secondaries()
+                 */
+                QIOChannelTee *tioc = qio_channel_tee_new();
+
+                qio_channel_tee_add(tioc, ioc);
+                ioc = QIO_CHANNEL(tioc);
+            } else {
+                object_ref(OBJECT(ioc));
+            }
+
+            f = qemu_file_new_output(ioc);
             migration_ioc_register_yank(ioc);
+            object_unref(OBJECT(ioc));
 
             qemu_mutex_lock(&s->qemu_file_lock);
             s->to_dst_file = f;
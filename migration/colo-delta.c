@@ -0,0 +1,184 @@
+/*
+ * COLO delta encoding of RAM pages
+ *
+ * During COLO the secondary keeps the content of the previous checkpoint
+ * (or has it in guest memory while still in precopy state), which is
+ * exactly what was last sent for each page.  The primary keeps a shadow of
+ * the last sent content of recently sent pages and sends those as XBZRLE
+ * deltas against it.  The shadow is split into stripes with their own
+ * lock, so the send channels encode in parallel.
+ *
+ * The payload of a packet is a be32 length for each page followed by the
+ * page data.  A length of the page size is a raw page, 0 means that the
+ * page didn't change and anything else is a delta.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+#include "colo-delta.h"
+
+#define COLO_DELTA_STRIPES 16
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} ColoDeltaStripe;
+
+struct ColoDelta {
+    uint32_t page_size;
+    ColoDeltaEncodeFunc *encode;
+    uint8_t *zero_page;
+    ColoDeltaStripe stripe[COLO_DELTA_STRIPES];
+};
+
+static ColoDeltaStripe *colo_delta_stripe(ColoDelta *cd, uint64_t addr,
+                                          uint64_t *key)
+{
+    uint64_t page = addr / cd->page_size;
+
+    *key = (page / COLO_DELTA_STRIPES) * cd->page_size;
+    return &cd->stripe[page % COLO_DELTA_STRIPES];
+}
+
+void colo_delta_free(ColoDelta *cd)
+{
+    for (int i = 0; i < COLO_DELTA_STRIPES; i++) {
+        ColoDeltaStripe *s = &cd->stripe[i];
+
+        if (s->cache) {
+            cache_fini(s->cache);
+            qemu_mutex_destroy(&s->lock);
+        }
+    }
+    g_free(cd->zero_page);
+    g_free(cd);
+}
+
+ColoDelta *colo_delta_new(uint64_t cache_size, uint32_t page_size,
+                          ColoDeltaEncodeFunc *encode, Error **errp)
+{
+    ColoDelta *cd = g_new0(ColoDelta, 1);
+    uint64_t pages = cache_size / page_size / COLO_DELTA_STRIPES;
+
+    cd->page_size = page_size;
+    cd->encode = encode;
+    cd->zero_page = g_malloc0(page_size);
+
+    pages = pow2floor(MAX(pages, 1));
+    for (int i = 0; i < COLO_DELTA_STRIPES; i++) {
+        ColoDeltaStripe *s = &cd->stripe[i];
+
+        s->cache = cache_init(pages * page_size, page_size, errp);
+        if (!s->cache) {
+            colo_delta_free(cd);
+            return NULL;
+        }
+        qemu_mutex_init(&s->lock);
+    }
+    return cd;
+}
+
+/*
+ * Encode @page, the current content of the page at @addr, into @out as a
+ * delta against the shadow and update it.  @page must be a copy the guest
+ * doesn't write to.  Returns the length written to @out, the page size if
+ * the page is stored raw.
+ */
+uint32_t colo_delta_encode_page(ColoDelta *cd, uint64_t addr, uint64_t age,
+                                const uint8_t *page, uint8_t *out)
+{
+    ColoDeltaStripe *s;
+    uint64_t key;
+    int len = -1;
+
+    s = colo_delta_stripe(cd, addr, &key);
+    qemu_mutex_lock(&s->lock);
+    if (cache_is_cached(s->cache, key, age)) {
+        uint8_t *shadow = get_cached_data(s->cache, key);
+
+        len = cd->encode(shadow, (uint8_t *)page, cd->page_size,
+                         out, cd->page_size - 1);
+        memcpy(shadow, page, cd->page_size);
+    } else {
+        /* Too bad if this fails, the page is just sent raw next time */
+        cache_insert(s->cache, key, page, age);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    if (len < 0) {
+        memcpy(out, page, cd->page_size);
+        len = cd->page_size;
+    }
+    return len;
+}
+
+/*
+ * The page at @addr was sent as a zero page outside of the delta
+ * packets, don't leave a stale shadow of it behind.
+ */
+void colo_delta_zero_page(ColoDelta *cd, uint64_t addr, uint64_t age)
+{
+    ColoDeltaStripe *s;
+    uint64_t key;
+
+    s = colo_delta_stripe(cd, addr, &key);
+    qemu_mutex_lock(&s->lock);
+    if (cache_is_cached(s->cache, key, age)) {
+        memcpy(get_cached_data(s->cache, key), cd->zero_page, cd->page_size);
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+/*
+ * Apply the payload @buf of @size bytes that carries @num pages to the
+ * pages at @offsets in @host.
+ */
+int colo_delta_decode(uint8_t *buf, uint32_t size, uint32_t num,
+                      uint32_t page_size, uint8_t *host,
+                      const ram_addr_t *offsets, Error **errp)
+{
+    uint32_t header = num * sizeof(uint32_t);
+    uint8_t *in, *end;
+
+    if (size < header || size > header + num * page_size) {
+        error_setg(errp, "COLO delta packet with %u pages has invalid "
+                   "size %u", num, size);
+        return -1;
+    }
+
+    in = buf + header;
+    end = buf + size;
+    for (int i = 0; i < num; i++) {
+        uint32_t len = ldl_be_p(buf + i * sizeof(uint32_t));
+        uint8_t *page = host + offsets[i];
+
+        if (len > page_size || len > end - in) {
+            error_setg(errp, "COLO delta of page %u has invalid length %u",
+                       i, len);
+            return -1;
+        }
+
+        if (len == page_size) {
+            memcpy(page, in, len);
+        } else if (len && xbzrle_decode_buffer(in, len, page, page_size) < 0) {
+            error_setg(errp, "failed to decode COLO delta of page %u", i);
+            return -1;
+        }
+        in += len;
+    }
+
+    if (in != end) {
+        error_setg(errp, "COLO delta packet has %td trailing bytes",
+                   end - in);
+        return -1;
+    }
+    return 0;
+}
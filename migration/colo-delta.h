@@ -0,0 +1,28 @@
+/*
+ * COLO delta encoding of RAM pages
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COLO_DELTA_H
+#define QEMU_MIGRATION_COLO_DELTA_H
+
+#include "exec/cpu-common.h"
+
+typedef struct ColoDelta ColoDelta;
+
+typedef int ColoDeltaEncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                uint8_t *dst, int dlen);
+
+ColoDelta *colo_delta_new(uint64_t cache_size, uint32_t page_size,
+                          ColoDeltaEncodeFunc *encode, Error **errp);
+void colo_delta_free(ColoDelta *cd);
+uint32_t colo_delta_encode_page(ColoDelta *cd, uint64_t addr, uint64_t age,
+                                const uint8_t *page, uint8_t *out);
+void colo_delta_zero_page(ColoDelta *cd, uint64_t addr, uint64_t age);
+int colo_delta_decode(uint8_t *buf, uint32_t size, uint32_t num,
+                      uint32_t page_size, uint8_t *host,
+                      const ram_addr_t *offsets, Error **errp);
+
+#endif
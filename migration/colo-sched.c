@@ -0,0 +1,210 @@
+/*
+ * Adaptive COLO checkpoint scheduling
+ *
+ * The VM is paused during a checkpoint and its outputs are held back until
+ * the checkpoint completes.  The pause is modelled as
+ *
+ *   pause = fixed + pending * send_cost + applied * apply_cost
+ *
+ * pending is the dirty ram that is sent while the VM is stopped.  applied
+ * is all ram sent since the last checkpoint, which the secondary flushes
+ * from its cache before it resumes.  Syncing ram in the background moves
+ * pending into applied while the VM keeps running, only a checkpoint
+ * resets applied.  So ram is synced in the background while that keeps
+ * the predicted pause below the limit, and a checkpoint is only done once
+ * it doesn't anymore.  This keeps checkpoints as rare as the limit allows,
+ * which minimizes the total time the VM is paused.
+ *
+ * When the outputs diverge, a checkpoint is forced anyway.  If that happens
+ * often, dirty ram is synced early so the forced checkpoints are short.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/timer.h"
+#include "colo-sched.h"
+#include "trace.h"
+
+/* Weight of a new sample in the moving averages */
+#define COLO_SCHED_WEIGHT 0.25
+
+/* Smaller transfers say little about the throughput */
+#define COLO_SCHED_MIN_BYTES (1024 * 1024)
+
+static struct {
+    /* Divergences since the last sample, atomic */
+    unsigned int divergences;
+
+    uint64_t checkpoints;
+    /* Time (QEMU_CLOCK_REALTIME, us) and dirty ram at the last sample */
+    int64_t last_time;
+    uint64_t last_pending;
+
+    /* Bytes dirtied per us */
+    double dirty_rate;
+    /* Divergences per us */
+    double divergence_rate;
+    /* us per byte sent during a checkpoint and in the background */
+    double send_cost;
+    double background_cost;
+
+    /*
+     * Moving averages of the ram applied (x) and the time of the
+     * checkpoint outside of sending ram (y), for fitting fixed and
+     * apply_cost.
+     */
+    double x, y, xx, xy;
+} colo_sched;
+
+static double colo_sched_avg(double avg, double sample, bool first)
+{
+    return first ? sample : avg + COLO_SCHED_WEIGHT * (sample - avg);
+}
+
+/*
+ * Update the dirty and divergence rates, @pending is the dirty ram
+ * including what was sent since the last sample.
+ */
+static void colo_sched_sample(uint64_t pending)
+{
+    int64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    double dt = now - colo_sched.last_time;
+    uint64_t dirtied;
+
+    if (dt <= 0) {
+        return;
+    }
+
+    dirtied = pending > colo_sched.last_pending ?
+              pending - colo_sched.last_pending : 0;
+    colo_sched.dirty_rate = colo_sched_avg(colo_sched.dirty_rate,
+                                           dirtied / dt, false);
+    colo_sched.divergence_rate =
+        colo_sched_avg(colo_sched.divergence_rate,
+                       qatomic_xchg(&colo_sched.divergences, 0) / dt, false);
+
+    colo_sched.last_time = now;
+    colo_sched.last_pending = pending;
+}
+
+void colo_sched_reset(void)
+{
+    memset(&colo_sched, 0, sizeof(colo_sched));
+    colo_sched.last_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+}
+
+void colo_sched_record_checkpoint(const ColoCheckpointTimes *times,
+                                  uint64_t ram_bytes,
+                                  uint64_t background_bytes)
+{
+    uint64_t memory = times->phase[COLO_CHECKPOINT_PHASE_MEMORY];
+    uint64_t total = times->phase[COLO_CHECKPOINT_PHASE_TOTAL];
+    double x = ram_bytes + background_bytes;
+    double y = total > memory ? total - memory : 0;
+    bool first = !colo_sched.checkpoints++;
+
+    /* Everything that was dirty has been sent */
+    colo_sched_sample(ram_bytes);
+    colo_sched.last_pending = 0;
+
+    if (ram_bytes >= COLO_SCHED_MIN_BYTES) {
+        colo_sched.send_cost = colo_sched_avg(colo_sched.send_cost,
+                                              (double)memory / ram_bytes,
+                                              !colo_sched.send_cost);
+    }
+
+    colo_sched.x = colo_sched_avg(colo_sched.x, x, first);
+    colo_sched.y = colo_sched_avg(colo_sched.y, y, first);
+    colo_sched.xx = colo_sched_avg(colo_sched.xx, x * x, first);
+    colo_sched.xy = colo_sched_avg(colo_sched.xy, x * y, first);
+}
+
+void colo_sched_record_background(uint64_t time_us, uint64_t bytes,
+                                  uint64_t pending)
+{
+    colo_sched_sample(bytes + pending);
+    colo_sched.last_pending = pending;
+
+    if (bytes >= COLO_SCHED_MIN_BYTES) {
+        colo_sched.background_cost =
+            colo_sched_avg(colo_sched.background_cost,
+                           (double)time_us / bytes,
+                           !colo_sched.background_cost);
+    }
+}
+
+void colo_sched_record_divergence(void)
+{
+    qatomic_inc(&colo_sched.divergences);
+}
+
+/*
+ * Least squares fit of the weighted samples.  Without enough spread in the
+ * ram applied, all of the time is attributed to the fixed part.
+ */
+static void colo_sched_fit(double *fixed, double *apply_cost)
+{
+    double var = colo_sched.xx - colo_sched.x * colo_sched.x;
+    double cov = colo_sched.xy - colo_sched.x * colo_sched.y;
+
+    if (var > colo_sched.xx * 1e-6) {
+        *apply_cost = MAX(cov / var, 0);
+    } else {
+        *apply_cost = 0;
+    }
+    *fixed = MAX(colo_sched.y - *apply_cost * colo_sched.x, 0);
+}
+
+bool colo_sched_decide(uint64_t pending, uint64_t transferred,
+                       uint64_t interval_us, uint64_t max_pause_us,
+                       ColoAction *action)
+{
+    double send_cost, background_cost, fixed, apply_cost, next;
+    double pause_next, pause_synced, chance, saved, delay;
+
+    colo_sched_sample(pending);
+
+    send_cost = colo_sched.send_cost ?: colo_sched.background_cost;
+    background_cost = colo_sched.background_cost ?: send_cost;
+    if (!colo_sched.checkpoints || !send_cost) {
+        return false;
+    }
+
+    colo_sched_fit(&fixed, &apply_cost);
+    next = colo_sched.dirty_rate * interval_us;
+
+    /* The pause at the next dirty check if nothing is done now */
+    pause_next = fixed + (pending + next) * send_cost +
+                 (transferred + pending + next) * apply_cost;
+    /* The pause at the next dirty check if the ram is synced now */
+    pause_synced = fixed + next * send_cost +
+                   (transferred + pending + next) * apply_cost;
+
+    /*
+     * A divergence before the next dirty check forces a checkpoint which
+     * syncing now makes shorter.  But a divergence while syncing has to
+     * wait for the sync to finish.
+     */
+    chance = MIN(colo_sched.divergence_rate * interval_us, 1);
+    saved = chance * pending * send_cost;
+    delay = pending * background_cost;
+    delay = colo_sched.divergence_rate * delay * delay / 2;
+
+    if (pause_synced >= max_pause_us) {
+        *action = ACTION_CHECKPOINT;
+    } else if (pause_next >= max_pause_us) {
+        *action = ACTION_BACKGROUND;
+    } else if (saved > delay && saved * 16 >= max_pause_us) {
+        *action = ACTION_BACKGROUND;
+    } else {
+        *action = ACTION_NONE;
+    }
+
+    trace_colo_sched_decide(pending, transferred, pause_next, pause_synced,
+                            colo_sched.dirty_rate * 1000000,
+                            colo_sched.divergence_rate * 60000000, *action);
+    return true;
+}
@@ -0,0 +1,63 @@
+/*
+ * Adaptive COLO checkpoint scheduling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COLO_SCHED_H
+#define QEMU_MIGRATION_COLO_SCHED_H
+
+#include "colo-stats.h"
+
+typedef enum ColoAction {
+    ACTION_NONE,
+    ACTION_BACKGROUND,
+    ACTION_CHECKPOINT
+} ColoAction;
+
+/*
+ * colo_sched_reset: Forget the model, called when COLO starts.
+ */
+void colo_sched_reset(void);
+
+/*
+ * colo_sched_record_checkpoint: Feed a completed checkpoint into the model.
+ *
+ * @times: per-phase timings of the checkpoint
+ * @ram_bytes: RAM bytes transferred during the checkpoint
+ * @background_bytes: RAM bytes transferred in the background since the
+ *                    previous checkpoint
+ */
+void colo_sched_record_checkpoint(const ColoCheckpointTimes *times,
+                                  uint64_t ram_bytes,
+                                  uint64_t background_bytes);
+
+/*
+ * colo_sched_record_background: Feed a background RAM transfer of @bytes
+ * that took @time_us into the model.  @pending is the dirty RAM left.
+ */
+void colo_sched_record_background(uint64_t time_us, uint64_t bytes,
+                                  uint64_t pending);
+
+/*
+ * colo_sched_record_divergence: Note that the outputs of the primary and
+ * secondary diverged.  Can be called from any thread.
+ */
+void colo_sched_record_divergence(void);
+
+/*
+ * colo_sched_decide: Pick what to do at a dirty check.
+ *
+ * @pending: dirty RAM bytes not yet sent
+ * @transferred: RAM bytes sent in the background since the last checkpoint
+ * @interval_us: time until the next dirty check
+ * @max_pause_us: the pause a checkpoint should stay below
+ *
+ * Returns false if there is not enough data to predict a checkpoint yet.
+ */
+bool colo_sched_decide(uint64_t pending, uint64_t transferred,
+                       uint64_t interval_us, uint64_t max_pause_us,
+                       ColoAction *action);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+ * COLO checkpoint statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/module.h"
+#include "qemu/thread.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "sysemu/stats.h"
+#include "migration/colo.h"
+#include "colo-stats.h"
+
+static struct {
+    QemuMutex lock;
+    uint64_t checkpoints;
+    ColoHistogram phase[COLO_CHECKPOINT_PHASE__MAX];
+    ColoHistogram ram_bytes;
+    ColoHistogram device_bytes;
+    ColoHistogram background;
+} colo_stats;
+
+static void colo_histogram_add(ColoHistogram *h, uint64_t value)
+{
+    int bucket = value ? 64 - clz64(value) : 0;
+
+    h->count++;
+    h->sum += value;
+    h->max = MAX(h->max, value);
+    h->buckets[MIN(bucket, COLO_STATS_BUCKETS - 1)]++;
+}
+
+/*
+ * Estimate a percentile from the log2 buckets.  The upper bound of the
+ * bucket holding the percentile is returned, so the estimate is off by
+ * at most a factor of two.
+ */
+static uint64_t colo_histogram_percentile(const ColoHistogram *h,
+                                          unsigned int pct)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (!h->count) {
+        return 0;
+    }
+
+    target = DIV_ROUND_UP(h->count * pct, 100);
+    for (i = 0; i < COLO_STATS_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= target) {
+            return i ? MIN((1ULL << i) - 1, h->max) : 0;
+        }
+    }
+
+    return h->max;
+}
+
+void colo_stats_reset(void)
+{
+    qemu_mutex_lock(&colo_stats.lock);
+    colo_stats.checkpoints = 0;
+    memset(colo_stats.phase, 0, sizeof(colo_stats.phase));
+    memset(&colo_stats.ram_bytes, 0, sizeof(colo_stats.ram_bytes));
+    memset(&colo_stats.device_bytes, 0, sizeof(colo_stats.device_bytes));
+    memset(&colo_stats.background, 0, sizeof(colo_stats.background));
+    qemu_mutex_unlock(&colo_stats.lock);
+}
+
+void colo_stats_record_checkpoint(const ColoCheckpointTimes *times,
+                                  uint64_t ram_bytes, uint64_t device_bytes)
+{
+    int i;
+
+    qemu_mutex_lock(&colo_stats.lock);
+    colo_stats.checkpoints++;
+    for (i = 0; i < COLO_CHECKPOINT_PHASE__MAX; i++) {
+        colo_histogram_add(&colo_stats.phase[i], times->phase[i]);
+    }
+    if (ram_bytes) {
+        colo_histogram_add(&colo_stats.ram_bytes, ram_bytes);
+    }
+    colo_histogram_add(&colo_stats.device_bytes, device_bytes);
+    qemu_mutex_unlock(&colo_stats.lock);
+}
+
+void colo_stats_record_background(uint64_t time_us)
+{
+    qemu_mutex_lock(&colo_stats.lock);
+    colo_histogram_add(&colo_stats.background, time_us);
+    qemu_mutex_unlock(&colo_stats.lock);
+}
+
+static COLOHistogram *colo_histogram_to_qapi(const ColoHistogram *h)
+{
+    COLOHistogram *info = g_new0(COLOHistogram, 1);
+    int last;
+
+    info->count = h->count;
+    info->sum = h->sum;
+    info->max = h->max;
+    info->p50 = colo_histogram_percentile(h, 50);
+    info->p99 = colo_histogram_percentile(h, 99);
+
+    /* Trailing empty buckets carry no information */
+    for (last = COLO_STATS_BUCKETS - 1; last >= 0; last--) {
+        if (h->buckets[last]) {
+            break;
+        }
+    }
+    for (; last >= 0; last--) {
+        QAPI_LIST_PREPEND(info->buckets, h->buckets[last]);
+    }
+
+    return info;
+}
+
+COLOStats *qmp_query_colo_stats(Error **errp)
+{
+    COLOStats *info = g_new0(COLOStats, 1);
+    int i;
+
+    info->mode = get_colo_mode();
+
+    qemu_mutex_lock(&colo_stats.lock);
+    info->checkpoints = colo_stats.checkpoints;
+    for (i = COLO_CHECKPOINT_PHASE__MAX - 1; i >= 0; i--) {
+        COLOPhaseStats *phase = g_new0(COLOPhaseStats, 1);
+
+        phase->phase = i;
+        phase->latency = colo_histogram_to_qapi(&colo_stats.phase[i]);
+        QAPI_LIST_PREPEND(info->phases, phase);
+    }
+    info->ram_bytes = colo_histogram_to_qapi(&colo_stats.ram_bytes);
+    info->device_bytes = colo_histogram_to_qapi(&colo_stats.device_bytes);
+    info->background = colo_histogram_to_qapi(&colo_stats.background);
+    qemu_mutex_unlock(&colo_stats.lock);
+
+    return info;
+}
+
+static StatsList *colo_stats_add_scalar(StatsList *list, strList *names,
+                                        const char *name, uint64_t value)
+{
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QNUM;
+    stats->value->u.scalar = value;
+
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+static StatsList *colo_stats_add_histogram(StatsList *list, strList *names,
+                                           const char *name,
+                                           const ColoHistogram *h)
+{
+    g_autofree char *max_name = g_strdup_printf("%s-max", name);
+    Stats *stats;
+    int i;
+
+    list = colo_stats_add_scalar(list, names, max_name, h->max);
+    if (!apply_str_list_filter(name, names)) {
+        return list;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+    stats->value->type = QTYPE_QLIST;
+    for (i = COLO_STATS_BUCKETS - 1; i >= 0; i--) {
+        QAPI_LIST_PREPEND(stats->value->u.list, h->buckets[i]);
+    }
+
+    QAPI_LIST_PREPEND(list, stats);
+    return list;
+}
+
+static void colo_stats_cb(StatsResultList **result, StatsTarget target,
+                          strList *names, strList *targets, Error **errp)
+{
+    StatsList *stats_list = NULL;
+    int i;
+
+    if (target != STATS_TARGET_VM) {
+        return;
+    }
+
+    qemu_mutex_lock(&colo_stats.lock);
+    stats_list = colo_stats_add_scalar(stats_list, names, "checkpoints",
+                                       colo_stats.checkpoints);
+    for (i = 0; i < COLO_CHECKPOINT_PHASE__MAX; i++) {
+        g_autofree char *name =
+            g_strdup_printf("%s-latency", COLOCheckpointPhase_str(i));
+
+        stats_list = colo_stats_add_histogram(stats_list, names, name,
+                                              &colo_stats.phase[i]);
+    }
+    stats_list = colo_stats_add_histogram(stats_list, names, "ram-bytes",
+                                          &colo_stats.ram_bytes);
+    stats_list = colo_stats_add_histogram(stats_list, names, "device-bytes",
+                                          &colo_stats.device_bytes);
+    stats_list = colo_stats_add_histogram(stats_list, names,
+                                          "background-latency",
+                                          &colo_stats.background);
+    qemu_mutex_unlock(&colo_stats.lock);
+
+    if (!stats_list) {
+        return;
+    }
+
+    add_stats_entry(result, STATS_PROVIDER_COLO, NULL, stats_list);
+}
+
+static StatsSchemaValueList *colo_stats_schema_add(StatsSchemaValueList *list,
+                                                   const char *name,
+                                                   StatsType type,
+                                                   StatsUnit unit,
+                                                   int16_t exponent)
+{
+    StatsSchemaValue *value = g_new0(StatsSchemaValue, 1);
+
+    value->name = g_strdup(name);
+    value->type = type;
+    value->has_unit = true;
+    value->unit = unit;
+    value->exponent = exponent;
+    if (exponent) {
+        value->has_base = true;
+        value->base = 10;
+    }
+
+    QAPI_LIST_PREPEND(list, value);
+    return list;
+}
+
+static void colo_stats_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+    StatsSchemaValue *checkpoints;
+    int i;
+
+    for (i = 0; i < COLO_CHECKPOINT_PHASE__MAX; i++) {
+        g_autofree char *name =
+            g_strdup_printf("%s-latency", COLOCheckpointPhase_str(i));
+        g_autofree char *max_name = g_strdup_printf("%s-max", name);
+
+        stats_list = colo_stats_schema_add(stats_list, name,
+                                           STATS_TYPE_LOG2_HISTOGRAM,
+                                           STATS_UNIT_SECONDS, -6);
+        stats_list = colo_stats_schema_add(stats_list, max_name,
+                                           STATS_TYPE_PEAK,
+                                           STATS_UNIT_SECONDS, -6);
+    }
+    stats_list = colo_stats_schema_add(stats_list, "ram-bytes",
+                                       STATS_TYPE_LOG2_HISTOGRAM,
+                                       STATS_UNIT_BYTES, 0);
+    stats_list = colo_stats_schema_add(stats_list, "ram-bytes-max",
+                                       STATS_TYPE_PEAK, STATS_UNIT_BYTES, 0);
+    stats_list = colo_stats_schema_add(stats_list, "device-bytes",
+                                       STATS_TYPE_LOG2_HISTOGRAM,
+                                       STATS_UNIT_BYTES, 0);
+    stats_list = colo_stats_schema_add(stats_list, "device-bytes-max",
+                                       STATS_TYPE_PEAK, STATS_UNIT_BYTES, 0);
+    stats_list = colo_stats_schema_add(stats_list, "background-latency",
+                                       STATS_TYPE_LOG2_HISTOGRAM,
+                                       STATS_UNIT_SECONDS, -6);
+    stats_list = colo_stats_schema_add(stats_list, "background-latency-max",
+                                       STATS_TYPE_PEAK, STATS_UNIT_SECONDS, -6);
+
+    /* The checkpoint counter is a plain number */
+    checkpoints = g_new0(StatsSchemaValue, 1);
+    checkpoints->name = g_strdup("checkpoints");
+    checkpoints->type = STATS_TYPE_CUMULATIVE;
+    QAPI_LIST_PREPEND(stats_list, checkpoints);
+
+    add_stats_schema(result, STATS_PROVIDER_COLO, STATS_TARGET_VM, stats_list);
+}
+
+static void colo_stats_register(void)
+{
+    qemu_mutex_init(&colo_stats.lock);
+    add_stats_callbacks(STATS_PROVIDER_COLO, colo_stats_cb,
+                        colo_stats_schemas_cb);
+}
+
+migration_init(colo_stats_register);
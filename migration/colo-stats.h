@@ -0,0 +1,51 @@
+/*
+ * COLO checkpoint statistics
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COLO_STATS_H
+#define QEMU_MIGRATION_COLO_STATS_H
+
+#include "qapi/qapi-types-migration.h"
+
+/* Bucket 0 counts zero samples, bucket n counts [2^(n-1), 2^n) */
+#define COLO_STATS_BUCKETS 40
+
+typedef struct ColoHistogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[COLO_STATS_BUCKETS];
+} ColoHistogram;
+
+/*
+ * Time (in us) spent in each phase of a single checkpoint, indexed by
+ * COLOCheckpointPhase.
+ */
+typedef struct ColoCheckpointTimes {
+    uint64_t phase[COLO_CHECKPOINT_PHASE__MAX];
+} ColoCheckpointTimes;
+
+/*
+ * colo_stats_reset: Forget all samples, called when COLO starts.
+ */
+void colo_stats_reset(void);
+
+/*
+ * colo_stats_record_checkpoint: Account a completed checkpoint.
+ *
+ * @times: per-phase timings of the checkpoint
+ * @ram_bytes: RAM bytes transferred during the checkpoint, 0 if unknown
+ * @device_bytes: size of the device state
+ */
+void colo_stats_record_checkpoint(const ColoCheckpointTimes *times,
+                                  uint64_t ram_bytes, uint64_t device_bytes);
+
+/*
+ * colo_stats_record_background: Account a background RAM transfer.
+ */
+void colo_stats_record_background(uint64_t time_us);
+
+#endif
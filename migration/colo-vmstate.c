@@ -0,0 +1,214 @@
+/*
+ * COLO device state buffer with incremental transfer
+ *
+ * Most device sections don't change between two checkpoints, so in delta
+ * mode only the sections that differ from the last transferred checkpoint
+ * are put on the wire.  Both sides keep a copy of the last checkpoint's
+ * sections and the receiver patches the delta into it, which gives back
+ * the complete device state to load.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "io/channel-buffer.h"
+#include "qemu-file.h"
+#include "savevm.h"
+#include "colo-vmstate.h"
+#include "trace.h"
+
+#define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
+
+/* Terminates the list of sections in a delta */
+#define COLO_VMSTATE_DELTA_END UINT32_MAX
+
+ColoVmstate *colo_vmstate_new(bool save)
+{
+    ColoVmstate *vs = g_new0(ColoVmstate, 1);
+
+    vs->bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
+    if (save) {
+        vs->fb = qemu_file_new_output(QIO_CHANNEL(vs->bioc));
+    } else {
+        vs->fb = qemu_file_new_input(QIO_CHANNEL(vs->bioc));
+    }
+    object_unref(OBJECT(vs->bioc));
+
+    vs->offsets = g_array_new(false, false, sizeof(uint64_t));
+    vs->prev = g_byte_array_new();
+    vs->prev_offsets = g_array_new(false, false, sizeof(uint64_t));
+
+    return vs;
+}
+
+void colo_vmstate_free(ColoVmstate *vs)
+{
+    if (!vs) {
+        return;
+    }
+
+    /* Drops the last reference to bioc */
+    qemu_fclose(vs->fb);
+    g_array_free(vs->offsets, true);
+    g_byte_array_free(vs->prev, true);
+    g_array_free(vs->prev_offsets, true);
+    g_free(vs);
+}
+
+static void colo_vmstate_section_done(void *opaque)
+{
+    ColoVmstate *vs = opaque;
+    uint64_t end;
+
+    qemu_fflush(vs->fb);
+    end = vs->bioc->usage;
+    g_array_append_val(vs->offsets, end);
+}
+
+int colo_vmstate_save(ColoVmstate *vs)
+{
+    int ret;
+
+    /* Reset channel-buffer directly */
+    qio_channel_io_seek(QIO_CHANNEL(vs->bioc), 0, 0, NULL);
+    vs->bioc->usage = 0;
+    g_array_set_size(vs->offsets, 0);
+
+    ret = qemu_save_device_state_sections(vs->fb, colo_vmstate_section_done,
+                                          vs);
+    qemu_fflush(vs->fb);
+
+    return ret;
+}
+
+void colo_vmstate_forget(ColoVmstate *vs)
+{
+    g_byte_array_set_size(vs->prev, 0);
+    g_array_set_size(vs->prev_offsets, 0);
+}
+
+static uint64_t colo_vmstate_offset(GArray *offsets, uint32_t i)
+{
+    return i ? g_array_index(offsets, uint64_t, i - 1) : 0;
+}
+
+void colo_vmstate_put_delta(ColoVmstate *vs, QEMUFile *f)
+{
+    uint32_t nr = vs->offsets->len;
+    /* A device got plugged or unplugged, all sections may have moved */
+    bool full = vs->prev_offsets->len != nr;
+    uint32_t i, changed = 0;
+
+    vs->sent = 0;
+    for (i = 0; i < nr; i++) {
+        uint64_t start = colo_vmstate_offset(vs->offsets, i);
+        uint64_t len = colo_vmstate_offset(vs->offsets, i + 1) - start;
+
+        if (!full) {
+            uint64_t prev_start = colo_vmstate_offset(vs->prev_offsets, i);
+            uint64_t prev_len = colo_vmstate_offset(vs->prev_offsets, i + 1) -
+                                prev_start;
+
+            if (len == prev_len &&
+                !memcmp(vs->bioc->data + start, vs->prev->data + prev_start,
+                        len)) {
+                continue;
+            }
+        }
+
+        qemu_put_be32(f, i);
+        qemu_put_be32(f, len);
+        qemu_put_buffer(f, vs->bioc->data + start, len);
+        vs->sent += 2 * sizeof(uint32_t) + len;
+        changed++;
+    }
+    qemu_put_be32(f, COLO_VMSTATE_DELTA_END);
+    vs->sent += sizeof(uint32_t);
+
+    trace_colo_vmstate_put_delta(changed, nr, vs->sent);
+
+    /* This is what the other side patches the next delta into */
+    g_byte_array_set_size(vs->prev, 0);
+    g_byte_array_append(vs->prev, vs->bioc->data,
+                        colo_vmstate_offset(vs->offsets, nr));
+    g_array_set_size(vs->prev_offsets, 0);
+    g_array_append_vals(vs->prev_offsets, vs->offsets->data, nr);
+}
+
+int colo_vmstate_get_delta(ColoVmstate *vs, QEMUFile *f,
+                           uint32_t nr_sections, Error **errp)
+{
+    g_autoptr(GByteArray) data = g_byte_array_new();
+    g_autoptr(GArray) offsets = g_array_new(false, false, sizeof(uint64_t));
+    uint32_t i, idx, changed = 0;
+    uint64_t end;
+    int ret;
+
+    vs->sent = sizeof(uint32_t);
+    idx = qemu_get_be32(f);
+    for (i = 0; i < nr_sections; i++) {
+        if (idx == i) {
+            uint32_t len = qemu_get_be32(f);
+            size_t start = data->len;
+
+            vs->sent += 2 * sizeof(uint32_t) + len;
+
+            g_byte_array_set_size(data, start + len);
+            if (qemu_get_buffer(f, data->data + start, len) != len) {
+                error_setg(errp, "COLO: short read of device state section %u",
+                           i);
+                return -EINVAL;
+            }
+            idx = qemu_get_be32(f);
+            changed++;
+        } else if (i < vs->prev_offsets->len) {
+            uint64_t start = colo_vmstate_offset(vs->prev_offsets, i);
+
+            g_byte_array_append(data, vs->prev->data + start,
+                                colo_vmstate_offset(vs->prev_offsets, i + 1) -
+                                start);
+        } else {
+            error_setg(errp, "COLO: missing device state section %u", i);
+            return -EINVAL;
+        }
+
+        end = data->len;
+        g_array_append_val(offsets, end);
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "COLO: failed to receive device state");
+        return ret;
+    }
+    if (idx != COLO_VMSTATE_DELTA_END) {
+        error_setg(errp, "COLO: unexpected device state section %u", idx);
+        return -EINVAL;
+    }
+
+    trace_colo_vmstate_get_delta(changed, nr_sections);
+
+    g_byte_array_free(vs->prev, true);
+    g_array_free(vs->prev_offsets, true);
+    vs->prev = g_steal_pointer(&data);
+    vs->prev_offsets = g_steal_pointer(&offsets);
+
+    return 0;
+}
+
+void colo_vmstate_rebuild(ColoVmstate *vs)
+{
+    QIOChannelBuffer *bioc = vs->bioc;
+    GByteArray *data = vs->prev;
+
+    if (data->len + 1 > bioc->capacity) {
+        bioc->capacity = data->len + 1;
+        bioc->data = g_realloc(bioc->data, bioc->capacity);
+    }
+    memcpy(bioc->data, data->data, data->len);
+    bioc->data[data->len] = QEMU_VM_EOF;
+    bioc->usage = data->len + 1;
+    qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
+}
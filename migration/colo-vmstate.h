@@ -0,0 +1,66 @@
+/*
+ * COLO device state buffer with incremental transfer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_COLO_VMSTATE_H
+#define QEMU_MIGRATION_COLO_VMSTATE_H
+
+#include "io/channel-buffer.h"
+#include "qemu-file.h"
+
+typedef struct ColoVmstate {
+    /* Device state of the current checkpoint, terminated by QEMU_VM_EOF */
+    QIOChannelBuffer *bioc;
+    QEMUFile *fb;
+    /* Offset in bioc at which each device section ends */
+    GArray *offsets;
+
+    /*
+     * Sections of the last checkpoint transferred in delta mode, i.e. the
+     * state the other side patches the next delta into.
+     */
+    GByteArray *prev;
+    GArray *prev_offsets;
+
+    /* Bytes of device state on the wire for the last checkpoint */
+    uint64_t sent;
+} ColoVmstate;
+
+ColoVmstate *colo_vmstate_new(bool save);
+void colo_vmstate_free(ColoVmstate *vs);
+
+/*
+ * colo_vmstate_save: Save the device state into the buffer, remembering
+ * where each section ends.  Called with the BQL held.
+ */
+int colo_vmstate_save(ColoVmstate *vs);
+
+/*
+ * colo_vmstate_forget: Drop the state of the last delta transfer, so the
+ * next delta contains all sections.
+ */
+void colo_vmstate_forget(ColoVmstate *vs);
+
+/*
+ * colo_vmstate_put_delta: Send the sections that changed since the last
+ * delta transfer.
+ */
+void colo_vmstate_put_delta(ColoVmstate *vs, QEMUFile *f);
+
+/*
+ * colo_vmstate_get_delta: Receive a delta of @nr_sections sections and
+ * patch it into the sections of the last delta transfer.
+ */
+int colo_vmstate_get_delta(ColoVmstate *vs, QEMUFile *f,
+                           uint32_t nr_sections, Error **errp);
+
+/*
+ * colo_vmstate_rebuild: Rebuild the full device state in the buffer from
+ * the sections received by colo_vmstate_get_delta().
+ */
+void colo_vmstate_rebuild(ColoVmstate *vs);
+
+#endif
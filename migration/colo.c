@@ -20,6 +20,10 @@
 #include "migration/colo.h"
 #include "block.h"
 #include "io/channel-buffer.h"
+#include "io/channel-socket.h"
+#include "io/channel-tee.h"
+#include "qemu/cutils.h"
+#include "qemu/sockets.h"
 #include "trace.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
@@ -36,6 +40,9 @@
 #include "net/filter.h"
 #include "options.h"
 #include "migration-stats.h"
+#include "colo-sched.h"
+#include "colo-stats.h"
+#include "colo-vmstate.h"
 
 static bool vmstate_loading;
 static bool colo_running = false;
@@ -43,7 +50,22 @@ static bool colo_running = false;
 /* User need to know colo mode after COLO failover */
 static COLOMode last_colo_mode;
 
-#define COLO_BUFFER_BASE_SIZE (4 * 1024 * 1024)
+/*
+ * With x-colo-secondaries the primary replicates to several secondaries,
+ * to_dst_file then writes to a tee channel with one child per secondary.
+ * The index of a secondary is the index of its secondary input in
+ * colo-compare.
+ */
+typedef struct ColoSecondaries {
+    QIOChannelTee *tee;
+    unsigned int count;
+    /* Return path of each secondary */
+    QEMUFile **rp_files;
+    /* Set once the secondary was dropped and colo-compare was told */
+    bool *dropped;
+} ColoSecondaries;
+
+static ColoSecondaries colo_secondaries;
 
 bool migration_in_colo_state(void)
 {
@@ -85,6 +107,16 @@ void colo_checkpoint_notify(void)
     _colo_checkpoint_notify(migrate_get_current());
 }
 
+void colo_divergence_notify(void)
+{
+    if (!colo_running) {
+        return;
+    }
+
+    colo_sched_record_divergence();
+    _colo_checkpoint_notify(migrate_get_current());
+}
+
 static void colo_dirty_check_notify(void *opaque)
 {
     MigrationState *s = opaque;
@@ -193,6 +225,8 @@ static void primary_vm_do_failover(void)
      * Wake up COLO thread which may blocked in recv() or send(),
      * The s->rp_state.from_dst_file and s->to_dst_file may use the
      * same fd, but we still shutdown the fd for twice, it is harmless.
+     * With several secondaries, shutting down to_dst_file shuts down
+     * every secondary channel and so their return paths.
      */
     if (s->to_dst_file) {
         qemu_file_shutdown(s->to_dst_file);
@@ -215,6 +249,12 @@ static void primary_vm_do_failover(void)
         local_err = NULL;
     }
 
+    /* Release the output held back by a filter-buffer with colo=on */
+    colo_notify_filters_event(COLO_EVENT_FAILOVER, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+    }
+
     /* Notify COLO thread that failover work is finished */
     qemu_sem_post(&s->colo_exit_sem);
 }
@@ -427,92 +467,263 @@ static uint64_t colo_receive_message_value(QEMUFile *f, uint32_t expect_msg,
     return value;
 }
 
-static int colo_do_checkpoint_transaction(MigrationState *s,
-                                          QIOChannelBuffer *bioc,
-                                          QEMUFile *fb)
+bool colo_connect_secondaries(MigrationState *s, Error **errp)
 {
-    Error *local_err = NULL;
-    int ret = -1;
-    uint64_t start = 0, total_start = 0, now = 0, total = 0, message = 0,
-        prep = 0, replication = 0, memory = 0, vmstate = 0, apply_mem = 0,
-        apply_dev = 0, net_notify = 0;
+    ERRP_GUARD();
+    const strList *uri;
+    QIOChannel *ioc;
+    QIOChannelTee *tioc;
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    total_start = now;
-    start = now;
+    if (!migrate_colo_secondaries()) {
+        return true;
+    }
 
-    colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
-                      &local_err);
-    if (local_err) {
-        goto out;
+    ioc = qemu_file_get_ioc(s->to_dst_file);
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TEE)) {
+        error_setg(errp, "x-colo-secondaries was set after the migration "
+                   "started");
+        return false;
     }
+    tioc = QIO_CHANNEL_TEE(ioc);
 
-    colo_receive_check_message(s->rp_state.from_dst_file,
-                    COLO_MESSAGE_CHECKPOINT_REPLY, &local_err);
-    if (local_err) {
-        goto out;
+    for (uri = migrate_colo_secondaries(); uri; uri = uri->next) {
+        g_autoptr(QIOChannelSocket) sioc = NULL;
+        SocketAddress *saddr;
+        const char *p = NULL;
+        int ret;
+
+        trace_colo_connect_secondary(qio_channel_tee_get_count(tioc),
+                                     uri->value);
+
+        strstart(uri->value, "tcp:", &p);
+        saddr = socket_parse(p ? p : uri->value, errp);
+        if (!saddr) {
+            return false;
+        }
+
+        sioc = qio_channel_socket_new();
+        qio_channel_set_name(QIO_CHANNEL(sioc), "migration-colo-secondary");
+        ret = qio_channel_socket_connect_sync(sioc, saddr, errp);
+        qapi_free_SocketAddress(saddr);
+        if (ret < 0) {
+            error_prepend(errp, "Failed to connect to COLO secondary %s: ",
+                          uri->value);
+            return false;
+        }
+
+        if (qio_channel_set_blocking(QIO_CHANNEL(sioc), true, errp) < 0) {
+            return false;
+        }
+        qio_channel_tee_add(tioc, QIO_CHANNEL(sioc));
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
+    return true;
+}
 
-    /* Reset channel-buffer directly */
-    qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
-    bioc->usage = 0;
+static bool colo_open_return_paths(MigrationState *s)
+{
+    ColoSecondaries *cs = &colo_secondaries;
+    QIOChannel *ioc = qemu_file_get_ioc(s->to_dst_file);
+    unsigned int i;
 
-    qemu_mutex_lock_iothread();
-    if (failover_get_state() != FAILOVER_STATUS_NONE) {
-        qemu_mutex_unlock_iothread();
-        goto out;
+    if (!object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TEE)) {
+        s->rp_state.from_dst_file = qemu_file_get_return_path(s->to_dst_file);
+        return s->rp_state.from_dst_file;
     }
-    vm_stop_force_state(RUN_STATE_COLO);
-    qemu_mutex_unlock_iothread();
-    trace_colo_vm_state_change("run", "stop");
-    /*
-     * Failover request bh could be called after vm_stop_force_state(),
-     * So we need check failover_request_is_active() again.
-     */
-    if (failover_get_state() != FAILOVER_STATUS_NONE) {
-        goto out;
+
+    cs->tee = QIO_CHANNEL_TEE(ioc);
+    cs->count = qio_channel_tee_get_count(cs->tee);
+    cs->rp_files = g_new0(QEMUFile *, cs->count);
+    cs->dropped = g_new0(bool, cs->count);
+    for (i = 0; i < cs->count; i++) {
+        cs->rp_files[i] = qemu_file_new_input(
+                                qio_channel_tee_get_child(cs->tee, i));
     }
+    return true;
+}
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    prep += now - start;
-    start = now;
+static void colo_close_return_paths(MigrationState *s)
+{
+    ColoSecondaries *cs = &colo_secondaries;
+    unsigned int i;
 
-    qemu_mutex_lock_iothread();
+    if (s->rp_state.from_dst_file) {
+        qemu_fclose(s->rp_state.from_dst_file);
+        s->rp_state.from_dst_file = NULL;
+    }
 
-    replication_do_checkpoint_all(&local_err);
+    for (i = 0; i < cs->count; i++) {
+        qemu_fclose(cs->rp_files[i]);
+    }
+    g_free(cs->rp_files);
+    g_free(cs->dropped);
+    memset(cs, 0, sizeof(*cs));
+}
+
+/*
+ * Stop replicating to a secondary that failed while others are left.
+ * Its channel is only closed once COLO exits, as for a single secondary.
+ */
+static void colo_drop_secondary(unsigned int index, Error *err)
+{
+    ColoSecondaries *cs = &colo_secondaries;
+
+    trace_colo_drop_secondary(index);
+    warn_reportf_err(err, "Dropping COLO secondary %u: ", index);
+
+    cs->dropped[index] = true;
+    qio_channel_tee_drop(cs->tee, index);
+    colo_compare_drop_secondary(index);
+}
+
+/*
+ * Receive @expect_msg from every secondary, dropping the ones that fail.
+ * Only fails once no secondary is left.
+ */
+static void colo_receive_check_replies(MigrationState *s,
+                                       COLOMessage expect_msg, Error **errp)
+{
+    ColoSecondaries *cs = &colo_secondaries;
+    bool replied = false;
+    unsigned int i;
+
+    if (!cs->tee) {
+        colo_receive_check_message(s->rp_state.from_dst_file, expect_msg,
+                                   errp);
+        return;
+    }
+
+    for (i = 0; i < cs->count; i++) {
+        Error *local_err = NULL;
+
+        if (cs->dropped[i]) {
+            continue;
+        }
+
+        if (qio_channel_tee_is_dropped(cs->tee, i)) {
+            error_setg(&local_err, "Failed to send to the secondary");
+        } else {
+            colo_receive_check_message(cs->rp_files[i], expect_msg,
+                                       &local_err);
+        }
+        if (!local_err) {
+            replied = true;
+            continue;
+        }
+
+        /* A failover shut down all secondaries, don't drop them */
+        if (failover_get_state() != FAILOVER_STATUS_NONE) {
+            error_propagate(errp, local_err);
+            return;
+        }
+        colo_drop_secondary(i, local_err);
+    }
+
+    if (!replied) {
+        error_setg(errp, "No COLO secondary is left");
+    }
+}
+
+/*
+ * Account the time since *start to @phase and restart the clock.
+ */
+static void colo_phase_done(ColoCheckpointTimes *times,
+                            COLOCheckpointPhase phase, uint64_t *start)
+{
+    uint64_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    times->phase[phase] += now - *start;
+    *start = now;
+}
+
+static void colo_checkpoint_done(ColoCheckpointTimes *times,
+                                 uint64_t total_start, uint64_t ram_bytes,
+                                 uint64_t device_bytes)
+{
+    times->phase[COLO_CHECKPOINT_PHASE_TOTAL] =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - total_start;
+
+    trace_colo_checkpoint_stats(times->phase[COLO_CHECKPOINT_PHASE_TOTAL],
+                                times->phase[COLO_CHECKPOINT_PHASE_MESSAGE],
+                                times->phase[COLO_CHECKPOINT_PHASE_PREP],
+                                times->phase[COLO_CHECKPOINT_PHASE_REPLICATION],
+                                times->phase[COLO_CHECKPOINT_PHASE_MEMORY],
+                                times->phase[COLO_CHECKPOINT_PHASE_VMSTATE],
+                                times->phase[COLO_CHECKPOINT_PHASE_APPLY_MEM],
+                                times->phase[COLO_CHECKPOINT_PHASE_APPLY_DEV],
+                                times->phase[COLO_CHECKPOINT_PHASE_NET_NOTIFY]);
+    colo_stats_record_checkpoint(times, ram_bytes, device_bytes);
+}
+
+static int colo_send_device_state(MigrationState *s, ColoVmstate *vs,
+                                  Error **errp)
+{
+    Error *local_err = NULL;
+
+    if (migrate_colo_vmstate_delta()) {
+        colo_send_message_value(s->to_dst_file, COLO_MESSAGE_VMSTATE_DELTA,
+                                vs->offsets->len, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return -1;
+        }
+
+        colo_vmstate_put_delta(vs, s->to_dst_file);
+        qemu_fflush(s->to_dst_file);
+        return qemu_file_get_error(s->to_dst_file);
+    }
+
+    /*
+     * We need the size of the VMstate data in Secondary side,
+     * With which we can decide how much data should be read.
+     */
+    colo_send_message_value(s->to_dst_file, COLO_MESSAGE_VMSTATE_SIZE,
+                            vs->bioc->usage, &local_err);
     if (local_err) {
-        qemu_mutex_unlock_iothread();
-        goto out;
+        error_propagate(errp, local_err);
+        return -1;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    replication += now - start;
-    start = now;
+    /* The secondary drops its copy of the sections on a full transfer */
+    colo_vmstate_forget(vs);
+    vs->sent = vs->bioc->usage;
 
-    /* Note: device state is saved into buffer */
-    ret = qemu_save_device_state(fb);
+    qemu_put_buffer(s->to_dst_file, vs->bioc->data, vs->bioc->usage);
+    qemu_fflush(s->to_dst_file);
+    return qemu_file_get_error(s->to_dst_file);
+}
 
+/*
+ * Save the device state into @vs, then send the dirty ram followed by the
+ * device state.  Called with the BQL held, so that the device state is
+ * saved in the same critical section as the replication checkpoint; the
+ * BQL is released once the device state is in the buffer.
+ */
+static int colo_send_state(MigrationState *s, ColoVmstate *vs,
+                           ColoCheckpointTimes *times,
+                           uint64_t *start, uint64_t *ram_bytes,
+                           Error **errp)
+{
+    Error *local_err = NULL;
+    uint64_t ram_start;
+    int ret;
+
+    /* Note: device state is saved into buffer */
+    ret = colo_vmstate_save(vs);
     qemu_mutex_unlock_iothread();
     if (ret < 0) {
-        goto out;
+        return ret;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    apply_dev += now - start;
-    start = now;
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_APPLY_DEV, start);
 
     colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_SEND, &local_err);
     if (local_err) {
-        goto out;
+        error_propagate(errp, local_err);
+        return -1;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_MESSAGE, start);
 
     if (migrate_auto_converge()) {
         mig_throttle_counter_reset();
@@ -522,44 +733,185 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
      * TODO: We may need a timeout mechanism to prevent COLO process
      * to be blocked here.
      */
+    ram_start = migration_transferred_bytes(s->to_dst_file);
     qemu_savevm_live_state(s->to_dst_file);
+    *ram_bytes = migration_transferred_bytes(s->to_dst_file) - ram_start;
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_MEMORY, start);
+
+    ret = colo_send_device_state(s, vs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_VMSTATE, start);
+    return 0;
+}
+
+typedef struct ColoDeviceSave {
+    ColoVmstate *vs;
+    QemuSemaphore done_sem;
+    bool done;
+    int ret;
+} ColoDeviceSave;
+
+static void colo_save_device_state_bh(void *opaque)
+{
+    ColoDeviceSave *ds = opaque;
+
+    /* Runs in the main loop, with the BQL held */
+    ds->ret = colo_vmstate_save(ds->vs);
+    qatomic_set(&ds->done, true);
+    qemu_sem_post(&ds->done_sem);
+}
+
+/*
+ * Pipelined variant of colo_send_state(): the main loop saves the device
+ * state while we already send the dirty ram.  The device state is then
+ * sent ahead of a last ram pass, which picks up anything that got dirtied
+ * while saving the devices.  This way the secondary has the complete
+ * checkpoint as soon as the ram stream ends and can start flushing its ram
+ * cache right away.  Called without the BQL held.
+ */
+static int colo_send_state_pipelined(MigrationState *s, ColoVmstate *vs,
+                                     ColoCheckpointTimes *times,
+                                     uint64_t *start, uint64_t *ram_bytes,
+                                     Error **errp)
+{
+    Error *local_err = NULL;
+    ColoDeviceSave ds = { .vs = vs };
+    uint64_t pend_pre, pend_post, ram_start;
+    int ret;
+
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_VMSTATE_PIPELINED,
+                      &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return -1;
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_MESSAGE, start);
 
-    qemu_fflush(fb);
+    if (migrate_auto_converge()) {
+        mig_throttle_counter_reset();
+    }
+
+    /* Sync the dirty bitmap before the main loop takes the BQL */
+    qemu_savevm_state_pending_exact(&pend_pre, &pend_post);
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    memory += now - start;
-    start = now;
+    qemu_sem_init(&ds.done_sem, 0);
+    aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                            colo_save_device_state_bh, &ds);
+
+    ram_start = migration_transferred_bytes(s->to_dst_file);
+    do {
+        ret = qemu_savevm_state_iterate(s->to_dst_file, false);
+    } while (ret == 0 && !qatomic_read(&ds.done) &&
+             !qemu_file_get_error(s->to_dst_file));
+    qemu_put_byte(s->to_dst_file, QEMU_VM_EOF);
+    qemu_fflush(s->to_dst_file);
 
     /*
-     * We need the size of the VMstate data in Secondary side,
-     * With which we can decide how much data should be read.
+     * The ram pass above ends as soon as the device state is saved, so
+     * the whole overlapped window is accounted to the device save.
      */
-    colo_send_message_value(s->to_dst_file, COLO_MESSAGE_VMSTATE_SIZE,
-                            bioc->usage, &local_err);
+    qemu_sem_wait(&ds.done_sem);
+    qemu_sem_destroy(&ds.done_sem);
+    if (ds.ret < 0) {
+        return ds.ret;
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_APPLY_DEV, start);
+
+    ret = colo_send_device_state(s, vs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_VMSTATE, start);
+
+    qemu_savevm_live_state(s->to_dst_file);
+    qemu_fflush(s->to_dst_file);
+    *ram_bytes = migration_transferred_bytes(s->to_dst_file) - ram_start -
+                 vs->sent;
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_MEMORY, start);
+
+    return qemu_file_get_error(s->to_dst_file);
+}
+
+static int colo_do_checkpoint_transaction(MigrationState *s,
+                                          ColoVmstate *vs)
+{
+    Error *local_err = NULL;
+    int ret = -1;
+    ColoCheckpointTimes times = { 0 };
+    uint64_t start, total_start, ram_bytes, background_bytes;
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    total_start = start;
+    background_bytes = migration_transferred_bytes(s->to_dst_file) -
+                       s->colo_last_transferred_bytes;
+
+    colo_send_message(s->to_dst_file, COLO_MESSAGE_CHECKPOINT_REQUEST,
+                      &local_err);
     if (local_err) {
         goto out;
     }
 
-    qemu_put_buffer(s->to_dst_file, bioc->data, bioc->usage);
-    qemu_fflush(s->to_dst_file);
-    ret = qemu_file_get_error(s->to_dst_file);
-    if (ret < 0) {
+    colo_receive_check_replies(s, COLO_MESSAGE_CHECKPOINT_REPLY, &local_err);
+    if (local_err) {
+        goto out;
+    }
+
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
+
+    qemu_mutex_lock_iothread();
+    if (failover_get_state() != FAILOVER_STATUS_NONE) {
+        qemu_mutex_unlock_iothread();
+        goto out;
+    }
+    vm_stop_force_state(RUN_STATE_COLO);
+    qemu_mutex_unlock_iothread();
+    trace_colo_vm_state_change("run", "stop");
+    /*
+     * Failover request bh could be called after vm_stop_force_state(),
+     * So we need check failover_request_is_active() again.
+     */
+    if (failover_get_state() != FAILOVER_STATUS_NONE) {
         goto out;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    vmstate += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_PREP, &start);
 
-    colo_receive_check_message(s->rp_state.from_dst_file,
-                       COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
+    qemu_mutex_lock_iothread();
+
+    replication_do_checkpoint_all(&local_err);
+    if (local_err) {
+        qemu_mutex_unlock_iothread();
+        goto out;
+    }
+
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_REPLICATION, &start);
+
+    if (migrate_colo_pipeline()) {
+        qemu_mutex_unlock_iothread();
+        ret = colo_send_state_pipelined(s, vs, &times, &start, &ram_bytes,
+                                        &local_err);
+    } else {
+        /* Drops the BQL once the device state is saved */
+        ret = colo_send_state(s, vs, &times, &start, &ram_bytes, &local_err);
+    }
+    if (ret < 0) {
+        goto out;
+    }
+
+    colo_receive_check_replies(s, COLO_MESSAGE_VMSTATE_RECEIVED, &local_err);
     if (local_err) {
         goto out;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
 
     qemu_event_reset(&s->colo_checkpoint_event);
     colo_notify_compares_event(NULL, COLO_EVENT_CHECKPOINT, &local_err);
@@ -567,33 +919,32 @@ static int colo_do_checkpoint_transaction(MigrationState *s,
         goto out;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    net_notify += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_NET_NOTIFY, &start);
 
-    colo_receive_check_message(s->rp_state.from_dst_file,
-                       COLO_MESSAGE_VMSTATE_LOADED, &local_err);
+    colo_receive_check_replies(s, COLO_MESSAGE_VMSTATE_LOADED, &local_err);
     if (local_err) {
         goto out;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
+
+    qemu_mutex_lock_iothread();
+    /* The checkpoint is acknowledged, release the output held back for it */
+    colo_notify_filters_event(COLO_EVENT_CHECKPOINT, &local_err);
+    if (local_err) {
+        qemu_mutex_unlock_iothread();
+        goto out;
+    }
 
     ret = 0;
 
-    qemu_mutex_lock_iothread();
     vm_start();
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    prep += now - start;
-    total = now - total_start;
-    trace_colo_checkpoint_stats(total, message, prep, replication,
-                                memory, vmstate, apply_mem, apply_dev,
-                                net_notify);
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_PREP, &start);
+    colo_checkpoint_done(&times, total_start, ram_bytes, vs->sent);
+    colo_sched_record_checkpoint(&times, ram_bytes, background_bytes);
 
 out:
     if (local_err) {
@@ -605,15 +956,11 @@ out:
     return ret;
 }
 
-typedef enum ColoAction {
-    ACTION_NONE,
-    ACTION_BACKGROUND,
-    ACTION_CHECKPOINT
-} ColoAction;
-
 static ColoAction colo_dirty_check(MigrationState *s)
 {
     uint64_t pending_bytes, pend_pre, pend_post, transferred_bytes;
+    uint64_t max_pause = migrate_colo_max_pause();
+    ColoAction action;
 
     qemu_savevm_state_pending_exact(&pend_pre, &pend_post);
     pending_bytes = pend_pre + pend_post;
@@ -623,6 +970,13 @@ static ColoAction colo_dirty_check(MigrationState *s)
 
     trace_colo_need_migrate_ram_background(pending_bytes, transferred_bytes);
 
+    if (max_pause &&
+        colo_sched_decide(pending_bytes, transferred_bytes,
+                          migrate_dirty_check_delay() * 1000ULL,
+                          max_pause * 1000, &action)) {
+        return action;
+    }
+
     if (pending_bytes + transferred_bytes >= migrate_dirty_checkpoint()) {
         return ACTION_CHECKPOINT;
     } else if (pending_bytes >= migrate_dirty_threshold()) {
@@ -634,9 +988,9 @@ static ColoAction colo_dirty_check(MigrationState *s)
 
 static void colo_process_checkpoint(MigrationState *s)
 {
-    QIOChannelBuffer *bioc;
-    QEMUFile *fb = NULL;
+    ColoVmstate *vs = NULL;
     Error *local_err = NULL;
+    uint64_t pend_pre, pend_post;
     int ret;
 
     if (get_colo_mode() != COLO_MODE_PRIMARY) {
@@ -646,27 +1000,25 @@ static void colo_process_checkpoint(MigrationState *s)
 
     failover_init_state();
 
-    s->rp_state.from_dst_file = qemu_file_get_return_path(s->to_dst_file);
-    if (!s->rp_state.from_dst_file) {
+    if (!colo_open_return_paths(s)) {
         error_report("Open QEMUFile from_dst_file failed");
         goto out;
     }
     qemu_file_set_delay(s->to_dst_file, false);
 
+    colo_stats_reset();
+    colo_sched_reset();
     colo_running = true;
 
     /*
      * Wait for Secondary finish loading VM states and enter COLO
      * restore.
      */
-    colo_receive_check_message(s->rp_state.from_dst_file,
-                       COLO_MESSAGE_CHECKPOINT_READY, &local_err);
+    colo_receive_check_replies(s, COLO_MESSAGE_CHECKPOINT_READY, &local_err);
     if (local_err) {
         goto out;
     }
-    bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
-    fb = qemu_file_new_output(QIO_CHANNEL(bioc));
-    object_unref(OBJECT(bioc));
+    vs = colo_vmstate_new(true);
 
     qemu_mutex_lock_iothread();
     replication_start_all(REPLICATION_MODE_PRIMARY, &local_err);
@@ -697,7 +1049,7 @@ static void colo_process_checkpoint(MigrationState *s)
         }
         if (qatomic_xchg(&s->colo_checkpoint_request, 0)) {
             /* start a colo checkpoint */
-            ret = colo_do_checkpoint_transaction(s, bioc, fb);
+            ret = colo_do_checkpoint_transaction(s, vs);
             if (ret < 0) {
                 goto out;
             }
@@ -706,7 +1058,7 @@ static void colo_process_checkpoint(MigrationState *s)
 
             if (action == ACTION_CHECKPOINT) {
                 qemu_event_reset(&s->colo_checkpoint_event);
-                ret = colo_do_checkpoint_transaction(s, bioc, fb);
+                ret = colo_do_checkpoint_transaction(s, vs);
                 if (ret < 0) {
                     goto out;
                 }
@@ -718,12 +1070,19 @@ static void colo_process_checkpoint(MigrationState *s)
                     goto out;
                 }
 
-                uint64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+                uint64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+                uint64_t sent = migration_transferred_bytes(s->to_dst_file);
                 qemu_savevm_state_iterate(s->to_dst_file, false);
-                trace_colo_background_took(qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
-                                           - start);
+                uint64_t took = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+                trace_colo_background_took(took);
+                colo_stats_record_background(took);
                 qemu_put_byte(s->to_dst_file, QEMU_VM_EOF);
 
+                qemu_savevm_state_pending_estimate(&pend_pre, &pend_post);
+                colo_sched_record_background(took,
+                    migration_transferred_bytes(s->to_dst_file) - sent,
+                    pend_pre + pend_post);
+
                 ret = qemu_file_get_error(s->to_dst_file);
                 if (ret < 0) {
                     error_setg_errno(&local_err, -ret,
@@ -742,9 +1101,7 @@ out:
         error_report_err(local_err);
     }
 
-    if (fb) {
-        qemu_fclose(fb);
-    }
+    colo_vmstate_free(vs);
 
     /*
      * There are only two reasons we can get here, some error happened
@@ -780,10 +1137,7 @@ out:
      * Or the failover BH may shutdown the wrong fd that
      * re-used by other threads after we release here.
      */
-    if (s->rp_state.from_dst_file) {
-        qemu_fclose(s->rp_state.from_dst_file);
-        s->rp_state.from_dst_file = NULL;
-    }
+    colo_close_return_paths(s);
 }
 
 void migrate_start_colo_process(MigrationState *s)
@@ -803,29 +1157,108 @@ void migrate_start_colo_process(MigrationState *s)
     qemu_mutex_lock_iothread();
 }
 
-static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
-                      QEMUFile *fb, QIOChannelBuffer *bioc, Error **errp)
+static int colo_incoming_load_ram(MigrationIncomingState *mis)
+{
+    int ret;
+
+    qemu_mutex_lock_iothread();
+    cpu_synchronize_all_states();
+    ret = qemu_loadvm_state_main(mis->from_src_file, mis);
+    qemu_mutex_unlock_iothread();
+
+    return ret;
+}
+
+static uint64_t colo_receive_device_state(MigrationIncomingState *mis,
+                                          ColoVmstate *vs,
+                                          ColoCheckpointTimes *times,
+                                          uint64_t *start, Error **errp)
 {
+    QIOChannelBuffer *bioc = vs->bioc;
     uint64_t total_size;
     uint64_t value;
     Error *local_err = NULL;
+    COLOMessage msg;
+
+    msg = colo_receive_message(mis->from_src_file, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return 0;
+    }
+    if (msg != COLO_MESSAGE_VMSTATE_SIZE &&
+        msg != COLO_MESSAGE_VMSTATE_DELTA) {
+        error_setg(errp, "Unexpected COLO message %d, expected %d or %d",
+                   msg, COLO_MESSAGE_VMSTATE_SIZE, COLO_MESSAGE_VMSTATE_DELTA);
+        return 0;
+    }
+    value = qemu_get_be64(mis->from_src_file);
+    if (qemu_file_get_error(mis->from_src_file)) {
+        error_setg(errp, "Failed to get value for COLO message: %s",
+                   COLOMessage_str(msg));
+        return 0;
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_MESSAGE, start);
+
+    if (msg == COLO_MESSAGE_VMSTATE_DELTA) {
+        if (colo_vmstate_get_delta(vs, mis->from_src_file, value, errp) < 0) {
+            return 0;
+        }
+        colo_phase_done(times, COLO_CHECKPOINT_PHASE_VMSTATE, start);
+
+        colo_vmstate_rebuild(vs);
+        colo_phase_done(times, COLO_CHECKPOINT_PHASE_APPLY_DEV, start);
+        return vs->sent;
+    }
+
+    /* A delta always applies to the last delta transferred */
+    colo_vmstate_forget(vs);
+
+    /*
+     * Read VM device state data into channel buffer,
+     * It's better to re-use the memory allocated.
+     * Here we need to handle the channel buffer directly.
+     */
+    if (value > bioc->capacity) {
+        bioc->capacity = value;
+        bioc->data = g_realloc(bioc->data, bioc->capacity);
+    }
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_APPLY_DEV, start);
+
+    total_size = qemu_get_buffer(mis->from_src_file, bioc->data, value);
+    if (total_size != value) {
+        error_setg(errp, "Got %" PRIu64 " VMState data, less than expected"
+                    " %" PRIu64, total_size, value);
+        return 0;
+    }
+    bioc->usage = total_size;
+    qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
+
+    colo_phase_done(times, COLO_CHECKPOINT_PHASE_VMSTATE, start);
+
+    return value;
+}
+
+static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
+                      ColoVmstate *vs, Error **errp)
+{
+    uint64_t value;
+    Error *local_err = NULL;
+    COLOMessage msg;
     int ret;
-    uint64_t start = 0, total_start = 0, now = 0, total = 0, message = 0,
-        prep = 0, replication = 0, memory = 0, vmstate = 0,
-        apply_mem = 0, apply_dev = 0, net_notify = 0, start_mem = 0;
+    ColoCheckpointTimes times = { 0 };
+    uint64_t start, total_start, start_mem;
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    total_start = now;
-    start = now;
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    total_start = start;
 
     qemu_mutex_lock_iothread();
     vm_stop_force_state(RUN_STATE_COLO);
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("run", "stop");
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    prep += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_PREP, &start);
 
     /* FIXME: This is unnecessary for periodic checkpoint mode */
     colo_send_message(mis->to_src_file, COLO_MESSAGE_CHECKPOINT_REPLY,
@@ -835,68 +1268,48 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
-    colo_receive_check_message(mis->from_src_file,
-                       COLO_MESSAGE_VMSTATE_SEND, &local_err);
+    msg = colo_receive_message(mis->from_src_file, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
     }
+    if (msg != COLO_MESSAGE_VMSTATE_SEND &&
+        msg != COLO_MESSAGE_VMSTATE_PIPELINED) {
+        error_setg(errp, "Unexpected COLO message %d, expected %d or %d",
+                   msg, COLO_MESSAGE_VMSTATE_SEND,
+                   COLO_MESSAGE_VMSTATE_PIPELINED);
+        return;
+    }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
-
-    qemu_mutex_lock_iothread();
-    cpu_synchronize_all_states();
-    ret = qemu_loadvm_state_main(mis->from_src_file, mis);
-    qemu_mutex_unlock_iothread();
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
 
+    ret = colo_incoming_load_ram(mis);
     if (ret < 0) {
         error_setg(errp, "Load VM's live state (ram) error");
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    memory += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MEMORY, &start);
 
-    value = colo_receive_message_value(mis->from_src_file,
-                             COLO_MESSAGE_VMSTATE_SIZE, &local_err);
+    value = colo_receive_device_state(mis, vs, &times, &start, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
-
     /*
-     * Read VM device state data into channel buffer,
-     * It's better to re-use the memory allocated.
-     * Here we need to handle the channel buffer directly.
+     * In pipelined mode the device state comes ahead of the last ram pass,
+     * so once it is loaded we have received the whole checkpoint.
      */
-    if (value > bioc->capacity) {
-        bioc->capacity = value;
-        bioc->data = g_realloc(bioc->data, bioc->capacity);
-    }
-
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    apply_dev += now - start;
-    start = now;
+    if (msg == COLO_MESSAGE_VMSTATE_PIPELINED) {
+        ret = colo_incoming_load_ram(mis);
+        if (ret < 0) {
+            error_setg(errp, "Load VM's live state (ram) error");
+            return;
+        }
 
-    total_size = qemu_get_buffer(mis->from_src_file, bioc->data, value);
-    if (total_size != value) {
-        error_setg(errp, "Got %" PRIu64 " VMState data, less than expected"
-                    " %" PRIu64, total_size, value);
-        return;
+        colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MEMORY, &start);
     }
-    bioc->usage = total_size;
-    qio_channel_io_seek(QIO_CHANNEL(bioc), 0, 0, NULL);
-
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    vmstate += now - start;
-    start = now;
 
     colo_send_message(mis->to_src_file, COLO_MESSAGE_VMSTATE_RECEIVED,
                  &local_err);
@@ -905,10 +1318,8 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    start = now;
-    start_mem = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
+    start_mem = start;
 
     qemu_mutex_lock_iothread();
     vmstate_loading = true;
@@ -933,9 +1344,7 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    replication += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_REPLICATION, &start);
 
     /* Notify all filters of all NIC to do checkpoint */
     colo_notify_filters_event(COLO_EVENT_CHECKPOINT, &local_err);
@@ -947,17 +1356,14 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    net_notify += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_NET_NOTIFY, &start);
 
     colo_flush_ram_cache_wait();
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    apply_mem += now - start_mem;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_APPLY_MEM, &start_mem);
+    start = start_mem;
 
-    ret = qemu_load_device_state(fb);
+    ret = qemu_load_device_state(vs->fb);
     if (ret < 0) {
         error_setg(errp, "COLO: load device state failed");
         vmstate_loading = false;
@@ -965,18 +1371,14 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
         return;
     }
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    apply_dev += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_APPLY_DEV, &start);
 
     vmstate_loading = false;
     vm_start();
     qemu_mutex_unlock_iothread();
     trace_colo_vm_state_change("stop", "run");
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    prep += now - start;
-    start = now;
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_PREP, &start);
 
     if (failover_get_state() == FAILOVER_STATUS_RELAUNCH) {
         return;
@@ -986,16 +1388,12 @@ static void colo_incoming_process_checkpoint(MigrationIncomingState *mis,
                  &local_err);
     error_propagate(errp, local_err);
 
-    now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-    message += now - start;
-    total = now - total_start;
-    trace_colo_checkpoint_stats(total, message, prep, replication,
-                                memory, vmstate, apply_mem, apply_dev,
-                                net_notify);
+    colo_phase_done(&times, COLO_CHECKPOINT_PHASE_MESSAGE, &start);
+    colo_checkpoint_done(&times, total_start, 0, value);
 }
 
 static void colo_wait_handle_message(MigrationIncomingState *mis,
-                QEMUFile *fb, QIOChannelBuffer *bioc, Error **errp)
+                ColoVmstate *vs, Error **errp)
 {
     COLOMessage msg;
     Error *local_err = NULL;
@@ -1008,7 +1406,7 @@ static void colo_wait_handle_message(MigrationIncomingState *mis,
 
     switch (msg) {
     case COLO_MESSAGE_CHECKPOINT_REQUEST:
-        colo_incoming_process_checkpoint(mis, fb, bioc, errp);
+        colo_incoming_process_checkpoint(mis, vs, errp);
         break;
     case COLO_MESSAGE_MIGRATE_RAM_BACKGROUND:
         if (qemu_loadvm_state_main(mis->from_src_file, mis) < 0) {
@@ -1044,8 +1442,7 @@ void colo_shutdown(void)
 static void *colo_process_incoming_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
-    QEMUFile *fb = NULL;
-    QIOChannelBuffer *bioc = NULL; /* Cache incoming device state */
+    ColoVmstate *vs = NULL; /* Cache incoming device state */
     Error *local_err = NULL;
 
     rcu_register_thread();
@@ -1075,11 +1472,13 @@ static void *colo_process_incoming_thread(void *opaque)
     qemu_file_set_blocking(mis->from_src_file, true);
     qemu_file_set_delay(mis->from_src_file, false);
 
-    colo_incoming_start_dirty_log();
+    colo_stats_reset();
+    if (colo_incoming_start_dirty_log() < 0) {
+        error_report("COLO incoming thread: Failed to start dirty tracking");
+        goto out;
+    }
 
-    bioc = qio_channel_buffer_new(COLO_BUFFER_BASE_SIZE);
-    fb = qemu_file_new_input(QIO_CHANNEL(bioc));
-    object_unref(OBJECT(bioc));
+    vs = colo_vmstate_new(false);
 
     qemu_mutex_lock_iothread();
     replication_start_all(REPLICATION_MODE_SECONDARY, &local_err);
@@ -1098,7 +1497,7 @@ static void *colo_process_incoming_thread(void *opaque)
     }
 
     while (mis->state == MIGRATION_STATUS_COLO) {
-        colo_wait_handle_message(mis, fb, bioc, &local_err);
+        colo_wait_handle_message(mis, vs, &local_err);
         if (local_err) {
             error_report_err(local_err);
             break;
@@ -1132,9 +1531,7 @@ out:
                                   COLO_EXIT_REASON_ERROR);
     }
 
-    if (fb) {
-        qemu_fclose(fb);
-    }
+    colo_vmstate_free(vs);
 
     /* Hope this not to be too long to loop here */
     qemu_sem_wait(&mis->colo_incoming_sem);
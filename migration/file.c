@@ -0,0 +1,201 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitops.h"
+#include "qemu/iov.h"
+#include "qapi/error.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "io/channel-file.h"
+#include "channel.h"
+#include "file.h"
+#include "migration.h"
+#include "options.h"
+#include "trace.h"
+
+static struct FileArgs {
+    char *filename;
+} file_args;
+
+static void file_set_filename(const char *filename)
+{
+    g_free(file_args.filename);
+    file_args.filename = g_strdup(filename);
+}
+
+QIOChannel *file_open_page_channel(int flags, Error **errp)
+{
+    QIOChannelFile *fioc;
+
+    if (migrate_mapped_ram_direct_io()) {
+#ifdef O_DIRECT
+        flags |= O_DIRECT;
+#else
+        error_setg(errp, "O_DIRECT is not supported on this host");
+        return NULL;
+#endif
+    }
+
+    fioc = qio_channel_file_new_path(file_args.filename, flags, 0, errp);
+    if (!fioc) {
+        return NULL;
+    }
+    qio_channel_set_name(QIO_CHANNEL(fioc), "migration-file-pages");
+    return QIO_CHANNEL(fioc);
+}
+
+void file_send_channel_create(QIOTaskFunc f, void *data)
+{
+    Error *err = NULL;
+    QIOChannel *ioc = file_open_page_channel(O_WRONLY, &err);
+    QIOTask *task = qio_task_new(OBJECT(ioc), f, data, NULL);
+
+    if (!ioc) {
+        qio_task_set_error(task, err);
+    }
+    qio_task_complete(task);
+}
+
+int file_pwritev_all(QIOChannel *ioc, struct iovec *iov, unsigned int niov,
+                     off_t offset, Error **errp)
+{
+    while (niov) {
+        ssize_t len = qio_channel_pwritev(ioc, iov, niov, offset, errp);
+
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unable to write to file at offset %lld",
+                       (long long)offset);
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
+        offset += len;
+    }
+    return 0;
+}
+
+int file_preadv_all(QIOChannel *ioc, struct iovec *iov, unsigned int niov,
+                    off_t offset, Error **errp)
+{
+    while (niov) {
+        ssize_t len = qio_channel_preadv(ioc, iov, niov, offset, errp);
+
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            error_setg(errp, "Unexpected end of file at offset %lld",
+                       (long long)offset);
+            return -1;
+        }
+        iov_discard_front(&iov, &niov, len);
+        offset += len;
+    }
+    return 0;
+}
+
+int file_write_ramblock_iov(QIOChannel *ioc, struct iovec *iov,
+                            unsigned int niov, RAMBlock *block, Error **errp)
+{
+    int page_bits = qemu_target_page_bits();
+    unsigned int start = 0, i;
+
+    for (i = 0; i < niov; i++) {
+        ram_addr_t offset = (uint8_t *)iov[i].iov_base - block->host;
+        unsigned long page = offset >> page_bits;
+        unsigned long end = page + (iov[i].iov_len >> page_bits);
+
+        for (; page < end; page++) {
+            set_bit_atomic(page, block->file_bmap);
+        }
+    }
+
+    for (i = 1; i <= niov; i++) {
+        ram_addr_t offset;
+
+        /* Pages next to each other in the block are written together */
+        if (i < niov && (uint8_t *)iov[i].iov_base ==
+                        (uint8_t *)iov[i - 1].iov_base + iov[i - 1].iov_len) {
+            continue;
+        }
+
+        offset = (uint8_t *)iov[start].iov_base - block->host;
+        if (file_pwritev_all(ioc, iov + start, i - start,
+                             block->pages_offset + offset, errp) < 0) {
+            return -1;
+        }
+        start = i;
+    }
+    return 0;
+}
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_outgoing(filename);
+
+    if (migrate_mapped_ram() && migrate_tls()) {
+        error_setg(errp, "Mapped-ram is not compatible with TLS");
+        return;
+    }
+
+    fioc = qio_channel_file_new_path(filename, O_CREAT | O_WRONLY | O_TRUNC,
+                                     0600, errp);
+    if (!fioc) {
+        return;
+    }
+    ioc = QIO_CHANNEL(fioc);
+
+    if (migrate_mapped_ram() &&
+        !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_setg(errp, "Mapped-ram needs a seekable file, %s isn't",
+                   filename);
+        object_unref(OBJECT(ioc));
+        return;
+    }
+    file_set_filename(filename);
+
+    qio_channel_set_name(ioc, "migration-file-outgoing");
+    migration_channel_connect(s, ioc, NULL, NULL);
+    object_unref(OBJECT(ioc));
+}
+
+static gboolean file_accept_incoming_migration(QIOChannel *ioc,
+                                               GIOCondition condition,
+                                               gpointer opaque)
+{
+    migration_channel_process_incoming(ioc);
+    object_unref(OBJECT(ioc));
+    return G_SOURCE_REMOVE;
+}
+
+void file_start_incoming_migration(const char *filename, Error **errp)
+{
+    QIOChannelFile *fioc;
+    QIOChannel *ioc;
+
+    trace_migration_file_incoming(filename);
+
+    fioc = qio_channel_file_new_path(filename, O_RDONLY, 0, errp);
+    if (!fioc) {
+        return;
+    }
+    ioc = QIO_CHANNEL(fioc);
+    file_set_filename(filename);
+
+    qio_channel_set_name(ioc, "migration-file-incoming");
+    qio_channel_add_watch_full(ioc, G_IO_IN,
+                               file_accept_incoming_migration,
+                               NULL, NULL,
+                               g_main_context_get_thread_default());
+}
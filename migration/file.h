@@ -0,0 +1,44 @@
+/*
+ * QEMU live migration to and from a file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_FILE_H
+#define QEMU_MIGRATION_FILE_H
+
+#include "io/task.h"
+
+void file_start_incoming_migration(const char *filename, Error **errp);
+
+void file_start_outgoing_migration(MigrationState *s, const char *filename,
+                                   Error **errp);
+
+/*
+ * file_open_page_channel: Open another channel on the migration file, to
+ * read or write the guest pages of a mapped-ram migration with.
+ */
+QIOChannel *file_open_page_channel(int flags, Error **errp);
+
+/* Create a channel for a multifd send thread, like socket_send_channel_create */
+void file_send_channel_create(QIOTaskFunc f, void *data);
+
+/*
+ * file_pwritev_all / file_preadv_all: Write or read all of @iov at @offset,
+ * failing on a short transfer.  @iov is modified.
+ */
+int file_pwritev_all(QIOChannel *ioc, struct iovec *iov, unsigned int niov,
+                     off_t offset, Error **errp);
+int file_preadv_all(QIOChannel *ioc, struct iovec *iov, unsigned int niov,
+                    off_t offset, Error **errp);
+
+/*
+ * file_write_ramblock_iov: Write the guest pages of @block in @iov to their
+ * place in a mapped-ram file, and note them in @block->file_bmap.  Each
+ * element of @iov is one or more whole pages.  Can be called from several
+ * threads at once.  @iov is modified.
+ */
+int file_write_ramblock_iov(QIOChannel *ioc, struct iovec *iov,
+                            unsigned int niov, RAMBlock *block, Error **errp);
+#endif
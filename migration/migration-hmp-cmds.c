@@ -123,6 +123,12 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "dirty pages rate: %" PRIu64 " pages\n",
                            info->ram->dirty_pages_rate);
         }
+        if (info->ram->dirty_sync_count) {
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " us "
+                           "(max %" PRIu64 " us)\n",
+                           info->ram->dirty_sync_time,
+                           info->ram->dirty_sync_time_max);
+        }
         if (info->ram->postcopy_requests) {
             monitor_printf(mon, "postcopy request count: %" PRIu64 "\n",
                            info->ram->postcopy_requests);
@@ -206,6 +212,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->postcopy_fault_latency) {
+        PostcopyFaultLatency *latency = info->postcopy_fault_latency;
+
+        monitor_printf(mon, "postcopy faults: %" PRIu64 ", latency p50 %"
+                       PRIu64 " us p99 %" PRIu64 " us max %" PRIu64 " us\n",
+                       latency->count, latency->p50, latency->p99,
+                       latency->max);
+        monitor_printf(mon, "postcopy prefetched pages: %" PRIu64 "\n",
+                       latency->prefetched);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -620,6 +636,10 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         error_setg(&err, "The block-bitmap-mapping parameter can only be set "
                    "through QMP");
         break;
+    case MIGRATION_PARAMETER_X_COLO_SECONDARIES:
+        error_setg(&err, "The x-colo-secondaries parameter can only be set "
+                   "through QMP");
+        break;
     default:
         assert(0);
     }
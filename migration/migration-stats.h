@@ -55,6 +55,12 @@ typedef struct {
      * copy.
      */
     Stat64 dirty_sync_missed_zero_copy;
+    /*
+     * Number of microseconds the last and the longest synchronization
+     * of guest bitmaps took.
+     */
+    Stat64 dirty_sync_time;
+    Stat64 dirty_sync_time_max;
     /*
      * Number of bytes sent at migration completion stage while the
      * guest is stopped.
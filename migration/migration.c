@@ -20,6 +20,7 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
@@ -104,6 +105,11 @@ static bool migration_needs_multiple_sockets(void)
 
 static bool uri_supports_multi_channels(const char *uri)
 {
+    /* With mapped-ram, each multifd channel opens the file */
+    if (strstart(uri, "file:", NULL)) {
+        return migrate_mapped_ram();
+    }
+
     return strstart(uri, "tcp:", NULL) || strstart(uri, "unix:", NULL) ||
            strstart(uri, "vsock:", NULL);
 }
@@ -111,6 +117,11 @@ static bool uri_supports_multi_channels(const char *uri)
 static bool
 migration_channels_and_uri_compatible(const char *uri, Error **errp)
 {
+    if (migrate_mapped_ram() && !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "Mapped-ram requires a file: URI");
+        return false;
+    }
+
     if (migration_needs_multiple_sockets() &&
         !uri_supports_multi_channels(uri)) {
         error_setg(errp, "Migration requires multi-channel URIs (e.g. tcp)");
@@ -120,6 +131,36 @@ migration_channels_and_uri_compatible(const char *uri, Error **errp)
     return true;
 }
 
+/*
+ * The extra COLO secondaries get a copy of the main stream written by a
+ * tee channel, which doesn't fit a second channel of any kind.
+ */
+static bool migrate_colo_secondaries_compatible(const char *uri, Error **errp)
+{
+    if (!migrate_colo() || !migrate_colo_secondaries()) {
+        return true;
+    }
+
+    if (strstart(uri, "rdma:", NULL) || strstart(uri, "file:", NULL)) {
+        error_setg(errp, "x-colo-secondaries is not supported with rdma: "
+                   "and file: URIs");
+        return false;
+    }
+
+    if (migrate_return_path() || migration_needs_multiple_sockets()) {
+        error_setg(errp, "x-colo-secondaries is not compatible with "
+                   "return-path, multifd and postcopy-preempt");
+        return false;
+    }
+
+    if (migrate_tls()) {
+        error_setg(errp, "x-colo-secondaries is not compatible with TLS");
+        return false;
+    }
+
+    return true;
+}
+
 static gint page_request_addr_cmp(gconstpointer ap, gconstpointer bp)
 {
     uintptr_t a = (uintptr_t) ap, b = (uintptr_t) bp;
@@ -311,11 +352,11 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
  *   Len: Length in bytes required - must be a multiple of pagesize
  */
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start)
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len)
 {
     uint8_t bufc[12 + 1 + 255]; /* start (8), len (4), rbname up to 256 */
     size_t msglen = 12; /* start + len */
-    size_t len = qemu_ram_pagesize(rb);
     enum mig_rp_message_type msg_type;
     const char *rbname;
     int rbname_len;
@@ -358,10 +399,11 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it, with the time of the request as the
+             * value.  It is never NULL, so that g_tree_lookup() finds it.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            g_tree_insert(mis->page_requested, aligned,
+                          postcopy_page_request_stamp());
             mis->page_requested_count++;
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -375,7 +417,8 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         return 0;
     }
 
-    return migrate_send_rp_message_req_pages(mis, rb, start);
+    return migrate_send_rp_message_req_pages(mis, rb, start,
+                                             qemu_ram_pagesize(rb));
 }
 
 void migrate_add_address(SocketAddress *address)
@@ -408,6 +451,8 @@ static void qemu_start_incoming_migration(const char *uri, Error **errp)
         exec_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -901,6 +946,9 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.dirty_sync_count);
     info->ram->dirty_sync_missed_zero_copy =
         stat64_get(&mig_stats.dirty_sync_missed_zero_copy);
+    info->ram->dirty_sync_time = stat64_get(&mig_stats.dirty_sync_time);
+    info->ram->dirty_sync_time_max =
+        stat64_get(&mig_stats.dirty_sync_time_max);
     info->ram->postcopy_requests =
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
@@ -1041,16 +1089,20 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_COLO:
+        info->has_status = true;
+        break;
     case MIGRATION_STATUS_POSTCOPY_ACTIVE:
     case MIGRATION_STATUS_POSTCOPY_PAUSED:
     case MIGRATION_STATUS_POSTCOPY_RECOVER:
-    case MIGRATION_STATUS_FAILED:
-    case MIGRATION_STATUS_COLO:
         info->has_status = true;
+        fill_destination_postcopy_fault_info(info);
         break;
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
+        fill_destination_postcopy_fault_info(info);
         break;
     }
     info->status = mis->state;
@@ -1611,6 +1663,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (!migrate_colo_secondaries_compatible(uri, errp)) {
+        return;
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -1635,6 +1691,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         exec_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         if (!(has_resume && resume)) {
             yank_unregister_instance(MIGRATION_YANK_INSTANCE);
@@ -2895,6 +2953,7 @@ static void *migration_thread(void *opaque)
     int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
     MigThrError thr_error;
     bool urgent = false;
+    Error *local_err = NULL;
 
     thread = MigrationThreadAdd("live_migration", qemu_get_thread_id());
 
@@ -2903,6 +2962,14 @@ static void *migration_thread(void *opaque)
     object_ref(OBJECT(s));
     update_iteration_initial_status(s);
 
+    if (migrate_colo() && !colo_connect_secondaries(s, &local_err)) {
+        migrate_set_error(s, local_err);
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        goto out;
+    }
+
     qemu_savevm_state_header(s->to_dst_file);
 
     /*
@@ -2965,6 +3032,7 @@ static void *migration_thread(void *opaque)
         urgent = migration_rate_limit();
     }
 
+out:
     trace_migration_thread_after_loop();
     migration_iteration_finish(s);
     object_unref(OBJECT(s));
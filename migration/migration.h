@@ -193,7 +193,10 @@ struct MigrationIncomingState {
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
 
-    /* A tree of pages that we requested to the source VM */
+    /*
+     * A tree of pages that we requested to the source VM.  The value is
+     * the time of the request, see postcopy_page_request_stamp().
+     */
     GTree *page_requested;
     /* For debugging purpose only, but would be nice to keep */
     int page_requested_count;
@@ -218,6 +221,7 @@ void migration_incoming_transport_cleanup(MigrationIncomingState *mis);
  * Functions to work with blocktime context
  */
 void fill_destination_postcopy_migration_info(MigrationInfo *info);
+void fill_destination_postcopy_fault_info(MigrationInfo *info);
 
 #define TYPE_MIGRATION "migration"
 
@@ -476,7 +480,8 @@ void migrate_send_rp_pong(MigrationIncomingState *mis,
 int migrate_send_rp_req_pages(MigrationIncomingState *mis, RAMBlock *rb,
                               ram_addr_t start, uint64_t haddr);
 int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
-                                      RAMBlock *rb, ram_addr_t start);
+                                      RAMBlock *rb, ram_addr_t start,
+                                      size_t len);
 void migrate_send_rp_recv_bitmap(MigrationIncomingState *mis,
                                  char *block_name);
 void migrate_send_rp_resume_ack(MigrationIncomingState *mis, uint32_t value);
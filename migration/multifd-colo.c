@@ -11,13 +11,17 @@
 #include "exec/target_page.h"
 #include "exec/ramblock.h"
 #include "qemu/error-report.h"
+#include "qemu/bswap.h"
 #include "qapi/error.h"
 #include "ram.h"
 #include "multifd.h"
 #include "options.h"
+#include "migration-stats.h"
+#include "colo-delta.h"
 #include "io/channel-socket.h"
 #include "migration/colo.h"
 #include "multifd-colo.h"
+#include "trace.h"
 
 void multifd_colo_prepare_recv_pages(MultiFDRecvParams *p)
 {
@@ -27,12 +31,23 @@ void multifd_colo_prepare_recv_pages(MultiFDRecvParams *p)
     assert(p->block->colo_cache);
 
     /*
-     * While we're still in precopy state (not yet in colo state), we copy
-     * received pages to both guest and cache. No need to set dirty bits,
-     * since guest and cache memory are in sync.
+     * While we're still in precopy state (not yet in colo state), we
+     * receive pages into guest memory only, see
+     * multifd_colo_process_recv_pages().
      */
-    if (migration_incoming_in_colo_state()) {
-        colo_record_bitmap(p->block, p->normal, p->normal_num);
+    if (!migration_incoming_in_colo_state()) {
+        return;
+    }
+
+    colo_record_bitmap(p->block, p->normal, p->normal_num);
+    colo_record_bitmap(p->block, p->zero, p->zero_num);
+    if (p->block->colo_cache_present) {
+        for (int i = 0; i < p->normal_num; i++) {
+            colo_lazy_cache_populate(p->block, p->normal[i]);
+        }
+        for (int i = 0; i < p->zero_num; i++) {
+            colo_lazy_cache_populate(p->block, p->zero[i]);
+        }
     }
     p->host = p->block->colo_cache;
 }
@@ -42,12 +57,174 @@ void multifd_colo_process_recv_pages(MultiFDRecvParams *p)
     if (!migrate_colo())
         return;
 
-    if (!migration_incoming_in_colo_state()) {
-        for (int i = 0; i < p->normal_num; i++) {
-            void *guest = p->block->host + p->normal[i];
-            void *cache = p->host + p->normal[i];
-            memcpy(guest, cache, p->page_size);
-        }
+    /*
+     * Record the received pages once they are in guest memory, the flush
+     * threads copy them into the cache in the background.  The lazy cache
+     * is only populated in colo state.
+     */
+    if (!migration_incoming_in_colo_state() &&
+        !p->block->colo_cache_present) {
+        colo_record_bitmap(p->block, p->normal, p->normal_num);
+        colo_record_bitmap(p->block, p->zero, p->zero_num);
     }
     p->host = p->block->host;
 }
+
+/*
+ * COLO delta encoding, see colo-delta.c.  The shadow is shared by the send
+ * channels that use it.
+ */
+static struct {
+    /* Number of send channels using the shadow */
+    unsigned int users;
+    ColoDelta *shadow;
+} colo_delta;
+
+typedef struct {
+    /* Copy of the page that is encoded, the guest may be running */
+    uint8_t *page;
+    /* Packet payload */
+    uint8_t *buf;
+} ColoDeltaSend;
+
+int multifd_colo_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    ColoDeltaSend *d;
+
+    /*
+     * The shadow has to see every page that is sent, so pages must not
+     * take the compress threads.  With zero copy the payload buffer would
+     * be reused while the kernel still reads it.
+     */
+    if (!migrate_colo() || !migrate_colo_delta_cache_size() ||
+        migrate_compress() || migrate_zero_copy_send()) {
+        return 0;
+    }
+
+    if (!colo_delta.users) {
+        colo_delta.shadow = colo_delta_new(migrate_colo_delta_cache_size(),
+                                           p->page_size,
+                                           xbzrle_encode_buffer_func, errp);
+        if (!colo_delta.shadow) {
+            return -1;
+        }
+    }
+    colo_delta.users++;
+
+    d = g_new0(ColoDeltaSend, 1);
+    d->page = g_malloc(p->page_size);
+    d->buf = g_malloc(p->page_count * (sizeof(uint32_t) + p->page_size));
+    p->data = d;
+    return 0;
+}
+
+void multifd_colo_send_cleanup(MultiFDSendParams *p)
+{
+    ColoDeltaSend *d = p->data;
+
+    if (!d) {
+        return;
+    }
+
+    g_free(d->page);
+    g_free(d->buf);
+    g_free(d);
+    p->data = NULL;
+
+    if (!--colo_delta.users) {
+        colo_delta_free(colo_delta.shadow);
+        colo_delta.shadow = NULL;
+    }
+}
+
+/*
+ * Encode the pages of @p against the shadow and update it.  Returns false
+ * if the pages are to be sent as they are.
+ */
+bool multifd_colo_send_delta(MultiFDSendParams *p)
+{
+    ColoDeltaSend *d = p->data;
+    RAMBlock *block = p->pages->block;
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+    uint8_t *out;
+    uint32_t deltas = 0;
+
+    if (!d || !migration_in_colo_state()) {
+        return false;
+    }
+
+    out = d->buf + p->normal_num * sizeof(uint32_t);
+    for (int i = 0; i < p->normal_num; i++) {
+        ram_addr_t offset = p->normal[i];
+        uint32_t len;
+
+        memcpy(d->page, block->host + offset, p->page_size);
+        len = colo_delta_encode_page(colo_delta.shadow, block->offset + offset,
+                                     age, d->page, out);
+        if (len < p->page_size) {
+            deltas++;
+        }
+        stl_be_p(d->buf + i * sizeof(uint32_t), len);
+        out += len;
+    }
+
+    p->next_packet_size = out - d->buf;
+    p->iov[p->iovs_num].iov_base = d->buf;
+    p->iov[p->iovs_num].iov_len = p->next_packet_size;
+    p->iovs_num++;
+    p->flags |= MULTIFD_FLAG_NOCOMP | MULTIFD_FLAG_COLO_DELTA;
+
+    trace_multifd_colo_send_delta(p->id, p->normal_num, deltas,
+                                  p->next_packet_size);
+    return true;
+}
+
+/*
+ * A page was sent as a zero page on the main channel, don't leave a stale
+ * shadow of it behind.
+ */
+void multifd_colo_delta_zero_page(ram_addr_t addr)
+{
+    if (!colo_delta.users) {
+        return;
+    }
+
+    colo_delta_zero_page(colo_delta.shadow, addr,
+                         stat64_get(&mig_stats.dirty_sync_count));
+}
+
+int multifd_colo_recv_delta(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t header = p->normal_num * sizeof(uint32_t);
+
+    /* Don't read more than the buffer holds */
+    if (p->next_packet_size < header ||
+        p->next_packet_size > header + p->normal_num * p->page_size) {
+        error_setg(errp, "multifd %u: COLO delta packet with %u pages has "
+                   "invalid size %u", p->id, p->normal_num,
+                   p->next_packet_size);
+        return -1;
+    }
+
+    if (!p->data) {
+        p->data = g_malloc(p->page_count * (sizeof(uint32_t) + p->page_size));
+    }
+
+    if (qio_channel_read_all(p->c, p->data, p->next_packet_size,
+                             errp) < 0) {
+        return -1;
+    }
+
+    if (colo_delta_decode(p->data, p->next_packet_size, p->normal_num,
+                          p->page_size, p->host, p->normal, errp) < 0) {
+        error_prepend(errp, "multifd %u: ", p->id);
+        return -1;
+    }
+    return 0;
+}
+
+void multifd_colo_recv_cleanup(MultiFDRecvParams *p)
+{
+    g_free(p->data);
+    p->data = NULL;
+}
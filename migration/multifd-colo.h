@@ -15,10 +15,37 @@
 void multifd_colo_prepare_recv_pages(MultiFDRecvParams *p);
 void multifd_colo_process_recv_pages(MultiFDRecvParams *p);
 
+int multifd_colo_send_setup(MultiFDSendParams *p, Error **errp);
+void multifd_colo_send_cleanup(MultiFDSendParams *p);
+bool multifd_colo_send_delta(MultiFDSendParams *p);
+void multifd_colo_delta_zero_page(ram_addr_t addr);
+int multifd_colo_recv_delta(MultiFDRecvParams *p, Error **errp);
+void multifd_colo_recv_cleanup(MultiFDRecvParams *p);
+
 #else
 
 static inline void multifd_colo_prepare_recv_pages(MultiFDRecvParams *p) {}
 static inline void multifd_colo_process_recv_pages(MultiFDRecvParams *p) {}
 
+static inline int multifd_colo_send_setup(MultiFDSendParams *p,
+                                          Error **errp)
+{
+    return 0;
+}
+static inline void multifd_colo_send_cleanup(MultiFDSendParams *p) {}
+static inline bool multifd_colo_send_delta(MultiFDSendParams *p)
+{
+    return false;
+}
+static inline void multifd_colo_delta_zero_page(ram_addr_t addr) {}
+static inline int multifd_colo_recv_delta(MultiFDRecvParams *p,
+                                          Error **errp)
+{
+    error_setg(errp, "multifd %u: received a COLO delta without COLO support",
+               p->id);
+    return -1;
+}
+static inline void multifd_colo_recv_cleanup(MultiFDRecvParams *p) {}
+
 #endif
 #endif
@@ -0,0 +1,282 @@
+/*
+ * Multifd lzo compression implementation
+ *
+ * LZO1X-1 compresses and decompresses several times faster than zlib and
+ * zstd, at the cost of a lower ratio.  Every page is compressed on its
+ * own and sent raw when it doesn't compress well, so incompressible
+ * guest memory costs no decompression on the destination.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <lzo/lzo1x.h>
+#include "qemu/bswap.h"
+#include "qemu/rcu.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+/*
+ * LZO can expand incompressible data a little, see
+ * http://www.oberhumer.com/opensource/lzo/lzofaq.php
+ */
+#define LZO_BOUND(size) ((size) + (size) / 16 + 64 + 3)
+
+struct lzo_data {
+    /* work memory of the compressor, reused for all pages */
+    lzo_bytep wrkmem;
+    /* compressed buffer */
+    uint8_t *zbuff;
+    /* size of compressed buffer */
+    uint32_t zbuff_len;
+};
+
+/*
+ * Each page is sent as a be32 length followed by the data.  A length of
+ * page_size means the page is sent raw.
+ */
+typedef uint32_t lzo_page_header;
+
+/* Multifd lzo compression */
+
+/**
+ * lzo_send_setup: setup send side
+ *
+ * Setup each channel with lzo compression.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lzo_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct lzo_data *z = g_new0(struct lzo_data, 1);
+
+    if (lzo_init() != LZO_E_OK) {
+        g_free(z);
+        error_setg(errp, "multifd %u: lzo_init failed", p->id);
+        return -1;
+    }
+
+    z->wrkmem = g_try_malloc(LZO1X_1_MEM_COMPRESS);
+    /* This is the maximum size of the compressed buffer */
+    z->zbuff_len = p->page_count * (sizeof(lzo_page_header) +
+                                    LZO_BOUND(p->page_size));
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->wrkmem || !z->zbuff) {
+        g_free(z->wrkmem);
+        g_free(z->zbuff);
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for lzo", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lzo_send_cleanup: cleanup send side
+ *
+ * Close the channel and return memory.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void lzo_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct lzo_data *z = p->data;
+
+    g_free(z->wrkmem);
+    z->wrkmem = NULL;
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lzo_send_prepare: prepare date to be able to send
+ *
+ * Create a buffer with all the pages that we are going to send, each
+ * one compressed unless that doesn't save at least 1/8 of it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lzo_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    struct lzo_data *z = p->data;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *page = p->pages->block->host + p->normal[i];
+        uint8_t *out = z->zbuff + out_size + sizeof(lzo_page_header);
+        lzo_uint len;
+        int ret;
+
+        ret = lzo1x_1_compress(page, p->page_size, out, &len, z->wrkmem);
+        if (ret != LZO_E_OK) {
+            error_setg(errp, "multifd %u: lzo1x_1_compress returned %d",
+                       p->id, ret);
+            return -1;
+        }
+        if (len > p->page_size - p->page_size / 8) {
+            memcpy(out, page, p->page_size);
+            len = p->page_size;
+        }
+        stl_be_p(z->zbuff + out_size, len);
+        out_size += sizeof(lzo_page_header) + len;
+    }
+    p->iov[p->iovs_num].iov_base = z->zbuff;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+    p->flags |= MULTIFD_FLAG_LZO;
+
+    return 0;
+}
+
+/**
+ * lzo_recv_setup: setup receive side
+ *
+ * Create the compressed buffer.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lzo_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct lzo_data *z = g_new0(struct lzo_data, 1);
+
+    if (lzo_init() != LZO_E_OK) {
+        g_free(z);
+        error_setg(errp, "multifd %u: lzo_init failed", p->id);
+        return -1;
+    }
+
+    z->zbuff_len = p->page_count * (sizeof(lzo_page_header) +
+                                    LZO_BOUND(p->page_size));
+    z->zbuff = g_try_malloc(z->zbuff_len);
+    if (!z->zbuff) {
+        g_free(z);
+        error_setg(errp, "multifd %u: out of memory for zbuff", p->id);
+        return -1;
+    }
+    p->data = z;
+    return 0;
+}
+
+/**
+ * lzo_recv_cleanup: cleanup receive side
+ *
+ * Free the compressed buffer.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void lzo_recv_cleanup(MultiFDRecvParams *p)
+{
+    struct lzo_data *z = p->data;
+
+    g_free(z->zbuff);
+    z->zbuff = NULL;
+    g_free(p->data);
+    p->data = NULL;
+}
+
+/**
+ * lzo_recv_pages: read the data from the channel into actual pages
+ *
+ * Read the buffer, and uncompress or copy it into the actual pages.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int lzo_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    struct lzo_data *z = p->data;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_LZO) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_LZO);
+        return -1;
+    }
+    if (in_size > z->zbuff_len) {
+        error_setg(errp, "multifd %u: packet size received %u size max %u",
+                   p->id, in_size, z->zbuff_len);
+        return -1;
+    }
+    ret = qio_channel_read_all(p->c, (void *)z->zbuff, in_size, errp);
+
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *page = p->host + p->normal[i];
+        lzo_uint out_len = p->page_size;
+        uint32_t len;
+
+        if (in_size - pos < sizeof(lzo_page_header)) {
+            break;
+        }
+        len = ldl_be_p(z->zbuff + pos);
+        pos += sizeof(lzo_page_header);
+        if (len > in_size - pos || len > p->page_size) {
+            break;
+        }
+
+        if (len == p->page_size) {
+            memcpy(page, z->zbuff + pos, len);
+        } else {
+            ret = lzo1x_decompress_safe(z->zbuff + pos, len, page, &out_len,
+                                        NULL);
+            if (ret != LZO_E_OK || out_len != p->page_size) {
+                error_setg(errp, "multifd %u: lzo1x_decompress_safe returned "
+                           "%d for page %u", p->id, ret, i);
+                return -1;
+            }
+        }
+        pos += len;
+    }
+    if (i != p->normal_num || pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u, "
+                   "%u of %u pages in it", p->id, in_size, i, p->normal_num);
+        return -1;
+    }
+    return 0;
+}
+
+static MultiFDMethods multifd_lzo_ops = {
+    .send_setup = lzo_send_setup,
+    .send_cleanup = lzo_send_cleanup,
+    .send_prepare = lzo_send_prepare,
+    .recv_setup = lzo_recv_setup,
+    .recv_cleanup = lzo_recv_cleanup,
+    .recv_pages = lzo_recv_pages
+};
+
+static void multifd_lzo_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_LZO, &multifd_lzo_ops);
+}
+
+migration_init(multifd_lzo_register);
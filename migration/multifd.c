@@ -12,6 +12,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -21,6 +22,7 @@
 #include "migration.h"
 #include "migration-stats.h"
 #include "socket.h"
+#include "file.h"
 #include "tls.h"
 #include "qemu-file.h"
 #include "trace.h"
@@ -36,6 +38,12 @@
 
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
+/*
+ * Packets that carry zero page offsets.  Destinations that don't know
+ * about the zero_pages field only accept MULTIFD_VERSION, so they fail
+ * the migration instead of ignoring the zero pages.
+ */
+#define MULTIFD_VERSION_ZERO_PAGE 2
 
 typedef struct {
     uint32_t magic;
@@ -51,7 +59,7 @@ typedef struct {
 /**
  * nocomp_send_setup: setup send side
  *
- * For no compression this function does nothing.
+ * For no compression we only set up the COLO delta encoding.
  *
  * Returns 0 for success or -1 for error
  *
@@ -60,20 +68,20 @@ typedef struct {
  */
 static int nocomp_send_setup(MultiFDSendParams *p, Error **errp)
 {
-    return 0;
+    return multifd_colo_send_setup(p, errp);
 }
 
 /**
  * nocomp_send_cleanup: cleanup send side
  *
- * For no compression this function does nothing.
+ * For no compression we only clean up the COLO delta encoding.
  *
  * @p: Params for the channel that we are using
  * @errp: pointer to an error
  */
 static void nocomp_send_cleanup(MultiFDSendParams *p, Error **errp)
 {
-    return;
+    multifd_colo_send_cleanup(p);
 }
 
 /**
@@ -91,6 +99,10 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
 {
     MultiFDPages_t *pages = p->pages;
 
+    if (multifd_colo_send_delta(p)) {
+        return 0;
+    }
+
     for (int i = 0; i < p->normal_num; i++) {
         p->iov[p->iovs_num].iov_base = pages->block->host + p->normal[i];
         p->iov[p->iovs_num].iov_len = p->page_size;
@@ -120,12 +132,13 @@ static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 /**
  * nocomp_recv_cleanup: setup receive side
  *
- * For no compression this function does nothing.
+ * For no compression we only free the COLO delta buffer.
  *
  * @p: Params for the channel that we are using
  */
 static void nocomp_recv_cleanup(MultiFDRecvParams *p)
 {
+    multifd_colo_recv_cleanup(p);
 }
 
 /**
@@ -147,6 +160,9 @@ static int nocomp_recv_pages(MultiFDRecvParams *p, Error **errp)
                    p->id, flags, MULTIFD_FLAG_NOCOMP);
         return -1;
     }
+    if (p->flags & MULTIFD_FLAG_COLO_DELTA) {
+        return multifd_colo_recv_delta(p, errp);
+    }
     for (int i = 0; i < p->normal_num; i++) {
         p->iov[i].iov_base = p->host + p->normal[i];
         p->iov[i].iov_len = p->page_size;
@@ -173,6 +189,17 @@ void multifd_register_ops(int method, MultiFDMethods *ops)
     multifd_ops[method] = ops;
 }
 
+static uint32_t multifd_send_version(void)
+{
+    return migrate_multifd_zero_page() ? MULTIFD_VERSION_ZERO_PAGE
+                                       : MULTIFD_VERSION;
+}
+
+static bool multifd_version_valid(uint32_t version)
+{
+    return version == MULTIFD_VERSION || version == MULTIFD_VERSION_ZERO_PAGE;
+}
+
 static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
 {
     MultiFDInit_t msg = {};
@@ -180,7 +207,7 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.version = cpu_to_be32(multifd_send_version());
     msg.id = p->id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
@@ -212,9 +239,10 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.version != MULTIFD_VERSION) {
+    if (!multifd_version_valid(msg.version)) {
         error_setg(errp, "multifd: received packet version %u "
-                   "expected %u", msg.version, MULTIFD_VERSION);
+                   "expected %u or %u", msg.version, MULTIFD_VERSION,
+                   MULTIFD_VERSION_ZERO_PAGE);
         return -1;
     }
 
@@ -267,6 +295,7 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
     packet->flags = cpu_to_be32(p->flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->normal_pages = cpu_to_be32(p->normal_num);
+    packet->zero_pages = cpu_to_be32(p->zero_num);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
 
@@ -280,6 +309,12 @@ static void multifd_send_fill_packet(MultiFDSendParams *p)
 
         packet->offset[i] = cpu_to_be64(temp);
     }
+
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t temp = p->zero[i];
+
+        packet->offset[p->normal_num + i] = cpu_to_be64(temp);
+    }
 }
 
 static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
@@ -296,10 +331,11 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (!multifd_version_valid(packet->version)) {
         error_setg(errp, "multifd: received packet "
-                   "version %u and expected version %u",
-                   packet->version, MULTIFD_VERSION);
+                   "version %u and expected version %u or %u",
+                   packet->version, MULTIFD_VERSION,
+                   MULTIFD_VERSION_ZERO_PAGE);
         return -1;
     }
 
@@ -325,10 +361,23 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
+    p->zero_num = be32_to_cpu(packet->zero_pages);
+    if (p->zero_num && packet->version != MULTIFD_VERSION_ZERO_PAGE) {
+        error_setg(errp, "multifd: received %u zero pages in a "
+                   "version %u packet", p->zero_num, packet->version);
+        return -1;
+    }
+    if (p->zero_num > packet->pages_alloc - p->normal_num) {
+        error_setg(errp, "multifd: received packet "
+                   "with %u zero pages and expected maximum pages are %u",
+                   p->zero_num, packet->pages_alloc - p->normal_num) ;
+        return -1;
+    }
+
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->normal_num == 0) {
+    if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
 
@@ -354,6 +403,18 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         p->normal[i] = offset;
     }
 
+    for (i = 0; i < p->zero_num; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[p->normal_num + i]);
+
+        if (offset > (p->block->used_length - p->page_size)) {
+            error_setg(errp, "multifd: offset too long %" PRIu64
+                       " (max " RAM_ADDR_FMT ")",
+                       offset, p->block->used_length);
+            return -1;
+        }
+        p->zero[i] = offset;
+    }
+
     return 0;
 }
 
@@ -549,6 +610,8 @@ void multifd_save_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_send_state->ops->send_cleanup(p, &local_err);
         if (local_err) {
             migrate_set_error(migrate_get_current(), local_err);
@@ -644,6 +707,28 @@ int multifd_send_sync_main(QEMUFile *f)
     return 0;
 }
 
+/*
+ * With mapped-ram, the pages are written to their place in the file
+ * instead of being sent in a packet.  Zero pages are dropped from the
+ * file, the destination leaves them zero.
+ */
+static int multifd_file_write_pages(MultiFDSendParams *p, RAMBlock *block,
+                                    Error **errp)
+{
+    int page_bits = qemu_target_page_bits();
+    uint32_t i;
+
+    for (i = 0; i < p->zero_num; i++) {
+        clear_bit_atomic(p->zero[i] >> page_bits, block->file_bmap);
+    }
+    for (i = 0; i < p->normal_num; i++) {
+        p->iov[i].iov_base = block->host + p->normal[i];
+        p->iov[i].iov_len = p->page_size;
+    }
+
+    return file_write_ramblock_iov(p->c, p->iov, p->normal_num, block, errp);
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -651,18 +736,22 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_zero_copy_send = migrate_zero_copy_send();
+    bool zero_page = migrate_multifd_zero_page();
+    bool mapped_ram = migrate_mapped_ram();
 
     thread = MigrationThreadAdd(p->name, qemu_get_thread_id());
 
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    if (!mapped_ram) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_post(&multifd_send_state->channels_ready);
@@ -675,8 +764,12 @@ static void *multifd_send_thread(void *opaque)
 
         if (p->pending_job) {
             uint64_t packet_num = p->packet_num;
+            RAMBlock *block = p->pages->block;
             uint32_t flags;
             p->normal_num = 0;
+            p->zero_num = 0;
+            /* No payload unless send_prepare() adds one */
+            p->next_packet_size = 0;
 
             if (use_zero_copy_send) {
                 p->iovs_num = 0;
@@ -685,11 +778,24 @@ static void *multifd_send_thread(void *opaque)
             }
 
             for (int i = 0; i < p->pages->num; i++) {
-                p->normal[p->normal_num] = p->pages->offset[i];
-                p->normal_num++;
+                ram_addr_t offset = p->pages->offset[i];
+
+                if (zero_page &&
+                    buffer_is_zero(p->pages->block->host + offset,
+                                   p->page_size)) {
+                    p->zero[p->zero_num] = offset;
+                    p->zero_num++;
+                    multifd_colo_delta_zero_page(p->pages->block->offset +
+                                                 offset);
+                } else {
+                    p->normal[p->normal_num] = offset;
+                    p->normal_num++;
+                }
             }
 
-            if (p->normal_num) {
+            if (mapped_ram) {
+                p->next_packet_size = p->normal_num * p->page_size;
+            } else if (p->normal_num) {
                 ret = multifd_send_state->ops->send_prepare(p, &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
@@ -701,30 +807,39 @@ static void *multifd_send_thread(void *opaque)
             p->flags = 0;
             p->num_packets++;
             p->total_normal_pages += p->normal_num;
+            p->total_zero_pages += p->zero_num;
             p->pages->num = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, p->normal_num, flags,
-                               p->next_packet_size);
+            stat64_add(&mig_stats.normal_pages, p->normal_num);
+            stat64_add(&mig_stats.zero_pages, p->zero_num);
 
-            if (use_zero_copy_send) {
-                /* Send header first, without zerocopy */
-                ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                            p->packet_len, &local_err);
-                if (ret != 0) {
-                    break;
-                }
-                stat64_add(&mig_stats.multifd_bytes, p->packet_len);
-                stat64_add(&mig_stats.transferred, p->packet_len);
+            trace_multifd_send(p->id, packet_num, p->normal_num, p->zero_num,
+                               flags, p->next_packet_size);
+
+            if (mapped_ram) {
+                ret = multifd_file_write_pages(p, block, &local_err);
             } else {
-                /* Send header using the same writev call */
-                p->iov[0].iov_len = p->packet_len;
-                p->iov[0].iov_base = p->packet;
-            }
+                if (use_zero_copy_send) {
+                    /* Send header first, without zerocopy */
+                    ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                                p->packet_len, &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                    stat64_add(&mig_stats.multifd_bytes, p->packet_len);
+                    stat64_add(&mig_stats.transferred, p->packet_len);
+                } else {
+                    /* Send header using the same writev call */
+                    p->iov[0].iov_len = p->packet_len;
+                    p->iov[0].iov_base = p->packet;
+                }
 
-            ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num, NULL,
-                                              0, p->write_flags, &local_err);
+                ret = qio_channel_writev_full_all(p->c, p->iov, p->iovs_num,
+                                                  NULL, 0, p->write_flags,
+                                                  &local_err);
+            }
             if (ret != 0) {
                 break;
             }
@@ -769,7 +884,8 @@ out:
 
     rcu_unregister_thread();
     MigrationThreadDel(thread);
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -938,11 +1054,12 @@ int multifd_save_setup(Error **errp)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        p->packet->version = cpu_to_be32(multifd_send_version());
         p->name = g_strdup_printf("multifdsend_%d", i);
         /* We need one extra place for the packet header */
         p->iov = g_new0(struct iovec, page_count + 1);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
         p->page_size = qemu_target_page_size();
         p->page_count = page_count;
 
@@ -952,7 +1069,11 @@ int multifd_save_setup(Error **errp)
             p->write_flags = 0;
         }
 
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (migrate_mapped_ram()) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -1015,9 +1136,18 @@ static void multifd_recv_terminate_threads(Error *err)
     }
 }
 
+/*
+ * With mapped-ram, the destination reads the pages from the file itself,
+ * there are no channels to receive them from.
+ */
+static bool multifd_recv_use_channels(void)
+{
+    return migrate_multifd() && !migrate_mapped_ram();
+}
+
 void multifd_load_shutdown(void)
 {
-    if (migrate_multifd()) {
+    if (multifd_recv_use_channels()) {
         multifd_recv_terminate_threads(NULL);
     }
 }
@@ -1026,7 +1156,7 @@ void multifd_load_cleanup(void)
 {
     int i;
 
-    if (!migrate_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     multifd_recv_terminate_threads(NULL);
@@ -1060,6 +1190,8 @@ void multifd_load_cleanup(void)
         p->iov = NULL;
         g_free(p->normal);
         p->normal = NULL;
+        g_free(p->zero);
+        p->zero = NULL;
         multifd_recv_state->ops->recv_cleanup(p);
     }
     qemu_sem_destroy(&multifd_recv_state->sem_sync);
@@ -1073,7 +1205,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -1096,6 +1228,21 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Zero the pages the sender found to be zero.  Pages that already are
+ * zero are left alone, so that untouched memory isn't allocated.
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    for (int i = 0; i < p->zero_num; i++) {
+        void *page = p->host + p->zero[i];
+
+        if (!buffer_is_zero(page, p->page_size)) {
+            memset(page, 0, p->page_size);
+        }
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1128,19 +1275,23 @@ static void *multifd_recv_thread(void *opaque)
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, p->normal_num, flags,
-                           p->next_packet_size);
+        trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
+                           flags, p->next_packet_size);
         p->num_packets++;
         p->total_normal_pages += p->normal_num;
+        p->total_zero_pages += p->zero_num;
         qemu_mutex_unlock(&p->mutex);
 
-        if (p->normal_num) {
+        if (p->normal_num || p->zero_num) {
             multifd_colo_prepare_recv_pages(p);
 
-            ret = multifd_recv_state->ops->recv_pages(p, &local_err);
-            if (ret != 0) {
-                break;
+            if (p->normal_num) {
+                ret = multifd_recv_state->ops->recv_pages(p, &local_err);
+                if (ret != 0) {
+                    break;
+                }
             }
+            multifd_recv_zero_pages(p);
 
             multifd_colo_process_recv_pages(p);
         }
@@ -1160,7 +1311,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->total_normal_pages,
+                                  p->total_zero_pages);
 
     return NULL;
 }
@@ -1175,7 +1327,7 @@ int multifd_load_setup(Error **errp)
      * Return successfully if multiFD recv state is already initialised
      * or multiFD is not enabled.
      */
-    if (multifd_recv_state || !migrate_multifd()) {
+    if (multifd_recv_state || !multifd_recv_use_channels()) {
         return 0;
     }
 
@@ -1199,6 +1351,7 @@ int multifd_load_setup(Error **errp)
         p->name = g_strdup_printf("multifdrecv_%d", i);
         p->iov = g_new0(struct iovec, page_count);
         p->normal = g_new0(ram_addr_t, page_count);
+        p->zero = g_new0(ram_addr_t, page_count);
         p->page_count = page_count;
         p->page_size = qemu_target_page_size();
     }
@@ -1221,7 +1374,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_multifd()) {
+    if (!multifd_recv_use_channels()) {
         return true;
     }
 
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "exec/target_page.h"
+#include "qemu/cutils.h"
 #include "qapi/clone-visitor.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
@@ -60,6 +61,16 @@
 #define DEFAULT_MIGRATE_X_DIRTY_THRESHOLD (100 * 1024 * 1024UL)
 #define DEFAULT_MIGRATE_X_DIRTY_CHECKPOINT (512 * 1024 * 1024UL)
 #define DEFAULT_MIGRATE_X_COLO_FLUSH_THREADS 0
+#define DEFAULT_MIGRATE_X_COLO_PIPELINE false
+#define DEFAULT_MIGRATE_X_COLO_VMSTATE_DELTA false
+#define DEFAULT_MIGRATE_X_COLO_LAZY_CACHE false
+#define DEFAULT_MIGRATE_X_COLO_MAX_PAUSE 0
+#define DEFAULT_MIGRATE_X_COLO_DELTA_CACHE_SIZE 0
+#define DEFAULT_MIGRATE_X_MULTIFD_ZERO_PAGE false
+#define DEFAULT_MIGRATE_X_MAPPED_RAM_DIRECT_IO false
+#define DEFAULT_MIGRATE_X_DIRTY_SYNC_THREADS 0
+#define DEFAULT_MIGRATE_X_POSTCOPY_PREFETCH_PAGES 0
+#define DEFAULT_MIGRATE_X_POSTCOPY_PREFETCH_STRIDE false
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
@@ -143,6 +154,36 @@ Property migration_properties[] = {
     DEFINE_PROP_UINT32("x-colo-flush-threads", MigrationState,
                       parameters.x_colo_flush_threads,
                       DEFAULT_MIGRATE_X_COLO_FLUSH_THREADS),
+    DEFINE_PROP_BOOL("x-colo-pipeline", MigrationState,
+                      parameters.x_colo_pipeline,
+                      DEFAULT_MIGRATE_X_COLO_PIPELINE),
+    DEFINE_PROP_BOOL("x-colo-vmstate-delta", MigrationState,
+                      parameters.x_colo_vmstate_delta,
+                      DEFAULT_MIGRATE_X_COLO_VMSTATE_DELTA),
+    DEFINE_PROP_BOOL("x-colo-lazy-cache", MigrationState,
+                      parameters.x_colo_lazy_cache,
+                      DEFAULT_MIGRATE_X_COLO_LAZY_CACHE),
+    DEFINE_PROP_UINT32("x-colo-max-pause", MigrationState,
+                      parameters.x_colo_max_pause,
+                      DEFAULT_MIGRATE_X_COLO_MAX_PAUSE),
+    DEFINE_PROP_SIZE("x-colo-delta-cache-size", MigrationState,
+                      parameters.x_colo_delta_cache_size,
+                      DEFAULT_MIGRATE_X_COLO_DELTA_CACHE_SIZE),
+    DEFINE_PROP_BOOL("x-multifd-zero-page", MigrationState,
+                      parameters.x_multifd_zero_page,
+                      DEFAULT_MIGRATE_X_MULTIFD_ZERO_PAGE),
+    DEFINE_PROP_BOOL("x-mapped-ram-direct-io", MigrationState,
+                      parameters.x_mapped_ram_direct_io,
+                      DEFAULT_MIGRATE_X_MAPPED_RAM_DIRECT_IO),
+    DEFINE_PROP_UINT8("x-dirty-sync-threads", MigrationState,
+                      parameters.x_dirty_sync_threads,
+                      DEFAULT_MIGRATE_X_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT32("x-postcopy-prefetch-pages", MigrationState,
+                      parameters.x_postcopy_prefetch_pages,
+                      DEFAULT_MIGRATE_X_POSTCOPY_PREFETCH_PAGES),
+    DEFINE_PROP_BOOL("x-postcopy-prefetch-stride", MigrationState,
+                      parameters.x_postcopy_prefetch_stride,
+                      DEFAULT_MIGRATE_X_POSTCOPY_PREFETCH_STRIDE),
     DEFINE_PROP_UINT8("multifd-channels", MigrationState,
                       parameters.multifd_channels,
                       DEFAULT_MIGRATE_MULTIFD_CHANNELS),
@@ -201,6 +242,7 @@ Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-zero-copy-send",
             MIGRATION_CAPABILITY_ZERO_COPY_SEND),
 #endif
+    DEFINE_PROP_MIG_CAP("x-mapped-ram", MIGRATION_CAPABILITY_X_MAPPED_RAM),
 
     DEFINE_PROP_END_OF_LIST(),
 };
@@ -268,6 +310,13 @@ bool migrate_late_block_activate(void)
     return s->capabilities[MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE];
 }
 
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_X_MAPPED_RAM];
+}
+
 bool migrate_multifd(void)
 {
     MigrationState *s = migrate_get_current();
@@ -429,6 +478,17 @@ INITIALIZE_MIGRATE_CAPS_SET(check_caps_background_snapshot,
     MIGRATION_CAPABILITY_XBZRLE,
     MIGRATION_CAPABILITY_X_COLO,
     MIGRATION_CAPABILITY_VALIDATE_UUID,
+    MIGRATION_CAPABILITY_ZERO_COPY_SEND,
+    MIGRATION_CAPABILITY_X_MAPPED_RAM);
+
+static const
+INITIALIZE_MIGRATE_CAPS_SET(check_caps_mapped_ram,
+    MIGRATION_CAPABILITY_POSTCOPY_RAM,
+    MIGRATION_CAPABILITY_COMPRESS,
+    MIGRATION_CAPABILITY_XBZRLE,
+    MIGRATION_CAPABILITY_X_COLO,
+    MIGRATION_CAPABILITY_BLOCK,
+    MIGRATION_CAPABILITY_RDMA_PIN_ALL,
     MIGRATION_CAPABILITY_ZERO_COPY_SEND);
 
 /**
@@ -577,6 +637,26 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_X_MAPPED_RAM]) {
+        int idx;
+
+        for (idx = 0; idx < check_caps_mapped_ram.size; idx++) {
+            int incomp_cap = check_caps_mapped_ram.caps[idx];
+            if (new_caps[incomp_cap]) {
+                error_setg(errp, "Mapped-ram is not compatible with %s",
+                           MigrationCapability_str(incomp_cap));
+                return false;
+            }
+        }
+
+        /* The pages are written to the file as they are */
+        if (migrate_multifd_compression()) {
+            error_setg(errp, "Mapped-ram is not compatible with multifd "
+                       "compression");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -706,6 +786,83 @@ uint32_t migrate_colo_flush_threads(void)
     return s->parameters.x_colo_flush_threads;
 }
 
+bool migrate_colo_pipeline(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_pipeline;
+}
+
+bool migrate_colo_vmstate_delta(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_vmstate_delta;
+}
+
+bool migrate_colo_lazy_cache(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_lazy_cache;
+}
+
+uint32_t migrate_colo_max_pause(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_max_pause;
+}
+
+uint64_t migrate_colo_delta_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_delta_cache_size;
+}
+
+const strList *migrate_colo_secondaries(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_colo_secondaries;
+}
+
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_multifd_zero_page;
+}
+
+bool migrate_mapped_ram_direct_io(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_mapped_ram_direct_io;
+}
+
+uint8_t migrate_dirty_sync_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_dirty_sync_threads;
+}
+
+uint32_t migrate_postcopy_prefetch_pages(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch_pages;
+}
+
+bool migrate_postcopy_prefetch_stride(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.x_postcopy_prefetch_stride;
+}
+
 int migrate_compress_level(void)
 {
     MigrationState *s = migrate_get_current();
@@ -925,6 +1082,27 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->x_dirty_checkpoint = s->parameters.x_dirty_checkpoint;
     params->has_x_colo_flush_threads = true;
     params->x_colo_flush_threads = s->parameters.x_colo_flush_threads;
+    params->has_x_colo_pipeline = true;
+    params->x_colo_pipeline = s->parameters.x_colo_pipeline;
+    params->has_x_colo_vmstate_delta = true;
+    params->x_colo_vmstate_delta = s->parameters.x_colo_vmstate_delta;
+    params->has_x_colo_lazy_cache = true;
+    params->x_colo_lazy_cache = s->parameters.x_colo_lazy_cache;
+    params->has_x_colo_max_pause = true;
+    params->x_colo_max_pause = s->parameters.x_colo_max_pause;
+    params->has_x_colo_delta_cache_size = true;
+    params->x_colo_delta_cache_size = s->parameters.x_colo_delta_cache_size;
+    params->has_x_multifd_zero_page = true;
+    params->x_multifd_zero_page = s->parameters.x_multifd_zero_page;
+    params->has_x_mapped_ram_direct_io = true;
+    params->x_mapped_ram_direct_io = s->parameters.x_mapped_ram_direct_io;
+    params->has_x_dirty_sync_threads = true;
+    params->x_dirty_sync_threads = s->parameters.x_dirty_sync_threads;
+    params->has_x_postcopy_prefetch_pages = true;
+    params->x_postcopy_prefetch_pages = s->parameters.x_postcopy_prefetch_pages;
+    params->has_x_postcopy_prefetch_stride = true;
+    params->x_postcopy_prefetch_stride =
+        s->parameters.x_postcopy_prefetch_stride;
     params->has_block_incremental = true;
     params->block_incremental = s->parameters.block_incremental;
     params->has_multifd_channels = true;
@@ -950,6 +1128,12 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->has_announce_step = true;
     params->announce_step = s->parameters.announce_step;
 
+    if (s->parameters.has_x_colo_secondaries) {
+        params->has_x_colo_secondaries = true;
+        params->x_colo_secondaries =
+            QAPI_CLONE(strList, s->parameters.x_colo_secondaries);
+    }
+
     if (s->parameters.has_block_bitmap_mapping) {
         params->has_block_bitmap_mapping = true;
         params->block_bitmap_mapping =
@@ -981,6 +1165,16 @@ void migrate_params_init(MigrationParameters *params)
     params->has_x_dirty_threshold = true;
     params->has_x_dirty_checkpoint = true;
     params->has_x_colo_flush_threads = true;
+    params->has_x_colo_pipeline = true;
+    params->has_x_colo_vmstate_delta = true;
+    params->has_x_colo_lazy_cache = true;
+    params->has_x_colo_max_pause = true;
+    params->has_x_colo_delta_cache_size = true;
+    params->has_x_multifd_zero_page = true;
+    params->has_x_mapped_ram_direct_io = true;
+    params->has_x_dirty_sync_threads = true;
+    params->has_x_postcopy_prefetch_pages = true;
+    params->has_x_postcopy_prefetch_stride = true;
     params->has_block_incremental = true;
     params->has_multifd_channels = true;
     params->has_multifd_compression = true;
@@ -1137,12 +1331,41 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
        return false;
     }
 
+    if (params->has_x_postcopy_prefetch_pages &&
+        params->x_postcopy_prefetch_pages > 1024) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x-postcopy-prefetch-pages",
+                   "a value between 0 and 1024");
+        return false;
+    }
+
+    if (params->has_x_colo_secondaries) {
+        const strList *uri;
+
+        for (uri = params->x_colo_secondaries; uri; uri = uri->next) {
+            if (!strstart(uri->value, "tcp:", NULL) &&
+                !strstart(uri->value, "unix:", NULL)) {
+                error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                           "x-colo-secondaries",
+                           "a list of tcp: and unix: URIs");
+                return false;
+            }
+        }
+    }
+
     if (params->has_block_bitmap_mapping &&
         !check_dirty_bitmap_mig_alias_map(params->block_bitmap_mapping, errp)) {
         error_prepend(errp, "Invalid mapping given for block-bitmap-mapping: ");
         return false;
     }
 
+    if (migrate_mapped_ram() &&
+        params->has_multifd_compression && params->multifd_compression) {
+        error_setg(errp, "Mapped-ram is not compatible with multifd "
+                   "compression");
+        return false;
+    }
+
 #ifdef CONFIG_LINUX
     if (migrate_zero_copy_send() &&
         ((params->has_multifd_compression && params->multifd_compression) ||
@@ -1153,15 +1376,6 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
     }
 #endif
 
-    if (params->has_x_colo_flush_threads) {
-        int flush_threads = params->x_colo_flush_threads;
-        if ((flush_threads - 1) & flush_threads) {
-            error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
-                       "x-colo-flush-threads", "a power of two.");
-            return false;
-        }
-    }
-
     return true;
 }
 
@@ -1237,6 +1451,36 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_x_colo_flush_threads) {
         dest->x_colo_flush_threads = params->x_colo_flush_threads;
     }
+    if (params->has_x_colo_pipeline) {
+        dest->x_colo_pipeline = params->x_colo_pipeline;
+    }
+    if (params->has_x_colo_vmstate_delta) {
+        dest->x_colo_vmstate_delta = params->x_colo_vmstate_delta;
+    }
+    if (params->has_x_colo_lazy_cache) {
+        dest->x_colo_lazy_cache = params->x_colo_lazy_cache;
+    }
+    if (params->has_x_colo_max_pause) {
+        dest->x_colo_max_pause = params->x_colo_max_pause;
+    }
+    if (params->has_x_colo_delta_cache_size) {
+        dest->x_colo_delta_cache_size = params->x_colo_delta_cache_size;
+    }
+    if (params->has_x_multifd_zero_page) {
+        dest->x_multifd_zero_page = params->x_multifd_zero_page;
+    }
+    if (params->has_x_mapped_ram_direct_io) {
+        dest->x_mapped_ram_direct_io = params->x_mapped_ram_direct_io;
+    }
+    if (params->has_x_dirty_sync_threads) {
+        dest->x_dirty_sync_threads = params->x_dirty_sync_threads;
+    }
+    if (params->has_x_postcopy_prefetch_pages) {
+        dest->x_postcopy_prefetch_pages = params->x_postcopy_prefetch_pages;
+    }
+    if (params->has_x_postcopy_prefetch_stride) {
+        dest->x_postcopy_prefetch_stride = params->x_postcopy_prefetch_stride;
+    }
 
     if (params->has_block_incremental) {
         dest->block_incremental = params->block_incremental;
@@ -1269,6 +1513,11 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
         dest->announce_step = params->announce_step;
     }
 
+    if (params->has_x_colo_secondaries) {
+        dest->has_x_colo_secondaries = true;
+        dest->x_colo_secondaries = params->x_colo_secondaries;
+    }
+
     if (params->has_block_bitmap_mapping) {
         dest->has_block_bitmap_mapping = true;
         dest->block_bitmap_mapping = params->block_bitmap_mapping;
@@ -1360,6 +1609,38 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_x_colo_flush_threads) {
         s->parameters.x_colo_flush_threads = params->x_colo_flush_threads;
     }
+    if (params->has_x_colo_pipeline) {
+        s->parameters.x_colo_pipeline = params->x_colo_pipeline;
+    }
+    if (params->has_x_colo_vmstate_delta) {
+        s->parameters.x_colo_vmstate_delta = params->x_colo_vmstate_delta;
+    }
+    if (params->has_x_colo_lazy_cache) {
+        s->parameters.x_colo_lazy_cache = params->x_colo_lazy_cache;
+    }
+    if (params->has_x_colo_max_pause) {
+        s->parameters.x_colo_max_pause = params->x_colo_max_pause;
+    }
+    if (params->has_x_colo_delta_cache_size) {
+        s->parameters.x_colo_delta_cache_size = params->x_colo_delta_cache_size;
+    }
+    if (params->has_x_multifd_zero_page) {
+        s->parameters.x_multifd_zero_page = params->x_multifd_zero_page;
+    }
+    if (params->has_x_mapped_ram_direct_io) {
+        s->parameters.x_mapped_ram_direct_io = params->x_mapped_ram_direct_io;
+    }
+    if (params->has_x_dirty_sync_threads) {
+        s->parameters.x_dirty_sync_threads = params->x_dirty_sync_threads;
+    }
+    if (params->has_x_postcopy_prefetch_pages) {
+        s->parameters.x_postcopy_prefetch_pages =
+            params->x_postcopy_prefetch_pages;
+    }
+    if (params->has_x_postcopy_prefetch_stride) {
+        s->parameters.x_postcopy_prefetch_stride =
+            params->x_postcopy_prefetch_stride;
+    }
 
     if (params->has_block_incremental) {
         s->parameters.block_incremental = params->block_incremental;
@@ -1396,6 +1677,14 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
         s->parameters.announce_step = params->announce_step;
     }
 
+    if (params->has_x_colo_secondaries) {
+        qapi_free_strList(s->parameters.x_colo_secondaries);
+
+        s->parameters.has_x_colo_secondaries = true;
+        s->parameters.x_colo_secondaries =
+            QAPI_CLONE(strList, params->x_colo_secondaries);
+    }
+
     if (params->has_block_bitmap_mapping) {
         qapi_free_BitmapMigrationNodeAliasList(
             s->parameters.block_bitmap_mapping);
@@ -32,6 +32,7 @@ bool migrate_dirty_bitmaps(void);
 bool migrate_events(void);
 bool migrate_ignore_shared(void);
 bool migrate_late_block_activate(void);
+bool migrate_mapped_ram(void);
 bool migrate_multifd(void);
 bool migrate_pause_before_switchover(void);
 bool migrate_postcopy_blocktime(void);
@@ -72,6 +73,17 @@ uint32_t migrate_dirty_check_delay(void);
 uint64_t migrate_dirty_threshold(void);
 uint64_t migrate_dirty_checkpoint(void);
 uint32_t migrate_colo_flush_threads(void);
+bool migrate_colo_pipeline(void);
+bool migrate_colo_vmstate_delta(void);
+bool migrate_colo_lazy_cache(void);
+uint32_t migrate_colo_max_pause(void);
+uint64_t migrate_colo_delta_cache_size(void);
+const strList *migrate_colo_secondaries(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_mapped_ram_direct_io(void);
+uint8_t migrate_dirty_sync_threads(void);
+uint32_t migrate_postcopy_prefetch_pages(void);
+bool migrate_postcopy_prefetch_stride(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_compress_wait_thread(void);
@@ -17,6 +17,8 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
 #include "qemu/madvise.h"
 #include "exec/target_page.h"
 #include "migration.h"
@@ -211,6 +213,97 @@ static uint32_t get_postcopy_total_blocktime(void)
     return bc->total_blocktime;
 }
 
+/* Bucket 0 counts latencies below 1us, bucket n counts [2^(n-1), 2^n) */
+#define POSTCOPY_FAULT_BUCKETS 32
+
+/*
+ * Latency of the page faults that needed a page from the source, from
+ * the page request until the page is placed.  Protected by
+ * page_request_mutex.
+ */
+static struct {
+    bool active;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[POSTCOPY_FAULT_BUCKETS];
+    uint64_t prefetched;
+} postcopy_fault_stats;
+
+/* Called with page_request_mutex held */
+static void postcopy_fault_latency_add(uint64_t latency)
+{
+    int bucket = latency ? 64 - clz64(latency) : 0;
+
+    postcopy_fault_stats.count++;
+    postcopy_fault_stats.sum += latency;
+    postcopy_fault_stats.max = MAX(postcopy_fault_stats.max, latency);
+    postcopy_fault_stats.buckets[MIN(bucket, POSTCOPY_FAULT_BUCKETS - 1)]++;
+}
+
+/*
+ * Estimate a percentile of the latencies, as the upper bound of the
+ * bucket it falls in.
+ */
+static uint64_t postcopy_fault_latency_percentile(unsigned int pct)
+{
+    uint64_t target, seen = 0;
+    int i;
+
+    if (!postcopy_fault_stats.count) {
+        return 0;
+    }
+
+    target = DIV_ROUND_UP(postcopy_fault_stats.count * pct, 100);
+    for (i = 0; i < POSTCOPY_FAULT_BUCKETS; i++) {
+        seen += postcopy_fault_stats.buckets[i];
+        if (seen >= target) {
+            return i ? MIN((1ULL << i) - 1, postcopy_fault_stats.max) : 0;
+        }
+    }
+
+    return postcopy_fault_stats.max;
+}
+
+/*
+ * Populates MigrationInfo with the page fault latencies of postcopy, on
+ * the destination only.
+ *
+ * @info: pointer to MigrationInfo to populate
+ */
+void fill_destination_postcopy_fault_info(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    PostcopyFaultLatency *latency;
+    int last;
+
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+    if (!postcopy_fault_stats.active) {
+        return;
+    }
+
+    latency = g_new0(PostcopyFaultLatency, 1);
+    latency->count = postcopy_fault_stats.count;
+    latency->sum = postcopy_fault_stats.sum;
+    latency->max = postcopy_fault_stats.max;
+    latency->p50 = postcopy_fault_latency_percentile(50);
+    latency->p99 = postcopy_fault_latency_percentile(99);
+    latency->prefetched = postcopy_fault_stats.prefetched;
+
+    /* Trailing empty buckets carry no information */
+    for (last = POSTCOPY_FAULT_BUCKETS - 1; last >= 0; last--) {
+        if (postcopy_fault_stats.buckets[last]) {
+            break;
+        }
+    }
+    for (; last >= 0; last--) {
+        QAPI_LIST_PREPEND(latency->buckets,
+                          postcopy_fault_stats.buckets[last]);
+    }
+
+    info->postcopy_fault_latency = latency;
+}
+
 /**
  * receive_ufd_features: check userfault fd features, to request only supported
  * features in the future.
@@ -930,6 +1023,112 @@ static void mark_postcopy_blocktime_end(uintptr_t addr)
                                       affected_cpu);
 }
 
+/*
+ * Prefetch state of the fault thread: the last fault, the distance to
+ * the fault before it, and the end of the pages prefetched after it.
+ */
+typedef struct PostcopyPrefetch {
+    RAMBlock *rb;
+    int64_t last_fault;
+    int64_t delta;
+    int64_t stride;
+    int64_t next;
+} PostcopyPrefetch;
+
+/* Called with page_request_mutex held */
+static bool postcopy_prefetch_wanted(MigrationIncomingState *mis,
+                                     RAMBlock *rb, ram_addr_t offset)
+{
+    return !ramblock_recv_bitmap_test_byte_offset(rb, offset) &&
+           !g_tree_lookup(mis->page_requested, rb->host + offset) &&
+           !ramblock_page_is_discarded(rb, offset);
+}
+
+/*
+ * After a fault at @offset of @rb, request the pages the guest is likely
+ * to touch next: those that follow it or, when the last three faults
+ * were the same distance apart, those further along that stride.
+ * Pages that were received, requested or prefetched already are
+ * skipped.  Prefetched pages are not put in page_requested, a fault on
+ * one that didn't arrive yet requests it again.
+ *
+ * Only called from the fault thread.
+ */
+static void postcopy_prefetch(MigrationIncomingState *mis,
+                              PostcopyPrefetch *pf, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    int64_t window = migrate_postcopy_prefetch_pages();
+    int64_t pagesize = qemu_ram_pagesize(rb);
+    int64_t stride = pagesize;
+    int64_t delta = 0, first = 1, k;
+    ram_addr_t run_start = 0;
+    size_t run_len = 0;
+    uint64_t prefetched = 0;
+
+    if (!window) {
+        return;
+    }
+
+    if (pf->rb == rb) {
+        delta = (int64_t)offset - pf->last_fault;
+        if (migrate_postcopy_prefetch_stride() && delta &&
+            delta == pf->delta) {
+            stride = delta;
+        }
+        /* Skip what the last prefetch requested already */
+        if (stride == pf->stride &&
+            (pf->next - (int64_t)offset) / stride > 0) {
+            first = (pf->next - (int64_t)offset) / stride;
+        }
+    }
+    pf->rb = rb;
+    pf->last_fault = offset;
+    pf->delta = delta;
+    pf->stride = stride;
+
+    for (k = first; k <= window; k++) {
+        int64_t page = (int64_t)offset + k * stride;
+        bool wanted = false;
+
+        if (page < 0 || page >= rb->used_length) {
+            break;
+        }
+        pf->next = page + stride;
+
+        WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+            wanted = postcopy_prefetch_wanted(mis, rb, page);
+        }
+        if (!wanted) {
+            continue;
+        }
+        prefetched++;
+
+        /* Requests for contiguous pages are merged */
+        if (run_len && run_start + run_len == page &&
+            run_len + pagesize <= UINT32_MAX) {
+            run_len += pagesize;
+            continue;
+        }
+        if (run_len &&
+            migrate_send_rp_message_req_pages(mis, rb, run_start, run_len)) {
+            run_len = 0;
+            break;
+        }
+        run_start = page;
+        run_len = pagesize;
+    }
+    if (run_len) {
+        migrate_send_rp_message_req_pages(mis, rb, run_start, run_len);
+    }
+
+    trace_postcopy_prefetch(qemu_ram_get_idstr(rb), offset, stride,
+                            prefetched);
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        postcopy_fault_stats.prefetched += prefetched;
+    }
+}
+
 static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 {
     trace_postcopy_pause_fault_thread();
@@ -943,6 +1142,7 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
 static void *postcopy_ram_fault_thread(void *opaque)
 {
     MigrationIncomingState *mis = opaque;
+    PostcopyPrefetch prefetch = {};
     struct uffd_msg msg;
     int ret;
     size_t index;
@@ -1071,6 +1271,7 @@ retry:
                 postcopy_pause_fault_thread(mis);
                 goto retry;
             }
+            postcopy_prefetch(mis, &prefetch, rb, rb_offset);
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1208,6 +1409,11 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        memset(&postcopy_fault_stats, 0, sizeof(postcopy_fault_stats));
+        postcopy_fault_stats.active = true;
+    }
+
     /* Now an eventfd we use to tell the fault-thread to quit */
     mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
     if (mis->userfault_event_fd == -1) {
@@ -1275,7 +1481,12 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
          * If this page resolves a page fault for a previous recorded faulted
          * address, take a special note to maintain the requested page list.
          */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
+        uintptr_t stamp = (uintptr_t)g_tree_lookup(mis->page_requested,
+                                                   host_addr);
+        if (stamp) {
+            uintptr_t now = (uintptr_t)postcopy_page_request_stamp();
+
+            postcopy_fault_latency_add(now - stamp);
             g_tree_remove(mis->page_requested, host_addr);
             mis->page_requested_count--;
             trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
@@ -1364,6 +1575,10 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
 {
 }
 
+void fill_destination_postcopy_fault_info(MigrationInfo *info)
+{
+}
+
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis, Error **errp)
 {
     error_report("%s: No OS support", __func__);
@@ -1451,6 +1666,14 @@ void postcopy_fault_thread_notify(MigrationIncomingState *mis)
     }
 }
 
+void *postcopy_page_request_stamp(void)
+{
+    /* Truncated on 32 bit hosts, which only matters after 71 minutes */
+    uintptr_t now = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    return (void *)(now ? now : 1);
+}
+
 /**
  * postcopy_discard_send_init: Called at the start of each RAMBlock before
  *   asking to discard individual ranges.
@@ -107,6 +107,12 @@ PostcopyState postcopy_state_set(PostcopyState new_state);
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis);
 
+/*
+ * postcopy_page_request_stamp: The time of a page request, as stored in
+ * the page_requested tree of MigrationIncomingState.  Never NULL.
+ */
+void *postcopy_page_request_stamp(void);
+
 /*
  * To be called once at the start before any device initialisation
  */
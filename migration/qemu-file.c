@@ -712,6 +712,57 @@ uint64_t qemu_file_transferred(QEMUFile *f)
     return f->total_transferred;
 }
 
+/* Like qemu_file_get_error_obj(), but sets @errp on any error */
+static int qemu_file_check_error(QEMUFile *f, Error **errp)
+{
+    if (!f->last_error) {
+        return 0;
+    }
+    if (f->last_error_obj) {
+        error_propagate(errp, error_copy(f->last_error_obj));
+    } else {
+        error_setg_errno(errp, -f->last_error, "Channel error");
+    }
+    return f->last_error;
+}
+
+off_t qemu_get_offset(QEMUFile *f, Error **errp)
+{
+    off_t offset;
+
+    qemu_fflush(f);
+    if (qemu_file_check_error(f, errp)) {
+        return -1;
+    }
+
+    offset = qio_channel_io_seek(f->ioc, 0, SEEK_CUR, errp);
+    if (offset < 0) {
+        return -1;
+    }
+    if (!qemu_file_is_writable(f)) {
+        offset -= f->buf_size - f->buf_index;
+    }
+    return offset;
+}
+
+int qemu_set_offset(QEMUFile *f, off_t offset, Error **errp)
+{
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+    if (qemu_file_check_error(f, errp)) {
+        return -1;
+    }
+
+    if (qio_channel_io_seek(f->ioc, offset, SEEK_SET, errp) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
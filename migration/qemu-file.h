@@ -97,6 +97,27 @@ uint64_t qemu_file_transferred(QEMUFile *f);
  */
 uint64_t qemu_file_transferred_fast(QEMUFile *f);
 
+/*
+ * qemu_get_offset:
+ *
+ * Get the position in the channel, which must be seekable, of the
+ * next byte that is read from or written to @f.
+ *
+ * Returns: the offset, or -1 on error
+ */
+off_t qemu_get_offset(QEMUFile *f, Error **errp);
+
+/*
+ * qemu_set_offset:
+ *
+ * Continue reading or writing @f at @offset in the channel, which
+ * must be seekable.  Written data is flushed first, read ahead data
+ * is dropped.
+ *
+ * Returns: 0 on success, -1 on error
+ */
+int qemu_set_offset(QEMUFile *f, off_t offset, Error **errp);
+
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
@@ -9,6 +9,22 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/bitmap.h"
+#include "qemu/rcu.h"
+#include "qemu/error-report.h"
+#include "qemu/event_notifier.h"
+#include "qemu/madvise.h"
+#include "exec/memory.h"
+#include "exec/ram_addr.h"
+
+#ifdef CONFIG_NUMA
+#include <numa.h>
+#include <numaif.h>
+#endif
+
+#if defined(__linux__)
+#include "qemu/userfaultfd.h"
+#endif
 
 #include "ram-colo.h"
 
@@ -16,19 +32,135 @@
 #include "options.h"
 #include "trace.h"
 
+typedef struct ColoFlushBlock {
+    RAMBlock *block;
+    unsigned long pages;
+    /*
+     * Host NUMA node backing each COLO_FLUSH_CHUNK_SIZE chunk, or -1.
+     * NULL without flush threads.
+     */
+    int *nodes;
+} ColoFlushBlock;
+
+/* Dirty pages of a COLO_FLUSH_GRANULE_SIZE granule */
+typedef struct ColoFlushGranule {
+    unsigned int block;
+    unsigned long start;
+    unsigned long dirty;
+} ColoFlushGranule;
+
+typedef struct ColoFlushWork {
+    RAMBlock *block;
+    unsigned long start;
+    unsigned long end;
+} ColoFlushWork;
+
 typedef struct FlushThreads {
     int num_threads;
     QemuSemaphore wait_sem;
     struct ColoFlushParams* threads;
+
+    GArray *blocks;
+    GArray *granules;
+    GArray *work;
+    uint64_t *load;
+    unsigned int steals;
+    /* Copy SVM's memory into the cache, instead of the other way round */
+    bool cache_sync;
+    /* Threads that were kicked and not waited for */
+    int outstanding;
 } FlushThreads;
 
 FlushThreads *colo_flush_threads = NULL;
 
+static bool colo_flush_queue_pop(ColoFlushParams *thread, bool steal,
+                                 unsigned int *item) {
+    bool ret = false;
+
+    qemu_spin_lock(&thread->lock);
+    if (thread->head < thread->queue->len) {
+        if (steal) {
+            *item = g_array_index(thread->queue, unsigned int,
+                                  thread->queue->len - 1);
+            g_array_set_size(thread->queue, thread->queue->len - 1);
+        } else {
+            *item = g_array_index(thread->queue, unsigned int, thread->head++);
+        }
+        ret = true;
+    }
+    qemu_spin_unlock(&thread->lock);
+
+    return ret;
+}
+
+static bool colo_flush_next_work(ColoFlushParams *thread, unsigned int *item) {
+    int num_threads = colo_flush_threads->num_threads;
+    int self = thread - colo_flush_threads->threads;
+
+    if (colo_flush_queue_pop(thread, false, item)) {
+        return true;
+    }
+
+    /* Out of work, steal from threads on the same node first */
+    for (int pass = 0; pass < 2; pass++) {
+        for (int n = 1; n < num_threads; n++) {
+            ColoFlushParams *victim =
+                &colo_flush_threads->threads[(self + n) % num_threads];
+
+            if ((victim->node == thread->node) != (pass == 0)) {
+                continue;
+            }
+            if (colo_flush_queue_pop(victim, true, item)) {
+                qatomic_inc(&colo_flush_threads->steals);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/*
+ * Before COLO state, received pages are only loaded into SVM's memory and
+ * recorded in the dirty bitmap.  Copy the recorded pages in [@start, @end)
+ * of @block into the cache.  @start is aligned to a bitmap word.
+ */
+static void colo_cache_sync_range(RAMBlock *block, unsigned long start,
+                                  unsigned long end) {
+    for (unsigned long word = BIT_WORD(start); word < BITS_TO_LONGS(end);
+         word++) {
+        unsigned long bits;
+
+        if (!qatomic_read(&block->bmap[word])) {
+            continue;
+        }
+
+        /*
+         * Pages are recorded after they have been loaded, so a page that
+         * is received again while we copy it gets copied another time.
+         */
+        bits = qatomic_xchg(&block->bmap[word], 0);
+        while (bits) {
+            int first = ctzl(bits);
+            int num = ctol(bits >> first);
+            ram_addr_t offset =
+                ((ram_addr_t)(word * BITS_PER_LONG + first)) << TARGET_PAGE_BITS;
+
+            memcpy(block->colo_cache + offset, block->host + offset,
+                   ((ram_addr_t)num) << TARGET_PAGE_BITS);
+            bits &= ~(num == BITS_PER_LONG ? ~0UL :
+                      ((1UL << num) - 1) << first);
+        }
+    }
+}
+
 static void *colo_flush_ram_cache_thread(void *opaque) {
     ColoFlushParams *thread = opaque;
 
     rcu_register_thread();
     while (true) {
+        unsigned int item;
+
         qemu_sem_wait(&thread->sem);
 
         qemu_mutex_lock(&thread->mutex);
@@ -40,7 +172,20 @@ static void *colo_flush_ram_cache_thread(void *opaque) {
         qemu_mutex_unlock(&thread->mutex);
 
         uint64_t start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
-        _colo_flush_ram_cache(thread);
+        WITH_RCU_READ_LOCK_GUARD() {
+            while (colo_flush_next_work(thread, &item)) {
+                ColoFlushWork *work = &g_array_index(colo_flush_threads->work,
+                                                     ColoFlushWork, item);
+
+                if (colo_flush_threads->cache_sync) {
+                    colo_cache_sync_range(work->block, work->start,
+                                          work->end);
+                } else {
+                    colo_flush_ram_cache_range(work->block, work->start,
+                                               work->end);
+                }
+            }
+        }
         trace_colo_flush_thread_took(qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
                                      - start);
         qemu_sem_post(&colo_flush_threads->wait_sem);
@@ -50,32 +195,310 @@ static void *colo_flush_ram_cache_thread(void *opaque) {
     return NULL;
 }
 
-void colo_flush_threads_run(void) {
+static int colo_flush_host_node(void *host) {
+#ifdef CONFIG_NUMA
+    int node;
+
+    if (!get_mempolicy(&node, NULL, 0, host, MPOL_F_NODE | MPOL_F_ADDR)) {
+        return node;
+    }
+#endif
+    return -1;
+}
+
+static void colo_flush_blocks_init(void) {
+    RAMBlock *block;
+
+    colo_flush_threads->blocks = g_array_new(false, false,
+                                             sizeof(ColoFlushBlock));
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ColoFlushBlock fb = {
+                .block = block,
+                .pages = block->used_length >> TARGET_PAGE_BITS,
+            };
+            unsigned long chunks = DIV_ROUND_UP(fb.pages,
+                                                COLO_FLUSH_CHUNK_SIZE);
+
+            /* Only the flush threads care where the memory lives */
+            if (colo_flush_threads->num_threads) {
+                fb.nodes = g_new(int, chunks);
+                for (unsigned long i = 0; i < chunks; i++) {
+                    fb.nodes[i] = colo_flush_host_node(block->host +
+                        ((i << COLO_FLUSH_CHUNK_SHIFT) << TARGET_PAGE_BITS));
+                }
+            }
+            g_array_append_val(colo_flush_threads->blocks, fb);
+        }
+    }
+}
+
+/*
+ * Pin the flush threads to the host NUMA nodes backing SVM's memory, with
+ * the number of threads per node proportional to the memory on the node.
+ */
+static void colo_flush_threads_pin(void) {
+#ifdef CONFIG_NUMA
     int num_threads = colo_flush_threads->num_threads;
+    int max_node, nbits;
+    g_autofree uint64_t *chunks = NULL;
+    g_autofree int *assigned = NULL;
+    struct bitmask *cpus;
 
-    if (num_threads == 0) {
-        ColoFlushParams thread = { 0 };
-        _colo_flush_ram_cache(&thread);
+    if (numa_available() < 0) {
         return;
     }
 
+    max_node = numa_max_node() + 1;
+    chunks = g_new0(uint64_t, max_node);
+    assigned = g_new0(int, max_node);
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        ColoFlushBlock *fb = &g_array_index(colo_flush_threads->blocks,
+                                            ColoFlushBlock, b);
+
+        for (unsigned long i = 0;
+             i < DIV_ROUND_UP(fb->pages, COLO_FLUSH_CHUNK_SIZE); i++) {
+            if (fb->nodes[i] >= 0 && fb->nodes[i] < max_node) {
+                chunks[fb->nodes[i]]++;
+            }
+        }
+    }
+
+    nbits = numa_num_possible_cpus();
+    cpus = numa_allocate_cpumask();
+    for (int n = 0; n < num_threads; n++) {
+        ColoFlushParams *thread = &colo_flush_threads->threads[n];
+        g_autofree unsigned long *bitmap = NULL;
+        int node = -1;
+
+        for (int i = 0; i < max_node; i++) {
+            if (chunks[i] && (node < 0 ||
+                chunks[i] * (assigned[node] + 1) >
+                chunks[node] * (assigned[i] + 1))) {
+                node = i;
+            }
+        }
+        if (node < 0) {
+            break;
+        }
+        assigned[node]++;
+
+        numa_bitmask_clearall(cpus);
+        if (numa_node_to_cpus(node, cpus)) {
+            continue;
+        }
+        bitmap = bitmap_new(nbits);
+        for (int i = 0; i < nbits; i++) {
+            if (numa_bitmask_isbitset(cpus, i)) {
+                set_bit(i, bitmap);
+            }
+        }
+        if (!qemu_thread_set_affinity(&thread->thread, bitmap, nbits)) {
+            thread->node = node;
+        }
+        trace_colo_flush_thread_node(n, thread->node);
+    }
+    numa_free_cpumask(cpus);
+#endif
+}
+
+static void colo_flush_work_add(ColoFlushWork *work, int node,
+                                uint64_t dirty) {
+    int num_threads = colo_flush_threads->num_threads;
+    uint64_t *load = colo_flush_threads->load;
+    unsigned int item = colo_flush_threads->work->len;
+    bool local = false;
+    int best = -1;
+
+    for (int n = 0; n < num_threads; n++) {
+        local |= colo_flush_threads->threads[n].node == node;
+    }
+
+    /* Give the work to the least loaded thread, on the right node if any */
+    for (int n = 0; n < num_threads; n++) {
+        if (local && colo_flush_threads->threads[n].node != node) {
+            continue;
+        }
+        if (best < 0 || load[n] < load[best]) {
+            best = n;
+        }
+    }
+
+    load[best] += dirty;
+    g_array_append_val(colo_flush_threads->work, *work);
+    g_array_append_val(colo_flush_threads->threads[best].queue, item);
+}
+
+/*
+ * Split the dirty pages into work items of about the same number of dirty
+ * pages and queue them on the flush threads.
+ */
+static void colo_flush_threads_plan(void) {
+    FlushThreads *ft = colo_flush_threads;
+    uint64_t total = 0, target, dirty = 0;
+    ColoFlushWork work = { 0 };
+    int node = -1;
+
+    g_array_set_size(ft->granules, 0);
+    g_array_set_size(ft->work, 0);
+    for (int n = 0; n < ft->num_threads; n++) {
+        g_array_set_size(ft->threads[n].queue, 0);
+        ft->threads[n].head = 0;
+        ft->load[n] = 0;
+    }
+    ft->steals = 0;
+
+    for (guint b = 0; b < ft->blocks->len; b++) {
+        ColoFlushBlock *fb = &g_array_index(ft->blocks, ColoFlushBlock, b);
+        unsigned long *bitmap = fb->block->bmap;
+        unsigned long pos = find_next_bit(bitmap, fb->pages, 0);
+
+        while (pos < fb->pages) {
+            ColoFlushGranule g = {
+                .block = b,
+                .start = pos & ~(COLO_FLUSH_GRANULE_SIZE - 1),
+            };
+            unsigned long end = MIN(g.start + COLO_FLUSH_GRANULE_SIZE,
+                                    fb->pages);
+
+            g.dirty = bitmap_count_one_with_offset(bitmap, g.start,
+                                                   end - g.start);
+            total += g.dirty;
+            g_array_append_val(ft->granules, g);
+            pos = find_next_bit(bitmap, fb->pages, end);
+        }
+    }
+
+    target = MAX(DIV_ROUND_UP(total,
+                              ft->num_threads * COLO_FLUSH_ITEMS_PER_THREAD),
+                 COLO_FLUSH_GRANULE_SIZE / 8);
+
+    for (guint i = 0; i < ft->granules->len; i++) {
+        ColoFlushGranule *g = &g_array_index(ft->granules, ColoFlushGranule, i);
+        ColoFlushBlock *fb = &g_array_index(ft->blocks, ColoFlushBlock,
+                                            g->block);
+        int g_node = fb->nodes[g->start >> COLO_FLUSH_CHUNK_SHIFT];
+
+        if (work.block && (work.block != fb->block || node != g_node ||
+                           dirty >= target)) {
+            colo_flush_work_add(&work, node, dirty);
+            work.block = NULL;
+        }
+        if (!work.block) {
+            work.block = fb->block;
+            work.start = g->start;
+            node = g_node;
+            dirty = 0;
+        }
+        work.end = MIN(g->start + COLO_FLUSH_GRANULE_SIZE, fb->pages);
+        dirty += g->dirty;
+    }
+    if (work.block) {
+        colo_flush_work_add(&work, node, dirty);
+    }
+
+    trace_colo_flush_threads_plan(total, ft->work->len);
+}
+
+static void colo_cache_sync_blocks(void) {
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        ColoFlushBlock *fb = &g_array_index(colo_flush_threads->blocks,
+                                            ColoFlushBlock, b);
+
+        if (!fb->block->colo_cache_present) {
+            colo_cache_sync_range(fb->block, 0, fb->pages);
+        }
+    }
+}
+
+static void colo_flush_threads_kick(void) {
+    int num_threads = colo_flush_threads->num_threads;
+
+    colo_flush_threads_plan();
+
     for (int n = 0; n < num_threads; n++) {
         struct ColoFlushParams *thread = &colo_flush_threads->threads[n];
         qemu_sem_post(&thread->sem);
     }
+    colo_flush_threads->outstanding = num_threads;
+}
+
+void colo_flush_threads_run(void) {
+    int num_threads = colo_flush_threads->num_threads;
+
+    if (num_threads == 0) {
+        WITH_RCU_READ_LOCK_GUARD() {
+            for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+                ColoFlushBlock *fb = &g_array_index(colo_flush_threads->blocks,
+                                                    ColoFlushBlock, b);
+
+                colo_flush_ram_cache_range(fb->block, 0, fb->pages);
+            }
+        }
+        return;
+    }
+
+    colo_flush_threads->cache_sync = false;
+    colo_flush_threads_kick();
 }
 
 void colo_flush_threads_wait(void) {
     int num_threads = colo_flush_threads->num_threads;
 
-    for (int n = 0; n < num_threads; n++) {
+    while (colo_flush_threads->outstanding) {
         qemu_sem_wait(&colo_flush_threads->wait_sem);
+        colo_flush_threads->outstanding--;
     }
+
+    if (num_threads) {
+        trace_colo_flush_threads_steals(colo_flush_threads->steals);
+    }
+}
+
+/*
+ * Kick the cache sync in the background after an iteration of the initial
+ * migration, unless the last one is still running.
+ */
+void colo_cache_sync_kick(void) {
+    FlushThreads *ft = colo_flush_threads;
+
+    if (ft->num_threads == 0) {
+        colo_cache_sync_blocks();
+        return;
+    }
+
+    while (ft->outstanding && !qemu_sem_timedwait(&ft->wait_sem, 0)) {
+        ft->outstanding--;
+    }
+    if (ft->outstanding) {
+        return;
+    }
+
+    ft->cache_sync = true;
+    colo_flush_threads_kick();
+}
+
+/* Copy what is left of the initial migration into the cache */
+void colo_cache_sync(void) {
+    FlushThreads *ft = colo_flush_threads;
+
+    colo_flush_threads_wait();
+    if (ft->num_threads == 0) {
+        colo_cache_sync_blocks();
+        return;
+    }
+
+    ft->cache_sync = true;
+    colo_flush_threads_kick();
+    colo_flush_threads_wait();
 }
 
 void colo_flush_threads_cleanup(void) {
     int num_threads = colo_flush_threads->num_threads;
 
+    colo_flush_threads_wait();
+
     for (int n = 0; n < num_threads; n++) {
         ColoFlushParams *thread = &colo_flush_threads->threads[n];
 
@@ -88,41 +511,327 @@ void colo_flush_threads_cleanup(void) {
         qemu_thread_join(&thread->thread);
         qemu_sem_destroy(&thread->sem);
         qemu_mutex_destroy(&thread->mutex);
+        g_array_free(thread->queue, true);
     }
 
     if (num_threads) {
         g_free(colo_flush_threads->threads);
+        g_free(colo_flush_threads->load);
+        g_array_free(colo_flush_threads->granules, true);
+        g_array_free(colo_flush_threads->work, true);
     }
 
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        g_free(g_array_index(colo_flush_threads->blocks,
+                             ColoFlushBlock, b).nodes);
+    }
+    g_array_free(colo_flush_threads->blocks, true);
+
     g_free(colo_flush_threads);
     colo_flush_threads = NULL;
 }
 
 void colo_flush_threads_init(void) {
     int num_threads = migrate_colo_flush_threads();
-    unsigned long thread_mask = num_threads;
-    thread_mask -= 1; // before: 0100 now: 0011
-    thread_mask <<= COLO_FLUSH_CHUNK_SHIFT;
 
     colo_flush_threads = g_new0(FlushThreads, 1);
     colo_flush_threads->num_threads = num_threads;
+    colo_flush_blocks_init();
     if (num_threads == 0) {
         return;
     }
 
     qemu_sem_init(&colo_flush_threads->wait_sem, 0);
     colo_flush_threads->threads = g_new0(ColoFlushParams, num_threads);
+    colo_flush_threads->load = g_new0(uint64_t, num_threads);
+    colo_flush_threads->granules = g_array_new(false, false,
+                                               sizeof(ColoFlushGranule));
+    colo_flush_threads->work = g_array_new(false, false,
+                                           sizeof(ColoFlushWork));
 
     for (int n = 0; n < num_threads; n++) {
         ColoFlushParams *thread = &colo_flush_threads->threads[n];
         qemu_sem_init(&thread->sem, 0);
         qemu_mutex_init(&thread->mutex);
+        qemu_spin_init(&thread->lock);
         thread->quit = false;
-        thread->thread_mask = thread_mask;
-        thread->thread_bits = n << COLO_FLUSH_CHUNK_SHIFT;
+        thread->node = -1;
+        thread->queue = g_array_new(false, false, sizeof(unsigned int));
 
         qemu_thread_create(&thread->thread, "flush thread",
                            colo_flush_ram_cache_thread, thread,
                            QEMU_THREAD_JOINABLE);
     }
+
+    colo_flush_threads_pin();
+}
+
+typedef struct ColoLazyCache {
+    int uffd;
+    EventNotifier quit;
+    QemuThread thread;
+    /* Serializes copying pages into the cache */
+    QemuMutex lock;
+} ColoLazyCache;
+
+static ColoLazyCache *colo_lazy_cache;
+
+/*
+ * The lazy cache can't track writes to read-only and MMIO-writable regions,
+ * these keep a full copy in the cache.
+ */
+bool colo_lazy_cache_block(RAMBlock *block) {
+    return migrate_colo_lazy_cache() &&
+           !block->mr->readonly && !block->mr->rom_device;
+}
+
+/*
+ * Copy the host page at @offset of @block from SVM's memory into the
+ * cache, unless it is already present there.  Must be called before the
+ * page is written in either SVM's memory or the cache.
+ */
+void colo_lazy_cache_populate(RAMBlock *block, ram_addr_t offset) {
+    unsigned long page;
+
+    offset = QEMU_ALIGN_DOWN(offset, block->page_size);
+    page = offset >> TARGET_PAGE_BITS;
+    if (test_bit(page, block->colo_cache_present)) {
+        return;
+    }
+
+    qemu_mutex_lock(&colo_lazy_cache->lock);
+    if (!test_bit(page, block->colo_cache_present)) {
+        memcpy(block->colo_cache + offset, block->host + offset,
+               block->page_size);
+        bitmap_set_atomic(block->colo_cache_present, page,
+                          block->page_size >> TARGET_PAGE_BITS);
+    }
+    qemu_mutex_unlock(&colo_lazy_cache->lock);
+}
+
+#if defined(__linux__)
+static RAMBlock *colo_lazy_cache_block_from_host(void *host,
+                                                 ram_addr_t *offset) {
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        RAMBlock *block = g_array_index(colo_flush_threads->blocks,
+                                        ColoFlushBlock, b).block;
+
+        if (block->colo_cache_present && (uint8_t *)host >= block->host &&
+            (uint8_t *)host < block->host + block->used_length) {
+            *offset = (uint8_t *)host - block->host;
+            return block;
+        }
+    }
+
+    return NULL;
+}
+
+static void *colo_lazy_cache_thread(void *opaque) {
+    ColoLazyCache *lc = opaque;
+    struct pollfd pfd[2] = {
+        { .fd = lc->uffd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&lc->quit), .events = POLLIN },
+    };
+
+    while (true) {
+        struct uffd_msg msg;
+        ram_addr_t offset;
+        RAMBlock *block;
+        void *host;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            error_report("%s: poll() failed: %s", __func__, strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+
+        if (uffd_read_events(lc->uffd, &msg, 1) <= 0 ||
+            msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        host = (void *)(uintptr_t)msg.arg.pagefault.address;
+        block = colo_lazy_cache_block_from_host(host, &offset);
+        if (!block) {
+            error_report("%s: write fault outside of guest memory at %p",
+                         __func__, host);
+            continue;
+        }
+
+        offset = QEMU_ALIGN_DOWN(offset, block->page_size);
+        colo_lazy_cache_populate(block, offset);
+        uffd_change_protection(lc->uffd, block->host + offset,
+                               block->page_size, false, false);
+        trace_colo_lazy_cache_fault(block->idstr, offset);
+    }
+
+    return NULL;
+}
+
+int colo_lazy_cache_start(void) {
+    ColoLazyCache *lc;
+    RAMBlock *block;
+    bool lazy = false;
+
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        block = g_array_index(colo_flush_threads->blocks,
+                              ColoFlushBlock, b).block;
+        lazy |= !!block->colo_cache_present;
+    }
+    if (!lazy) {
+        return 0;
+    }
+
+    lc = g_new0(ColoLazyCache, 1);
+    lc->uffd = uffd_create_fd(UFFD_FEATURE_PAGEFAULT_FLAG_WP, true);
+    if (lc->uffd < 0) {
+        g_free(lc);
+        return -1;
+    }
+    qemu_mutex_init(&lc->lock);
+    event_notifier_init(&lc->quit, false);
+    colo_lazy_cache = lc;
+
+    qemu_thread_create(&lc->thread, "colo lazy cache",
+                       colo_lazy_cache_thread, lc, QEMU_THREAD_JOINABLE);
+
+    /* Write protection skips pages that are not populated */
+    ram_write_tracking_prepare();
+
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        block = g_array_index(colo_flush_threads->blocks,
+                              ColoFlushBlock, b).block;
+        if (!block->colo_cache_present) {
+            continue;
+        }
+
+        if (uffd_register_memory(lc->uffd, block->host, block->max_length,
+                                 UFFDIO_REGISTER_MODE_WP, NULL) ||
+            uffd_change_protection(lc->uffd, block->host, block->used_length,
+                                   true, false)) {
+            error_report("%s: Can't write protect block %s", __func__,
+                         block->idstr);
+            colo_lazy_cache_stop();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void colo_lazy_cache_stop(void) {
+    ColoLazyCache *lc = colo_lazy_cache;
+
+    if (!lc) {
+        return;
+    }
+
+    /* Wakes up any thread still waiting for a write fault */
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        RAMBlock *block = g_array_index(colo_flush_threads->blocks,
+                                        ColoFlushBlock, b).block;
+
+        if (block->colo_cache_present) {
+            uffd_unregister_memory(lc->uffd, block->host, block->max_length);
+        }
+    }
+
+    event_notifier_set(&lc->quit);
+    qemu_thread_join(&lc->thread);
+    event_notifier_cleanup(&lc->quit);
+    uffd_close_fd(lc->uffd);
+    qemu_mutex_destroy(&lc->lock);
+    g_free(lc);
+    colo_lazy_cache = NULL;
+}
+
+/*
+ * Flush the pages in [@start, @start + @num) of @block that are present in
+ * the cache.  Pages that are not present were written by neither side, so
+ * SVM's memory holds their content already.
+ */
+void colo_lazy_cache_flush(RAMBlock *block, unsigned long start,
+                           unsigned long num) {
+    unsigned long end = start + num;
+    unsigned long first = find_next_bit(block->colo_cache_present, end,
+                                        start);
+
+    while (first < end) {
+        unsigned long last = find_next_zero_bit(block->colo_cache_present,
+                                                end, first);
+        ram_addr_t offset = ((ram_addr_t)first) << TARGET_PAGE_BITS;
+        size_t len = (last - first) << TARGET_PAGE_BITS;
+
+        uffd_change_protection(colo_lazy_cache->uffd,
+                               block->host + QEMU_ALIGN_DOWN(offset,
+                                                             block->page_size),
+                               QEMU_ALIGN_UP(offset + len, block->page_size) -
+                               QEMU_ALIGN_DOWN(offset, block->page_size),
+                               false, false);
+        memcpy(block->host + offset, block->colo_cache + offset, len);
+        first = find_next_bit(block->colo_cache_present, end, last);
+    }
+}
+
+/*
+ * After the flush SVM's memory matches the cache again.  Drop the pages
+ * from the cache and write protect them in SVM's memory again.  Called
+ * with the VM stopped.
+ */
+void colo_lazy_cache_release(void) {
+    uint64_t released = 0;
+
+    if (!colo_lazy_cache) {
+        return;
+    }
+
+    for (guint b = 0; b < colo_flush_threads->blocks->len; b++) {
+        ColoFlushBlock *fb = &g_array_index(colo_flush_threads->blocks,
+                                            ColoFlushBlock, b);
+        unsigned long *present = fb->block->colo_cache_present;
+        unsigned long first;
+
+        if (!present) {
+            continue;
+        }
+
+        first = find_next_bit(present, fb->pages, 0);
+        while (first < fb->pages) {
+            unsigned long last = find_next_zero_bit(present, fb->pages, first);
+            ram_addr_t offset = ((ram_addr_t)first) << TARGET_PAGE_BITS;
+            size_t len = (last - first) << TARGET_PAGE_BITS;
+
+            qemu_madvise(fb->block->colo_cache + offset, len,
+                         QEMU_MADV_DONTNEED);
+            uffd_change_protection(colo_lazy_cache->uffd,
+                                   fb->block->host + offset, len, true, false);
+            bitmap_clear(present, first, last - first);
+            released += last - first;
+            first = find_next_bit(present, fb->pages, last);
+        }
+    }
+
+    trace_colo_lazy_cache_release(released);
+}
+#else
+int colo_lazy_cache_start(void) {
+    /* colo_init_ram_cache() refuses the lazy cache */
+    return 0;
+}
+
+void colo_lazy_cache_stop(void) {
+}
+
+void colo_lazy_cache_flush(RAMBlock *block, unsigned long start,
+                           unsigned long num) {
+    g_assert_not_reached();
+}
+
+void colo_lazy_cache_release(void) {
 }
+#endif /* defined(__linux__) */
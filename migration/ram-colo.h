@@ -11,23 +11,49 @@
 #define QEMU_MIGRATION_RAM_COLO_H
 
 #include "qemu/thread.h"
+#include "exec/cpu-common.h"
 
 typedef struct ColoFlushParams {
     QemuThread thread;
     QemuSemaphore sem;
     QemuMutex mutex;
     bool quit;
-    unsigned long thread_mask;
-    unsigned long thread_bits;
+    /* Host NUMA node the thread is pinned to, or -1 */
+    int node;
+
+    /*
+     * Work items assigned to this thread.  The owner takes them from the
+     * head, idle threads steal from the tail.
+     */
+    QemuSpin lock;
+    GArray *queue;
+    unsigned int head;
 } ColoFlushParams;
 
 /* 4096 * 4k = 16m bytes chunk size */
 #define COLO_FLUSH_CHUNK_SHIFT 12
 #define COLO_FLUSH_CHUNK_SIZE (1ul << COLO_FLUSH_CHUNK_SHIFT)
 
+/* Dirty pages are counted in granules of 512 * 4k = 2m bytes */
+#define COLO_FLUSH_GRANULE_SHIFT 9
+#define COLO_FLUSH_GRANULE_SIZE (1ul << COLO_FLUSH_GRANULE_SHIFT)
+
+/* Work items per flush thread the dirty pages are split into */
+#define COLO_FLUSH_ITEMS_PER_THREAD 8
+
 void colo_flush_threads_init(void);
 void colo_flush_threads_cleanup(void);
 void colo_flush_threads_run(void);
 void colo_flush_threads_wait(void);
+void colo_cache_sync_kick(void);
+void colo_cache_sync(void);
+
+bool colo_lazy_cache_block(RAMBlock *block);
+int colo_lazy_cache_start(void);
+void colo_lazy_cache_stop(void);
+void colo_lazy_cache_populate(RAMBlock *block, ram_addr_t offset);
+void colo_lazy_cache_flush(RAMBlock *block, unsigned long start,
+                           unsigned long num);
+void colo_lazy_cache_release(void);
 
 #endif // QEMU_MIGRATION_RAM_COLO.H
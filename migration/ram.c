@@ -28,6 +28,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/madvise.h"
@@ -58,6 +59,8 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "multifd-colo.h"
+#include "file.h"
 #include "sysemu/runstate.h"
 #include "options.h"
 
@@ -91,6 +94,21 @@
 #define RAM_SAVE_FLAG_MULTIFD_FLUSH    0x200
 /* We can't use any flag that is bigger than 0x200 */
 
+/*
+ * With the mapped-ram capability, each RAMBlock entry in the stream is
+ * followed by a header and a region of the file.  The region holds a
+ * bitmap of the pages that are in the file, and then every page at its
+ * offset in the block.  The pages are written in place each time they
+ * are sent, the bitmaps at the end of the migration.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+/* version, page size, bitmap offset, pages offset */
+#define MAPPED_RAM_HDR_SIZE (4 + 8 + 8 + 8)
+/* Where the pages start is aligned for O_DIRECT and huge pages */
+#define MAPPED_RAM_FILE_OFFSET_ALIGNMENT (1 * MiB)
+/* The destination reads the pages in chunks of this size in parallel */
+#define MAPPED_RAM_LOAD_CHUNK (4 * MiB)
+
 int (*xbzrle_encode_buffer_func)(uint8_t *, uint8_t *, int,
      uint8_t *, int) = xbzrle_encode_buffer;
 #if defined(CONFIG_AVX512BW_OPT)
@@ -419,6 +437,13 @@ struct RAMState {
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /* Threads that help merging the dirty bitmaps, or NULL */
+    struct DirtySyncThreads *sync_threads;
+    /*
+     * Channel the pages of a mapped-ram migration without multifd are
+     * written to, when they need their own, or NULL
+     */
+    QIOChannel *mapped_ram_ioc;
 };
 typedef struct RAMState RAMState;
 
@@ -791,67 +816,31 @@ migration_clear_memory_region_dirty_bitmap_range(RAMBlock *rb,
  * colo_bitmap_find_diry:find contiguous dirty pages from start
  *
  * Returns the page offset within memory region of the start of the contiguout
- * dirty page
+ * dirty page, or a value >= @end if there is none
  *
- * @rs: current RAM state
  * @rb: RAMBlock where to search for dirty pages
  * @start: page where we start the search
+ * @end: page where we stop the search
  * @num: the number of contiguous dirty pages
  */
 static inline
-unsigned long colo_bitmap_find_dirty(ColoFlushParams *thread, RAMBlock *rb,
-                                     unsigned long start, unsigned long *num)
+unsigned long colo_bitmap_find_dirty(RAMBlock *rb, unsigned long start,
+                                     unsigned long end, unsigned long *num)
 {
     unsigned long size = rb->used_length >> TARGET_PAGE_BITS;
     unsigned long *bitmap = rb->bmap;
-    unsigned long thread_mask = thread->thread_mask;
-    unsigned long thread_bits = thread->thread_bits;
-    unsigned long first = start;
+    unsigned long first;
     unsigned long next_zero;
 
     *num = 0;
+    end = MIN(end, size);
 
-    while (true) {
-        first = find_next_bit(bitmap, size, first);
-        if (first >= size) {
-            return first;
-        }
-
-        if ((first & thread_mask) == thread_bits) {
-            /* Beginning lies within one of our chunks */
-            break;
-        }
-
-        /* Round up to our next chunk */
-
-        if ((first & thread_mask) > thread_bits) {
-            /*
-             * Go to the next stripe by adding '1' to the left of the
-             * thread bits.
-             */
-            first |= thread_mask;
-            first += COLO_FLUSH_CHUNK_SIZE;
-        }
-
-        /* Set thread bits to our thread */
-        first |= thread_mask;
-        first &= (thread_bits | ~thread_mask);
-
-        /* Clear chunk offset */
-        first &= ~(COLO_FLUSH_CHUNK_SIZE - 1);
-
-        if (first >= size) {
-            return first;
-        }
+    first = find_next_bit(bitmap, end, start);
+    if (first >= end) {
+        return size;
     }
 
-    next_zero = find_next_zero_bit(bitmap, size, first + 1);
-
-    if (thread_mask) {
-        /* num_threads > 1 */
-        unsigned long chunk_last = first | (COLO_FLUSH_CHUNK_SIZE - 1);
-        next_zero = MIN(next_zero, chunk_last + 1);
-    }
+    next_zero = find_next_zero_bit(bitmap, end, first + 1);
     assert(next_zero > first);
 
     *num = next_zero - first;
@@ -967,6 +956,210 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Dirty bitmap sync threads
+ *
+ * On every sync, the RAMBlocks are cut into chunks of
+ * DIRTY_SYNC_CHUNK_PAGES pages.  The sync threads and the migration
+ * thread claim the chunks one at a time and merge the dirty bits of
+ * each into the migration bitmap.  Chunks start at a word of both the
+ * global dirty bitmap and the RAMBlock bitmap, so no two threads write
+ * the same word of those.  One bit of the clear bitmap can cover pages
+ * of several chunks, clear_bmap_set() sets it atomically.
+ */
+
+/* 1G with 4k pages, a multiple of BITS_PER_LONG */
+#define DIRTY_SYNC_CHUNK_PAGES (256 * 1024)
+
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+typedef struct DirtySyncThread {
+    QemuThread thread;
+    QemuSemaphore sem;
+    struct DirtySyncThreads *threads;
+    /* new dirty pages found in the last sync */
+    uint64_t num_dirty;
+    bool quit;
+} DirtySyncThread;
+
+typedef struct DirtySyncThreads {
+    int num_threads;
+    DirtySyncThread *threads;
+    QemuSemaphore wait_sem;
+    /* chunks of the current sync, and the next one to claim */
+    GArray *chunks;
+    unsigned int next_chunk;
+} DirtySyncThreads;
+
+/*
+ * Returns the number of pages at the start of @rb that can be merged by
+ * the sync threads.  The rest, if any, is merged page by page, which
+ * also clears the dirty log of the memory region, and is left to the
+ * migration thread.
+ */
+static unsigned long ramblock_sync_parallel_pages(RAMBlock *rb)
+{
+    unsigned long pages = rb->used_length >> TARGET_PAGE_BITS;
+
+    if (!rb->clear_bmap ||
+        (rb->offset >> TARGET_PAGE_BITS) % BITS_PER_LONG) {
+        return 0;
+    }
+    return QEMU_ALIGN_DOWN(pages, BITS_PER_LONG);
+}
+
+/* Called with RCU critical section */
+static uint64_t dirty_sync_do_chunks(DirtySyncThreads *st)
+{
+    uint64_t num_dirty = 0;
+    unsigned int i;
+
+    while ((i = qatomic_fetch_inc(&st->next_chunk)) < st->chunks->len) {
+        DirtySyncChunk *chunk = &g_array_index(st->chunks, DirtySyncChunk, i);
+
+        num_dirty += cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                           chunk->start,
+                                                           chunk->length);
+    }
+    return num_dirty;
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncThread *thread = opaque;
+    DirtySyncThreads *st = thread->threads;
+
+    rcu_register_thread();
+    while (true) {
+        qemu_sem_wait(&thread->sem);
+        if (qatomic_read(&thread->quit)) {
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            thread->num_dirty = dirty_sync_do_chunks(st);
+        }
+        qemu_sem_post(&st->wait_sem);
+    }
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+static void dirty_sync_threads_setup(RAMState *rs)
+{
+    int num_threads = migrate_dirty_sync_threads();
+    DirtySyncThreads *st;
+
+    if (!num_threads || rs->sync_threads) {
+        return;
+    }
+
+    st = g_new0(DirtySyncThreads, 1);
+    st->num_threads = num_threads;
+    st->threads = g_new0(DirtySyncThread, num_threads);
+    st->chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    qemu_sem_init(&st->wait_sem, 0);
+
+    for (int n = 0; n < num_threads; n++) {
+        DirtySyncThread *thread = &st->threads[n];
+
+        thread->threads = st;
+        qemu_sem_init(&thread->sem, 0);
+        qemu_thread_create(&thread->thread, "mig/dirtysync",
+                           dirty_sync_thread, thread, QEMU_THREAD_JOINABLE);
+    }
+    rs->sync_threads = st;
+}
+
+static void dirty_sync_threads_cleanup(RAMState *rs)
+{
+    DirtySyncThreads *st = rs->sync_threads;
+
+    if (!st) {
+        return;
+    }
+
+    for (int n = 0; n < st->num_threads; n++) {
+        DirtySyncThread *thread = &st->threads[n];
+
+        qatomic_set(&thread->quit, true);
+        qemu_sem_post(&thread->sem);
+        qemu_thread_join(&thread->thread);
+        qemu_sem_destroy(&thread->sem);
+    }
+    qemu_sem_destroy(&st->wait_sem);
+    g_array_free(st->chunks, true);
+    g_free(st->threads);
+    g_free(st);
+    rs->sync_threads = NULL;
+}
+
+/*
+ * Merge the dirty bitmaps of all the RAMBlocks, with the help of the
+ * sync threads if there are any.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ */
+static void ram_sync_dirty_bitmaps(RAMState *rs)
+{
+    DirtySyncThreads *st = rs->sync_threads;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+
+    if (!st) {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            ramblock_sync_dirty_bitmap(rs, block);
+        }
+        return;
+    }
+
+    g_array_set_size(st->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        unsigned long pages = ramblock_sync_parallel_pages(block);
+
+        for (unsigned long start = 0; start < pages;
+             start += DIRTY_SYNC_CHUNK_PAGES) {
+            DirtySyncChunk chunk = {
+                .block = block,
+                .start = (ram_addr_t)start << TARGET_PAGE_BITS,
+                .length = (ram_addr_t)MIN(DIRTY_SYNC_CHUNK_PAGES,
+                                          pages - start) << TARGET_PAGE_BITS,
+            };
+
+            g_array_append_val(st->chunks, chunk);
+        }
+    }
+    qatomic_set(&st->next_chunk, 0);
+
+    for (int n = 0; n < st->num_threads; n++) {
+        qemu_sem_post(&st->threads[n].sem);
+    }
+    new_dirty_pages = dirty_sync_do_chunks(st);
+    for (int n = 0; n < st->num_threads; n++) {
+        qemu_sem_wait(&st->wait_sem);
+    }
+    for (int n = 0; n < st->num_threads; n++) {
+        new_dirty_pages += st->threads[n].num_dirty;
+    }
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t start = (ram_addr_t)ramblock_sync_parallel_pages(block)
+                           << TARGET_PAGE_BITS;
+
+        if (start < block->used_length) {
+            new_dirty_pages += cpu_physical_memory_sync_dirty_bitmap(
+                block, start, block->used_length - start);
+        }
+    }
+
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1078,7 +1271,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
-    RAMBlock *block;
+    int64_t start_us, merge_us, end_us;
     int64_t end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
@@ -1088,19 +1281,23 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
     }
 
     trace_migration_bitmap_sync_start();
+    start_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync(last_stage);
 
     qemu_mutex_lock(&rs->bitmap_mutex);
+    merge_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        ram_sync_dirty_bitmaps(rs);
         stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    end_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    merge_us - start_us, end_us - merge_us);
+    stat64_set(&mig_stats.dirty_sync_time, end_us - start_us);
+    stat64_max(&mig_stats.dirty_sync_time_max, end_us - start_us);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1189,7 +1386,19 @@ static int save_zero_page_to_file(PageSearchStatus *pss, QEMUFile *file,
 static int save_zero_page(PageSearchStatus *pss, QEMUFile *f, RAMBlock *block,
                           ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(pss, f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        if (!buffer_is_zero(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        /* The destination leaves pages that aren't in the file zero */
+        clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        stat64_add(&mig_stats.zero_pages, 1);
+        return 1;
+    }
+
+    len = save_zero_page_to_file(pss, f, block, offset);
 
     if (len) {
         stat64_add(&mig_stats.zero_pages, 1);
@@ -1237,6 +1446,36 @@ static bool control_save_page(PageSearchStatus *pss, RAMBlock *block,
     return true;
 }
 
+/*
+ * mapped_ram_save_page: write the page to its place in the file
+ *
+ * Returns the number of pages written, or -1 on error.
+ *
+ * @f: QEMUFile of the migration file
+ * @block: block that contains the page we want to send
+ * @offset: offset inside the block for the page
+ */
+static int mapped_ram_save_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset)
+{
+    struct iovec iov = {
+        .iov_base = block->host + offset,
+        .iov_len = TARGET_PAGE_SIZE,
+    };
+    QIOChannel *ioc = ram_state->mapped_ram_ioc ?: qemu_file_get_ioc(f);
+    Error *local_err = NULL;
+
+    if (file_write_ramblock_iov(ioc, &iov, 1, block, &local_err) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_err);
+        return -1;
+    }
+    /* For the rate limit */
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    ram_transferred_add(TARGET_PAGE_SIZE);
+    stat64_add(&mig_stats.normal_pages, 1);
+    return 1;
+}
+
 /*
  * directly send the page to the stream
  *
@@ -1253,6 +1492,10 @@ static int save_normal_page(PageSearchStatus *pss, RAMBlock *block,
 {
     QEMUFile *file = pss->pss_channel;
 
+    if (migrate_mapped_ram()) {
+        return mapped_ram_save_page(file, block, offset);
+    }
+
     ram_transferred_add(save_page_header(pss, pss->pss_channel, block,
                                          offset | RAM_SAVE_FLAG_PAGE));
     if (async) {
@@ -1319,7 +1562,7 @@ static int ram_save_multifd_page(QEMUFile *file, RAMBlock *block,
     if (multifd_queue_page(file, block, offset) < 0) {
         return -1;
     }
-    stat64_add(&mig_stats.normal_pages, 1);
+    /* The send threads count the pages once they know if they are zero */
 
     return 1;
 }
@@ -2164,6 +2407,15 @@ static int ram_save_target_page_legacy(RAMState *rs, PageSearchStatus *pss)
         return 1;
     }
 
+    /*
+     * The multifd send threads detect the zero pages themselves, see
+     * below for why multifd isn't used in postcopy.
+     */
+    if (migrate_multifd_zero_page() && migrate_multifd() &&
+        !migration_in_postcopy()) {
+        return ram_save_multifd_page(pss->pss_channel, block, offset);
+    }
+
     res = save_zero_page(pss, pss->pss_channel, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -2174,6 +2426,9 @@ static int ram_save_target_page_legacy(RAMState *rs, PageSearchStatus *pss)
             xbzrle_cache_zero_page(rs, block->offset + offset);
             XBZRLE_cache_unlock();
         }
+        if (migrate_multifd()) {
+            multifd_colo_delta_zero_page(block->offset + offset);
+        }
         return res;
     }
 
@@ -2481,6 +2736,10 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        dirty_sync_threads_cleanup(*rsp);
+        if ((*rsp)->mapped_ram_ioc) {
+            object_unref(OBJECT((*rsp)->mapped_ram_ioc));
+        }
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2532,6 +2791,11 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
     }
 
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
@@ -2918,6 +3182,8 @@ static void migration_bitmap_clear_discarded_pages(RAMState *rs)
 
 static void ram_init_bitmaps(RAMState *rs)
 {
+    dirty_sync_threads_setup(rs);
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
@@ -3037,6 +3303,70 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
     }
 }
 
+/* The bitmap of a block in a mapped-ram file is in 64 bit units */
+static uint64_t mapped_ram_bitmap_bits(ram_addr_t length)
+{
+    return ROUND_UP(length >> TARGET_PAGE_BITS, 64);
+}
+
+/*
+ * mapped_ram_setup_ramblock: write the mapped-ram header of @block and
+ * skip over its region in the file
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block,
+                                     Error **errp)
+{
+    uint64_t nbits = mapped_ram_bitmap_bits(block->used_length);
+    off_t header = qemu_get_offset(f, errp);
+
+    if (header < 0) {
+        return -1;
+    }
+
+    block->file_bmap = bitmap_new(nbits);
+    block->bitmap_offset = header + MAPPED_RAM_HDR_SIZE;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + nbits / 8,
+                                   MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    return qemu_set_offset(f, block->pages_offset + block->used_length, errp);
+}
+
+/*
+ * mapped_ram_save_bitmaps: write the bitmaps of the pages that are in the
+ * file, once all of them have been written
+ *
+ * Returns 0 for success or -1 for error
+ */
+static int mapped_ram_save_bitmaps(QEMUFile *f, Error **errp)
+{
+    RAMBlock *block;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        uint64_t nbits = mapped_ram_bitmap_bits(block->used_length);
+        g_autofree unsigned long *le = bitmap_new(nbits);
+        struct iovec iov = {
+            .iov_base = le,
+            .iov_len = nbits / 8,
+        };
+
+        bitmap_to_le(le, block->file_bmap, nbits);
+        if (file_pwritev_all(qemu_file_get_ioc(f), &iov, 1,
+                             block->bitmap_offset, errp) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
 /*
  * Each of ram_save_setup, ram_save_iterate and ram_save_complete has
  * long-running RCU critical section.  When rcu-reclaims in the code
@@ -3071,6 +3401,21 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     (*rsp)->pss[RAM_CHANNEL_PRECOPY].pss_channel = f;
 
+    /*
+     * With multifd, every channel opens the file itself.  Without it,
+     * O_DIRECT needs a channel of its own for the pages.
+     */
+    if (migrate_mapped_ram() && migrate_mapped_ram_direct_io() &&
+        !migrate_multifd()) {
+        Error *local_err = NULL;
+
+        (*rsp)->mapped_ram_ioc = file_open_page_channel(O_WRONLY, &local_err);
+        if (!(*rsp)->mapped_ram_ioc) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         qemu_put_be64(f, ram_bytes_total_with_ignored()
                          | RAM_SAVE_FLAG_MEM_SIZE);
@@ -3086,6 +3431,14 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram()) {
+                Error *local_err = NULL;
+
+                if (mapped_ram_setup_ramblock(f, block, &local_err) < 0) {
+                    error_report_err(local_err);
+                    return -1;
+                }
+            }
         }
     }
 
@@ -3296,6 +3649,15 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         return ret;
     }
 
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (mapped_ram_save_bitmaps(f, &local_err) < 0) {
+            error_report_err(local_err);
+            return -1;
+        }
+    }
+
     if (!migrate_multifd_flush_after_each_section()) {
         qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_FLUSH);
     }
@@ -3454,16 +3816,40 @@ static ram_addr_t host_page_offset_from_ram_block_offset(RAMBlock *block,
     return ((uintptr_t)block->host + offset) & (block->page_size - 1);
 }
 
+/*
+ * Pages recorded by colo_record_bitmap() that are not accounted in
+ * migration_dirty_pages yet.
+ */
+static unsigned long colo_recorded_pages;
+
+/*
+ * Record the pages at the offsets in @normal in the dirty bitmap of
+ * @block.  This doesn't take the bitmap mutex, the pages that fall into
+ * the same bitmap word are set with a single atomic operation.
+ */
 void colo_record_bitmap(RAMBlock *block, ram_addr_t *normal, uint32_t pages)
 {
-    qemu_mutex_lock(&ram_state->bitmap_mutex);
-    for (int i = 0; i < pages; i++) {
-        ram_addr_t offset = normal[i];
-        ram_state->migration_dirty_pages += !test_and_set_bit(
-                                                offset >> TARGET_PAGE_BITS,
-                                                block->bmap);
+    unsigned long new_dirty = 0;
+    uint32_t i = 0;
+
+    while (i < pages) {
+        unsigned long word = BIT_WORD(normal[i] >> TARGET_PAGE_BITS);
+        unsigned long mask = 0, old;
+
+        for (; i < pages; i++) {
+            unsigned long page = normal[i] >> TARGET_PAGE_BITS;
+
+            if (BIT_WORD(page) != word) {
+                break;
+            }
+            mask |= BIT_MASK(page);
+        }
+
+        old = qatomic_fetch_or(&block->bmap[word], mask);
+        new_dirty += ctpopl(mask & ~old);
     }
-    qemu_mutex_unlock(&ram_state->bitmap_mutex);
+
+    qatomic_add(&colo_recorded_pages, new_dirty);
 }
 
 static inline void *colo_cache_from_block_offset(RAMBlock *block,
@@ -3485,6 +3871,9 @@ static inline void *colo_cache_from_block_offset(RAMBlock *block,
     */
     if (record_bitmap) {
         colo_record_bitmap(block, &offset, 1);
+        if (block->colo_cache_present) {
+            colo_lazy_cache_populate(block, offset);
+        }
     }
     return block->colo_cache + offset;
 }
@@ -3520,6 +3909,12 @@ int colo_init_ram_cache(void)
 {
     RAMBlock *block;
 
+    if (migrate_colo_lazy_cache() && !ram_write_tracking_available()) {
+        error_report("%s: COLO lazy cache needs userfaultfd write protection",
+                     __func__);
+        return -EINVAL;
+    }
+
     WITH_RCU_READ_LOCK_GUARD() {
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             block->colo_cache = qemu_anon_ram_alloc(block->used_length,
@@ -3554,6 +3949,9 @@ int colo_init_ram_cache(void)
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
             unsigned long pages = block->max_length >> TARGET_PAGE_BITS;
             block->bmap = bitmap_new(pages);
+            if (colo_lazy_cache_block(block)) {
+                block->colo_cache_present = bitmap_new(pages);
+            }
         }
     }
 
@@ -3563,9 +3961,15 @@ int colo_init_ram_cache(void)
 }
 
 /* TODO: duplicated with ram_init_bitmaps */
-void colo_incoming_start_dirty_log(void)
+int colo_incoming_start_dirty_log(void)
 {
+    int ret = 0;
+
     RAMBlock *block = NULL;
+
+    /* Copy what is left of the initial migration into the cache */
+    colo_cache_sync();
+
     /* For memory_global_dirty_log_start below. */
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
@@ -3580,8 +3984,14 @@ void colo_incoming_start_dirty_log(void)
         memory_global_dirty_log_start(GLOBAL_DIRTY_MIGRATION);
     }
     ram_state->migration_dirty_pages = 0;
+    qatomic_set(&colo_recorded_pages, 0);
     qemu_mutex_unlock_ramlist();
+
+    /* From here on SVM's memory and the cache diverge */
+    ret = colo_lazy_cache_start();
     qemu_mutex_unlock_iothread();
+
+    return ret;
 }
 
 /* It is need to hold the global lock to call this helper */
@@ -3589,12 +3999,15 @@ void colo_release_ram_cache(void)
 {
     RAMBlock *block;
 
+    colo_lazy_cache_stop();
     colo_flush_threads_cleanup();
 
     memory_global_dirty_log_stop(GLOBAL_DIRTY_MIGRATION);
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->bmap);
         block->bmap = NULL;
+        g_free(block->colo_cache_present);
+        block->colo_cache_present = NULL;
     }
 
     WITH_RCU_READ_LOCK_GUARD() {
@@ -3851,33 +4264,33 @@ static bool postcopy_is_running(void)
     return ps >= POSTCOPY_INCOMING_LISTENING && ps < POSTCOPY_INCOMING_END;
 }
 
-void _colo_flush_ram_cache(ColoFlushParams *thread)
+/*
+ * Flush the dirty pages in [@start, @end) of @block from the RAM cache
+ * into SVM's memory.
+ */
+void colo_flush_ram_cache_range(RAMBlock *block, unsigned long start,
+                                unsigned long end)
 {
-    RAMBlock *block = NULL;
+    unsigned long offset = start, num = 0;
     void *dst_host;
     void *src_host;
 
-    barrier();
-    WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            unsigned long offset = 0, num = 0;
-            while (true) {
-                offset = colo_bitmap_find_dirty(thread, block, offset, &num);
-                if (!offset_in_ramblock(
-                            block, ((ram_addr_t)offset) << TARGET_PAGE_BITS)) {
-                    break;
-                } else {
-                    dst_host = block->host
-                             + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                    src_host = block->colo_cache
-                             + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
-                    memcpy(dst_host, src_host, TARGET_PAGE_SIZE * num);
-                    offset += num;
-                }
-            }
+    while (true) {
+        offset = colo_bitmap_find_dirty(block, offset, end, &num);
+        if (!num) {
+            break;
+        }
+        if (block->colo_cache_present) {
+            colo_lazy_cache_flush(block, offset, num);
+            offset += num;
+            continue;
         }
+        dst_host = block->host + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
+        src_host = block->colo_cache
+                 + (((ram_addr_t)offset) << TARGET_PAGE_BITS);
+        memcpy(dst_host, src_host, TARGET_PAGE_SIZE * num);
+        offset += num;
     }
-    barrier();
 }
 
 /*
@@ -3895,6 +4308,7 @@ void colo_flush_ram_cache_begin(void)
             ramblock_sync_dirty_bitmap(ram_state, block);
         }
     }
+    ram_state->migration_dirty_pages += qatomic_xchg(&colo_recorded_pages, 0);
 
     trace_colo_flush_ram_cache_begin(ram_state->migration_dirty_pages);
 
@@ -3909,14 +4323,15 @@ void colo_flush_ram_cache_wait(void)
     colo_flush_threads_wait();
     barrier();
 
+    colo_lazy_cache_release();
+
     WITH_RCU_READ_LOCK_GUARD() {
         RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            unsigned long size = block->used_length >> TARGET_PAGE_BITS;
             unsigned long offset = 0, num = 0;
             while (true) {
-                ColoFlushParams params = { 0 };
-                offset = colo_bitmap_find_dirty(&params, block, offset, &num);
-                if (!offset_in_ramblock(
-                            block, ((ram_addr_t)offset) << TARGET_PAGE_BITS)) {
+                offset = colo_bitmap_find_dirty(block, offset, size, &num);
+                if (!num) {
                     break;
                 } else {
                     for (unsigned long i = 0; i < num; i++) {
@@ -3932,6 +4347,172 @@ void colo_flush_ram_cache_wait(void)
     trace_colo_flush_ram_cache_end();
 }
 
+typedef struct MappedRamLoad {
+    QIOChannel *ioc;
+    RAMBlock *block;
+    /* pages that are in the file */
+    unsigned long *bitmap;
+    unsigned long pages;
+    off_t pages_offset;
+    /* the next chunk to load, atomic */
+    unsigned long next_chunk;
+    unsigned long chunks;
+    /* the first error, atomic */
+    Error *err;
+} MappedRamLoad;
+
+/*
+ * Read the pages that are in the file and zero the others, a chunk at a
+ * time until all are claimed.
+ */
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoad *load = opaque;
+    unsigned long chunk_pages = MAPPED_RAM_LOAD_CHUNK >> TARGET_PAGE_BITS;
+    unsigned long chunk;
+
+    while ((chunk = qatomic_fetch_inc(&load->next_chunk)) < load->chunks &&
+           !qatomic_read(&load->err)) {
+        unsigned long page = chunk * chunk_pages;
+        unsigned long end = MIN(page + chunk_pages, load->pages);
+
+        while (page < end) {
+            unsigned long next = find_next_bit(load->bitmap, end, page);
+            uint8_t *host;
+            struct iovec iov;
+            Error *local_err = NULL;
+
+            /* Like RAM_SAVE_FLAG_ZERO pages */
+            for (; page < next; page++) {
+                ram_handle_compressed(load->block->host +
+                                      ((ram_addr_t)page << TARGET_PAGE_BITS),
+                                      0, TARGET_PAGE_SIZE);
+            }
+            if (page == end) {
+                break;
+            }
+
+            next = find_next_zero_bit(load->bitmap, end, page);
+            host = load->block->host + ((ram_addr_t)page << TARGET_PAGE_BITS);
+            iov.iov_base = host;
+            iov.iov_len = (next - page) << TARGET_PAGE_BITS;
+            if (file_preadv_all(load->ioc, &iov, 1, load->pages_offset +
+                                ((off_t)page << TARGET_PAGE_BITS),
+                                &local_err) < 0) {
+                if (qatomic_cmpxchg(&load->err, NULL, local_err)) {
+                    error_free(local_err);
+                }
+                return NULL;
+            }
+            page = next;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * mapped_ram_load_ramblock: read the pages of @block from a mapped-ram
+ * file, with as many threads as there are multifd channels
+ *
+ * Returns 0 for success or a negative errno
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    uint64_t nbits = mapped_ram_bitmap_bits(length);
+    g_autofree unsigned long *le = NULL;
+    g_autofree unsigned long *bitmap = NULL;
+    g_autofree QemuThread *threads = NULL;
+    MappedRamLoad load = {};
+    uint64_t page_size, bitmap_offset, pages_offset;
+    uint32_t version;
+    Error *local_err = NULL;
+    struct iovec iov;
+    int nthreads, i;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram version %u for block %s",
+                     version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size %" PRIu64
+                     " for block %s", page_size, block->idstr);
+        return -EINVAL;
+    }
+    if (pages_offset < bitmap_offset + nbits / 8 ||
+        !QEMU_IS_ALIGNED(pages_offset, TARGET_PAGE_SIZE)) {
+        error_report("Invalid mapped-ram offsets for block %s",
+                     block->idstr);
+        return -EINVAL;
+    }
+
+    /* The source doesn't save the pages of shared blocks */
+    if (ramblock_is_ignored(block)) {
+        goto out;
+    }
+
+    le = bitmap_new(nbits);
+    bitmap = bitmap_new(nbits);
+    iov.iov_base = le;
+    iov.iov_len = nbits / 8;
+    if (file_preadv_all(qemu_file_get_ioc(f), &iov, 1, bitmap_offset,
+                        &local_err) < 0) {
+        goto err;
+    }
+    bitmap_from_le(bitmap, le, nbits);
+
+    if (migrate_mapped_ram_direct_io()) {
+        load.ioc = file_open_page_channel(O_RDONLY, &local_err);
+        if (!load.ioc) {
+            goto err;
+        }
+    } else {
+        load.ioc = qemu_file_get_ioc(f);
+        object_ref(OBJECT(load.ioc));
+    }
+    load.block = block;
+    load.bitmap = bitmap;
+    load.pages = length >> TARGET_PAGE_BITS;
+    load.pages_offset = pages_offset;
+    load.chunks = DIV_ROUND_UP(length, MAPPED_RAM_LOAD_CHUNK);
+
+    nthreads = migrate_multifd() ? migrate_multifd_channels() : 1;
+    nthreads = MIN(nthreads, load.chunks);
+    threads = g_new0(QemuThread, nthreads);
+    /* This thread is one of them */
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_create(&threads[i], "mapped-ram-load",
+                           mapped_ram_load_thread, &load,
+                           QEMU_THREAD_JOINABLE);
+    }
+    mapped_ram_load_thread(&load);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&threads[i]);
+    }
+    object_unref(OBJECT(load.ioc));
+
+    if (load.err) {
+        local_err = load.err;
+        goto err;
+    }
+
+out:
+    if (qemu_set_offset(f, pages_offset + length, &local_err) < 0) {
+        goto err;
+    }
+    return 0;
+
+err:
+    error_reportf_err(local_err, "Failed to load block %s: ", block->idstr);
+    return -EIO;
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3955,6 +4536,7 @@ static int ram_load_precopy(QEMUFile *f)
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host = NULL, *host_bak = NULL;
+        RAMBlock *colo_block = NULL;
         uint8_t ch;
 
         /*
@@ -3993,10 +4575,11 @@ static int ram_load_precopy(QEMUFile *f)
              * NOTE: We need to keep a copy of SVM's ram in colo_cache.
              * Previously, we copied all these memory in preparing stage of COLO
              * while we need to stop VM, which is a time-consuming process.
-             * Here we optimize it by a trick, back-up every page while in
-             * migration process while COLO is enabled, though it affects the
-             * speed of the migration, but it obviously reduce the downtime of
-             * back-up all SVM'S memory in COLO preparing stage.
+             * Here we load the pages into SVM's memory only while in migration
+             * process and record them in the dirty bitmap.  The flush threads
+             * copy them into the cache in the background after each
+             * iteration, so only the last iteration is left to copy in COLO
+             * preparing stage and pages sent several times are copied once.
              */
             if (migrate_colo()) {
                 if (migration_incoming_in_colo_state()) {
@@ -4005,9 +4588,20 @@ static int ram_load_precopy(QEMUFile *f)
                 } else {
                    /*
                     * In migration stage but before COLO stage,
-                    * Put all pages into both cache and SVM's memory.
+                    * put all pages into SVM's memory.  Compressed pages are
+                    * decompressed asynchronously, these are put into the
+                    * cache right away.  The lazy cache is only populated in
+                    * COLO stage.
                     */
-                    host_bak = colo_cache_from_block_offset(block, addr, false);
+                    if (!block->colo_cache_present) {
+                        if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+                            host_bak = colo_cache_from_block_offset(block,
+                                                                    addr,
+                                                                    false);
+                        } else {
+                            colo_block = block;
+                        }
+                    }
                 }
             }
             if (!host) {
@@ -4073,6 +4667,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -4134,9 +4731,16 @@ static int ram_load_precopy(QEMUFile *f)
         if (!ret && host_bak) {
             memcpy(host_bak, host, TARGET_PAGE_SIZE);
         }
+        if (!ret && colo_block) {
+            colo_record_bitmap(colo_block, &addr, 1);
+        }
     }
 
     ret |= wait_for_decompress_done();
+
+    if (!ret && migrate_colo() && !migration_incoming_in_colo_state()) {
+        colo_cache_sync_kick();
+    }
     return ret;
 }
 
@@ -36,6 +36,8 @@
 
 extern XBZRLECacheStats xbzrle_counters;
 extern CompressionStats compression_counters;
+extern int (*xbzrle_encode_buffer_func)(uint8_t *, uint8_t *, int,
+                                        uint8_t *, int);
 
 bool ramblock_is_ignored(RAMBlock *block);
 /* Should be holding either ram_list.mutex, or the RCU lock. */
@@ -80,11 +82,12 @@ void *postcopy_preempt_thread(void *opaque);
 
 /* ram cache */
 int colo_init_ram_cache(void);
-void _colo_flush_ram_cache(ColoFlushParams *thread);
+void colo_flush_ram_cache_range(RAMBlock *block, unsigned long start,
+                                unsigned long end);
 void colo_flush_ram_cache_begin(void);
 void colo_flush_ram_cache_wait(void);
 void colo_release_ram_cache(void);
-void colo_incoming_start_dirty_log(void);
+int colo_incoming_start_dirty_log(void);
 void colo_record_bitmap(RAMBlock *block, ram_addr_t *normal, uint32_t pages);
 
 /* Background snapshot */
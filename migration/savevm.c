@@ -1676,7 +1676,13 @@ void qemu_savevm_live_state(QEMUFile *f)
     qemu_put_byte(f, QEMU_VM_EOF);
 }
 
-int qemu_save_device_state(QEMUFile *f)
+/*
+ * Like qemu_save_device_state(), but call @section_done after each device
+ * section has been written to @f.
+ */
+int qemu_save_device_state_sections(QEMUFile *f,
+                                    void (*section_done)(void *opaque),
+                                    void *opaque)
 {
     SaveStateEntry *se;
 
@@ -1696,6 +1702,9 @@ int qemu_save_device_state(QEMUFile *f)
         if (ret) {
             return ret;
         }
+        if (section_done) {
+            section_done(opaque);
+        }
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
@@ -1703,6 +1712,11 @@ int qemu_save_device_state(QEMUFile *f)
     return qemu_file_get_error(f);
 }
 
+int qemu_save_device_state(QEMUFile *f)
+{
+    return qemu_save_device_state_sections(f, NULL, NULL);
+}
+
 static SaveStateEntry *find_se(const char *idstr, uint32_t instance_id)
 {
     SaveStateEntry *se;
@@ -2138,7 +2152,8 @@ static gboolean postcopy_sync_page_req(gpointer key, gpointer value,
         return FALSE;
     }
 
-    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset);
+    ret = migrate_send_rp_message_req_pages(mis, rb, rb_offset,
+                                            qemu_ram_pagesize(rb));
     if (ret) {
         /* Please refer to above comment. */
         error_report("%s: send rp message failed for addr %p",
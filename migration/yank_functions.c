@@ -14,6 +14,7 @@
 #include "qemu/yank.h"
 #include "io/channel-socket.h"
 #include "io/channel-tls.h"
+#include "io/channel-tee.h"
 #include "qemu-file.h"
 
 void migration_yank_iochannel(void *opaque)
@@ -27,7 +28,8 @@ void migration_yank_iochannel(void *opaque)
 static bool migration_ioc_yank_supported(QIOChannel *ioc)
 {
     return object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_SOCKET) ||
-        object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS);
+        object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TLS) ||
+        object_dynamic_cast(OBJECT(ioc), TYPE_QIO_CHANNEL_TEE);
 }
 
 void migration_ioc_register_yank(QIOChannel *ioc)
@@ -46,6 +46,16 @@ uint16_t net_checksum_finish(uint32_t sum)
     return ~sum;
 }
 
+void net_checksum_update_32(uint8_t *csum, uint32_t old, uint32_t new)
+{
+    /* RFC 1624: HC' = ~(~HC + ~m + m') */
+    uint32_t sum = (uint16_t)~lduw_be_p(csum);
+
+    sum += (uint16_t)~(old >> 16) + (uint16_t)~old;
+    sum += (new >> 16) + (uint16_t)new;
+    stw_be_p(csum, net_checksum_finish(sum));
+}
+
 uint16_t net_checksum_tcpudp(uint16_t length, uint16_t proto,
                              uint8_t *addrs, uint8_t *buf)
 {
@@ -16,10 +16,12 @@
 #include "qemu/error-report.h"
 #include "trace.h"
 #include "qapi/error.h"
+#include "qapi/qapi-builtin-visit.h"
 #include "net/net.h"
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
 #include "qemu/iov.h"
+#include "qemu/crc32c.h"
 #include "qom/object.h"
 #include "net/queue.h"
 #include "chardev/char-fe.h"
@@ -97,41 +99,149 @@ typedef struct SendEntry {
     uint32_t size;
     uint32_t vnet_hdr_len;
     uint8_t *buf;
+    /* Packet buf belongs to, it goes back to its pool once sent */
+    Packet *pkt;
+    /* Used by the in-process transport, see colo_compare_attach() */
+    QSLIST_ENTRY(SendEntry) next;
 } SendEntry;
 
+typedef QSLIST_HEAD(, SendEntry) SendEntryList;
+
+/*
+ * The connections of one secondary in a shard.  With several secondaries
+ * each lane gets a copy of the primary packets and compares it with the
+ * packets of its secondary.
+ */
+typedef struct CompareLane {
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+    /*
+     * Secondary packets handed over from the iothread of the compare,
+     * protected by the lock of the shard.  Element type: Packet
+     */
+    GQueue sec_in;
+    /* Set by colo_compare_drop_lane(), atomic */
+    bool drop_requested;
+    /* Set once the secondary was dropped, its packets are discarded */
+    bool dropped;
+} CompareLane;
+
+/*
+ * The connections are sharded over one or more compare threads by their
+ * connection_key_hash().  Only the thread of a shard touches its
+ * connections and their packet queues.
+ */
+typedef struct CompareShard {
+    CompareState *s;
+    /* Thread of the shard, NULL if it runs in the iothread of the compare */
+    IOThread *iothread;
+    AioContext *ctx;
+
+    /*
+     * Primary packets handed over from the iothread of the compare,
+     * protected by lock.  Element type: Packet
+     */
+    QemuMutex lock;
+    GQueue pri_in;
+    QEMUBH *in_bh;
+
+    /* One lane per secondary, indexed like CompareState.secondaries */
+    CompareLane *lanes;
+    /*
+     * Connections that got packets since the last comparison, they are
+     * compared once the input read from the chardev has been queued.
+     * Element type: Connection
+     */
+    GPtrArray *compare_batch;
+
+    QEMUTimer *packet_check_timer;
+    QEMUBH *event_bh;
+} CompareShard;
+
+/*
+ * With several secondaries, the primary packet is sent once a quorum of
+ * the lanes released their copy of it.  Only used in the shard thread.
+ */
+typedef struct PacketVote {
+    Packet *pkt;
+    CompareShard *sh;
+    /* Copies that are not destroyed yet */
+    unsigned int copies;
+    /* Copies that were released, because they matched or were flushed */
+    unsigned int released;
+    /* Releases needed to send pkt, capped by the ones still possible */
+    unsigned int needed;
+} PacketVote;
+
+typedef struct CompareSecondary {
+    CompareState *s;
+    CharBackend chr_in;
+    SocketReadState rs;
+} CompareSecondary;
+
 struct CompareState {
     Object parent;
 
     char *pri_indev;
     char *sec_indev;
+    strList *extra_sec_indev;
     char *outdev;
     char *notify_dev;
     CharBackend chr_pri_in;
-    CharBackend chr_sec_in;
     CharBackend chr_out;
     CharBackend chr_notify_dev;
     SocketReadState pri_rs;
-    SocketReadState sec_rs;
     SocketReadState notify_rs;
+    /*
+     * secondary_in followed by extra_secondary_in, the index of a
+     * secondary is the one of its COLO migration stream
+     */
+    CompareSecondary *secondaries;
+    uint32_t nb_secondaries;
+    uint32_t quorum;
     SendCo out_sendco;
     SendCo notify_sendco;
     bool vnet_hdr;
+    bool compare_hash;
     uint64_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
+
+    CompareShard *shards;
+    /* Packets read from the chardevs, only taken from in the iothread */
+    PacketPool *pool;
 
     /*
-     * Record the connection that through the NIC
-     * Element type: Connection
+     * Primary packets released by shards with their own thread, sent
+     * from the iothread of the compare.  Protected by out_lock.
+     * Element type: Packet
      */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    QemuMutex out_lock;
+    GQueue out_list;
+    QEMUBH *out_bh;
+
+    /*
+     * Set if neither primary_in nor outdev is given.  The primary packets
+     * then come from, and the released packets go to, the filter attached
+     * with colo_compare_attach().  The lists are pushed to without a lock
+     * and are in reverse order.
+     */
+    bool local;
+    ColoCompareOutputFunc *local_output;
+    void *local_opaque;
+    SendEntryList local_in;
+    QEMUBH *local_in_bh;
+    SendEntryList local_out;
+    QEMUBH *local_out_bh;
 
     IOThread *iothread;
     GMainContext *worker_context;
-    QEMUTimer *packet_check_timer;
 
-    QEMUBH *event_bh;
     enum colo_event event;
 
     QTAILQ_ENTRY(CompareState) next;
@@ -157,6 +267,9 @@ static int compare_chr_send(CompareState *s,
                             uint32_t vnet_hdr_len,
                             bool notify_remote_frame,
                             bool zero_copy);
+static int compare_send_pkt(CompareState *s, Packet *pkt);
+
+static void colo_compare_batch(CompareShard *sh);
 
 static bool packet_matches_str(const char *str,
                                const uint8_t *buf,
@@ -169,8 +282,9 @@ static bool packet_matches_str(const char *str,
     return !memcmp(str, buf, packet_len);
 }
 
-static void notify_remote_frame(CompareState *s)
+static void notify_remote_frame(void *opaque)
 {
+    CompareState *s = opaque;
     char msg[] = "DO_CHECKPOINT";
     int ret = 0;
 
@@ -180,12 +294,18 @@ static void notify_remote_frame(CompareState *s)
     }
 }
 
-static void colo_compare_inconsistency_notify(CompareState *s)
+static void colo_compare_inconsistency_notify(CompareShard *sh)
 {
-    if (s->notify_dev) {
-        notify_remote_frame(s);
+    CompareState *s = sh->s;
+
+    if (!s->notify_dev) {
+        colo_divergence_notify();
+    } else if (sh->iothread) {
+        /* The notify chardev is only used from the iothread of the compare */
+        aio_bh_schedule_oneshot(iothread_get_aio_context(s->iothread),
+                                notify_remote_frame, s);
     } else {
-        colo_checkpoint_notify();
+        notify_remote_frame(s);
     }
 }
 
@@ -195,6 +315,37 @@ static gint seq_sorter(Packet *a, Packet *b, gpointer data)
     return b->tcp_seq - a->tcp_seq;
 }
 
+/*
+ * With offloads, the guest hands over TCP super-frames that the host
+ * segments later, so primary and secondary may split the same byte stream
+ * differently.  colo_compare_tcp() only compares byte ranges of the stream,
+ * which also covers the super-frames.
+ */
+static bool colo_packet_is_gso(Packet *pkt)
+{
+    struct virtio_net_hdr *vnet_hdr = pkt->data;
+
+    return pkt->vnet_hdr_len >= sizeof(*vnet_hdr) &&
+           vnet_hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE;
+}
+
+/*
+ * Return the end of the ip packet in @pkt.  Frames that were padded to the
+ * minimal ethernet length end before the frame does.  The ip total length
+ * of a super-frame may not be filled in, it always ends with the frame.
+ */
+static int colo_packet_ip_end(Packet *pkt)
+{
+    int start = pkt->network_header - (uint8_t *)pkt->data;
+    int end = start + ntohs(pkt->ip->ip_len);
+
+    if (colo_packet_is_gso(pkt) ||
+        end > pkt->size || end < pkt->transport_header - (uint8_t *)pkt->data) {
+        return pkt->size;
+    }
+    return end;
+}
+
 static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
 {
     Packet *pkt = data;
@@ -208,7 +359,7 @@ static void fill_pkt_tcp_info(void *data, uint32_t *max_ack)
     *max_ack = pkt->tcp_ack - *max_ack > 0 ? pkt->tcp_ack : *max_ack;
     pkt->header_size = pkt->transport_header - (uint8_t *)pkt->data
                        + (tcphd->th_off << 2);
-    pkt->payload_size = pkt->size - pkt->header_size;
+    pkt->payload_size = MAX(colo_packet_ip_end(pkt) - pkt->header_size, 0);
     pkt->seq_end = pkt->tcp_seq + pkt->payload_size;
     pkt->flags = tcphd->th_flags;
 }
@@ -235,41 +386,80 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
 }
 
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Hash the part of the packet that is compared, so that most pairs that
+ * differ are told apart without comparing their payload.
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static void colo_packet_hash(Packet *pkt)
 {
+    int offset, end = pkt->size;
+
+    switch (pkt->ip->ip_p) {
+    case IPPROTO_TCP:
+        offset = pkt->header_size;
+        end = offset + pkt->payload_size;
+        break;
+    case IPPROTO_UDP:
+        /* The checksum isn't compared, see colo_packet_compare_udp() */
+        offset = (pkt->ip->ip_hl << 2) + ETH_HLEN + pkt->vnet_hdr_len +
+                 sizeof(struct udp_hdr);
+        break;
+    case IPPROTO_ICMP:
+        offset = (pkt->ip->ip_hl << 2) + ETH_HLEN + pkt->vnet_hdr_len;
+        break;
+    default:
+        offset = pkt->vnet_hdr_len;
+        break;
+    }
+
+    if (offset < end) {
+        pkt->hash = crc32c(0xffffffff, (uint8_t *)pkt->data + offset,
+                           end - offset);
+    }
+}
+
+/*
+ * Return true if the hashes prove that the compared parts of the packets
+ * differ.  The hashes only cover the same part if the headers have the
+ * same length.  Equal hashes still need the payload to be compared.
+ */
+static bool colo_packet_hash_differs(Packet *ppkt, Packet *spkt)
+{
+    return ppkt->hash && spkt->hash && ppkt->hash != spkt->hash &&
+           ppkt->vnet_hdr_len == spkt->vnet_hdr_len &&
+           ppkt->ip->ip_hl == spkt->ip->ip_hl;
+}
+
+static void colo_compare_queue(CompareShard *sh, Connection *conn);
+static void colo_shard_send_primary_pkt(CompareShard *sh, Packet *pkt);
+static void colo_vote_copy_destroy(Packet *copy);
+static void colo_flush_packets(void *opaque, void *user_data);
+
+/*
+ * Called from the thread of the shard to queue a packet to its
+ * connection in the lane of secondary @index.
+ */
+static void colo_lane_enqueue(CompareShard *sh, unsigned int index,
+                              int mode, Packet *pkt)
+{
+    CompareLane *lane = &sh->lanes[index];
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
     int ret;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
+    if (lane->dropped) {
+        trace_colo_compare_drop_packet(colo_mode[mode],
+                                       "secondary was dropped");
         packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
+        return;
     }
+
     fill_connection_key(pkt, &key, false);
 
-    conn = connection_get(s->connection_track_table,
+    /* A busy connection that is evicted releases its primary packets */
+    conn = connection_get(lane->connection_track_table,
                           &key,
-                          &s->conn_list);
-
-    if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
-        conn->processing = true;
-    }
+                          &lane->conn_list,
+                          colo_flush_packets, sh);
 
     if (mode == PRIMARY_IN) {
         ret = colo_insert_packet(&conn->primary_list, pkt, &conn->pack);
@@ -282,9 +472,180 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
             "queue size too big, drop packet");
         packet_destroy(pkt, NULL);
         pkt = NULL;
+    } else if (sh->s->compare_hash) {
+        colo_packet_hash(pkt);
+    }
+
+    /* compare packet in the specified connection */
+    colo_compare_queue(sh, conn);
+}
+
+/*
+ * Called from the thread of the shard to queue a packet.  With several
+ * secondaries, each lane that isn't dropped gets a copy of a primary
+ * packet, see PacketVote.
+ */
+static void colo_shard_enqueue(CompareShard *sh, int mode, unsigned int index,
+                               Packet *pkt)
+{
+    CompareState *s = sh->s;
+    g_autofree Packet **copies = NULL;
+    PacketVote *vote;
+    unsigned int i, live = 0;
+
+    if (mode == SECONDARY_IN || s->nb_secondaries == 1) {
+        colo_lane_enqueue(sh, index, mode, pkt);
+        return;
+    }
+
+    for (i = 0; i < s->nb_secondaries; i++) {
+        live += !sh->lanes[i].dropped;
+    }
+    if (!live) {
+        /* Nothing left to compare with, COLO is about to exit */
+        colo_shard_send_primary_pkt(sh, pkt);
+        return;
+    }
+
+    vote = g_new0(PacketVote, 1);
+    vote->pkt = pkt;
+    vote->sh = sh;
+    vote->copies = live;
+    vote->needed = MIN(s->quorum ? s->quorum : live, live);
+
+    /*
+     * Make all copies before queueing them.  Queueing one may compare the
+     * others already queued, which can send pkt and free vote.
+     */
+    copies = g_new0(Packet *, s->nb_secondaries);
+    for (i = 0; i < s->nb_secondaries; i++) {
+        if (sh->lanes[i].dropped) {
+            continue;
+        }
+
+        copies[i] = packet_new(pkt->data, pkt->size, pkt->vnet_hdr_len);
+        parse_packet_early(copies[i]);
+        copies[i]->creation_ms = pkt->creation_ms;
+        copies[i]->destroy_hook = colo_vote_copy_destroy;
+        copies[i]->hook_opaque = vote;
+    }
+    for (i = 0; i < s->nb_secondaries; i++) {
+        if (copies[i]) {
+            colo_lane_enqueue(sh, i, PRIMARY_IN, copies[i]);
+        }
+    }
+}
+
+static void colo_lane_clear(void *opaque, void *user_data)
+{
+    Connection *conn = opaque;
+
+    g_queue_foreach(&conn->primary_list, packet_destroy, NULL);
+    g_queue_clear(&conn->primary_list);
+    g_queue_foreach(&conn->secondary_list, packet_destroy, NULL);
+    g_queue_clear(&conn->secondary_list);
+}
+
+/*
+ * Called from the thread of the shard for the packets handed over to it.
+ */
+static void colo_shard_take_input(CompareShard *sh)
+{
+    CompareState *s = sh->s;
+    GQueue pri, sec;
+    unsigned int i;
+
+    qemu_mutex_lock(&sh->lock);
+    pri = sh->pri_in;
+    g_queue_init(&sh->pri_in);
+    qemu_mutex_unlock(&sh->lock);
+
+    while (!g_queue_is_empty(&pri)) {
+        colo_shard_enqueue(sh, PRIMARY_IN, 0, g_queue_pop_head(&pri));
+    }
+
+    for (i = 0; i < s->nb_secondaries; i++) {
+        qemu_mutex_lock(&sh->lock);
+        sec = sh->lanes[i].sec_in;
+        g_queue_init(&sh->lanes[i].sec_in);
+        qemu_mutex_unlock(&sh->lock);
+
+        while (!g_queue_is_empty(&sec)) {
+            colo_shard_enqueue(sh, SECONDARY_IN, i, g_queue_pop_head(&sec));
+        }
+    }
+}
+
+/*
+ * Drop the lanes of the secondaries passed to colo_compare_drop_lane(),
+ * once what they sent so far was compared.  The primary packets waiting
+ * for them are sent if the other lanes released enough copies.
+ */
+static void colo_shard_drop_lanes(CompareShard *sh)
+{
+    unsigned int i;
+
+    for (i = 0; i < sh->s->nb_secondaries; i++) {
+        CompareLane *lane = &sh->lanes[i];
+
+        if (lane->dropped || !qatomic_read(&lane->drop_requested)) {
+            continue;
+        }
+
+        trace_colo_compare_drop_secondary(i);
+        lane->dropped = true;
+        g_queue_foreach(&lane->conn_list, colo_lane_clear, NULL);
+    }
+}
+
+/* Ask the shards to drop the lane of secondary @index */
+static void colo_compare_drop_lane(CompareState *s, unsigned int index)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        qatomic_set(&s->shards[i].lanes[index].drop_requested, true);
+        qemu_bh_schedule(s->shards[i].in_bh);
+    }
+}
+
+static void colo_shard_in_bh(void *opaque)
+{
+    CompareShard *sh = opaque;
+
+    colo_shard_take_input(sh);
+    colo_compare_batch(sh);
+    colo_shard_drop_lanes(sh);
+}
+
+/*
+ * Called from the iothread of the compare.
+ * Return 0 on success, if return -1 means the pkt
+ * is unsupported(arp and ipv6) and is left to the caller
+ */
+static int packet_enqueue(CompareState *s, int mode, unsigned int index,
+                          Packet *pkt)
+{
+    ConnectionKey key;
+    CompareShard *sh;
+
+    if (parse_packet_early(pkt)) {
+        return -1;
+    }
+
+    if (s->compare_threads == 1) {
+        colo_shard_enqueue(&s->shards[0], mode, index, pkt);
+        return 0;
     }
 
-    *con = conn;
+    fill_connection_key(pkt, &key, false);
+    sh = &s->shards[connection_key_hash(&key) % s->compare_threads];
+
+    qemu_mutex_lock(&sh->lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &sh->pri_in :
+                      &sh->lanes[index].sec_in, pkt);
+    qemu_mutex_unlock(&sh->lock);
+    qemu_bh_schedule(sh->in_bh);
 
     return 0;
 }
@@ -294,20 +655,94 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_send_primary_pkt(CompareState *s, Packet *pkt)
 {
     int ret;
-    ret = compare_chr_send(s,
-                           pkt->data,
-                           pkt->size,
-                           pkt->vnet_hdr_len,
-                           false,
-                           true);
+    ret = compare_send_pkt(s, pkt);
     if (ret < 0) {
         error_report("colo send primary packet failed");
     }
+}
+
+/*
+ * Called from the iothread of the compare to send the packets released
+ * by shards with their own thread.
+ */
+static void colo_compare_out_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    GQueue list;
+
+    qemu_mutex_lock(&s->out_lock);
+    list = s->out_list;
+    g_queue_init(&s->out_list);
+    qemu_mutex_unlock(&s->out_lock);
+
+    while (!g_queue_is_empty(&list)) {
+        colo_send_primary_pkt(s, g_queue_pop_head(&list));
+    }
+}
+
+/* Only the iothread of the compare writes to outdev */
+static void colo_shard_send_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    CompareState *s = sh->s;
+
+    if (!sh->iothread) {
+        colo_send_primary_pkt(s, pkt);
+        return;
+    }
+
+    qemu_mutex_lock(&s->out_lock);
+    g_queue_push_tail(&s->out_list, pkt);
+    qemu_mutex_unlock(&s->out_lock);
+    qemu_bh_schedule(s->out_bh);
+}
+
+/*
+ * Destroy hook of the copies of a primary packet, sends the packet once
+ * enough copies were released.  It is dropped if that can't happen
+ * anymore, like a primary packet without secondaries to compare with.
+ */
+static void colo_vote_copy_destroy(Packet *copy)
+{
+    PacketVote *vote = copy->hook_opaque;
+
+    vote->copies--;
+    vote->needed = MIN(vote->needed, vote->released + vote->copies);
+    if (vote->pkt && vote->needed && vote->released >= vote->needed) {
+        colo_shard_send_primary_pkt(vote->sh, vote->pkt);
+        vote->pkt = NULL;
+    }
+
+    if (!vote->copies) {
+        if (vote->pkt) {
+            trace_colo_compare_drop_packet(colo_mode[PRIMARY_IN],
+                                           "no quorum of secondaries");
+            packet_destroy(vote->pkt, NULL);
+        }
+        g_free(vote);
+    }
+}
+
+/* Send a primary packet, or a vote for the one it's a copy of */
+static void colo_shard_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
+    if (pkt->destroy_hook == colo_vote_copy_destroy) {
+        PacketVote *vote = pkt->hook_opaque;
+
+        vote->released++;
+        packet_destroy(pkt, NULL);
+        return;
+    }
+
+    colo_shard_send_primary_pkt(sh, pkt);
+}
+
+static void colo_release_primary_pkt(CompareShard *sh, Packet *pkt)
+{
     trace_colo_compare_main("packet same and release packet");
-    packet_destroy_partial(pkt, NULL);
+    colo_shard_release_primary_pkt(sh, pkt);
 }
 
 /*
@@ -319,9 +754,9 @@ static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
  */
 static int colo_compare_packet_payload(Packet *ppkt,
                                        Packet *spkt,
-                                       uint16_t poffset,
-                                       uint16_t soffset,
-                                       uint16_t len)
+                                       uint32_t poffset,
+                                       uint32_t soffset,
+                                       uint32_t len)
 
 {
     if (trace_event_get_state_backends(TRACE_COLO_COMPARE_IP_INFO)) {
@@ -351,9 +786,15 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     *mark = 0;
 
     if (ppkt->tcp_seq == spkt->tcp_seq && ppkt->seq_end == spkt->seq_end) {
-        if (!colo_compare_packet_payload(ppkt, spkt,
-                                        ppkt->header_size, spkt->header_size,
-                                        ppkt->payload_size)) {
+        if (colo_packet_hash_differs(ppkt, spkt)) {
+            /* Below, the same bytes would be compared again */
+            if (!ppkt->offset && !spkt->offset) {
+                return false;
+            }
+        } else if (!colo_compare_packet_payload(ppkt, spkt,
+                                               ppkt->header_size,
+                                               spkt->header_size,
+                                               ppkt->payload_size)) {
             *mark = COLO_COMPARE_FREE_SECONDARY | COLO_COMPARE_FREE_PRIMARY;
             return true;
         }
@@ -393,7 +834,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *sh, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -425,13 +866,13 @@ sec:
     spkt = g_queue_pop_tail(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(sh, ppkt);
         ppkt = NULL;
     }
 
@@ -471,7 +912,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             g_queue_push_tail(&conn->secondary_list, spkt);
             goto pri;
         } else if (mark == COLO_COMPARE_FREE_SECONDARY) {
@@ -480,7 +921,7 @@ sec:
             goto sec;
         } else if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(sh, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -493,7 +934,7 @@ sec:
         qemu_hexdump(stderr, "colo-compare spkt", spkt->data, spkt->size);
 #endif
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_inconsistency_notify(sh);
     }
 }
 
@@ -506,6 +947,7 @@ static int colo_packet_compare_udp(Packet *spkt, Packet *ppkt)
 {
     uint16_t network_header_length = ppkt->ip->ip_hl << 2;
     uint16_t offset = network_header_length + ETH_HLEN + ppkt->vnet_hdr_len;
+    int ret;
 
     trace_colo_compare_main("compare udp");
 
@@ -523,8 +965,28 @@ static int colo_packet_compare_udp(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("UDP: payload size of packets are different");
         return -1;
     }
-    if (colo_compare_packet_payload(ppkt, spkt, offset, offset,
-                                    ppkt->size - offset)) {
+    if (colo_packet_hash_differs(ppkt, spkt)) {
+        trace_colo_compare_main("UDP: hash of packets are different");
+        return -1;
+    }
+    /*
+     * With checksum offload, one of the packets may carry the partial
+     * checksum of the pseudo header only.  The checksum covers nothing
+     * that isn't compared anyway, so skip it.
+     */
+    if (ppkt->size >= offset + sizeof(struct udp_hdr)) {
+        ret = colo_compare_packet_payload(ppkt, spkt, offset, offset,
+                                          offsetof(struct udp_hdr, uh_sum)) ||
+              colo_compare_packet_payload(ppkt, spkt,
+                                          offset + sizeof(struct udp_hdr),
+                                          offset + sizeof(struct udp_hdr),
+                                          ppkt->size - offset -
+                                          sizeof(struct udp_hdr));
+    } else {
+        ret = colo_compare_packet_payload(ppkt, spkt, offset, offset,
+                                          ppkt->size - offset);
+    }
+    if (ret) {
         trace_colo_compare_udp_miscompare("primary pkt size", ppkt->size);
         trace_colo_compare_udp_miscompare("Secondary pkt size", spkt->size);
 #ifdef DEBUG_COLO_PACKETS
@@ -562,6 +1024,10 @@ static int colo_packet_compare_icmp(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("ICMP: payload size of packets are different");
         return -1;
     }
+    if (colo_packet_hash_differs(ppkt, spkt)) {
+        trace_colo_compare_main("ICMP: hash of packets are different");
+        return -1;
+    }
     if (colo_compare_packet_payload(ppkt, spkt, offset, offset,
                                     ppkt->size - offset)) {
         trace_colo_compare_icmp_miscompare("primary pkt size",
@@ -591,6 +1057,10 @@ static int colo_packet_compare_other(Packet *spkt, Packet *ppkt)
         trace_colo_compare_main("Other: payload size of packets are different");
         return -1;
     }
+    if (colo_packet_hash_differs(ppkt, spkt)) {
+        trace_colo_compare_main("Other: hash of packets are different");
+        return -1;
+    }
     return colo_compare_packet_payload(ppkt, spkt, offset, offset,
                                        ppkt->size - offset);
 }
@@ -608,8 +1078,10 @@ static int colo_old_packet_check_one(Packet *pkt, int64_t *check_time)
 }
 
 static int colo_old_packet_check_one_conn(Connection *conn,
-                                          CompareState *s)
+                                          CompareShard *sh)
 {
+    CompareState *s = sh->s;
+
     if (!g_queue_is_empty(&conn->primary_list)) {
         if (g_queue_find_custom(&conn->primary_list,
                                 &s->compare_timeout,
@@ -628,7 +1100,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 
 out:
     /* Do checkpoint will flush old packet */
-    colo_compare_inconsistency_notify(s);
+    colo_compare_inconsistency_notify(sh);
     return 0;
 }
 
@@ -639,17 +1111,22 @@ out:
  */
 static void colo_old_packet_check(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
+    unsigned int i;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    for (i = 0; i < sh->s->nb_secondaries; i++) {
+        if (g_queue_find_custom(&sh->lanes[i].conn_list, sh,
+                                (GCompareFunc)colo_old_packet_check_one_conn)) {
+            break;
+        }
+    }
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *sh, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -663,7 +1140,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
                  pkt, (GCompareFunc)HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(sh, pkt);
             packet_destroy(result->data, NULL);
             g_queue_delete_link(&conn->secondary_list, result);
         } else {
@@ -676,7 +1153,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_tail(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_inconsistency_notify(sh);
             break;
         }
     }
@@ -690,25 +1167,61 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  */
 static void colo_compare_connection(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
 
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(sh, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(sh, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(sh, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(sh, conn, colo_packet_compare_other);
         break;
     }
 }
 
+/*
+ * Called from the compare thread on the primary when a packet was
+ * queued to @conn.  Comparing once per batch of packets instead of once
+ * per packet saves walking the queues of busy connections repeatedly.
+ */
+static void colo_compare_queue(CompareShard *sh, Connection *conn)
+{
+    if (!conn->compare_queued) {
+        conn->compare_queued = true;
+        g_ptr_array_add(sh->compare_batch, conn);
+    }
+}
+
+static void colo_compare_batch(CompareShard *sh)
+{
+    guint i;
+
+    for (i = 0; i < sh->compare_batch->len; i++) {
+        Connection *conn = g_ptr_array_index(sh->compare_batch, i);
+
+        conn->compare_queued = false;
+        colo_compare_connection(conn, sh);
+    }
+    g_ptr_array_set_size(sh->compare_batch, 0);
+}
+
+static void send_entry_free(SendEntry *entry)
+{
+    if (entry->pkt) {
+        packet_destroy(entry->pkt, NULL);
+    } else {
+        g_free(entry->buf);
+    }
+    g_slice_free(SendEntry, entry);
+}
+
 static void coroutine_fn _compare_chr_send(void *opaque)
 {
     SendCo *sendco = opaque;
@@ -722,8 +1235,7 @@ static void coroutine_fn _compare_chr_send(void *opaque)
         ret = qemu_chr_fe_write_all(sendco->chr, (uint8_t *)&len, sizeof(len));
 
         if (ret != sizeof(len)) {
-            g_free(entry->buf);
-            g_slice_free(SendEntry, entry);
+            send_entry_free(entry);
             goto err;
         }
 
@@ -739,8 +1251,7 @@ static void coroutine_fn _compare_chr_send(void *opaque)
                                         sizeof(len));
 
             if (ret != sizeof(len)) {
-                g_free(entry->buf);
-                g_slice_free(SendEntry, entry);
+                send_entry_free(entry);
                 goto err;
             }
         }
@@ -750,13 +1261,11 @@ static void coroutine_fn _compare_chr_send(void *opaque)
                                     entry->size);
 
         if (ret != entry->size) {
-            g_free(entry->buf);
-            g_slice_free(SendEntry, entry);
+            send_entry_free(entry);
             goto err;
         }
 
-        g_free(entry->buf);
-        g_slice_free(SendEntry, entry);
+        send_entry_free(entry);
     }
 
     sendco->ret = 0;
@@ -765,8 +1274,7 @@ static void coroutine_fn _compare_chr_send(void *opaque)
 err:
     while (!g_queue_is_empty(&sendco->send_list)) {
         SendEntry *entry = g_queue_pop_tail(&sendco->send_list);
-        g_free(entry->buf);
-        g_slice_free(SendEntry, entry);
+        send_entry_free(entry);
     }
     sendco->ret = ret < 0 ? ret : -EIO;
 out:
@@ -775,15 +1283,10 @@ out:
     aio_wait_kick();
 }
 
-static int compare_chr_send(CompareState *s,
-                            uint8_t *buf,
-                            uint32_t size,
-                            uint32_t vnet_hdr_len,
-                            bool notify_remote_frame,
-                            bool zero_copy)
+static int compare_send_entry(CompareState *s, SendEntry *entry,
+                              bool notify_remote_frame)
 {
     SendCo *sendco;
-    SendEntry *entry;
 
     if (notify_remote_frame) {
         sendco = &s->notify_sendco;
@@ -791,19 +1294,12 @@ static int compare_chr_send(CompareState *s,
         sendco = &s->out_sendco;
     }
 
-    if (!size) {
-        return -1;
+    if (!notify_remote_frame && s->local) {
+        QSLIST_INSERT_HEAD_ATOMIC(&s->local_out, entry, next);
+        qemu_bh_schedule(s->local_out_bh);
+        return 0;
     }
 
-    entry = g_slice_new(SendEntry);
-    entry->size = size;
-    entry->vnet_hdr_len = vnet_hdr_len;
-    if (zero_copy) {
-        entry->buf = buf;
-    } else {
-        entry->buf = g_malloc(size);
-        memcpy(entry->buf, buf, size);
-    }
     g_queue_push_tail(&sendco->send_list, entry);
 
     if (sendco->done) {
@@ -820,6 +1316,112 @@ static int compare_chr_send(CompareState *s,
     return 0;
 }
 
+static int compare_chr_send(CompareState *s,
+                            uint8_t *buf,
+                            uint32_t size,
+                            uint32_t vnet_hdr_len,
+                            bool notify_remote_frame,
+                            bool zero_copy)
+{
+    SendEntry *entry;
+
+    if (!size) {
+        return -1;
+    }
+
+    entry = g_slice_new(SendEntry);
+    entry->size = size;
+    entry->vnet_hdr_len = vnet_hdr_len;
+    entry->pkt = NULL;
+    if (zero_copy) {
+        entry->buf = buf;
+    } else {
+        entry->buf = g_malloc(size);
+        memcpy(entry->buf, buf, size);
+    }
+
+    return compare_send_entry(s, entry, notify_remote_frame);
+}
+
+/* Send the data of @pkt and destroy it, returning its buffer to the pool */
+static int compare_send_pkt(CompareState *s, Packet *pkt)
+{
+    SendEntry *entry;
+
+    if (!pkt->size) {
+        packet_destroy(pkt, NULL);
+        return -1;
+    }
+
+    entry = g_slice_new(SendEntry);
+    entry->size = pkt->size;
+    entry->vnet_hdr_len = pkt->vnet_hdr_len;
+    entry->buf = pkt->data;
+    entry->pkt = pkt;
+
+    return compare_send_entry(s, entry, false);
+}
+
+/* Take all entries of a list pushed with QSLIST_INSERT_HEAD_ATOMIC in order */
+static void compare_local_take(SendEntryList *list, SendEntryList *ordered)
+{
+    SendEntryList reversed;
+    SendEntry *entry;
+
+    QSLIST_MOVE_ATOMIC(&reversed, list);
+    QSLIST_INIT(ordered);
+    while ((entry = QSLIST_FIRST(&reversed))) {
+        QSLIST_REMOVE_HEAD(&reversed, next);
+        QSLIST_INSERT_HEAD(ordered, entry, next);
+    }
+}
+
+static void compare_pri_packet_in(CompareState *s, Packet *pkt);
+
+/*
+ * Called from the iothread of the compare for the primary packets
+ * passed in with colo_compare_receive().
+ */
+static void compare_local_in_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    SendEntryList list;
+    SendEntry *entry;
+
+    compare_local_take(&s->local_in, &list);
+    while ((entry = QSLIST_FIRST(&list))) {
+        QSLIST_REMOVE_HEAD(&list, next);
+        compare_pri_packet_in(s, packet_new_nocopy(entry->buf, entry->size,
+                                                   entry->vnet_hdr_len));
+        g_slice_free(SendEntry, entry);
+    }
+
+    if (s->compare_threads == 1) {
+        colo_compare_batch(&s->shards[0]);
+    }
+}
+
+/*
+ * Called from the main thread to hand the released packets to the
+ * attached filter.  They are dropped if it has been detached.
+ */
+static void compare_local_out_bh(void *opaque)
+{
+    CompareState *s = opaque;
+    SendEntryList list;
+    SendEntry *entry;
+
+    compare_local_take(&s->local_out, &list);
+    while ((entry = QSLIST_FIRST(&list))) {
+        QSLIST_REMOVE_HEAD(&list, next);
+        if (s->local_output) {
+            s->local_output(s->local_opaque, entry->buf, entry->size,
+                            entry->vnet_hdr_len);
+        }
+        send_entry_free(entry);
+    }
+}
+
 static int compare_chr_can_read(void *opaque)
 {
     return COMPARE_READ_LEN_MAX;
@@ -835,6 +1437,9 @@ static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
     int ret;
 
     ret = net_fill_rstate(&s->pri_rs, buf, size);
+    if (s->compare_threads == 1) {
+        colo_compare_batch(&s->shards[0]);
+    }
     if (ret == -1) {
         qemu_chr_fe_set_handlers(&s->chr_pri_in, NULL, NULL, NULL, NULL,
                                  NULL, NULL, true);
@@ -848,17 +1453,36 @@ static void compare_pri_chr_in(void *opaque, const uint8_t *buf, int size)
  */
 static void compare_sec_chr_in(void *opaque, const uint8_t *buf, int size)
 {
-    CompareState *s = COLO_COMPARE(opaque);
+    CompareSecondary *sec = opaque;
+    CompareState *s = sec->s;
     int ret;
 
-    ret = net_fill_rstate(&s->sec_rs, buf, size);
+    ret = net_fill_rstate(&sec->rs, buf, size);
+    if (s->compare_threads == 1) {
+        colo_compare_batch(&s->shards[0]);
+    }
     if (ret == -1) {
-        qemu_chr_fe_set_handlers(&s->chr_sec_in, NULL, NULL, NULL, NULL,
+        qemu_chr_fe_set_handlers(&sec->chr_in, NULL, NULL, NULL, NULL,
                                  NULL, NULL, true);
         error_report("colo-compare secondary_in error");
     }
 }
 
+/*
+ * Called from the iothread of the compare.  A secondary whose chardev got
+ * closed can't release its copies anymore, so with others left its lane is
+ * dropped as if COLO had dropped the secondary.
+ */
+static void compare_sec_chr_event(void *opaque, QEMUChrEvent event)
+{
+    CompareSecondary *sec = opaque;
+    CompareState *s = sec->s;
+
+    if (event == CHR_EVENT_CLOSED && s->nb_secondaries > 1) {
+        colo_compare_drop_lane(s, sec - s->secondaries);
+    }
+}
+
 static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
 {
     CompareState *s = COLO_COMPARE(opaque);
@@ -878,18 +1502,20 @@ static void compare_notify_chr(void *opaque, const uint8_t *buf, int size)
  */
 static void check_old_packet_regular(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
     /* if have old packet we will notify checkpoint */
-    colo_old_packet_check(s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+    colo_old_packet_check(sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
 /* Public API, Used for COLO frame to notify compare event */
 void colo_notify_compares_event(void *opaque, int event, Error **errp)
 {
     CompareState *s;
+    uint32_t i;
+
     qemu_mutex_lock(&colo_compare_mutex);
 
     if (!colo_compare_active) {
@@ -900,8 +1526,10 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     qemu_mutex_lock(&event_mtx);
     QTAILQ_FOREACH(s, &net_compares, next) {
         s->event = event;
-        qemu_bh_schedule(s->event_bh);
-        event_unhandled_count++;
+        for (i = 0; i < s->compare_threads; i++) {
+            qemu_bh_schedule(s->shards[i].event_bh);
+            event_unhandled_count++;
+        }
     }
     /* Wait all compare threads to finish handling this event */
     while (event_unhandled_count > 0) {
@@ -912,34 +1540,48 @@ void colo_notify_compares_event(void *opaque, int event, Error **errp)
     qemu_mutex_unlock(&colo_compare_mutex);
 }
 
-static void colo_compare_timer_init(CompareState *s)
+static void colo_compare_timer_init(CompareShard *sh)
 {
-    AioContext *ctx = iothread_get_aio_context(s->iothread);
-
-    s->packet_check_timer = aio_timer_new(ctx, QEMU_CLOCK_HOST,
+    sh->packet_check_timer = aio_timer_new(sh->ctx, QEMU_CLOCK_HOST,
                                 SCALE_MS, check_old_packet_regular,
-                                s);
-    timer_mod(s->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
-              s->expired_scan_cycle);
+                                sh);
+    timer_mod(sh->packet_check_timer, qemu_clock_get_ms(QEMU_CLOCK_HOST) +
+              sh->s->expired_scan_cycle);
 }
 
-static void colo_compare_timer_del(CompareState *s)
+static void colo_compare_timer_del(CompareShard *sh)
 {
-    if (s->packet_check_timer) {
-        timer_free(s->packet_check_timer);
-        s->packet_check_timer = NULL;
+    if (sh->packet_check_timer) {
+        timer_free(sh->packet_check_timer);
+        sh->packet_check_timer = NULL;
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
+/*
+ * Release all packets of the shard, called in the shard's context.
+ * Packets still waiting to be handed over are taken in first so
+ * nothing the primary sent before the checkpoint is left behind.
+ */
+static void colo_shard_flush(void *opaque)
+{
+    CompareShard *sh = opaque;
+    unsigned int i;
+
+    colo_shard_take_input(sh);
+    for (i = 0; i < sh->s->nb_secondaries; i++) {
+        g_queue_foreach(&sh->lanes[i].conn_list, colo_flush_packets, sh);
+    }
+    /* The connections are empty now, this just clears compare_queued */
+    colo_compare_batch(sh);
+}
 
 static void colo_compare_handle_event(void *opaque)
 {
-    CompareState *s = opaque;
+    CompareShard *sh = opaque;
 
-    switch (s->event) {
+    switch (sh->s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_shard_flush(sh);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -957,23 +1599,41 @@ static void colo_compare_handle_event(void *opaque)
 static void colo_compare_iothread(CompareState *s)
 {
     AioContext *ctx = iothread_get_aio_context(s->iothread);
+    uint32_t i;
+
     object_ref(OBJECT(s->iothread));
     s->worker_context = iothread_get_g_main_context(s->iothread);
 
-    qemu_chr_fe_set_handlers(&s->chr_pri_in, compare_chr_can_read,
-                             compare_pri_chr_in, NULL, NULL,
-                             s, s->worker_context, true);
-    qemu_chr_fe_set_handlers(&s->chr_sec_in, compare_chr_can_read,
-                             compare_sec_chr_in, NULL, NULL,
-                             s, s->worker_context, true);
+    /* The chardev handlers below may schedule these right away */
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        colo_compare_timer_init(sh);
+        sh->event_bh = aio_bh_new(sh->ctx, colo_compare_handle_event, sh);
+        sh->in_bh = aio_bh_new(sh->ctx, colo_shard_in_bh, sh);
+    }
+    s->out_bh = aio_bh_new(ctx, colo_compare_out_bh, s);
+
+    if (s->local) {
+        s->local_in_bh = aio_bh_new(ctx, compare_local_in_bh, s);
+        s->local_out_bh = qemu_bh_new(compare_local_out_bh, s);
+    } else {
+        qemu_chr_fe_set_handlers(&s->chr_pri_in, compare_chr_can_read,
+                                 compare_pri_chr_in, NULL, NULL,
+                                 s, s->worker_context, true);
+    }
+    for (i = 0; i < s->nb_secondaries; i++) {
+        qemu_chr_fe_set_handlers(&s->secondaries[i].chr_in,
+                                 compare_chr_can_read, compare_sec_chr_in,
+                                 compare_sec_chr_event, NULL,
+                                 &s->secondaries[i], s->worker_context,
+                                 true);
+    }
     if (s->notify_dev) {
         qemu_chr_fe_set_handlers(&s->chr_notify_dev, compare_chr_can_read,
                                  compare_notify_chr, NULL, NULL,
                                  s, s->worker_context, true);
     }
-
-    colo_compare_timer_init(s);
-    s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1006,6 +1666,30 @@ static void compare_set_sec_indev(Object *obj, const char *value, Error **errp)
     s->sec_indev = g_strdup(value);
 }
 
+static void compare_get_extra_sec_indev(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    strList *list = s->extra_sec_indev;
+
+    visit_type_strList(v, name, &list, errp);
+}
+
+static void compare_set_extra_sec_indev(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    strList *list;
+
+    if (!visit_type_strList(v, name, &list, errp)) {
+        return;
+    }
+    qapi_free_strList(s->extra_sec_indev);
+    s->extra_sec_indev = list;
+}
+
 static char *compare_get_outdev(Object *obj, Error **errp)
 {
     CompareState *s = COLO_COMPARE(obj);
@@ -1037,6 +1721,20 @@ static void compare_set_vnet_hdr(Object *obj,
     s->vnet_hdr = value;
 }
 
+static bool compare_get_compare_hash(Object *obj, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    return s->compare_hash;
+}
+
+static void compare_set_compare_hash(Object *obj, bool value, Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    s->compare_hash = value;
+}
+
 static char *compare_get_notify_dev(Object *obj, Error **errp)
 {
     CompareState *s = COLO_COMPARE(obj);
@@ -1108,6 +1806,57 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "Property '%s.%s' requires a positive value",
+                   object_get_typename(obj), name);
+        return;
+    }
+    s->compare_threads = value;
+}
+
+static void compare_get_quorum(Object *obj, Visitor *v,
+                               const char *name, void *opaque,
+                               Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->quorum;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_quorum(Object *obj, Visitor *v,
+                               const char *name, void *opaque,
+                               Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    s->quorum = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1134,35 +1883,36 @@ static void set_max_queue_size(Object *obj, Visitor *v,
     max_queue_size = value;
 }
 
+static void compare_pri_packet_in(CompareState *s, Packet *pkt)
+{
+    if (packet_enqueue(s, PRIMARY_IN, 0, pkt)) {
+        trace_colo_compare_main("primary: unsupported packet in");
+        compare_send_pkt(s, pkt);
+    }
+}
+
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
-        trace_colo_compare_main("primary: unsupported packet in");
-        compare_chr_send(s,
-                         pri_rs->buf,
-                         pri_rs->packet_len,
-                         pri_rs->vnet_hdr_len,
-                         false,
-                         false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
-    }
+    compare_pri_packet_in(s, packet_pool_get(s->pool,
+                                             pri_rs->buf,
+                                             pri_rs->packet_len,
+                                             pri_rs->vnet_hdr_len));
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
-    CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
-
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    CompareSecondary *sec = container_of(sec_rs, CompareSecondary, rs);
+    CompareState *s = sec->s;
+    Packet *pkt = packet_pool_get(s->pool,
+                                  sec_rs->buf,
+                                  sec_rs->packet_len,
+                                  sec_rs->vnet_hdr_len);
+
+    if (packet_enqueue(s, SECONDARY_IN, sec - s->secondaries, pkt)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
+        packet_destroy(pkt, NULL);
     }
 }
 
@@ -1171,6 +1921,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
     CompareState *s = container_of(notify_rs, CompareState, notify_rs);
 
     const char msg[] = "COLO_COMPARE_GET_XEN_INIT";
+    uint32_t i;
     int ret;
 
     if (packet_matches_str("COLO_USERSPACE_PROXY_INIT",
@@ -1184,12 +1935,47 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        for (i = 0; i < s->compare_threads; i++) {
+            CompareShard *sh = &s->shards[i];
+
+            if (sh->iothread) {
+                aio_bh_schedule_oneshot(sh->ctx, colo_shard_flush, sh);
+            } else {
+                colo_shard_flush(sh);
+            }
+        }
     } else {
         error_report("COLO compare got unsupported instruction");
     }
 }
 
+/* Return true if no chardev is used twice */
+static bool compare_chardevs_distinct(CompareState *s)
+{
+    g_autoptr(GPtrArray) names = g_ptr_array_new();
+    strList *e;
+    guint i, j;
+
+    if (!s->local) {
+        g_ptr_array_add(names, s->pri_indev);
+        g_ptr_array_add(names, s->outdev);
+    }
+    g_ptr_array_add(names, s->sec_indev);
+    for (e = s->extra_sec_indev; e; e = e->next) {
+        g_ptr_array_add(names, e->value);
+    }
+
+    for (i = 0; i < names->len; i++) {
+        for (j = i + 1; j < names->len; j++) {
+            if (!strcmp(g_ptr_array_index(names, i),
+                        g_ptr_array_index(names, j))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 /*
  * Return 0 is success.
  * Return 1 is failed.
@@ -1228,19 +2014,36 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    strList *e;
+    uint32_t i, j;
 
-    if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
-        error_setg(errp, "colo compare needs 'primary_in' ,"
-                   "'secondary_in','outdev','iothread' property set");
+    if (!s->sec_indev || !s->iothread) {
+        error_setg(errp, "colo compare needs 'secondary_in',"
+                   "'iothread' property set");
         return;
-    } else if (!strcmp(s->pri_indev, s->outdev) ||
-               !strcmp(s->sec_indev, s->outdev) ||
-               !strcmp(s->pri_indev, s->sec_indev)) {
+    } else if (!s->pri_indev != !s->outdev) {
+        error_setg(errp, "colo compare needs both or none of 'primary_in' "
+                   "and 'outdev' set");
+        return;
+    }
+
+    s->local = !s->pri_indev;
+    if (!compare_chardevs_distinct(s)) {
         error_setg(errp, "'indev' and 'outdev' could not be same "
                    "for compare module");
         return;
     }
 
+    s->nb_secondaries = 1;
+    for (e = s->extra_sec_indev; e; e = e->next) {
+        s->nb_secondaries++;
+    }
+    if (s->quorum > s->nb_secondaries) {
+        error_setg(errp, "colo compare 'quorum' is larger than the number "
+                   "of secondaries");
+        return;
+    }
+
     if (!s->compare_timeout) {
         /* Set default value to 3000 MS */
         s->compare_timeout = DEFAULT_TIME_OUT_MS;
@@ -1251,28 +2054,46 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         s->expired_scan_cycle = REGULAR_PACKET_CHECK_MS;
     }
 
+    if (!s->compare_threads) {
+        s->compare_threads = 1;
+    }
+
     if (!max_queue_size) {
         /* Set default queue size to 1024 */
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
-    if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
-        !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
+    if (!s->local &&
+        (find_and_check_chardev(&chr, s->pri_indev, errp) ||
+         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp))) {
         return;
     }
 
-    if (find_and_check_chardev(&chr, s->sec_indev, errp) ||
-        !qemu_chr_fe_init(&s->chr_sec_in, chr, errp)) {
-        return;
+    s->secondaries = g_new0(CompareSecondary, s->nb_secondaries);
+    for (i = 0, e = s->extra_sec_indev; i < s->nb_secondaries; i++) {
+        CompareSecondary *sec = &s->secondaries[i];
+        char *name = s->sec_indev;
+
+        if (i) {
+            name = e->value;
+            e = e->next;
+        }
+
+        sec->s = s;
+        if (find_and_check_chardev(&chr, name, errp) ||
+            !qemu_chr_fe_init(&sec->chr_in, chr, errp)) {
+            return;
+        }
+        net_socket_rs_init(&sec->rs, compare_sec_rs_finalize, s->vnet_hdr);
     }
 
-    if (find_and_check_chardev(&chr, s->outdev, errp) ||
-        !qemu_chr_fe_init(&s->chr_out, chr, errp)) {
+    if (!s->local &&
+        (find_and_check_chardev(&chr, s->outdev, errp) ||
+         !qemu_chr_fe_init(&s->chr_out, chr, errp))) {
         return;
     }
 
     net_socket_rs_init(&s->pri_rs, compare_pri_rs_finalize, s->vnet_hdr);
-    net_socket_rs_init(&s->sec_rs, compare_sec_rs_finalize, s->vnet_hdr);
 
     /* Try to enable remote notify chardev, currently just for Xen COLO */
     if (s->notify_dev) {
@@ -1299,12 +2120,47 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
+    qemu_mutex_init(&s->out_lock);
+    g_queue_init(&s->out_list);
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      NULL);
+    /* Enough for a full primary queue and full secondary queues */
+    s->pool = packet_pool_new((1 + s->nb_secondaries) * max_queue_size);
+
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (s->compare_threads > 1) {
+            g_autofree char *name = g_strdup_printf("%s-compare%u",
+                object_get_canonical_path_component(OBJECT(s)), i);
+
+            sh->iothread = iothread_create(name, errp);
+            if (!sh->iothread) {
+                return;
+            }
+            sh->ctx = iothread_get_aio_context(sh->iothread);
+        } else {
+            sh->ctx = iothread_get_aio_context(s->iothread);
+        }
+
+        qemu_mutex_init(&sh->lock);
+        g_queue_init(&sh->pri_in);
+        sh->lanes = g_new0(CompareLane, s->nb_secondaries);
+        for (j = 0; j < s->nb_secondaries; j++) {
+            CompareLane *lane = &sh->lanes[j];
+
+            g_queue_init(&lane->sec_in);
+            g_queue_init(&lane->conn_list);
+            lane->connection_track_table = g_hash_table_new_full(
+                                                connection_key_hash,
+                                                connection_key_equal,
+                                                g_free,
+                                                NULL);
+        }
+        sh->compare_batch = g_ptr_array_new();
+        /* Marks the shard as initialized for finalize */
+        sh->s = s;
+    }
 
     colo_compare_iothread(s);
 
@@ -1322,19 +2178,13 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 
 static void colo_flush_packets(void *opaque, void *user_data)
 {
-    CompareState *s = user_data;
+    CompareShard *sh = user_data;
     Connection *conn = opaque;
     Packet *pkt = NULL;
 
     while (!g_queue_is_empty(&conn->primary_list)) {
         pkt = g_queue_pop_tail(&conn->primary_list);
-        compare_chr_send(s,
-                         pkt->data,
-                         pkt->size,
-                         pkt->vnet_hdr_len,
-                         false,
-                         true);
-        packet_destroy_partial(pkt, NULL);
+        colo_shard_release_primary_pkt(sh, pkt);
     }
     while (!g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_tail(&conn->secondary_list);
@@ -1357,6 +2207,12 @@ static void colo_compare_init(Object *obj)
                             compare_get_pri_indev, compare_set_pri_indev);
     object_property_add_str(obj, "secondary_in",
                             compare_get_sec_indev, compare_set_sec_indev);
+    object_property_add(obj, "extra_secondary_in", "strList",
+                        compare_get_extra_sec_indev,
+                        compare_set_extra_sec_indev, NULL, NULL);
+    object_property_add(obj, "quorum", "uint32",
+                        compare_get_quorum,
+                        compare_set_quorum, NULL, NULL);
     object_property_add_str(obj, "outdev",
                             compare_get_outdev, compare_set_outdev);
     object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
@@ -1379,9 +2235,88 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_compare_threads,
+                        compare_set_compare_threads, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
+
+    object_property_add_bool(obj, "compare_hash", compare_get_compare_hash,
+                             compare_set_compare_hash);
+}
+
+bool colo_compare_attach(Object *obj, ColoCompareOutputFunc *output,
+                         void *opaque, Error **errp)
+{
+    CompareState *s = (CompareState *)object_dynamic_cast(obj,
+                                                          TYPE_COLO_COMPARE);
+
+    if (!s) {
+        error_setg(errp, "'%s' is not a colo-compare object",
+                   object_get_canonical_path_component(obj));
+        return false;
+    }
+    if (!s->local) {
+        error_setg(errp, "colo-compare '%s' has 'primary_in' and 'outdev' "
+                   "set", object_get_canonical_path_component(obj));
+        return false;
+    }
+    if (s->local_output) {
+        error_setg(errp, "colo-compare '%s' already has a filter attached",
+                   object_get_canonical_path_component(obj));
+        return false;
+    }
+
+    s->local_output = output;
+    s->local_opaque = opaque;
+    return true;
+}
+
+void colo_compare_detach(Object *obj, void *opaque)
+{
+    CompareState *s = COLO_COMPARE(obj);
+
+    if (s->local_opaque == opaque) {
+        s->local_output = NULL;
+        s->local_opaque = NULL;
+    }
+}
+
+void colo_compare_receive(Object *obj, const struct iovec *iov, int iovcnt,
+                          uint32_t vnet_hdr_len)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    size_t size = iov_size(iov, iovcnt);
+    SendEntry *entry;
+
+    if (!size) {
+        return;
+    }
+
+    entry = g_slice_new(SendEntry);
+    entry->size = size;
+    entry->vnet_hdr_len = vnet_hdr_len;
+    entry->pkt = NULL;
+    entry->buf = g_malloc(size);
+    iov_to_buf(iov, iovcnt, 0, entry->buf, size);
+
+    QSLIST_INSERT_HEAD_ATOMIC(&s->local_in, entry, next);
+    qemu_bh_schedule(s->local_in_bh);
+}
+
+void colo_compare_drop_secondary(unsigned int index)
+{
+    CompareState *s;
+
+    qemu_mutex_lock(&colo_compare_mutex);
+    QTAILQ_FOREACH(s, &net_compares, next) {
+        if (index < s->nb_secondaries) {
+            colo_compare_drop_lane(s, index);
+        }
+    }
+    qemu_mutex_unlock(&colo_compare_mutex);
 }
 
 void colo_compare_cleanup(void)
@@ -1398,6 +2333,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i, j;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1414,15 +2350,43 @@ static void colo_compare_finalize(Object *obj)
     qemu_mutex_unlock(&colo_compare_mutex);
 
     qemu_chr_fe_deinit(&s->chr_pri_in, false);
-    qemu_chr_fe_deinit(&s->chr_sec_in, false);
+    for (i = 0; s->secondaries && i < s->nb_secondaries; i++) {
+        qemu_chr_fe_deinit(&s->secondaries[i].chr_in, false);
+    }
     qemu_chr_fe_deinit(&s->chr_out, false);
     if (s->notify_dev) {
         qemu_chr_fe_deinit(&s->chr_notify_dev, false);
     }
 
-    colo_compare_timer_del(s);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (!sh->s) {
+            break;
+        }
+        if (sh->iothread) {
+            iothread_stop(sh->iothread);
+        }
+        colo_compare_timer_del(sh);
+        if (sh->event_bh) {
+            qemu_bh_delete(sh->event_bh);
+        }
+        if (sh->in_bh) {
+            qemu_bh_delete(sh->in_bh);
+        }
+    }
+
+    if (s->local_in_bh) {
+        SendEntryList list;
+        SendEntry *entry;
 
-    qemu_bh_delete(s->event_bh);
+        qemu_bh_delete(s->local_in_bh);
+        compare_local_take(&s->local_in, &list);
+        while ((entry = QSLIST_FIRST(&list))) {
+            QSLIST_REMOVE_HEAD(&list, next);
+            send_entry_free(entry);
+        }
+    }
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
@@ -1433,23 +2397,55 @@ static void colo_compare_finalize(Object *obj)
     aio_context_release(ctx);
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    for (i = 0; s->shards && i < s->compare_threads && s->shards[i].s; i++) {
+        colo_shard_flush(&s->shards[i]);
+    }
+    if (s->shards) {
+        colo_compare_out_bh(s);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
+    if (s->local_out_bh) {
+        compare_local_out_bh(s);
+        qemu_bh_delete(s->local_out_bh);
+    }
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        CompareShard *sh = &s->shards[i];
+
+        if (sh->iothread) {
+            iothread_destroy(sh->iothread);
+        }
+        if (!sh->s) {
+            break;
+        }
+        for (j = 0; j < s->nb_secondaries; j++) {
+            g_queue_clear(&sh->lanes[j].conn_list);
+            g_hash_table_destroy(sh->lanes[j].connection_track_table);
+        }
+        g_free(sh->lanes);
+        g_ptr_array_free(sh->compare_batch, true);
+        qemu_mutex_destroy(&sh->lock);
+    }
+    if (s->shards) {
+        g_free(s->shards);
+        packet_pool_unref(s->pool);
+        if (s->out_bh) {
+            qemu_bh_delete(s->out_bh);
+        }
+        qemu_mutex_destroy(&s->out_lock);
     }
 
     object_unref(OBJECT(s->iothread));
 
     g_free(s->pri_indev);
     g_free(s->sec_indev);
+    qapi_free_strList(s->extra_sec_indev);
+    g_free(s->secondaries);
     g_free(s->outdev);
     g_free(s->notify_dev);
 }
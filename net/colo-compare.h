@@ -17,7 +17,28 @@
 #ifndef QEMU_COLO_COMPARE_H
 #define QEMU_COLO_COMPARE_H
 
+typedef void ColoCompareOutputFunc(void *opaque, const uint8_t *buf,
+                                   int size, uint32_t vnet_hdr_len);
+
 void colo_notify_compares_event(void *opaque, int event, Error **errp);
 void colo_compare_cleanup(void);
+/*
+ * Stop comparing with the secondary at @index, called by COLO when it
+ * dropped that secondary.  Index 0 is secondary_in, the others follow
+ * extra_secondary_in.
+ */
+void colo_compare_drop_secondary(unsigned int index);
+
+/*
+ * Pass the primary packets of a colo-compare without primary_in and
+ * outdev in-process instead of over chardevs.  The packets released by
+ * the compare are passed to @output in the main thread.
+ */
+bool colo_compare_attach(Object *obj, ColoCompareOutputFunc *output,
+                         void *opaque, Error **errp);
+void colo_compare_detach(Object *obj, void *opaque);
+/* Queue a primary packet, called from the main thread */
+void colo_compare_receive(Object *obj, const struct iovec *iov, int iovcnt,
+                          uint32_t vnet_hdr_len);
 
 #endif /* QEMU_COLO_COMPARE_H */
@@ -13,10 +13,20 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/atomic.h"
 #include "trace.h"
 #include "colo.h"
 #include "util.h"
 
+struct PacketPool {
+    /* Free packets, only used by the thread taking packets */
+    QSLIST_HEAD(, Packet) free;
+    /* Packets destroyed since they were last moved to free */
+    QSLIST_HEAD(, Packet) returned;
+    /* One for the owner and one for each packet in use, atomic */
+    unsigned int refs;
+};
+
 uint32_t connection_key_hash(const void *opaque)
 {
     const ConnectionKey *key = opaque;
@@ -142,6 +152,7 @@ Connection *connection_new(ConnectionKey *key)
 {
     Connection *conn = g_slice_new0(Connection);
 
+    conn->key = *key;
     conn->ip_proto = key->ip_proto;
     conn->processing = false;
     conn->tcp_state = TCPS_CLOSED;
@@ -190,10 +201,19 @@ Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len)
     return pkt;
 }
 
+static void packet_pool_put(Packet *pkt);
+
 void packet_destroy(void *opaque, void *user_data)
 {
     Packet *pkt = opaque;
 
+    if (pkt->destroy_hook) {
+        pkt->destroy_hook(pkt);
+    }
+    if (pkt->pool) {
+        packet_pool_put(pkt);
+        return;
+    }
     g_free(pkt->data);
     g_slice_free(Packet, pkt);
 }
@@ -202,9 +222,101 @@ void packet_destroy_partial(void *opaque, void *user_data)
 {
     Packet *pkt = opaque;
 
+    if (pkt->destroy_hook) {
+        pkt->destroy_hook(pkt);
+    }
+    if (pkt->pool) {
+        /* The buffer was handed on, the pool gets a new one */
+        pkt->data = g_malloc(PACKET_POOL_BUF_SIZE);
+        packet_pool_put(pkt);
+        return;
+    }
     g_slice_free(Packet, pkt);
 }
 
+PacketPool *packet_pool_new(unsigned int size)
+{
+    PacketPool *pool = g_new0(PacketPool, 1);
+    unsigned int i;
+
+    pool->refs = 1;
+    for (i = 0; i < size; i++) {
+        Packet *pkt = g_slice_new0(Packet);
+
+        pkt->data = g_malloc(PACKET_POOL_BUF_SIZE);
+        QSLIST_INSERT_HEAD(&pool->free, pkt, pool_next);
+    }
+
+    return pool;
+}
+
+static void packet_pool_free(PacketPool *pool)
+{
+    Packet *pkt;
+
+    while ((pkt = QSLIST_FIRST(&pool->free))) {
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+        g_free(pkt->data);
+        g_slice_free(Packet, pkt);
+    }
+    while ((pkt = QSLIST_FIRST(&pool->returned))) {
+        QSLIST_REMOVE_HEAD(&pool->returned, pool_next);
+        g_free(pkt->data);
+        g_slice_free(Packet, pkt);
+    }
+    g_free(pool);
+}
+
+static void packet_pool_put(Packet *pkt)
+{
+    PacketPool *pool = pkt->pool;
+
+    QSLIST_INSERT_HEAD_ATOMIC(&pool->returned, pkt, pool_next);
+    if (qatomic_fetch_dec(&pool->refs) == 1) {
+        packet_pool_free(pool);
+    }
+}
+
+void packet_pool_unref(PacketPool *pool)
+{
+    if (qatomic_fetch_dec(&pool->refs) == 1) {
+        packet_pool_free(pool);
+    }
+}
+
+Packet *packet_pool_get(PacketPool *pool, const void *data, int size,
+                        int vnet_hdr_len)
+{
+    Packet *pkt;
+    void *buf;
+
+    if (size > PACKET_POOL_BUF_SIZE) {
+        return packet_new(data, size, vnet_hdr_len);
+    }
+
+    if (QSLIST_EMPTY(&pool->free)) {
+        QSLIST_MOVE_ATOMIC(&pool->free, &pool->returned);
+    }
+    pkt = QSLIST_FIRST(&pool->free);
+    if (!pkt) {
+        trace_colo_proxy_main("colo proxy packet pool empty");
+        return packet_new(data, size, vnet_hdr_len);
+    }
+    QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+    qatomic_inc(&pool->refs);
+
+    buf = pkt->data;
+    memset(pkt, 0, sizeof(*pkt));
+    memcpy(buf, data, size);
+    pkt->data = buf;
+    pkt->pool = pool;
+    pkt->size = size;
+    pkt->creation_ms = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    pkt->vnet_hdr_len = vnet_hdr_len;
+
+    return pkt;
+}
+
 /*
  * Clear hashtable, stop this hash growing really huge
  */
@@ -213,10 +325,61 @@ void connection_hashtable_reset(GHashTable *connection_track_table)
     g_hash_table_remove_all(connection_track_table);
 }
 
-/* if not found, create a new connection and add to hash table */
+/*
+ * Make room in a full table by dropping the least recently used idle
+ * connection.  If there is none near the old end of conn_list, the
+ * oldest one is dropped, after @evict was called with it and @opaque
+ * to hand its queued packets on.  Connections queued for comparison
+ * are never dropped.
+ */
+static void connection_evict(GHashTable *connection_track_table,
+                             GQueue *conn_list, GFunc evict, void *opaque)
+{
+    GList *link, *victim = NULL;
+    Connection *conn;
+    int i = 0;
+
+    for (link = conn_list->head; link; link = link->next) {
+        conn = link->data;
+        if (conn->compare_queued) {
+            continue;
+        }
+        if (g_queue_is_empty(&conn->primary_list) &&
+            g_queue_is_empty(&conn->secondary_list)) {
+            victim = link;
+            break;
+        }
+        if (!victim) {
+            victim = link;
+        }
+        if (++i >= CONNECTION_EVICT_SCAN) {
+            trace_colo_proxy_main("colo proxy no idle connection to evict");
+            break;
+        }
+    }
+    if (!victim) {
+        return;
+    }
+
+    conn = victim->data;
+    if (evict) {
+        evict(conn, opaque);
+    }
+    g_queue_delete_link(conn_list, victim);
+    g_hash_table_remove(connection_track_table, &conn->key);
+    connection_destroy(conn);
+}
+
+/*
+ * if not found, create a new connection and add to hash table.
+ * If conn_list is given, the connection is kept on it in least
+ * recently used order, and a full table evicts from it, see
+ * connection_evict().
+ */
 Connection *connection_get(GHashTable *connection_track_table,
                            ConnectionKey *key,
-                           GQueue *conn_list)
+                           GQueue *conn_list,
+                           GFunc evict, void *opaque)
 {
     Connection *conn = g_hash_table_lookup(connection_track_table, key);
 
@@ -226,18 +389,25 @@ Connection *connection_get(GHashTable *connection_track_table,
         conn = connection_new(key);
 
         if (g_hash_table_size(connection_track_table) > HASHTABLE_MAX_SIZE) {
-            trace_colo_proxy_main("colo proxy connection hashtable full,"
-                                  " clear it");
-            connection_hashtable_reset(connection_track_table);
-            /*
-             * clear the conn_list
-             */
-            while (conn_list && !g_queue_is_empty(conn_list)) {
-                connection_destroy(g_queue_pop_head(conn_list));
+            if (conn_list && !g_queue_is_empty(conn_list)) {
+                connection_evict(connection_track_table, conn_list,
+                                 evict, opaque);
+            } else {
+                trace_colo_proxy_main("colo proxy connection hashtable full,"
+                                      " clear it");
+                connection_hashtable_reset(connection_track_table);
             }
         }
 
         g_hash_table_insert(connection_track_table, new_key, conn);
+        if (conn_list) {
+            g_queue_push_tail(conn_list, conn);
+            conn->link = conn_list->tail;
+            conn->processing = true;
+        }
+    } else if (conn->link && conn->link != conn_list->tail) {
+        g_queue_unlink(conn_list, conn->link);
+        g_queue_push_tail_link(conn_list, conn->link);
     }
 
     return conn;
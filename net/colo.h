@@ -22,6 +22,14 @@
 
 #define HASHTABLE_MAX_SIZE 16384
 
+/* Idle connections looked for from the least recently used end */
+#define CONNECTION_EVICT_SCAN 16
+
+/* Size of the payload buffers recycled by a PacketPool */
+#define PACKET_POOL_BUF_SIZE 2048
+
+typedef struct PacketPool PacketPool;
+
 #ifndef IPPROTO_DCCP
 #define IPPROTO_DCCP 33
 #endif
@@ -55,6 +63,14 @@ typedef struct Packet {
     /* record the payload offset(the length that has been compared) */
     uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
+    /* crc32c of the compared part of the packet, 0 if not computed */
+    uint32_t hash;
+    /* Pool the packet and its buffer go back to, NULL if not pooled */
+    PacketPool *pool;
+    QSLIST_ENTRY(Packet) pool_next;
+    /* Called by packet_destroy() before the packet is freed */
+    void (*destroy_hook)(struct Packet *pkt);
+    void *hook_opaque;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -67,12 +83,17 @@ typedef struct ConnectionKey {
 } QEMU_PACKED ConnectionKey;
 
 typedef struct Connection {
+    ConnectionKey key;
+    /* link of the connection in conn_list, oldest used first */
+    GList *link;
     /* connection primary send queue: element type: Packet */
     GQueue primary_list;
     /* connection secondary send queue: element type: Packet */
     GQueue secondary_list;
     /* flag to enqueue unprocessed_connections */
     bool processing;
+    /* queued for the next batch of comparisons */
+    bool compare_queued;
     uint8_t ip_proto;
     /* record the sequence number that has been compared */
     uint32_t compare_seq;
@@ -97,7 +118,8 @@ Connection *connection_new(ConnectionKey *key);
 void connection_destroy(void *opaque);
 Connection *connection_get(GHashTable *connection_track_table,
                            ConnectionKey *key,
-                           GQueue *conn_list);
+                           GQueue *conn_list,
+                           GFunc evict, void *opaque);
 bool connection_has_tracked(GHashTable *connection_track_table,
                             ConnectionKey *key);
 void connection_hashtable_reset(GHashTable *connection_track_table);
@@ -106,4 +128,16 @@ Packet *packet_new_nocopy(void *data, int size, int vnet_hdr_len);
 void packet_destroy(void *opaque, void *user_data);
 void packet_destroy_partial(void *opaque, void *user_data);
 
+/*
+ * A pool of @size preallocated packets with payload buffers.  Packets
+ * are taken from it by a single thread, but can be destroyed in any
+ * thread.  The pool is freed once it is unreferenced and all of its
+ * packets are destroyed.
+ */
+PacketPool *packet_pool_new(unsigned int size);
+void packet_pool_unref(PacketPool *pool);
+/* Like packet_new(), falls back to it when the pool is empty */
+Packet *packet_pool_get(PacketPool *pool, const void *data, int size,
+                        int vnet_hdr_len);
+
 #endif /* NET_COLO_H */
@@ -15,6 +15,7 @@
 #include "qapi/qapi-builtin-visit.h"
 #include "qapi/qmp/qerror.h"
 #include "qom/object.h"
+#include "migration/colo.h"
 
 #define TYPE_FILTER_BUFFER "filter-buffer"
 
@@ -25,6 +26,12 @@ struct FilterBufferState {
 
     NetQueue *incoming_queue;
     uint32_t interval;
+    /*
+     * Release the packets when a COLO checkpoint is acknowledged instead
+     * of on a timer.  The VM is stopped during a checkpoint, so all that
+     * is queued then was sent in the epoch the checkpoint covers.
+     */
+    bool colo;
     QEMUTimer release_timer;
 };
 
@@ -117,10 +124,14 @@ static void filter_buffer_setup(NetFilterState *nf, Error **errp)
     FilterBufferState *s = FILTER_BUFFER(nf);
 
     /*
-     * We may want to accept zero interval when VM FT solutions like MC
-     * or COLO use this filter to release packets on demand.
+     * With colo, VM FT solutions like MC or COLO release the packets on
+     * demand and there is no interval.
      */
-    if (!s->interval) {
+    if (s->colo && s->interval) {
+        error_setg(errp, "filter-buffer can't have 'interval' set "
+                   "together with 'colo'");
+        return;
+    } else if (!s->colo && !s->interval) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "interval",
                    "a non-zero interval");
         return;
@@ -144,6 +155,32 @@ static void filter_buffer_status_changed(NetFilterState *nf, Error **errp)
     }
 }
 
+static void filter_buffer_handle_event(NetFilterState *nf, int event,
+                                      Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(nf);
+
+    switch (event) {
+    case COLO_EVENT_CHECKPOINT:
+        /*
+         * Packets are passed on from the queue without another copy.
+         * Like with the timer, those that can't be sent are dropped.
+         */
+        if (s->colo && nf->on) {
+            filter_buffer_flush(nf);
+        }
+        break;
+    case COLO_EVENT_FAILOVER:
+        /* Nothing is acknowledged anymore, release what is held back */
+        if (s->colo) {
+            object_property_set_str(OBJECT(nf), "status", "off", errp);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
 static void filter_buffer_get_interval(Object *obj, Visitor *v,
                                        const char *name, void *opaque,
                                        Error **errp)
@@ -172,6 +209,20 @@ static void filter_buffer_set_interval(Object *obj, Visitor *v,
     s->interval = value;
 }
 
+static bool filter_buffer_get_colo(Object *obj, Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+
+    return s->colo;
+}
+
+static void filter_buffer_set_colo(Object *obj, bool value, Error **errp)
+{
+    FilterBufferState *s = FILTER_BUFFER(obj);
+
+    s->colo = value;
+}
+
 static void filter_buffer_class_init(ObjectClass *oc, void *data)
 {
     NetFilterClass *nfc = NETFILTER_CLASS(oc);
@@ -179,11 +230,14 @@ static void filter_buffer_class_init(ObjectClass *oc, void *data)
     object_class_property_add(oc, "interval", "uint32",
                               filter_buffer_get_interval,
                               filter_buffer_set_interval, NULL, NULL);
+    object_class_property_add_bool(oc, "colo", filter_buffer_get_colo,
+                                   filter_buffer_set_colo);
 
     nfc->setup = filter_buffer_setup;
     nfc->cleanup = filter_buffer_cleanup;
     nfc->receive_iov = filter_buffer_receive_iov;
     nfc->status_changed = filter_buffer_status_changed;
+    nfc->handle_event = filter_buffer_handle_event;
 }
 
 static const TypeInfo filter_buffer_info = {
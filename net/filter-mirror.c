@@ -21,6 +21,7 @@
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
 #include "block/aio-wait.h"
+#include "net/colo-compare.h"
 
 #define TYPE_FILTER_MIRROR "filter-mirror"
 typedef struct MirrorState MirrorState;
@@ -37,6 +38,9 @@ struct MirrorState {
     NetFilterState parent_obj;
     char *indev;
     char *outdev;
+    /* colo-compare the packets are passed to in-process */
+    char *compare;
+    Object *compare_obj;
     CharBackend chr_in;
     CharBackend chr_out;
     SocketReadState rs;
@@ -220,7 +224,11 @@ static ssize_t filter_redirector_receive_iov(NetFilterState *nf,
     MirrorState *s = FILTER_REDIRECTOR(nf);
     int ret;
 
-    if (qemu_chr_fe_backend_connected(&s->chr_out)) {
+    if (s->compare_obj) {
+        colo_compare_receive(s->compare_obj, iov, iovcnt,
+                             s->vnet_hdr ? nf->netdev->vnet_hdr_len : 0);
+        return iov_size(iov, iovcnt);
+    } else if (qemu_chr_fe_backend_connected(&s->chr_out)) {
         ret = filter_send(s, iov, iovcnt);
         if (ret < 0) {
             error_report("filter redirector send failed(%s)", strerror(-ret));
@@ -242,6 +250,11 @@ static void filter_redirector_cleanup(NetFilterState *nf)
 {
     MirrorState *s = FILTER_REDIRECTOR(nf);
 
+    if (s->compare_obj) {
+        colo_compare_detach(s->compare_obj, nf);
+        object_unref(s->compare_obj);
+        s->compare_obj = NULL;
+    }
     qemu_chr_fe_deinit(&s->chr_in, false);
     qemu_chr_fe_deinit(&s->chr_out, false);
 }
@@ -275,10 +288,38 @@ static void redirector_rs_finalize(SocketReadState *rs)
     redirector_to_filter(nf, rs->buf, rs->packet_len);
 }
 
+static void redirector_compare_output(void *opaque, const uint8_t *buf,
+                                      int size, uint32_t vnet_hdr_len)
+{
+    redirector_to_filter(opaque, buf, size);
+}
+
 static void filter_redirector_setup(NetFilterState *nf, Error **errp)
 {
     MirrorState *s = FILTER_REDIRECTOR(nf);
     Chardev *chr;
+    Object *obj;
+
+    if (s->compare) {
+        if (s->indev || s->outdev) {
+            error_setg(errp, "filter redirector can't have 'indev' or "
+                       "'outdev' set together with 'compare'");
+            return;
+        }
+
+        obj = object_resolve_path_component(object_get_objects_root(),
+                                            s->compare);
+        if (!obj) {
+            error_set(errp, ERROR_CLASS_DEVICE_NOT_FOUND,
+                      "colo-compare '%s' not found", s->compare);
+            return;
+        }
+        if (!colo_compare_attach(obj, redirector_compare_output, nf, errp)) {
+            return;
+        }
+        s->compare_obj = object_ref(obj);
+        return;
+    }
 
     if (!s->indev && !s->outdev) {
         error_setg(errp, "filter redirector needs 'indev' or "
@@ -394,6 +435,23 @@ static void filter_redirector_set_outdev(Object *obj,
     s->outdev = g_strdup(value);
 }
 
+static char *filter_redirector_get_compare(Object *obj, Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    return g_strdup(s->compare);
+}
+
+static void filter_redirector_set_compare(Object *obj,
+                                          const char *value,
+                                          Error **errp)
+{
+    MirrorState *s = FILTER_REDIRECTOR(obj);
+
+    g_free(s->compare);
+    s->compare = g_strdup(value);
+}
+
 static bool filter_redirector_get_vnet_hdr(Object *obj, Error **errp)
 {
     MirrorState *s = FILTER_REDIRECTOR(obj);
@@ -433,6 +491,8 @@ static void filter_redirector_class_init(ObjectClass *oc, void *data)
                                   filter_redirector_set_indev);
     object_class_property_add_str(oc, "outdev", filter_redirector_get_outdev,
                                   filter_redirector_set_outdev);
+    object_class_property_add_str(oc, "compare", filter_redirector_get_compare,
+                                  filter_redirector_set_compare);
     object_class_property_add_bool(oc, "vnet_hdr_support",
                                    filter_redirector_get_vnet_hdr,
                                    filter_redirector_set_vnet_hdr);
@@ -469,6 +529,7 @@ static void filter_redirector_fini(Object *obj)
 
     g_free(s->indev);
     g_free(s->outdev);
+    g_free(s->compare);
 }
 
 static const TypeInfo filter_redirector_info = {
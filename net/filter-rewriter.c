@@ -18,6 +18,7 @@
 #include "qom/object.h"
 #include "qemu/main-loop.h"
 #include "qemu/iov.h"
+#include "qapi/visitor.h"
 #include "net/checksum.h"
 #include "net/colo.h"
 #include "migration/colo.h"
@@ -34,8 +35,25 @@ struct RewriterState {
     NetQueue *incoming_queue;
     /* hashtable to save connection */
     GHashTable *connection_track_table;
+    /*
+     * Last established connection seen from the primary and the
+     * secondary.  The table never frees connections, so these stay
+     * valid, they are checked against the key and the state.
+     */
+    Connection *flow[2];
+    ConnectionKey flow_key[2];
+    /* Reused for the packets, unless a packet arrives while it is in use */
+    uint8_t *buf;
+    bool buf_busy;
     bool vnet_hdr;
     bool failover_mode;
+
+    /* Packets with seq or ack rewritten */
+    uint64_t rewritten;
+    /* Packets passed without connection tracking */
+    uint64_t untracked;
+    /* TCP packets that needed the full state machine */
+    uint64_t fallback;
 };
 
 static void filter_rewriter_failover_mode(RewriterState *s)
@@ -115,6 +133,7 @@ static int handle_primary_tcp_pkt(RewriterState *rf,
 
             net_checksum_calculate((uint8_t *)pkt->data + pkt->vnet_hdr_len,
                                    pkt->size - pkt->vnet_hdr_len, CSUM_TCP);
+            rf->rewritten++;
         }
 
         /*
@@ -217,6 +236,7 @@ static int handle_secondary_tcp_pkt(RewriterState *rf,
 
             net_checksum_calculate((uint8_t *)pkt->data + pkt->vnet_hdr_len,
                                    pkt->size - pkt->vnet_hdr_len, CSUM_TCP);
+            rf->rewritten++;
         }
     }
 
@@ -249,6 +269,60 @@ static int handle_secondary_tcp_pkt(RewriterState *rf,
     return 0;
 }
 
+/*
+ * Packets of an established connection without SYN or FIN only need
+ * their seq or ack shifted by the offset, which keeps the checksum
+ * valid with an incremental update.  Return false if the packet needs
+ * the full state machine.
+ */
+static bool colo_rewriter_fast_path(RewriterState *s, Packet *pkt,
+                                    ConnectionKey *key, bool primary)
+{
+    struct tcp_hdr *tcp_pkt = (struct tcp_hdr *)pkt->transport_header;
+    struct virtio_net_hdr *vnet_hdr = pkt->data;
+    Connection *conn = s->flow[primary];
+    uint32_t old, new;
+
+    if ((tcp_pkt->th_flags & (TH_ACK | TH_SYN | TH_FIN)) != TH_ACK) {
+        return false;
+    }
+    /* A partial checksum can't be updated incrementally */
+    if (pkt->vnet_hdr_len && pkt->vnet_hdr_len >= sizeof(*vnet_hdr) &&
+        (vnet_hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return false;
+    }
+
+    if (!conn || conn->tcp_state != TCPS_ESTABLISHED ||
+        !connection_key_equal(key, &s->flow_key[primary])) {
+        conn = g_hash_table_lookup(s->connection_track_table, key);
+        if (!conn || conn->tcp_state != TCPS_ESTABLISHED) {
+            return false;
+        }
+        s->flow[primary] = conn;
+        s->flow_key[primary] = *key;
+    }
+
+    if (!conn->offset) {
+        return true;
+    }
+
+    if (primary) {
+        /* handle packets to the secondary from the primary */
+        old = ntohl(tcp_pkt->th_ack);
+        new = old + conn->offset;
+        tcp_pkt->th_ack = htonl(new);
+    } else {
+        /* handle packets to the primary from the secondary */
+        old = ntohl(tcp_pkt->th_seq);
+        new = old - conn->offset;
+        tcp_pkt->th_seq = htonl(new);
+    }
+    net_checksum_update_32((uint8_t *)&tcp_pkt->th_sum, old, new);
+    s->rewritten++;
+
+    return true;
+}
+
 static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
                                          NetClientState *sender,
                                          unsigned flags,
@@ -262,8 +336,12 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
     Packet *pkt;
     ssize_t size = iov_size(iov, iovcnt);
     ssize_t vnet_hdr_len = 0;
-    char *buf = g_malloc0(size);
+    bool primary = sender == nf->netdev;
+    bool own_buf = s->buf_busy || size > NET_BUFSIZE;
+    uint8_t *buf = own_buf ? g_malloc(size) : s->buf;
+    ssize_t ret = 0;
 
+    s->buf_busy = true;
     iov_to_buf(iov, iovcnt, 0, buf, size);
 
     if (s->vnet_hdr) {
@@ -277,53 +355,62 @@ static ssize_t colo_rewriter_receive_iov(NetFilterState *nf,
      * we will rewrite it to make secondary guest's
      * connection established successfully
      */
-    if (pkt && is_tcp_packet(pkt)) {
+    if (!is_tcp_packet(pkt)) {
+        s->untracked++;
+        goto out;
+    }
 
-        fill_connection_key(pkt, &key, sender == nf->netdev);
+    fill_connection_key(pkt, &key, primary);
 
-        /* After failover we needn't change new TCP packet */
-        if (s->failover_mode &&
-            !connection_has_tracked(s->connection_track_table, &key)) {
+    if (colo_rewriter_fast_path(s, pkt, &key, primary)) {
+        goto send;
+    }
+
+    /* After failover we needn't change new TCP packet */
+    if (s->failover_mode &&
+        !connection_has_tracked(s->connection_track_table, &key)) {
+        s->untracked++;
+        goto out;
+    }
+
+    s->fallback++;
+    if (g_hash_table_size(s->connection_track_table) > HASHTABLE_MAX_SIZE) {
+        /* connection_get() resets the table, don't keep stale flows */
+        s->flow[0] = s->flow[1] = NULL;
+    }
+    conn = connection_get(s->connection_track_table,
+                          &key,
+                          NULL, NULL, NULL);
+
+    if (primary) {
+        /* NET_FILTER_DIRECTION_TX */
+        if (handle_primary_tcp_pkt(s, conn, pkt, &key)) {
             goto out;
         }
-
-        conn = connection_get(s->connection_track_table,
-                              &key,
-                              NULL);
-
-        if (sender == nf->netdev) {
-            /* NET_FILTER_DIRECTION_TX */
-            if (!handle_primary_tcp_pkt(s, conn, pkt, &key)) {
-                qemu_net_queue_send(s->incoming_queue, sender, 0,
-                (const uint8_t *)pkt->data, pkt->size, NULL);
-                packet_destroy(pkt, NULL);
-                pkt = NULL;
-                /*
-                 * We block the packet here,after rewrite pkt
-                 * and will send it
-                 */
-                return 1;
-            }
-        } else {
-            /* NET_FILTER_DIRECTION_RX */
-            if (!handle_secondary_tcp_pkt(s, conn, pkt, &key)) {
-                qemu_net_queue_send(s->incoming_queue, sender, 0,
-                (const uint8_t *)pkt->data, pkt->size, NULL);
-                packet_destroy(pkt, NULL);
-                pkt = NULL;
-                /*
-                 * We block the packet here,after rewrite pkt
-                 * and will send it
-                 */
-                return 1;
-            }
+    } else {
+        /* NET_FILTER_DIRECTION_RX */
+        if (handle_secondary_tcp_pkt(s, conn, pkt, &key)) {
+            goto out;
         }
     }
 
+send:
+    /*
+     * We block the packet here,after rewrite pkt
+     * and will send it
+     */
+    qemu_net_queue_send(s->incoming_queue, sender, 0,
+                        (const uint8_t *)pkt->data, pkt->size, NULL);
+    ret = 1;
+
 out:
-    packet_destroy(pkt, NULL);
-    pkt = NULL;
-    return 0;
+    packet_destroy_partial(pkt, NULL);
+    if (own_buf) {
+        g_free(buf);
+    } else {
+        s->buf_busy = false;
+    }
+    return ret;
 }
 
 static void reset_seq_offset(gpointer key, gpointer value, gpointer user_data)
@@ -374,6 +461,9 @@ static void colo_rewriter_cleanup(NetFilterState *nf)
     }
 
     g_hash_table_destroy(s->connection_track_table);
+    s->flow[0] = s->flow[1] = NULL;
+    g_free(s->buf);
+    s->buf = NULL;
 }
 
 static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
@@ -385,6 +475,7 @@ static void colo_rewriter_setup(NetFilterState *nf, Error **errp)
                                                       g_free,
                                                       NULL);
     s->incoming_queue = qemu_new_net_queue(qemu_netfilter_pass_to_next, nf);
+    s->buf = g_malloc(NET_BUFSIZE);
 }
 
 static bool filter_rewriter_get_vnet_hdr(Object *obj, Error **errp)
@@ -403,12 +494,28 @@ static void filter_rewriter_set_vnet_hdr(Object *obj,
     s->vnet_hdr = value;
 }
 
+static void filter_rewriter_get_stat(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    uint64_t value = *(uint64_t *)opaque;
+
+    visit_type_uint64(v, name, &value, errp);
+}
+
 static void filter_rewriter_init(Object *obj)
 {
     RewriterState *s = FILTER_REWRITER(obj);
 
     s->vnet_hdr = false;
     s->failover_mode = FAILOVER_MODE_OFF;
+
+    object_property_add(obj, "rewritten", "uint64",
+                        filter_rewriter_get_stat, NULL, NULL, &s->rewritten);
+    object_property_add(obj, "untracked", "uint64",
+                        filter_rewriter_get_stat, NULL, NULL, &s->untracked);
+    object_property_add(obj, "fallback", "uint64",
+                        filter_rewriter_get_stat, NULL, NULL, &s->fallback);
 }
 
 static void colo_rewriter_class_init(ObjectClass *oc, void *data)
@@ -5198,11 +5198,14 @@ SRST
                  -object tls-cipher-suites,id=mysuite0,priority=@SYSTEM \\
                  -fw_cfg name=etc/edk2/https/ciphers,gen_id=mysuite0
 
-    ``-object filter-buffer,id=id,netdev=netdevid,interval=t[,queue=all|rx|tx][,status=on|off][,position=head|tail|id=<id>][,insert=behind|before]``
+    ``-object filter-buffer,id=id,netdev=netdevid,interval=t|colo=on[,queue=all|rx|tx][,status=on|off][,position=head|tail|id=<id>][,insert=behind|before]``
         Interval t can't be 0, this filter batches the packet delivery:
         all packets arriving in a given interval on netdev netdevid are
         delayed until the end of the interval. Interval is in
-        microseconds. ``status`` is optional that indicate whether the
+        microseconds. With ``colo=on`` instead of an interval, packets
+        are delayed until the secondary has acknowledged the next COLO
+        checkpoint, and released on failover, which also turns the
+        filter off. ``status`` is optional that indicate whether the
         netfilter is on (enabled) or off (disabled), the default status
         for netfilter will be 'on'.
 
@@ -5244,7 +5247,7 @@ SRST
         chardevchardevid, if it has the vnet\_hdr\_support flag,
         filter-mirror will mirror packet with vnet\_hdr\_len.
 
-    ``-object filter-redirector,id=id,netdev=netdevid,indev=chardevid,outdev=chardevid,queue=all|rx|tx[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
+    ``-object filter-redirector,id=id,netdev=netdevid,indev=chardevid,outdev=chardevid|compare=id,queue=all|rx|tx[,vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
         filter-redirector on netdev netdevid,redirect filter's net
         packet to chardev chardevid,and redirect indev's packet to
         filter.if it has the vnet\_hdr\_support flag, filter-redirector
@@ -5252,6 +5255,10 @@ SRST
         filter-redirector we need to differ outdev id from indev id, id
         can not be the same. we can just use indev or outdev, but at
         least one of indev or outdev need to be specified.
+        Instead of indev and outdev, compare=id names a colo-compare
+        object created earlier without primary\_in and outdev. The
+        packets are then passed to it in the same process, and the
+        packets it releases are redirected to the filter.
 
     ``-object filter-rewriter,id=id,netdev=netdevid,queue=all|rx|tx,[vnet_hdr_support][,position=head|tail|id=<id>][,insert=behind|before]``
         Filter-rewriter is a part of COLO project.It will rewrite tcp
@@ -5259,6 +5266,10 @@ SRST
         connection,and rewrite tcp packet to primary from secondary make
         tcp packet can be handled by client.if it has the
         vnet\_hdr\_support flag, we can parse packet with vnet header.
+        The read-only properties rewritten, untracked and fallback count
+        the packets whose seq or ack was rewritten, that were passed on
+        without tracking, and that missed the fast path for established
+        connections.
 
         usage: colo secondary: -object
         filter-redirector,id=f1,netdev=hn0,queue=tx,indev=red0 -object
@@ -5271,7 +5282,7 @@ SRST
         stored. The file format is libpcap, so it can be analyzed with
         tools such as tcpdump or Wireshark.
 
-    ``-object colo-compare,id=id,primary_in=chardevid,secondary_in=chardevid,outdev=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}]``
+    ``-object colo-compare,id=id[,primary_in=chardevid,outdev=chardevid],secondary_in=chardevid,iothread=id[,vnet_hdr_support][,notify_dev=id][,compare_timeout=@var{ms}][,expired_scan_cycle=@var{ms}][,max_queue_size=@var{size}][,compare_hash=on|off][,compare_threads=@var{n}]``
         Colo-compare gets packet from primary\_in chardevid and
         secondary\_in, then compare whether the payload of primary packet
         and secondary packet are the same. If same, it will output
@@ -5285,6 +5296,15 @@ SRST
         is to set the period of scanning expired primary node network packets.
         The max\_queue\_size=@var{size} is to set the max compare queue
         size depend on user environment.
+        If compare\_hash is on, colo-compare computes a crc32c of each
+        packet as it is queued, and only compares packets byte by byte
+        if their hashes match.
+        The compare\_threads=@var{n} sets the number of threads the
+        connections are compared in. With more than one, the iothread
+        only reads and parses packets and each connection is compared
+        in one of n internal threads.
+        Without primary\_in and outdev, the primary packets come from
+        a filter-redirector with compare=id in the same process.
         If user want to use Xen COLO, need to add the notify\_dev to
         notify Xen colo-frame to do checkpoint.
 
@@ -14,6 +14,8 @@
 
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "block/aio-wait.h"
 #include "block/replication.h"
 
 static QLIST_HEAD(, ReplicationState) replication_states;
@@ -58,20 +60,63 @@ void replication_start_all(ReplicationMode mode, Error **errp)
     }
 }
 
+typedef struct ReplicationCheckpoint {
+    ReplicationState *rs;
+    Error *err;
+    unsigned int *pending;
+} ReplicationCheckpoint;
+
+static void coroutine_fn replication_do_checkpoint_co(void *opaque)
+{
+    ReplicationCheckpoint *cp = opaque;
+
+    cp->rs->ops->checkpoint(cp->rs, &cp->err);
+    (*cp->pending)--;
+    aio_wait_kick();
+}
+
 void replication_do_checkpoint_all(Error **errp)
 {
-    ReplicationState *rs, *next;
-    Error *local_err = NULL;
+    ReplicationState *rs;
+    ReplicationCheckpoint *cps;
+    unsigned int i, n = 0, pending;
 
-    QLIST_FOREACH_SAFE(rs, &replication_states, node, next) {
+    QLIST_FOREACH(rs, &replication_states, node) {
+        n++;
+    }
+
+    /*
+     * Emptying the overlays of a device waits for its I/O, let the devices
+     * do that concurrently.  The coroutines run in the main loop like the
+     * callers, the callbacks only must not hold an AioContext lock while
+     * they yield.
+     */
+    cps = g_new0(ReplicationCheckpoint, n);
+    pending = 0;
+    i = 0;
+    QLIST_FOREACH(rs, &replication_states, node) {
         if (rs->ops && rs->ops->checkpoint) {
-            rs->ops->checkpoint(rs, &local_err);
+            cps[i].rs = rs;
+            cps[i].pending = &pending;
+            pending++;
+            i++;
         }
-        if (local_err) {
-            error_propagate(errp, local_err);
-            return;
+    }
+    n = i;
+
+    for (i = 0; i < n; i++) {
+        qemu_coroutine_enter(qemu_coroutine_create(replication_do_checkpoint_co,
+                                                   &cps[i]));
+    }
+    AIO_WAIT_WHILE_UNLOCKED(NULL, pending > 0);
+
+    /* Report the first error */
+    for (i = 0; i < n; i++) {
+        if (cps[i].err) {
+            error_propagate(errp, cps[i].err);
         }
     }
+    g_free(cps);
 }
 
 void replication_get_error_all(Error **errp)
@@ -1,7 +1,28 @@
 #include "qemu/osdep.h"
 #include "qemu/notify.h"
+#include "qapi/error.h"
 #include "net/colo-compare.h"
 
 void colo_compare_cleanup(void)
 {
 }
+
+void colo_compare_drop_secondary(unsigned int index)
+{
+}
+
+bool colo_compare_attach(Object *obj, ColoCompareOutputFunc *output,
+                         void *opaque, Error **errp)
+{
+    error_setg(errp, "COLO support is not compiled in");
+    return false;
+}
+
+void colo_compare_detach(Object *obj, void *opaque)
+{
+}
+
+void colo_compare_receive(Object *obj, const struct iovec *iov, int iovcnt,
+                          uint32_t vnet_hdr_len)
+{
+}
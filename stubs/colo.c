@@ -10,6 +10,10 @@ void colo_checkpoint_notify(void)
 {
 }
 
+void colo_divergence_notify(void)
+{
+}
+
 void colo_shutdown(void)
 {
 }
@@ -30,6 +34,11 @@ void migrate_start_colo_process(MigrationState *s)
     abort();
 }
 
+bool colo_connect_secondaries(MigrationState *s, Error **errp)
+{
+    return true;
+}
+
 bool migration_in_colo_state(void)
 {
     return false;
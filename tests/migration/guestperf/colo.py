@@ -0,0 +1,274 @@
+#
+# Migration test COLO packet stream and results
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or (at your option) any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public
+# License along with this library; if not, see <http://www.gnu.org/licenses/>.
+#
+
+
+import os
+import socket
+import struct
+import threading
+import time
+
+
+def free_udp_port():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    sock.bind(("127.0.0.1", 0))
+    port = sock.getsockname()[1]
+    sock.close()
+    return port
+
+
+class PacketStream(object):
+    """
+    Pings the guest through a '-netdev socket,udp=...' backend, so the
+    replies pass through colo-compare.  The guest kernel has to have the
+    NIC driver and IP autoconfiguration built in, it is configured with
+    the 'ip=' kernel parameter from guest_cmdline().
+    """
+
+    GUEST_MAC = "52:54:00:12:34:56"
+    HOST_MAC = "52:54:00:12:34:02"
+    GUEST_IP = "10.0.2.15"
+    HOST_IP = "10.0.2.2"
+
+    def __init__(self, rate):
+        self._rate = rate # pings per second
+        self._ident = os.getpid() & 0xffff
+
+        self._sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self._sock.bind(("127.0.0.1", 0))
+        self._sock.settimeout(0.1)
+
+        self._lock = threading.Lock()
+        self._target = None
+        self._seq = 0
+        self._sent = {}
+        self._replies = []
+        self._quit = False
+        self._threads = []
+
+    def port(self):
+        return self._sock.getsockname()[1]
+
+    @classmethod
+    def guest_cmdline(cls):
+        return "ip=%s::%s:255.255.255.0::eth0:off" % (cls.GUEST_IP,
+                                                       cls.HOST_IP)
+
+    def set_target(self, port):
+        with self._lock:
+            self._target = ("127.0.0.1", port)
+
+    def start(self):
+        if self._rate == 0:
+            return
+        for func in (self._sender, self._receiver):
+            thread = threading.Thread(target=func, daemon=True)
+            thread.start()
+            self._threads.append(thread)
+
+    def stop(self):
+        self._quit = True
+        for thread in self._threads:
+            thread.join()
+        self._threads = []
+        self._sock.close()
+
+    @staticmethod
+    def _checksum(data):
+        if len(data) % 2:
+            data += b"\0"
+        total = sum(struct.unpack("!%dH" % (len(data) // 2), data))
+        while total >> 16:
+            total = (total & 0xffff) + (total >> 16)
+        return ~total & 0xffff
+
+    @staticmethod
+    def _mac(addr):
+        return bytes(int(byte, 16) for byte in addr.split(":"))
+
+    def _ether(self, ethertype, payload):
+        return (self._mac(self.GUEST_MAC) + self._mac(self.HOST_MAC) +
+                struct.pack("!H", ethertype) + payload)
+
+    def _echo_request(self, seq):
+        icmp = struct.pack("!BBHHH", 8, 0, 0, self._ident, seq) + bytes(56)
+        icmp = icmp[:2] + struct.pack("!H", self._checksum(icmp)) + icmp[4:]
+
+        ip = struct.pack("!BBHHHBBH4s4s", 0x45, 0, 20 + len(icmp), seq, 0,
+                         64, socket.IPPROTO_ICMP, 0,
+                         socket.inet_aton(self.HOST_IP),
+                         socket.inet_aton(self.GUEST_IP))
+        ip = ip[:10] + struct.pack("!H", self._checksum(ip)) + ip[12:]
+
+        return self._ether(0x0800, ip + icmp)
+
+    def _arp_reply(self, frame):
+        arp = frame[14:42]
+        if len(arp) < 28:
+            return None
+        oper, sha, spa, tpa = (struct.unpack("!H", arp[6:8])[0],
+                               arp[8:14], arp[14:18], arp[24:28])
+        if oper != 1 or tpa != socket.inet_aton(self.HOST_IP):
+            return None
+        return self._ether(0x0806, struct.pack("!HHBBH", 1, 0x0800, 6, 4, 2) +
+                           self._mac(self.HOST_MAC) + tpa + sha + spa)
+
+    def _sender(self):
+        interval = 1.0 / self._rate
+        next_time = time.time()
+        while not self._quit:
+            with self._lock:
+                target = self._target
+                self._seq = (self._seq + 1) & 0xffff
+                seq = self._seq
+                self._sent[seq] = time.time()
+            if target is not None:
+                try:
+                    self._sock.sendto(self._echo_request(seq), target)
+                except OSError:
+                    pass
+
+            next_time += interval
+            delay = next_time - time.time()
+            if delay > 0:
+                time.sleep(delay)
+
+    def _receiver(self):
+        while not self._quit:
+            try:
+                frame, addr = self._sock.recvfrom(65536)
+            except (socket.timeout, OSError):
+                continue
+            now = time.time()
+            if len(frame) < 14:
+                continue
+
+            ethertype = struct.unpack("!H", frame[12:14])[0]
+            if ethertype == 0x0806:
+                reply = self._arp_reply(frame)
+                if reply is not None:
+                    self._sock.sendto(reply, addr)
+                continue
+
+            if ethertype != 0x0800 or len(frame) < 42:
+                continue
+            ihl = (frame[14] & 0xf) * 4
+            if frame[23] != socket.IPPROTO_ICMP:
+                continue
+            icmp = frame[14 + ihl:14 + ihl + 8]
+            if len(icmp) < 8:
+                continue
+            kind, _, _, ident, seq = struct.unpack("!BBHHH", icmp)
+            if kind != 0 or ident != self._ident:
+                continue
+            with self._lock:
+                sent = self._sent.pop(seq, None)
+                if sent is not None:
+                    self._replies.append((sent, now))
+
+    def first_reply_after(self, start):
+        with self._lock:
+            for sent, received in self._replies:
+                if sent >= start:
+                    return received
+        return None
+
+    def stats(self, end=None):
+        with self._lock:
+            replies = [r for r in self._replies if end is None or r[0] < end]
+            sent = len(replies) + len([t for t in self._sent.values()
+                                       if end is None or t < end])
+        latencies = sorted((received - sent) * 1000.0
+                           for sent, received in replies)
+
+        def percentile(pcent):
+            if not latencies:
+                return 0
+            return latencies[min(len(latencies) - 1,
+                                 int(len(latencies) * pcent / 100))]
+
+        return {
+            "sent": sent,
+            "received": len(latencies),
+            "latency_p50_ms": percentile(50),
+            "latency_p99_ms": percentile(99),
+            "latency_max_ms": latencies[-1] if latencies else 0,
+        }
+
+
+class ColoResult(object):
+
+    def __init__(self,
+                 primary_stats,
+                 secondary_stats,
+                 failover,
+                 failover_exit,
+                 failover_service,
+                 packets):
+
+        self._primary_stats = primary_stats # query-colo-stats
+        self._secondary_stats = secondary_stats # query-colo-stats
+        self._failover = failover # side that survived
+        self._failover_exit = failover_exit # seconds until COLO_EXIT
+        self._failover_service = failover_service # seconds until a reply
+        self._packets = packets # PacketStream.stats() before failover
+
+    def summary(self):
+        lines = []
+        for name, stats in (("primary", self._primary_stats),
+                            ("secondary", self._secondary_stats)):
+            if not stats:
+                continue
+            lines.append("%s: %d checkpoints" % (name, stats["checkpoints"]))
+            for phase in stats["phases"]:
+                latency = phase["latency"]
+                if not latency["count"]:
+                    continue
+                lines.append("  %-12s p50 %8dus p99 %8dus max %8dus" % (
+                    phase["phase"], latency["p50"], latency["p99"],
+                    latency["max"]))
+        lines.append("packets: %(sent)d sent %(received)d received, "
+                     "p50 %(latency_p50_ms).1fms p99 %(latency_p99_ms).1fms "
+                     "max %(latency_max_ms).1fms" % self._packets)
+        if self._failover:
+            lines.append("failover to %s: COLO exit after %s, service after %s" % (
+                self._failover,
+                "%.1fms" % (self._failover_exit * 1000)
+                if self._failover_exit is not None else "-",
+                "%.1fms" % (self._failover_service * 1000)
+                if self._failover_service is not None else "-"))
+        return "\n".join(lines)
+
+    def serialize(self):
+        return {
+            "primary_stats": self._primary_stats,
+            "secondary_stats": self._secondary_stats,
+            "failover": self._failover,
+            "failover_exit": self._failover_exit,
+            "failover_service": self._failover_service,
+            "packets": self._packets,
+        }
+
+    @classmethod
+    def deserialize(cls, data):
+        return cls(
+            data["primary_stats"],
+            data["secondary_stats"],
+            data["failover"],
+            data["failover_exit"],
+            data["failover_service"],
+            data["packets"])
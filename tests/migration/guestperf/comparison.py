@@ -135,4 +135,19 @@ def __init__(self, name, scenarios):
         Scenario("compr-multifd-channels-64",
                  multifd=True, multifd_channels=64),
     ]),
+
+
+    # Looking at COLO checkpoint pauses and failover time
+    # with varying guest dirty rates
+    Comparison("colo-dirty-rate", scenarios = [
+        Scenario("colo-dirty-rate-10",
+                 colo=True, colo_time=30, dirty_rate=10),
+        Scenario("colo-dirty-rate-100",
+                 colo=True, colo_time=30, dirty_rate=100),
+        Scenario("colo-dirty-rate-1000",
+                 colo=True, colo_time=30, dirty_rate=1000),
+        Scenario("colo-dirty-rate-primary-failover",
+                 colo=True, colo_time=30, dirty_rate=100,
+                 colo_failover="primary"),
+    ]),
 ]
@@ -23,6 +23,7 @@
 import sys
 import time
 
+from guestperf.colo import ColoResult, PacketStream, free_udp_port
 from guestperf.progress import Progress, ProgressStats
 from guestperf.report import Report
 from guestperf.timings import TimingRecord, Timings
@@ -104,7 +105,8 @@ def _migrate_progress(self, vm):
             info.get("cpu-throttle-percentage", 0),
         )
 
-    def _migrate(self, hardware, scenario, src, dst, connect_uri):
+    def _migrate(self, hardware, scenario, src, dst, connect_uri,
+                 stream=None, net_ports=None):
         src_qemu_time = []
         src_vcpu_time = []
         src_pid = src.get_pid()
@@ -203,6 +205,11 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
             resp = dst.command("migrate-set-parameters",
                                multifd_channels=scenario._multifd_channels)
 
+        if scenario._colo:
+            return self._colo(scenario, src, dst, connect_uri,
+                              stream, net_ports, src_pid, src_threads,
+                              src_qemu_time, src_vcpu_time)
+
         resp = src.command("migrate", uri=connect_uri)
 
         post_copy = False
@@ -281,6 +288,132 @@ def _migrate(self, hardware, scenario, src, dst, connect_uri):
                 resp = src.command("stop")
                 paused = True
 
+    def _colo_failover(self, scenario, src, dst, stream, net_ports):
+        if scenario._colo_failover == "primary":
+            # The secondary died, resume on the primary
+            dst.kill()
+            start = time.time()
+            for obj in ("comp0", "iothread1", "m0", "redire0", "redire1"):
+                src.command("object-del", id=obj)
+            src.command("x-colo-lost-heartbeat")
+            survivor = src
+        else:
+            # The primary died, resume on the secondary
+            src.kill()
+            start = time.time()
+            stream.set_target(net_ports[1])
+            dst.command("x-colo-lost-heartbeat")
+            for obj in ("f2", "f1"):
+                dst.command("object-del", id=obj)
+            survivor = dst
+
+        failover_exit = None
+        if survivor.event_wait("COLO_EXIT", timeout=scenario._max_time):
+            failover_exit = time.time() - start
+
+        failover_service = None
+        if scenario._colo_packet_rate:
+            end = start + self._sleep
+            while time.time() < end:
+                received = stream.first_reply_after(start)
+                if received is not None:
+                    failover_service = received - start
+                    break
+                time.sleep(0.01)
+
+        return failover_exit, failover_service
+
+    def _colo(self, scenario, src, dst, connect_uri, stream, net_ports,
+              src_pid, src_threads, src_qemu_time, src_vcpu_time):
+        for vm in (src, dst):
+            vm.command("migrate-set-capabilities",
+                       capabilities = [
+                           { "capability": "x-colo",
+                             "state": True }
+                       ])
+        src.command("migrate-set-parameters",
+                    x_checkpoint_delay=scenario._colo_checkpoint_delay)
+        if scenario._colo_max_pause:
+            src.command("migrate-set-parameters",
+                        x_colo_max_pause=scenario._colo_max_pause)
+
+        stream.set_target(net_ports[0])
+        stream.start()
+
+        resp = src.command("migrate", uri=connect_uri)
+
+        progress_history = []
+
+        start = time.time()
+        colo_start = None
+        loop = 0
+        while True:
+            loop = loop + 1
+            time.sleep(0.05)
+
+            progress = self._migrate_progress(src)
+            if (loop % 20) == 0:
+                src_qemu_time.append(self._cpu_timing(src_pid))
+                src_vcpu_time.extend(self._vcpu_timing(src_pid, src_threads))
+
+            if (len(progress_history) == 0 or
+                (progress_history[-1]._ram._iterations <
+                 progress._ram._iterations)):
+                progress_history.append(progress)
+
+            if progress._status in ("completed", "failed", "cancelled"):
+                raise Exception("COLO did not start, migration %s" %
+                                progress._status)
+
+            if progress._status != "colo":
+                if time.time() > (start + scenario._max_time):
+                    raise Exception("COLO did not start after %d seconds" %
+                                    scenario._max_time)
+                continue
+
+            if colo_start is None:
+                if self._verbose:
+                    print("COLO started, running for %d seconds" %
+                          scenario._colo_time)
+                colo_start = time.time()
+
+            if self._verbose and (loop % 20) == 0:
+                stats = src.command("query-colo-stats")
+                print("COLO: %5d checkpoints (total %5dMB @ %5dMb/sec)" % (
+                    stats["checkpoints"],
+                    progress._ram._transferred_bytes / (1024 * 1024),
+                    progress._ram._transfer_rate_mbs,
+                ))
+
+            if time.time() > (colo_start + scenario._colo_time):
+                break
+
+        if progress_history[-1] != progress:
+            progress_history.append(progress)
+
+        packets = stream.stats()
+        primary_stats = src.command("query-colo-stats")
+        secondary_stats = dst.command("query-colo-stats")
+
+        failover = None
+        failover_exit = None
+        failover_service = None
+        if scenario._colo_failover in ("primary", "secondary"):
+            failover = scenario._colo_failover
+            if self._verbose:
+                print("Failing over to the %s" % failover)
+            failover_exit, failover_service = self._colo_failover(
+                scenario, src, dst, stream, net_ports)
+
+        stream.stop()
+
+        colo = ColoResult(primary_stats, secondary_stats, failover,
+                          failover_exit, failover_service, packets)
+        if self._verbose:
+            print(colo.summary())
+
+        return [progress_history, src_qemu_time, src_vcpu_time, colo]
+
     def _is_ppc64le(self):
         _, _, _, _, machine = os.uname()
         if machine == "ppc64le":
@@ -301,7 +434,7 @@ def _get_qemu_serial_args(self):
             return ["-chardev", "stdio,id=cdev0",
                     "-device", "isa-serial,chardev=cdev0"]
 
-    def _get_common_args(self, hardware, tunnelled=False):
+    def _get_common_args(self, hardware, scenario, tunnelled=False):
         args = [
             "noapic",
             "edd=off",
@@ -320,6 +453,12 @@ def _get_common_args(self, hardware, tunnelled=False):
 
         args.append("ramsize=%s" % hardware._mem)
 
+        if scenario._dirty_rate:
+            args.append("dirtyrate=%d" % scenario._dirty_rate)
+
+        if scenario._colo and scenario._colo_packet_rate:
+            args.append(PacketStream.guest_cmdline())
+
         cmdline = " ".join(args)
         if tunnelled:
             cmdline = "'" + cmdline + "'"
@@ -349,14 +488,58 @@ def _get_common_args(self, hardware, tunnelled=False):
 
         return argv
 
-    def _get_src_args(self, hardware):
-        return self._get_common_args(hardware)
+    @staticmethod
+    def _colo_socket(name):
+        return "/var/tmp/qemu-colo-%d-%s.sock" % (os.getpid(), name)
+
+    def _get_colo_net_args(self, stream_port, net_port):
+        return [
+            "-netdev", "socket,id=hn0,udp=127.0.0.1:%d,localaddr=127.0.0.1:%d" %
+            (stream_port, net_port),
+            "-device", "e1000,netdev=hn0,mac=%s" % PacketStream.GUEST_MAC,
+        ]
+
+    def _get_colo_src_args(self, stream_port, net_port):
+        sock = self._colo_socket
+        return self._get_colo_net_args(stream_port, net_port) + [
+            "-chardev", "socket,id=mirror0,path=%s,server=on,wait=off" %
+            sock("mirror0"),
+            "-chardev", "socket,id=compare1,path=%s,server=on,wait=off" %
+            sock("compare1"),
+            "-chardev", "socket,id=compare0,path=%s,server=on,wait=off" %
+            sock("compare0"),
+            "-chardev", "socket,id=compare0-0,path=%s" % sock("compare0"),
+            "-chardev", "socket,id=compare_out,path=%s,server=on,wait=off" %
+            sock("compare_out"),
+            "-chardev", "socket,id=compare_out0,path=%s" % sock("compare_out"),
+            "-object", "filter-mirror,id=m0,netdev=hn0,queue=tx,outdev=mirror0",
+            "-object", "filter-redirector,netdev=hn0,id=redire0,queue=rx,"
+            "indev=compare_out",
+            "-object", "filter-redirector,netdev=hn0,id=redire1,queue=rx,"
+            "outdev=compare0",
+            "-object", "iothread,id=iothread1",
+            "-object", "colo-compare,id=comp0,primary_in=compare0-0,"
+            "secondary_in=compare1,outdev=compare_out0,iothread=iothread1",
+        ]
 
-    def _get_dst_args(self, hardware, uri):
+    def _get_colo_dst_args(self, stream_port, net_port):
+        sock = self._colo_socket
+        return self._get_colo_net_args(stream_port, net_port) + [
+            "-chardev", "socket,id=red0,path=%s,reconnect=1" % sock("mirror0"),
+            "-chardev", "socket,id=red1,path=%s,reconnect=1" % sock("compare1"),
+            "-object", "filter-redirector,id=f1,netdev=hn0,queue=tx,indev=red0",
+            "-object", "filter-redirector,id=f2,netdev=hn0,queue=rx,outdev=red1",
+            "-object", "filter-rewriter,id=rew0,netdev=hn0,queue=all",
+        ]
+
+    def _get_src_args(self, hardware, scenario):
+        return self._get_common_args(hardware, scenario)
+
+    def _get_dst_args(self, hardware, scenario, uri):
         tunnelled = False
         if self._dst_host != "localhost":
             tunnelled = True
-        argv = self._get_common_args(hardware, tunnelled)
+        argv = self._get_common_args(hardware, scenario, tunnelled)
         return argv + ["-incoming", uri]
 
     @staticmethod
@@ -424,14 +607,26 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
             dstmonaddr = "/var/tmp/qemu-dst-%d-monitor.sock" % os.getpid()
         srcmonaddr = "/var/tmp/qemu-src-%d-monitor.sock" % os.getpid()
 
+        src_args = self._get_src_args(hardware, scenario)
+        dst_args = self._get_dst_args(hardware, scenario, uri)
+        stream = None
+        net_ports = None
+        if scenario._colo:
+            if self._dst_host != "localhost":
+                raise Exception("COLO is only supported with a localhost target")
+            stream = PacketStream(scenario._colo_packet_rate)
+            net_ports = (free_udp_port(), free_udp_port())
+            src_args += self._get_colo_src_args(stream.port(), net_ports[0])
+            dst_args += self._get_colo_dst_args(stream.port(), net_ports[1])
+
         src = QEMUMachine(self._binary,
-                          args=self._get_src_args(hardware),
+                          args=src_args,
                           wrapper=self._get_src_wrapper(hardware),
                           name="qemu-src-%d" % os.getpid(),
                           monitor_address=srcmonaddr)
 
         dst = QEMUMachine(self._binary,
-                          args=self._get_dst_args(hardware, uri),
+                          args=dst_args,
                           wrapper=self._get_dst_wrapper(hardware),
                           name="qemu-dst-%d" % os.getpid(),
                           monitor_address=dstmonaddr)
@@ -440,10 +635,12 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
             src.launch()
             dst.launch()
 
-            ret = self._migrate(hardware, scenario, src, dst, uri)
+            ret = self._migrate(hardware, scenario, src, dst, uri,
+                                stream, net_ports)
             progress_history = ret[0]
             qemu_timings = ret[1]
             vcpu_timings = ret[2]
+            colo = ret[3] if scenario._colo else None
             if uri[0:5] == "unix:" and os.path.exists(uri[5:]):
                 os.remove(uri[5:])
 
@@ -453,6 +650,11 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
             if self._dst_host == "localhost" and os.path.exists(dstmonaddr):
                 os.remove(dstmonaddr)
 
+            if scenario._colo:
+                for name in ("mirror0", "compare1", "compare0", "compare_out"):
+                    if os.path.exists(self._colo_socket(name)):
+                        os.remove(self._colo_socket(name))
+
             if self._verbose:
                 print("Finished migration")
 
@@ -464,10 +666,13 @@ def run(self, hardware, scenario, result_dir=os.getcwd()):
                           Timings(qemu_timings),
                           Timings(vcpu_timings),
                           self._binary, self._dst_host, self._kernel,
-                          self._initrd, self._transport, self._sleep)
+                          self._initrd, self._transport, self._sleep,
+                          colo)
         except Exception as e:
             if self._debug:
                 print("Failed: %s" % str(e))
+            if stream is not None:
+                stream.stop()
             try:
                 src.shutdown()
             except:
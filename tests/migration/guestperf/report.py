@@ -23,6 +23,7 @@
 from guestperf.scenario import Scenario
 from guestperf.progress import Progress
 from guestperf.timings import Timings
+from guestperf.colo import ColoResult
 
 class Report(object):
 
@@ -38,7 +39,8 @@ def __init__(self,
                  kernel,
                  initrd,
                  transport,
-                 sleep):
+                 sleep,
+                 colo=None):
 
         self._hardware = hardware
         self._scenario = scenario
@@ -52,6 +54,7 @@ def __init__(self,
         self._initrd = initrd
         self._transport = transport
         self._sleep = sleep
+        self._colo = colo
 
     def serialize(self):
         return {
@@ -67,6 +70,7 @@ def serialize(self):
             "initrd": self._initrd,
             "transport": self._transport,
             "sleep": self._sleep,
+            "colo": self._colo.serialize() if self._colo else None,
         }
 
     @classmethod
@@ -83,7 +87,8 @@ def deserialize(cls, data):
             data["kernel"],
             data["initrd"],
             data["transport"],
-            data["sleep"])
+            data["sleep"],
+            ColoResult.deserialize(data["colo"]) if data.get("colo") else None)
 
     def to_json(self):
         return json.dumps(self.serialize(), indent=4)
@@ -30,7 +30,11 @@ def __init__(self, name,
                  auto_converge=False, auto_converge_step=10,
                  compression_mt=False, compression_mt_threads=1,
                  compression_xbzrle=False, compression_xbzrle_cache=10,
-                 multifd=False, multifd_channels=2):
+                 multifd=False, multifd_channels=2,
+                 dirty_rate=0,
+                 colo=False, colo_checkpoint_delay=200, colo_max_pause=0,
+                 colo_time=60, colo_failover="secondary",
+                 colo_packet_rate=100):
 
         self._name = name
 
@@ -60,6 +64,17 @@ def __init__(self, name,
         self._multifd = multifd
         self._multifd_channels = multifd_channels
 
+        # Guest workload
+        self._dirty_rate = dirty_rate # MiB per second, 0 is unlimited
+
+        # COLO instead of a one-off migration
+        self._colo = colo
+        self._colo_checkpoint_delay = colo_checkpoint_delay # milliseconds
+        self._colo_max_pause = colo_max_pause # milliseconds, 0 is disabled
+        self._colo_time = colo_time # seconds before failing over
+        self._colo_failover = colo_failover # 'primary' or 'secondary' survives
+        self._colo_packet_rate = colo_packet_rate # pings per second
+
     def serialize(self):
         return {
             "name": self._name,
@@ -79,6 +94,13 @@ def serialize(self):
             "compression_xbzrle_cache": self._compression_xbzrle_cache,
             "multifd": self._multifd,
             "multifd_channels": self._multifd_channels,
+            "dirty_rate": self._dirty_rate,
+            "colo": self._colo,
+            "colo_checkpoint_delay": self._colo_checkpoint_delay,
+            "colo_max_pause": self._colo_max_pause,
+            "colo_time": self._colo_time,
+            "colo_failover": self._colo_failover,
+            "colo_packet_rate": self._colo_packet_rate,
         }
 
     @classmethod
@@ -100,4 +122,11 @@ def deserialize(cls, data):
             data["compression_xbzrle"],
             data["compression_xbzrle_cache"],
             data["multifd"],
-            data["multifd_channels"])
+            data["multifd_channels"],
+            data.get("dirty_rate", 0),
+            data.get("colo", False),
+            data.get("colo_checkpoint_delay", 200),
+            data.get("colo_max_pause", 0),
+            data.get("colo_time", 60),
+            data.get("colo_failover", "secondary"),
+            data.get("colo_packet_rate", 100))
@@ -127,6 +127,16 @@ def __init__(self):
         parser.add_argument("--multifd-channels", dest="multifd_channels",
                             default=2, type=int)
 
+        parser.add_argument("--dirty-rate", dest="dirty_rate", default=0, type=int)
+
+        parser.add_argument("--colo", dest="colo", default=False, action="store_true")
+        parser.add_argument("--colo-checkpoint-delay", dest="colo_checkpoint_delay", default=200, type=int)
+        parser.add_argument("--colo-max-pause", dest="colo_max_pause", default=0, type=int)
+        parser.add_argument("--colo-time", dest="colo_time", default=60, type=int)
+        parser.add_argument("--colo-failover", dest="colo_failover", default="secondary",
+                            choices=["primary", "secondary", "none"])
+        parser.add_argument("--colo-packet-rate", dest="colo_packet_rate", default=100, type=int)
+
     def get_scenario(self, args):
         return Scenario(name="perfreport",
                         downtime=args.downtime,
@@ -150,7 +160,16 @@ def get_scenario(self, args):
                         compression_xbzrle_cache=args.compression_xbzrle_cache,
 
                         multifd=args.multifd,
-                        multifd_channels=args.multifd_channels)
+                        multifd_channels=args.multifd_channels,
+
+                        dirty_rate=args.dirty_rate,
+
+                        colo=args.colo,
+                        colo_checkpoint_delay=args.colo_checkpoint_delay,
+                        colo_max_pause=args.colo_max_pause,
+                        colo_time=args.colo_time,
+                        colo_failover=args.colo_failover,
+                        colo_packet_rate=args.colo_packet_rate)
 
     def run(self, argv):
         args = self._parser.parse_args(argv)
@@ -27,6 +27,9 @@
 
 const char *argv0;
 
+/* Limit of the MB dirtied per second by each thread, 0 is unlimited */
+static unsigned long long dirtyrateMB;
+
 #define RAM_PAGE_SIZE 4096
 
 #ifndef CONFIG_GETTID
@@ -165,7 +168,8 @@ static void stressone(unsigned long long ramsizeMB)
     g_autofree char *data = g_malloc(RAM_PAGE_SIZE);
     char *dataptr;
     size_t nMB = 0;
-    unsigned long long before, after;
+    unsigned long long before, after, start;
+    unsigned long long dirtiedMB = 0;
 
     /* We don't care about initial state, but we do want
      * to fault it all into RAM, otherwise the first iter
@@ -178,7 +182,7 @@ static void stressone(unsigned long long ramsizeMB)
         return;
     }
 
-    before = now();
+    before = start = now();
 
     while (1) {
 
@@ -193,6 +197,16 @@ static void stressone(unsigned long long ramsizeMB)
                 }
             }
 
+            if (dirtyrateMB) {
+                /* Sleep off the time the MBs so far should have taken */
+                unsigned long long due = start + ++dirtiedMB * 1000 / dirtyrateMB;
+                unsigned long long cur = now();
+
+                if (due > cur) {
+                    g_usleep((due - cur) * 1000);
+                }
+            }
+
             if (nMB == 1024) {
                 after = now();
                 fprintf(stderr, "%s (%05d): INFO: %06llums copied 1 GB in %05llums\n",
@@ -218,6 +232,10 @@ static void stress(unsigned long long ramsizeGB, int ncpus)
 {
     size_t i;
     unsigned long long ramsizeMB = ramsizeGB * 1024 / ncpus;
+
+    if (dirtyrateMB) {
+        dirtyrateMB = MAX(dirtyrateMB / ncpus, 1);
+    }
     ncpus--;
 
     for (i = 0; i < ncpus; i++) {
@@ -266,11 +284,12 @@ int main(int argc, char **argv)
     char *end;
     int ch;
     int opt_ind = 0;
-    const char *sopt = "hr:c:";
+    const char *sopt = "hr:c:d:";
     struct option lopt[] = {
         { "help", no_argument, NULL, 'h' },
         { "ramsize", required_argument, NULL, 'r' },
         { "cpus", required_argument, NULL, 'c' },
+        { "dirtyrate", required_argument, NULL, 'd' },
         { NULL, 0, NULL, 0 }
     };
     int ret;
@@ -300,9 +319,20 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'd':
+            errno = 0;
+            dirtyrateMB = strtoll(optarg, &end, 10);
+            if (errno != 0 || *end) {
+                fprintf(stderr, "%s (%05d): ERROR: Cannot parse dirty rate %s\n",
+                        argv0, gettid(), optarg);
+                exit_failure();
+            }
+            break;
+
         case '?':
         case 'h':
-            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]\n", argv0);
+            fprintf(stderr, "%s: [--help][--ramsize GB][--cpus N]"
+                    "[--dirtyrate MB/s]\n", argv0);
             exit_failure();
         }
     }
@@ -314,6 +344,10 @@ int main(int argc, char **argv)
         ret = get_command_arg_ull("ramsize", &ramsizeGB);
         if (ret < 0)
             exit_failure();
+
+        ret = get_command_arg_ull("dirtyrate", &dirtyrateMB);
+        if (ret < 0)
+            exit_failure();
     }
 
     if (ncpus == 0)
@@ -531,6 +531,8 @@ typedef struct {
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
     bool use_dirty_ring;
+    /* Guest memory size, if not the default of the architecture */
+    const char *memory_size;
     const char *opts_source;
     const char *opts_target;
 } MigrateStart;
@@ -678,6 +680,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         g_assert_not_reached();
     }
 
+    if (args->memory_size) {
+        memory_size = args->memory_size;
+    }
+
     if (!getenv("QTEST_LOG") && args->hide_stderr) {
 #ifndef _WIN32
         ignore_stderr = "2>/dev/null";
@@ -1240,6 +1246,42 @@ static void test_postcopy_compress(void)
     test_postcopy_common(&args);
 }
 
+static void *
+test_migrate_postcopy_prefetch_start(QTestState *from,
+                                     QTestState *to)
+{
+    migrate_set_parameter_int(to, "x-postcopy-prefetch-pages", 16);
+    migrate_set_parameter_bool(to, "x-postcopy-prefetch-stride", true);
+
+    return NULL;
+}
+
+static void
+test_migrate_postcopy_prefetch_finish(QTestState *from,
+                                      QTestState *to,
+                                      void *opaque)
+{
+    QDict *rsp_return = migrate_query_not_failed(to);
+    QDict *latency;
+
+    g_assert(qdict_haskey(rsp_return, "postcopy-fault-latency"));
+    latency = qdict_get_qdict(rsp_return, "postcopy-fault-latency");
+    /* The guest scans its memory, so it faults and prefetch kicks in */
+    g_assert_cmpint(qdict_get_int(latency, "count"), >, 0);
+    g_assert_cmpint(qdict_get_int(latency, "prefetched"), >, 0);
+    qobject_unref(rsp_return);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateCommon args = {
+        .start_hook = test_migrate_postcopy_prefetch_start,
+        .finish_hook = test_migrate_postcopy_prefetch_finish,
+    };
+
+    test_postcopy_common(&args);
+}
+
 static void test_postcopy_preempt(void)
 {
     MigrateCommon args = {
@@ -1494,6 +1536,26 @@ static void test_precopy_unix_dirty_ring(void)
     test_precopy_common(&args);
 }
 
+/*
+ * The dirty ring syncs the slot bitmaps in chunks of 16M.  With 100M the
+ * RAM slot above 1M ends in the middle of a chunk, and the guest dirties
+ * memory up to its end, so the last partial chunk has to be synced too.
+ */
+static void test_precopy_unix_dirty_ring_partial_chunk(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .start = {
+            .use_dirty_ring = true,
+            .memory_size = "100M",
+        },
+        .listen_uri = uri,
+        .connect_uri = uri,
+    };
+
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_GNUTLS
 static void test_precopy_unix_tls_psk(void)
 {
@@ -1605,6 +1667,47 @@ static void test_precopy_unix_xbzrle(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_dirty_sync_threads_start(QTestState *from,
+                                      QTestState *to)
+{
+    migrate_set_parameter_int(from, "x-dirty-sync-threads", 4);
+
+    return NULL;
+}
+
+static void
+test_migrate_dirty_sync_threads_finish(QTestState *from,
+                                       QTestState *to,
+                                       void *opaque)
+{
+    QDict *rsp_return = migrate_query_not_failed(from);
+    QDict *rsp_ram = qdict_get_qdict(rsp_return, "ram");
+
+    g_assert(qdict_haskey(rsp_ram, "dirty-sync-time"));
+    g_assert(qdict_haskey(rsp_ram, "dirty-sync-time-max"));
+    g_assert_cmpint(qdict_get_int(rsp_ram, "dirty-sync-time"), >, 0);
+    g_assert_cmpint(qdict_get_int(rsp_ram, "dirty-sync-time-max"), >=,
+                    qdict_get_int(rsp_ram, "dirty-sync-time"));
+    qobject_unref(rsp_return);
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = uri,
+
+        .start_hook = test_migrate_dirty_sync_threads_start,
+        .finish_hook = test_migrate_dirty_sync_threads_finish,
+
+        .iterations = 2,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_compress(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -1838,6 +1941,62 @@ static void test_migrate_fd_proto(void)
 }
 #endif /* _WIN32 */
 
+/*
+ * A file migration has to complete on the source before the destination
+ * can start reading the file, so it doesn't fit test_precopy_common().
+ */
+static void test_file_common(bool multifd)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp;
+
+    if (test_migrate_start(&from, &to, "defer", &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "x-mapped-ram", true);
+    migrate_set_capability(to, "x-mapped-ram", true);
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", true);
+        migrate_set_capability(to, "multifd", true);
+    }
+
+    migrate_ensure_converge(from);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+
+    qtest_qmp_eventwait(to, "RESUME");
+    wait_for_serial("dest_serial");
+
+    test_migrate_end(from, to, true);
+}
+
+static void test_precopy_file_mapped_ram(void)
+{
+    test_file_common(false);
+}
+
+static void test_multifd_file_mapped_ram(void)
+{
+    test_file_common(true);
+}
+
 static void do_test_validate_uuid(MigrateStart *args, bool should_fail)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2044,6 +2203,15 @@ test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
 }
 #endif /* CONFIG_ZSTD */
 
+#ifdef CONFIG_LZO
+static void *
+test_migrate_precopy_tcp_multifd_lzo_start(QTestState *from,
+                                           QTestState *to)
+{
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "lzo");
+}
+#endif /* CONFIG_LZO */
+
 static void test_multifd_tcp_none(void)
 {
     MigrateCommon args = {
@@ -2053,6 +2221,33 @@ static void test_multifd_tcp_none(void)
     test_precopy_common(&args);
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_zero_page_start(QTestState *from,
+                                                 QTestState *to)
+{
+    migrate_set_parameter_bool(from, "x-multifd-zero-page", true);
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+}
+
+static void
+test_migrate_multifd_zero_page_finish(QTestState *from,
+                                      QTestState *to,
+                                      void *opaque)
+{
+    /* The guest RAM above the test area is never touched */
+    g_assert_cmpint(read_ram_property_int(from, "duplicate"), >, 0);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_zero_page_start,
+        .finish_hook = test_migrate_multifd_zero_page_finish,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_zlib(void)
 {
     MigrateCommon args = {
@@ -2073,6 +2268,17 @@ static void test_multifd_tcp_zstd(void)
 }
 #endif
 
+#ifdef CONFIG_LZO
+static void test_multifd_tcp_lzo(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_lzo_start,
+    };
+    test_precopy_common(&args);
+}
+#endif
+
 #ifdef CONFIG_GNUTLS
 static void *
 test_migrate_multifd_tcp_tls_psk_start_match(QTestState *from,
@@ -2645,6 +2851,8 @@ int main(int argc, char **argv)
         qtest_add_func("/migration/postcopy/recovery/plain",
                        test_postcopy_recovery);
         qtest_add_func("/migration/postcopy/preempt/plain", test_postcopy_preempt);
+        qtest_add_func("/migration/postcopy/prefetch",
+                       test_postcopy_prefetch);
         qtest_add_func("/migration/postcopy/preempt/recovery/plain",
                        test_postcopy_preempt_recovery);
         if (getenv("QEMU_TEST_FLAKY_TESTS")) {
@@ -2658,6 +2866,8 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/bad_dest", test_baddest);
     qtest_add_func("/migration/precopy/unix/plain", test_precopy_unix_plain);
     qtest_add_func("/migration/precopy/unix/xbzrle", test_precopy_unix_xbzrle);
+    qtest_add_func("/migration/precopy/unix/dirty-sync-threads",
+                   test_precopy_unix_dirty_sync_threads);
     /*
      * Compression fails from time to time.
      * Put test here but don't enable it until everything is fixed.
@@ -2722,6 +2932,10 @@ int main(int argc, char **argv)
 #ifndef _WIN32
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
 #endif
+    qtest_add_func("/migration/precopy/file/mapped-ram",
+                   test_precopy_file_mapped_ram);
+    qtest_add_func("/migration/multifd/file/mapped-ram",
+                   test_multifd_file_mapped_ram);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
     qtest_add_func("/migration/validate_uuid_src_not_set",
@@ -2736,6 +2950,8 @@ int main(int argc, char **argv)
     }
     qtest_add_func("/migration/multifd/tcp/plain/none",
                    test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/plain/zero-page",
+                   test_multifd_tcp_zero_page);
     /*
      * This test is flaky and sometimes fails in CI and otherwise:
      * don't run unless user opts in via environment variable.
@@ -2750,6 +2966,10 @@ int main(int argc, char **argv)
     qtest_add_func("/migration/multifd/tcp/plain/zstd",
                    test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZO
+    qtest_add_func("/migration/multifd/tcp/plain/lzo",
+                   test_multifd_tcp_lzo);
+#endif
 #ifdef CONFIG_GNUTLS
     qtest_add_func("/migration/multifd/tcp/tls/psk/match",
                    test_multifd_tcp_tls_psk_match);
@@ -2772,6 +2992,8 @@ int main(int argc, char **argv)
     if (g_str_equal(arch, "x86_64") && has_kvm && kvm_dirty_ring_supported()) {
         qtest_add_func("/migration/dirty_ring",
                        test_precopy_unix_dirty_ring);
+        qtest_add_func("/migration/dirty_ring_partial_chunk",
+                       test_precopy_unix_dirty_ring_partial_chunk);
         qtest_add_func("/migration/vcpu_dirty_limit",
                        test_vcpu_dirty_limit);
     }
@@ -0,0 +1,549 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The test side plays filter-mirror, filter-redirector and the
+ * secondaries:
+ *
+ * qemu side                     | test side
+ *                               |
+ * +-----------------------+     |  +--------+
+ * | primary_in            <--------+ pri    |
+ * +-----------------------+     |  +--------+
+ * +-----------------------+     |  +--------+
+ * | secondary_in          <--------+ sec[0] |
+ * +-----------------------+     |  +--------+
+ * +-----------------------+     |  +--------+
+ * | extra_secondary_in.n  <--------+ sec[n] |
+ * +-----------------------+     |  +--------+
+ * +-----------------------+     |  +--------+
+ * | outdev                +--------> out    |
+ * +-----------------------+     |  +--------+
+ *
+ * For the in-process transport, pri feeds a netdev instead, whose
+ * filter-redirector passes the packets to the compare, and a
+ * filter-mirror behind it shows what the compare released on out.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define MAX_SECONDARIES 3
+#define SHARD_CONNECTIONS 64
+#define PAYLOAD_LEN 32
+#define PACKET_MAX 2048
+/* Minimum ethernet frame length without FCS */
+#define ETH_MIN_LEN 60
+
+/* How long to wait for a packet that must be released */
+#define RELEASE_TIMEOUT_MS 5000
+/* How long a packet that must be held back is checked for */
+#define HOLD_TIMEOUT_MS 200
+
+typedef struct CompareTest {
+    QTestState *qts;
+    int pri[2];
+    int out[2];
+    int sec[MAX_SECONDARIES][2];
+    unsigned int nb_secondaries;
+} CompareTest;
+
+static void compare_socketpair(int sv[2])
+{
+    int ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+
+    g_assert_cmpint(ret, !=, -1);
+    /* Only QEMU gets sv[1], so closing sv[0] disconnects it */
+    qemu_set_cloexec(sv[0]);
+}
+
+static void compare_test_start(CompareTest *t, unsigned int nb_secondaries,
+                               const char *opts)
+{
+    g_autoptr(GString) cmd = g_string_new(NULL);
+    unsigned int i;
+
+    g_assert_cmpuint(nb_secondaries, <=, MAX_SECONDARIES);
+    t->nb_secondaries = nb_secondaries;
+
+    compare_socketpair(t->pri);
+    compare_socketpair(t->out);
+    g_string_append_printf(cmd, "-object iothread,id=iothread0 "
+                           "-chardev socket,id=pri,fd=%d "
+                           "-chardev socket,id=out,fd=%d ",
+                           t->pri[1], t->out[1]);
+    for (i = 0; i < nb_secondaries; i++) {
+        compare_socketpair(t->sec[i]);
+        g_string_append_printf(cmd, "-chardev socket,id=sec%u,fd=%d ",
+                               i, t->sec[i][1]);
+    }
+
+    g_string_append(cmd, "-object colo-compare,id=comp0,primary_in=pri,"
+                    "secondary_in=sec0,outdev=out,iothread=iothread0,"
+                    "compare_timeout=60000");
+    for (i = 1; i < nb_secondaries; i++) {
+        g_string_append_printf(cmd, ",extra_secondary_in.%u=sec%u", i - 1, i);
+    }
+    if (opts) {
+        g_string_append_printf(cmd, ",%s", opts);
+    }
+
+    t->qts = qtest_init(cmd->str);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(t->qts, "{ 'execute' : 'query-status'}");
+}
+
+/*
+ * Start a compare without primary_in and outdev, attached to a
+ * filter-redirector.  The netdev is connected to a hub that always takes
+ * the packets.
+ */
+static void compare_test_start_local(CompareTest *t)
+{
+    t->nb_secondaries = 1;
+
+    compare_socketpair(t->pri);
+    compare_socketpair(t->out);
+    compare_socketpair(t->sec[0]);
+
+    t->qts = qtest_initf(
+        "-object iothread,id=iothread0 "
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-netdev hubport,id=hp0,hubid=0,netdev=qtest-bn0 "
+        "-netdev hubport,id=hp1,hubid=0 "
+        "-chardev socket,id=sec0,fd=%d "
+        "-chardev socket,id=out,fd=%d "
+        "-object colo-compare,id=comp0,secondary_in=sec0,"
+        "iothread=iothread0,compare_timeout=60000 "
+        "-object filter-redirector,id=red0,netdev=qtest-bn0,queue=tx,"
+        "compare=comp0 "
+        "-object filter-mirror,id=m0,netdev=qtest-bn0,queue=tx,outdev=out"
+        , t->pri[1], t->sec[0][1], t->out[1]);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(t->qts, "{ 'execute' : 'query-status'}");
+}
+
+static void compare_close(int *fd)
+{
+    if (*fd >= 0) {
+        close(*fd);
+        *fd = -1;
+    }
+}
+
+static void compare_test_end(CompareTest *t)
+{
+    unsigned int i;
+
+    qtest_quit(t->qts);
+
+    compare_close(&t->pri[0]);
+    compare_close(&t->pri[1]);
+    compare_close(&t->out[0]);
+    compare_close(&t->out[1]);
+    for (i = 0; i < t->nb_secondaries; i++) {
+        compare_close(&t->sec[i][0]);
+        compare_close(&t->sec[i][1]);
+    }
+}
+
+/*
+ * Build an ethernet frame with a UDP datagram from 10.0.0.1:@sport to
+ * 10.0.0.2:7, whose payload is filled with @fill.
+ */
+static size_t build_udp(uint8_t *buf, uint16_t sport, uint8_t fill)
+{
+    static const uint8_t hdr[] = {
+        /* ethernet: destination, source, IPv4 */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4: version and length, tos, total length, id, fragment */
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x01, 0x40, 0x00,
+        /* ttl, UDP, checksum, source, destination */
+        0x40, 0x11, 0x00, 0x00,
+        10, 0, 0, 1,
+        10, 0, 0, 2,
+        /* UDP: source port, destination port, length, checksum */
+        0x00, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00, 0x00,
+    };
+    size_t size = sizeof(hdr) + PAYLOAD_LEN;
+
+    memcpy(buf, hdr, sizeof(hdr));
+    stw_be_p(buf + 16, size - 14);
+    stw_be_p(buf + 34, sport);
+    stw_be_p(buf + 38, size - 34);
+    memset(buf + sizeof(hdr), fill, PAYLOAD_LEN);
+
+    return size;
+}
+
+/*
+ * Build an ethernet frame with a TCP segment from 10.0.0.1:1000 to
+ * 10.0.0.2:80 that carries @len bytes of @payload at @seq.  Frames
+ * shorter than the ethernet minimum are padded with @pad.
+ */
+static size_t build_tcp(uint8_t *buf, uint32_t seq, const uint8_t *payload,
+                        size_t len, uint8_t pad)
+{
+    static const uint8_t hdr[] = {
+        /* ethernet: destination, source, IPv4 */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4: version and length, tos, total length, id, fragment */
+        0x45, 0x00, 0x00, 0x00, 0x00, 0x01, 0x40, 0x00,
+        /* ttl, TCP, checksum, source, destination */
+        0x40, 0x06, 0x00, 0x00,
+        10, 0, 0, 1,
+        10, 0, 0, 2,
+        /* TCP: source port, destination port, seq, ack */
+        0x03, 0xe8, 0x00, 0x50,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x01,
+        /* data offset, ACK and PSH, window, checksum, urgent pointer */
+        0x50, 0x18, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+    };
+    size_t size = sizeof(hdr) + len;
+
+    memcpy(buf, hdr, sizeof(hdr));
+    stw_be_p(buf + 16, size - 14);
+    stl_be_p(buf + 38, seq);
+    memcpy(buf + sizeof(hdr), payload, len);
+    if (size < ETH_MIN_LEN) {
+        memset(buf + size, pad, ETH_MIN_LEN - size);
+        size = ETH_MIN_LEN;
+    }
+
+    return size;
+}
+
+static void send_packet(int fd, const uint8_t *buf, size_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+/*
+ * Receive a packet from outdev into @buf.  Return its size, or 0 if none
+ * arrived within @timeout_ms.
+ */
+static size_t recv_packet(int fd, uint8_t *buf, int timeout_ms)
+{
+    GPollFD pfd = { .fd = fd, .events = G_IO_IN };
+    uint32_t len;
+    ssize_t ret;
+
+    if (g_poll(&pfd, 1, timeout_ms) <= 0) {
+        return 0;
+    }
+
+    ret = recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpuint(len, <=, PACKET_MAX);
+
+    ret = recv(fd, buf, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+
+    return len;
+}
+
+static void assert_released(CompareTest *t, const uint8_t *pkt, size_t size)
+{
+    uint8_t buf[PACKET_MAX];
+
+    g_assert_cmpuint(recv_packet(t->out[0], buf, RELEASE_TIMEOUT_MS), ==,
+                     size);
+    g_assert(!memcmp(buf, pkt, size));
+}
+
+static void assert_held(CompareTest *t)
+{
+    uint8_t buf[PACKET_MAX];
+
+    g_assert_cmpuint(recv_packet(t->out[0], buf, HOLD_TIMEOUT_MS), ==, 0);
+}
+
+/* A primary packet is released once the secondary sent the same */
+static void test_compare_release(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX];
+    size_t size = build_udp(pkt, 1000, 0xaa);
+
+    compare_test_start(&t, 1, NULL);
+
+    send_packet(t.pri[0], pkt, size);
+    assert_held(&t);
+    send_packet(t.sec[0][0], pkt, size);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+/*
+ * The redirector passes the primary packets in-process, and the released
+ * ones continue down its filter chain in order.
+ */
+static void test_compare_in_process(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX], pkt2[PACKET_MAX];
+    size_t size = build_udp(pkt, 1000, 0xaa);
+    size_t size2 = build_udp(pkt2, 1001, 0xbb);
+
+    compare_test_start_local(&t);
+
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.pri[0], pkt2, size2);
+    assert_held(&t);
+    send_packet(t.sec[0][0], pkt, size);
+    send_packet(t.sec[0][0], pkt2, size2);
+    assert_released(&t, pkt, size);
+    assert_released(&t, pkt2, size2);
+
+    compare_test_end(&t);
+}
+
+/* A compare with primary_in and outdev can't be attached to */
+static void test_compare_in_process_chardev(void)
+{
+    CompareTest t;
+    QDict *response;
+
+    compare_test_start(&t, 1, NULL);
+
+    qtest_qmp_assert_success(t.qts, "{ 'execute': 'netdev_add', "
+                             "'arguments': { 'type': 'hubport', "
+                             "'id': 'qtest-bn0', 'hubid': 0 } }");
+    response = qtest_qmp(t.qts, "{ 'execute': 'object-add', 'arguments': {"
+                         " 'qom-type': 'filter-redirector', 'id': 'red0',"
+                         " 'netdev': 'qtest-bn0', 'compare': 'comp0' } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    compare_test_end(&t);
+}
+
+/* By default, every secondary has to match the primary packet */
+static void test_compare_all_secondaries(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX];
+    size_t size = build_udp(pkt, 1000, 0xaa);
+
+    compare_test_start(&t, 2, NULL);
+
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.sec[0][0], pkt, size);
+    assert_held(&t);
+    send_packet(t.sec[1][0], pkt, size);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+/* With a quorum, any of the secondaries may release the packet */
+static void test_compare_quorum(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX];
+    size_t size;
+    unsigned int i;
+
+    compare_test_start(&t, 3, "quorum=2");
+
+    for (i = 0; i < t.nb_secondaries; i++) {
+        size = build_udp(pkt, 1000 + i, 0xaa);
+        send_packet(t.pri[0], pkt, size);
+        send_packet(t.sec[i][0], pkt, size);
+        assert_held(&t);
+        send_packet(t.sec[(i + 1) % t.nb_secondaries][0], pkt, size);
+        assert_released(&t, pkt, size);
+    }
+
+    compare_test_end(&t);
+}
+
+/*
+ * A secondary whose input disconnects is dropped, the packets waiting
+ * for it are released and the next ones don't wait for it.
+ */
+static void test_compare_drop_secondary(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX];
+    size_t size = build_udp(pkt, 1000, 0xaa);
+
+    compare_test_start(&t, 2, NULL);
+
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.sec[0][0], pkt, size);
+    assert_held(&t);
+    compare_close(&t.sec[1][0]);
+    assert_released(&t, pkt, size);
+
+    size = build_udp(pkt, 1001, 0xbb);
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.sec[0][0], pkt, size);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+/*
+ * With several compare threads, the connections are spread over the
+ * shards.  Every primary packet is still released exactly once, whatever
+ * shard compared it.
+ */
+static void test_compare_shards(void)
+{
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX], buf[PACKET_MAX];
+    bool released[SHARD_CONNECTIONS] = { false };
+    size_t size = 0;
+    unsigned int i, sport;
+
+    compare_test_start(&t, 1, "compare_threads=4");
+
+    for (i = 0; i < SHARD_CONNECTIONS; i++) {
+        size = build_udp(pkt, 1000 + i, i);
+        send_packet(t.pri[0], pkt, size);
+    }
+    assert_held(&t);
+
+    /* the secondary answers in the opposite order */
+    for (i = SHARD_CONNECTIONS; i-- > 0;) {
+        size = build_udp(pkt, 1000 + i, i);
+        send_packet(t.sec[0][0], pkt, size);
+    }
+
+    for (i = 0; i < SHARD_CONNECTIONS; i++) {
+        g_assert_cmpuint(recv_packet(t.out[0], buf, RELEASE_TIMEOUT_MS), ==,
+                         size);
+        sport = lduw_be_p(buf + 34) - 1000;
+        g_assert_cmpuint(sport, <, SHARD_CONNECTIONS);
+        g_assert(!released[sport]);
+        released[sport] = true;
+
+        build_udp(pkt, 1000 + sport, sport);
+        g_assert(!memcmp(buf, pkt, size));
+    }
+    assert_held(&t);
+
+    compare_test_end(&t);
+}
+
+/*
+ * With checksum offload, the UDP checksum may only be partially filled
+ * in.  Packets that only differ in it are the same.
+ */
+static void test_compare_udp_checksum(const void *opaque)
+{
+    const char *opts = opaque;
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX], spkt[PACKET_MAX];
+    size_t size = build_udp(pkt, 1000, 0xaa);
+
+    memcpy(spkt, pkt, size);
+    stw_be_p(spkt + 40, 0x1234);
+
+    compare_test_start(&t, 1, opts);
+
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.sec[0][0], spkt, size);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+/* The ethernet padding of short frames isn't part of the TCP stream */
+static void test_compare_tcp_padding(void)
+{
+    static const uint8_t payload[] = "data";
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX], spkt[PACKET_MAX];
+    size_t size;
+
+    size = build_tcp(pkt, 0x1000, payload, 4, 0x00);
+    g_assert_cmpuint(build_tcp(spkt, 0x1000, payload, 4, 0xee), ==, size);
+
+    compare_test_start(&t, 1, NULL);
+
+    send_packet(t.pri[0], pkt, size);
+    send_packet(t.sec[0][0], spkt, size);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+/*
+ * TCP is compared as a byte stream, so a segment of the primary matches
+ * the same bytes split over two segments of the secondary.
+ */
+static void test_compare_tcp_segments(void)
+{
+    static const uint8_t payload[] = "segments";
+    CompareTest t;
+    uint8_t pkt[PACKET_MAX], spkt[PACKET_MAX];
+    size_t size, ssize;
+
+    size = build_tcp(pkt, 0x1000, payload, 8, 0);
+
+    compare_test_start(&t, 1, NULL);
+
+    send_packet(t.pri[0], pkt, size);
+    ssize = build_tcp(spkt, 0x1000, payload, 4, 0);
+    send_packet(t.sec[0][0], spkt, ssize);
+    assert_held(&t);
+    ssize = build_tcp(spkt, 0x1004, payload + 4, 4, 0);
+    send_packet(t.sec[0][0], spkt, ssize);
+    assert_released(&t, pkt, size);
+
+    compare_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/colo-compare/release", test_compare_release);
+    qtest_add_func("/colo-compare/in-process", test_compare_in_process);
+    qtest_add_func("/colo-compare/in-process-chardev",
+                   test_compare_in_process_chardev);
+    qtest_add_func("/colo-compare/all-secondaries",
+                   test_compare_all_secondaries);
+    qtest_add_func("/colo-compare/quorum", test_compare_quorum);
+    qtest_add_func("/colo-compare/drop-secondary",
+                   test_compare_drop_secondary);
+    qtest_add_func("/colo-compare/shards", test_compare_shards);
+    qtest_add_data_func("/colo-compare/udp-checksum", NULL,
+                        test_compare_udp_checksum);
+    qtest_add_data_func("/colo-compare/udp-checksum-hash", "compare_hash=on",
+                        test_compare_udp_checksum);
+    qtest_add_func("/colo-compare/tcp-padding", test_compare_tcp_padding);
+    qtest_add_func("/colo-compare/tcp-segments", test_compare_tcp_segments);
+
+    return g_test_run();
+}
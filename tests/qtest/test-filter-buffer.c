@@ -0,0 +1,173 @@
+/*
+ * QTest testcase for filter-buffer
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * A filter-mirror behind the buffer shows what the buffer passes on:
+ *
+ * qemu side                       | test side
+ *                                 |
+ * +---------+                     |  +-------+
+ * | backend <------------------------+ sock0 |
+ * +----+----+                     |  +-------+
+ *      |                          |
+ * +----v----+                     |
+ * |  fbuf0  |                     |
+ * +----+----+                     |
+ *      |                          |
+ * +----v----+                     |  +-------+
+ * |   m0    +------------------------> sock1 |
+ * +---------+                     |  +-------+
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+/* How long to wait for a packet that must be passed on */
+#define PASS_TIMEOUT_MS 5000
+/* How long a packet that must be held back is checked for */
+#define HOLD_TIMEOUT_MS 200
+
+static QTestState *buffer_test_start(int send_sock[2], int recv_sock[2],
+                                     const char *opts)
+{
+    QTestState *qts;
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, send_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, recv_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    qts = qtest_initf(
+        "-nic socket,id=qtest-bn0,fd=%d "
+        "-chardev socket,id=mirror0,fd=%d "
+        "-object filter-buffer,id=fbuf0,netdev=qtest-bn0,queue=tx,%s "
+        "-object filter-mirror,id=m0,netdev=qtest-bn0,queue=tx,outdev=mirror0 "
+        , send_sock[1], recv_sock[1], opts);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(qts, "{ 'execute' : 'query-status'}");
+
+    return qts;
+}
+
+static void buffer_test_end(QTestState *qts, int send_sock[2],
+                            int recv_sock[2])
+{
+    qtest_quit(qts);
+    close(send_sock[0]);
+    close(send_sock[1]);
+    close(recv_sock[0]);
+    close(recv_sock[1]);
+}
+
+static void send_packet(int fd, const char *buf, uint32_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+/* Return whether the mirror passed on @buf within @timeout_ms */
+static bool recv_packet(int fd, const char *buf, uint32_t size,
+                        int timeout_ms)
+{
+    GPollFD pfd = { .fd = fd, .events = G_IO_IN };
+    g_autofree char *recv_buf = NULL;
+    uint32_t len;
+    ssize_t ret;
+
+    if (g_poll(&pfd, 1, timeout_ms) <= 0) {
+        return false;
+    }
+
+    ret = recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpuint(len, ==, size);
+
+    recv_buf = g_malloc(len);
+    ret = recv(fd, recv_buf, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+    g_assert(!memcmp(recv_buf, buf, len));
+
+    return true;
+}
+
+/*
+ * With colo=on the packets wait for a COLO checkpoint, which never comes
+ * here.  Turning the filter off releases them.
+ */
+static void test_buffer_colo(void)
+{
+    int send_sock[2], recv_sock[2];
+    char send_buf[] = "Hello! filter-buffer~";
+    QTestState *qts;
+
+    qts = buffer_test_start(send_sock, recv_sock, "colo=on");
+
+    send_packet(send_sock[0], send_buf, sizeof(send_buf));
+    g_assert(!recv_packet(recv_sock[0], send_buf, sizeof(send_buf),
+                          HOLD_TIMEOUT_MS));
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'qom-set', 'arguments': {"
+                             " 'path': '/objects/fbuf0',"
+                             " 'property': 'status', 'value': 'off' } }");
+    g_assert(recv_packet(recv_sock[0], send_buf, sizeof(send_buf),
+                         PASS_TIMEOUT_MS));
+
+    buffer_test_end(qts, send_sock, recv_sock);
+}
+
+/* Exactly one of interval and colo=on must be given */
+static void test_buffer_colo_interval(void)
+{
+    QTestState *qts = qtest_init("-netdev hubport,id=qtest-bn0,hubid=0");
+    QDict *response;
+
+    response = qtest_qmp(qts, "{ 'execute': 'object-add', 'arguments': {"
+                         " 'qom-type': 'filter-buffer', 'id': 'fbuf0',"
+                         " 'netdev': 'qtest-bn0', 'colo': true,"
+                         " 'interval': 1000 } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    response = qtest_qmp(qts, "{ 'execute': 'object-add', 'arguments': {"
+                         " 'qom-type': 'filter-buffer', 'id': 'fbuf0',"
+                         " 'netdev': 'qtest-bn0' } }");
+    g_assert(qdict_haskey(response, "error"));
+    qobject_unref(response);
+
+    qtest_qmp_assert_success(qts, "{ 'execute': 'object-add', 'arguments': {"
+                             " 'qom-type': 'filter-buffer', 'id': 'fbuf0',"
+                             " 'netdev': 'qtest-bn0', 'colo': true } }");
+
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netfilter/buffer/colo", test_buffer_colo);
+    qtest_add_func("/netfilter/buffer/colo-interval",
+                   test_buffer_colo_interval);
+
+    return g_test_run();
+}
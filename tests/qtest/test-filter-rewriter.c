@@ -0,0 +1,280 @@
+/*
+ * QTest testcase for filter-rewriter
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The test side plays the primary, a filter-mirror behind the rewriter
+ * shows what it passes on to the secondary guest.  Instead of a NIC,
+ * whose guest never enables receiving, the netdev is connected to a hub
+ * that always takes the packets:
+ *
+ * qemu side                       | test side
+ *                                 |
+ * +---------+                     |  +-------+
+ * | backend <------------------------+ sock0 |
+ * +----+----+                     |  +-------+
+ *      |                          |
+ * +----v----+                     |
+ * |   rew0  |                     |
+ * +----+----+                     |
+ *      |                          |
+ * +----v----+                     |  +-------+
+ * |   m0    +------------------------> sock1 |
+ * +----+----+                     |  +-------+
+ *      |                          |
+ * +----v----+                     |
+ * |   hub0  |                     |
+ * +---------+                     |
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define PACKET_MAX 2048
+#define RECV_TIMEOUT_MS 5000
+
+/* Established ACKs after the handshake, they take the fast path */
+#define NB_ACKS 16
+
+#define TCP_SYN 0x02
+#define TCP_ACK 0x10
+
+typedef struct RewriterTest {
+    QTestState *qts;
+    int send_sock[2];
+    int recv_sock[2];
+} RewriterTest;
+
+static void rewriter_test_start(RewriterTest *t)
+{
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->send_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, t->recv_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    t->qts = qtest_initf(
+        "-netdev socket,id=qtest-bn0,fd=%d "
+        "-netdev hubport,id=hp0,hubid=0,netdev=qtest-bn0 "
+        "-netdev hubport,id=hp1,hubid=0 "
+        "-chardev socket,id=mirror0,fd=%d "
+        "-object filter-rewriter,id=rew0,netdev=qtest-bn0,queue=all "
+        "-object filter-mirror,id=m0,netdev=qtest-bn0,queue=tx,outdev=mirror0 "
+        , t->send_sock[1], t->recv_sock[1]);
+
+    /* send a qmp command to guarantee that 'connected' is setting to true. */
+    qtest_qmp_assert_success(t->qts, "{ 'execute' : 'query-status'}");
+}
+
+static void rewriter_test_end(RewriterTest *t)
+{
+    qtest_quit(t->qts);
+    close(t->send_sock[0]);
+    close(t->send_sock[1]);
+    close(t->recv_sock[0]);
+    close(t->recv_sock[1]);
+}
+
+static uint64_t rewriter_get_stat(RewriterTest *t, const char *name)
+{
+    QDict *response;
+    uint64_t value;
+
+    response = qtest_qmp(t->qts, "{ 'execute': 'qom-get', 'arguments': {"
+                         " 'path': '/objects/rew0', 'property': %s } }",
+                         name);
+    g_assert(qdict_haskey(response, "return"));
+    value = qdict_get_int(response, "return");
+    qobject_unref(response);
+
+    return value;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < len; i += 2) {
+        sum += lduw_be_p(buf + i);
+    }
+    if (len & 1) {
+        sum += buf[len - 1] << 8;
+    }
+    return sum;
+}
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+/* Return whether the TCP checksum of the frame in @buf is valid */
+static bool tcp_csum_valid(const uint8_t *buf, size_t size)
+{
+    size_t tcp_len = size - 34;
+    uint32_t sum;
+
+    /* pseudo header: source, destination, protocol, TCP length */
+    sum = csum_add(0, buf + 26, 8);
+    sum += 6 + tcp_len;
+    sum = csum_add(sum, buf + 34, tcp_len);
+
+    return csum_fold(sum) == 0;
+}
+
+/*
+ * Build an ethernet frame with a TCP segment without payload from
+ * 10.0.0.1:1000 to 10.0.0.2:80, with a valid checksum.
+ */
+static size_t build_tcp(uint8_t *buf, uint8_t flags, uint32_t seq,
+                        uint32_t ack)
+{
+    static const uint8_t hdr[] = {
+        /* ethernet: destination, source, IPv4 */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4: version and length, tos, total length, id, fragment */
+        0x45, 0x00, 0x00, 40, 0x00, 0x01, 0x40, 0x00,
+        /* ttl, TCP, checksum, source, destination */
+        0x40, 0x06, 0x00, 0x00,
+        10, 0, 0, 1,
+        10, 0, 0, 2,
+        /* TCP: source port, destination port, seq, ack */
+        0x03, 0xe8, 0x00, 0x50,
+        0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00,
+        /* data offset, flags, window, checksum, urgent pointer */
+        0x50, 0x00, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00,
+    };
+    size_t size = sizeof(hdr);
+    uint32_t sum;
+
+    memcpy(buf, hdr, size);
+    stl_be_p(buf + 38, seq);
+    stl_be_p(buf + 42, ack);
+    buf[47] = flags;
+
+    sum = csum_add(0, buf + 26, 8);
+    sum += 6 + size - 34;
+    sum = csum_add(sum, buf + 34, size - 34);
+    stw_be_p(buf + 50, csum_fold(sum));
+
+    return size;
+}
+
+static void send_packet(int fd, const uint8_t *buf, size_t size)
+{
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(fd, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+/* Receive what the mirror passed on into @buf and return its size */
+static size_t recv_packet(int fd, uint8_t *buf)
+{
+    GPollFD pfd = { .fd = fd, .events = G_IO_IN };
+    uint32_t len;
+    ssize_t ret;
+
+    g_assert_cmpint(g_poll(&pfd, 1, RECV_TIMEOUT_MS), ==, 1);
+
+    ret = recv(fd, &len, sizeof(len), MSG_WAITALL);
+    g_assert_cmpint(ret, ==, sizeof(len));
+    len = ntohl(len);
+    g_assert_cmpuint(len, <=, PACKET_MAX);
+
+    ret = recv(fd, buf, len, MSG_WAITALL);
+    g_assert_cmpint(ret, ==, len);
+
+    return len;
+}
+
+/*
+ * The secondary never answered, so its initial sequence number is 0 and
+ * the ACKs of the primary are shifted to acknowledge 1.  The handshake
+ * takes the full state machine, the ACKs after it the fast path.
+ */
+static void test_rewriter_fast_path(void)
+{
+    RewriterTest t;
+    uint8_t pkt[PACKET_MAX], buf[PACKET_MAX];
+    uint32_t ack = 0x10000;
+    size_t size;
+    int i;
+
+    rewriter_test_start(&t);
+
+    size = build_tcp(pkt, TCP_SYN, 0x1000, 0);
+    send_packet(t.send_sock[0], pkt, size);
+    g_assert_cmpuint(recv_packet(t.recv_sock[0], buf), ==, size);
+    g_assert(!memcmp(buf, pkt, size));
+
+    for (i = 0; i <= NB_ACKS; i++) {
+        size = build_tcp(pkt, TCP_ACK, 0x1001 + i, ack + i);
+        send_packet(t.send_sock[0], pkt, size);
+        g_assert_cmpuint(recv_packet(t.recv_sock[0], buf), ==, size);
+
+        g_assert_cmphex(ldl_be_p(buf + 42), ==, 1 + i);
+        g_assert(tcp_csum_valid(buf, size));
+    }
+
+    g_assert_cmpuint(rewriter_get_stat(&t, "fallback"), ==, 2);
+    g_assert_cmpuint(rewriter_get_stat(&t, "rewritten"), ==, NB_ACKS + 1);
+    g_assert_cmpuint(rewriter_get_stat(&t, "untracked"), ==, 0);
+
+    rewriter_test_end(&t);
+}
+
+/* Packets that aren't TCP are passed on untouched */
+static void test_rewriter_untracked(void)
+{
+    RewriterTest t;
+    uint8_t pkt[PACKET_MAX], buf[PACKET_MAX];
+    size_t size;
+
+    rewriter_test_start(&t);
+
+    size = build_tcp(pkt, TCP_ACK, 0x1000, 0x10000);
+    /* make it UDP, the rewriter doesn't look at the checksum */
+    pkt[23] = 0x11;
+    send_packet(t.send_sock[0], pkt, size);
+    g_assert_cmpuint(recv_packet(t.recv_sock[0], buf), ==, size);
+    g_assert(!memcmp(buf, pkt, size));
+
+    g_assert_cmpuint(rewriter_get_stat(&t, "untracked"), ==, 1);
+    g_assert_cmpuint(rewriter_get_stat(&t, "fallback"), ==, 0);
+    g_assert_cmpuint(rewriter_get_stat(&t, "rewritten"), ==, 0);
+
+    rewriter_test_end(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netfilter/rewriter/fast-path", test_rewriter_fast_path);
+    qtest_add_func("/netfilter/rewriter/untracked", test_rewriter_untracked);
+
+    return g_test_run();
+}
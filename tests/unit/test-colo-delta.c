@@ -0,0 +1,191 @@
+/*
+ * COLO delta encoding test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qapi/error.h"
+#include "../migration/xbzrle.h"
+#include "../migration/colo-delta.h"
+
+#define PAGE_SIZE 4096
+#define NB_PAGES 8
+
+typedef struct {
+    ColoDelta *cd;
+    uint64_t age;
+    /* guest memory of the primary and the secondary */
+    uint8_t *src;
+    uint8_t *dst;
+    ram_addr_t offsets[NB_PAGES];
+    uint8_t *buf;
+    uint32_t lens[NB_PAGES];
+} DeltaTest;
+
+static void delta_test_init(DeltaTest *t)
+{
+    t->cd = colo_delta_new(NB_PAGES * PAGE_SIZE * 16, PAGE_SIZE,
+                           xbzrle_encode_buffer, &error_abort);
+    t->age = 1;
+    t->src = g_malloc0(NB_PAGES * PAGE_SIZE);
+    t->dst = g_malloc0(NB_PAGES * PAGE_SIZE);
+    for (int i = 0; i < NB_PAGES; i++) {
+        t->offsets[i] = i * PAGE_SIZE;
+    }
+    t->buf = g_malloc(NB_PAGES * (sizeof(uint32_t) + PAGE_SIZE));
+}
+
+static void delta_test_cleanup(DeltaTest *t)
+{
+    colo_delta_free(t->cd);
+    g_free(t->src);
+    g_free(t->dst);
+    g_free(t->buf);
+}
+
+/*
+ * Send all pages in one packet like a multifd channel does, apply it to
+ * the secondary and check that both sides are the same.  Return the
+ * size of the packet.
+ */
+static uint32_t delta_test_send(DeltaTest *t)
+{
+    uint8_t *out = t->buf + NB_PAGES * sizeof(uint32_t);
+    uint32_t size;
+
+    for (int i = 0; i < NB_PAGES; i++) {
+        t->lens[i] = colo_delta_encode_page(t->cd, t->offsets[i], t->age,
+                                            t->src + t->offsets[i], out);
+        stl_be_p(t->buf + i * sizeof(uint32_t), t->lens[i]);
+        out += t->lens[i];
+    }
+    size = out - t->buf;
+
+    g_assert_cmpint(colo_delta_decode(t->buf, size, NB_PAGES, PAGE_SIZE,
+                                      t->dst, t->offsets, &error_abort),
+                    ==, 0);
+    g_assert(!memcmp(t->src, t->dst, NB_PAGES * PAGE_SIZE));
+
+    return size;
+}
+
+static void test_round_trip(void)
+{
+    DeltaTest t;
+    int i;
+
+    delta_test_init(&t);
+
+    /* the first time, every page is sent raw */
+    for (i = 0; i < NB_PAGES * PAGE_SIZE; i++) {
+        t.src[i] = i * 7;
+    }
+    delta_test_send(&t);
+    for (i = 0; i < NB_PAGES; i++) {
+        g_assert_cmpuint(t.lens[i], ==, PAGE_SIZE);
+    }
+
+    /* unchanged pages are empty deltas */
+    t.age++;
+    g_assert_cmpuint(delta_test_send(&t), ==,
+                     NB_PAGES * sizeof(uint32_t));
+
+    /* a few changed bytes make a small delta */
+    t.age++;
+    for (i = 0; i < NB_PAGES; i++) {
+        t.src[i * PAGE_SIZE + i * 100] ^= 0xff;
+    }
+    delta_test_send(&t);
+    for (i = 0; i < NB_PAGES; i++) {
+        g_assert_cmpuint(t.lens[i], >, 0);
+        g_assert_cmpuint(t.lens[i], <, PAGE_SIZE / 8);
+    }
+
+    /* a page that changed completely is sent raw again */
+    t.age++;
+    for (i = 0; i < PAGE_SIZE; i++) {
+        t.src[i] = ~t.src[i];
+    }
+    delta_test_send(&t);
+    g_assert_cmpuint(t.lens[0], ==, PAGE_SIZE);
+
+    delta_test_cleanup(&t);
+}
+
+/*
+ * Pages that are sent as zero pages outside of the delta packets leave
+ * the shadow zeroed, so the next delta applies to the zero page the
+ * secondary has.
+ */
+static void test_zero_page(void)
+{
+    DeltaTest t;
+    int i;
+
+    delta_test_init(&t);
+
+    memset(t.src, 0x5a, NB_PAGES * PAGE_SIZE);
+    delta_test_send(&t);
+
+    t.age++;
+    for (i = 0; i < NB_PAGES; i += 2) {
+        memset(t.src + t.offsets[i], 0, PAGE_SIZE);
+        memset(t.dst + t.offsets[i], 0, PAGE_SIZE);
+        colo_delta_zero_page(t.cd, t.offsets[i], t.age);
+    }
+
+    t.age++;
+    for (i = 0; i < NB_PAGES; i += 2) {
+        t.src[t.offsets[i] + 10] = 1;
+    }
+    delta_test_send(&t);
+    for (i = 0; i < NB_PAGES; i++) {
+        g_assert_cmpuint(t.lens[i], <, PAGE_SIZE / 8);
+    }
+
+    delta_test_cleanup(&t);
+}
+
+/* Malformed packets are rejected instead of writing past the pages */
+static void test_invalid(void)
+{
+    DeltaTest t;
+    uint32_t size;
+    Error *err = NULL;
+
+    delta_test_init(&t);
+    size = delta_test_send(&t);
+
+    /* a page longer than a page */
+    stl_be_p(t.buf, PAGE_SIZE + 1);
+    g_assert_cmpint(colo_delta_decode(t.buf, size, NB_PAGES, PAGE_SIZE,
+                                      t.dst, t.offsets, &err), <, 0);
+    error_free_or_abort(&err);
+
+    /* a truncated packet */
+    stl_be_p(t.buf, PAGE_SIZE);
+    g_assert_cmpint(colo_delta_decode(t.buf, size - 1, NB_PAGES, PAGE_SIZE,
+                                      t.dst, t.offsets, &err), <, 0);
+    error_free_or_abort(&err);
+
+    /* trailing bytes */
+    stl_be_p(t.buf, PAGE_SIZE - 1);
+    g_assert_cmpint(colo_delta_decode(t.buf, size, NB_PAGES, PAGE_SIZE,
+                                      t.dst, t.offsets, &err), <, 0);
+    error_free_or_abort(&err);
+
+    delta_test_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo-delta/round_trip", test_round_trip);
+    g_test_add_func("/colo-delta/zero_page", test_zero_page);
+    g_test_add_func("/colo-delta/invalid", test_invalid);
+
+    return g_test_run();
+}
@@ -0,0 +1,94 @@
+/*
+ * COLO checkpoint scheduler test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The dirty rate is measured against the wall clock, so the decisions are
+ * checked with an interval of 0, where it doesn't matter.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "../migration/colo-sched.h"
+
+static void record_checkpoint(uint64_t memory_us, uint64_t other_us,
+                              uint64_t ram_bytes, uint64_t background_bytes)
+{
+    ColoCheckpointTimes times = { };
+
+    times.phase[COLO_CHECKPOINT_PHASE_MEMORY] = memory_us;
+    times.phase[COLO_CHECKPOINT_PHASE_TOTAL] = memory_us + other_us;
+    colo_sched_record_checkpoint(&times, ram_bytes, background_bytes);
+}
+
+static ColoAction decide(uint64_t pending, uint64_t transferred,
+                         uint64_t max_pause_us)
+{
+    ColoAction action;
+
+    g_assert(colo_sched_decide(pending, transferred, 0, max_pause_us,
+                               &action));
+    return action;
+}
+
+/* Nothing is predicted before the throughput is known */
+static void test_no_data(void)
+{
+    ColoAction action;
+
+    colo_sched_reset();
+    g_assert(!colo_sched_decide(MiB, 0, 0, 1000, &action));
+
+    /* too little ram to tell the throughput */
+    record_checkpoint(10, 1000, 4 * KiB, 0);
+    g_assert(!colo_sched_decide(MiB, 0, 0, 1000, &action));
+
+    /* the background transfers tell it too */
+    colo_sched_record_background(1024, MiB, 0);
+    g_assert(colo_sched_decide(MiB, 0, 0, 1000, &action));
+}
+
+/*
+ * One checkpoint of 1000us besides sending 16M in 16384us.  1M pending
+ * makes the next one 2024us, and 1000us are left if it's synced now.
+ */
+static void test_fixed(void)
+{
+    colo_sched_reset();
+    record_checkpoint(16 * KiB, 1000, 16 * MiB, 0);
+
+    g_assert_cmpint(decide(MiB, 0, 100000), ==, ACTION_NONE);
+    g_assert_cmpint(decide(MiB, 0, 1500), ==, ACTION_BACKGROUND);
+    g_assert_cmpint(decide(MiB, 0, 1000), ==, ACTION_CHECKPOINT);
+}
+
+/*
+ * Checkpoints of 1000us plus 1us per KiB applied.  The ram synced in the
+ * background since the last checkpoint makes the next one longer, even
+ * though it doesn't have to be sent anymore.
+ */
+static void test_apply_cost(void)
+{
+    colo_sched_reset();
+    record_checkpoint(KiB, 1000 + KiB, MiB, 0);
+    record_checkpoint(KiB, 1000 + 4 * KiB, MiB, 3 * MiB);
+
+    /* 8M synced and 1M pending: 10216us, or 11240us at the next check */
+    g_assert_cmpint(decide(MiB, 8 * MiB, 12000), ==, ACTION_NONE);
+    g_assert_cmpint(decide(MiB, 8 * MiB, 11000), ==, ACTION_BACKGROUND);
+    g_assert_cmpint(decide(MiB, 8 * MiB, 10000), ==, ACTION_CHECKPOINT);
+
+    /* the same without the synced ram stays far below the limit */
+    g_assert_cmpint(decide(MiB, 0, 10000), ==, ACTION_NONE);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo-sched/no-data", test_no_data);
+    g_test_add_func("/colo-sched/fixed", test_fixed);
+    g_test_add_func("/colo-sched/apply-cost", test_apply_cost);
+
+    return g_test_run();
+}
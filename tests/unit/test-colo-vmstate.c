@@ -0,0 +1,161 @@
+/*
+ * COLO device state delta transfer test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "io/channel-buffer.h"
+#include "migration/qemu-file-types.h"
+#include "../migration/qemu-file.h"
+#include "../migration/savevm.h"
+#include "../migration/colo-vmstate.h"
+
+#define MAX_SECTIONS 4
+
+/* The device state that qemu_save_device_state_sections() saves */
+static const char *sections[MAX_SECTIONS];
+static uint32_t nb_sections;
+
+int qemu_save_device_state_sections(QEMUFile *f,
+                                    void (*section_done)(void *opaque),
+                                    void *opaque)
+{
+    uint32_t i;
+
+    for (i = 0; i < nb_sections; i++) {
+        qemu_put_buffer(f, (const uint8_t *)sections[i], strlen(sections[i]));
+        section_done(opaque);
+    }
+    qemu_put_byte(f, QEMU_VM_EOF);
+
+    return 0;
+}
+
+static void set_sections(uint32_t nb, const char *s0, const char *s1,
+                         const char *s2, const char *s3)
+{
+    nb_sections = nb;
+    sections[0] = s0;
+    sections[1] = s1;
+    sections[2] = s2;
+    sections[3] = s3;
+}
+
+/* Size of a delta with sections of @len bytes in total */
+static uint64_t delta_size(uint32_t changed, uint64_t len)
+{
+    return changed * 2 * sizeof(uint32_t) + len + sizeof(uint32_t);
+}
+
+/*
+ * Save the device state on @src, send it as a delta and rebuild it on
+ * @dst.  Return the result of colo_vmstate_get_delta().
+ */
+static int transfer(ColoVmstate *src, ColoVmstate *dst, Error **errp)
+{
+    QIOChannelBuffer *wire = qio_channel_buffer_new(0);
+    QIOChannelBuffer *in;
+    QEMUFile *f;
+    int ret;
+
+    g_assert_cmpint(colo_vmstate_save(src), ==, 0);
+
+    f = qemu_file_new_output(QIO_CHANNEL(wire));
+    colo_vmstate_put_delta(src, f);
+    qemu_fflush(f);
+    g_assert_cmpuint(wire->usage, ==, src->sent);
+
+    /* Closing the output drops the buffer, so read from a copy */
+    in = qio_channel_buffer_new(wire->usage);
+    memcpy(in->data, wire->data, wire->usage);
+    in->usage = wire->usage;
+    qemu_fclose(f);
+    object_unref(OBJECT(wire));
+
+    f = qemu_file_new_input(QIO_CHANNEL(in));
+    object_unref(OBJECT(in));
+    ret = colo_vmstate_get_delta(dst, f, src->offsets->len, errp);
+    qemu_fclose(f);
+    if (ret < 0) {
+        return ret;
+    }
+
+    g_assert_cmpuint(dst->sent, ==, src->sent);
+    colo_vmstate_rebuild(dst);
+    g_assert_cmpuint(dst->bioc->usage, ==, src->bioc->usage);
+    g_assert(!memcmp(dst->bioc->data, src->bioc->data, src->bioc->usage));
+
+    return 0;
+}
+
+/* Only the sections that changed since the last transfer are sent */
+static void test_delta(void)
+{
+    ColoVmstate *src = colo_vmstate_new(true);
+    ColoVmstate *dst = colo_vmstate_new(false);
+
+    set_sections(3, "aaaa", "bbbbbbbb", "cc", NULL);
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(3, 14));
+
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(0, 0));
+
+    /* same length, different content */
+    set_sections(3, "aaaa", "bbbbBbbb", "cc", NULL);
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(1, 8));
+
+    /* different length */
+    set_sections(3, "aaaa", "bbbbBbbb", "ccc", NULL);
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(1, 3));
+
+    /* a device got plugged, everything is sent again */
+    set_sections(4, "aaaa", "bbbbBbbb", "ccc", "d");
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(4, 16));
+
+    colo_vmstate_free(src);
+    colo_vmstate_free(dst);
+}
+
+/*
+ * After a full transfer both sides forget the last delta, so the next one
+ * contains all sections.  A receiver that forgot on its own can't patch a
+ * delta.
+ */
+static void test_forget(void)
+{
+    ColoVmstate *src = colo_vmstate_new(true);
+    ColoVmstate *dst = colo_vmstate_new(false);
+    Error *err = NULL;
+
+    set_sections(2, "aaaa", "bb", NULL, NULL);
+    transfer(src, dst, &error_abort);
+
+    colo_vmstate_forget(src);
+    colo_vmstate_forget(dst);
+    transfer(src, dst, &error_abort);
+    g_assert_cmpuint(src->sent, ==, delta_size(2, 6));
+
+    colo_vmstate_forget(dst);
+    set_sections(2, "aaaa", "bB", NULL, NULL);
+    g_assert_cmpint(transfer(src, dst, &err), <, 0);
+    error_free_or_abort(&err);
+
+    colo_vmstate_free(src);
+    colo_vmstate_free(dst);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/colo-vmstate/delta", test_delta);
+    g_test_add_func("/colo-vmstate/forget", test_forget);
+
+    return g_test_run();
+}
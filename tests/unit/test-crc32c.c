@@ -0,0 +1,68 @@
+/*
+ * QEMU crc32c test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/crc32c.h"
+
+#define MAX_LEN 100
+#define MAX_ALIGN 8
+
+/* Bit by bit CRC-32C, independent of the table and of the host ISA */
+static uint32_t crc32c_ref(const uint8_t *data, size_t length)
+{
+    uint32_t crc = 0xffffffff;
+    int i;
+
+    while (length--) {
+        crc ^= *data++;
+        for (i = 0; i < 8; i++) {
+            crc = (crc >> 1) ^ (crc & 1 ? 0x82f63b78 : 0);
+        }
+    }
+    return crc ^ 0xffffffff;
+}
+
+static void test_1(void)
+{
+    static const uint8_t check[] = "123456789";
+    uint8_t buffer[MAX_ALIGN + MAX_LEN];
+    size_t a, s;
+
+    /* The check value of the CRC-32C definition */
+    g_assert_cmphex(crc32c(0xffffffff, check, sizeof(check) - 1), ==,
+                    0xe3069283);
+
+    for (s = 0; s < sizeof(buffer); s++) {
+        buffer[s] = s * 37 + 11;
+    }
+
+    /*
+     * Unaligned starts, and lengths that leave every tail below the
+     * 8 bytes processed at once.
+     */
+    for (a = 0; a < MAX_ALIGN; a++) {
+        for (s = 0; s <= MAX_LEN; s++) {
+            g_assert_cmphex(crc32c(0xffffffff, buffer + a, s), ==,
+                            crc32c_ref(buffer + a, s));
+        }
+    }
+}
+
+static void test_2(void)
+{
+    do {
+        test_1();
+    } while (test_crc32c_next_accel());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/crc32c/accel", test_2);
+
+    return g_test_run();
+}
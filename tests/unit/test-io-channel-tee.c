@@ -0,0 +1,96 @@
+/*
+ * QEMU I/O channel tee test
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "io/channel-tee.h"
+#include "io/channel-buffer.h"
+#include "io/channel-null.h"
+#include "qapi/error.h"
+
+static void test_io_channel_tee_io(void)
+{
+    g_autoptr(QIOChannelTee) tee = qio_channel_tee_new();
+    g_autoptr(QIOChannelBuffer) buf1 = qio_channel_buffer_new(0);
+    g_autoptr(QIOChannelNull) null = qio_channel_null_new();
+    g_autoptr(QIOChannelBuffer) buf2 = qio_channel_buffer_new(0);
+    char buf[1024];
+    Error *local_err = NULL;
+
+    qio_channel_tee_add(tee, QIO_CHANNEL(buf1));
+    qio_channel_tee_add(tee, QIO_CHANNEL(null));
+    qio_channel_tee_add(tee, QIO_CHANNEL(buf2));
+    g_assert_cmpuint(qio_channel_tee_get_count(tee), ==, 3);
+    g_assert(qio_channel_tee_get_child(tee, 1) == QIO_CHANNEL(null));
+
+    /* A closed null channel fails writes */
+    qio_channel_close(QIO_CHANNEL(null), &error_abort);
+
+    /* The failing child is dropped, the others get everything */
+    g_assert(qio_channel_write(QIO_CHANNEL(tee),
+                               "Hello World", 11,
+                               &error_abort) == 11);
+    g_assert(!qio_channel_tee_is_dropped(tee, 0));
+    g_assert(qio_channel_tee_is_dropped(tee, 1));
+    g_assert(!qio_channel_tee_is_dropped(tee, 2));
+
+    g_assert_cmpuint(buf1->usage, ==, 11);
+    g_assert(!memcmp(buf1->data, "Hello World", 11));
+    g_assert_cmpuint(buf2->usage, ==, 11);
+    g_assert(!memcmp(buf2->data, "Hello World", 11));
+
+    g_assert(qio_channel_read(QIO_CHANNEL(tee),
+                              buf, sizeof(buf),
+                              &local_err) == -1);
+    g_assert_nonnull(local_err);
+
+    g_clear_pointer(&local_err, error_free);
+
+    /* A dropped child isn't written to anymore */
+    qio_channel_tee_drop(tee, 0);
+    g_assert(qio_channel_tee_is_dropped(tee, 0));
+
+    g_assert(qio_channel_write(QIO_CHANNEL(tee),
+                               "Bye", 3,
+                               &error_abort) == 3);
+    g_assert_cmpuint(buf1->usage, ==, 11);
+    g_assert_cmpuint(buf2->usage, ==, 14);
+    g_assert(!memcmp(buf2->data + 11, "Bye", 3));
+
+    /* Writes fail once no child is left */
+    qio_channel_tee_drop(tee, 2);
+
+    g_assert(qio_channel_write(QIO_CHANNEL(tee),
+                               "Hello World", 11,
+                               &local_err) == -1);
+    g_assert_nonnull(local_err);
+
+    g_clear_pointer(&local_err, error_free);
+
+    qio_channel_close(QIO_CHANNEL(tee), &error_abort);
+}
+
+int main(int argc, char **argv)
+{
+    module_call_init(MODULE_INIT_QOM);
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/io/channel/tee/io", test_io_channel_tee_io);
+
+    return g_test_run();
+}
@@ -18,6 +18,7 @@
 #include "block/block_int.h"
 #include "block/qdict.h"
 #include "sysemu/block-backend.h"
+#include "iothread.h"
 
 #define IMG_SIZE (64 * 1024 * 1024)
 
@@ -32,6 +33,16 @@ static char *s_local_disk;
 static char *s_active_disk;
 static char *s_hidden_disk;
 
+/* a second secondary disk, checkpointed together with the first one */
+#define S2_ID "secondary2-id"
+#define S2_LOCAL_DISK_ID "secondary2-local-disk-id"
+static char *s2_local_disk;
+static char *s2_active_disk;
+static char *s2_hidden_disk;
+
+/* replication-overlay */
+static char *o_base_disk;
+
 /* FIXME: steal from blockdev.c */
 QemuOptsList qemu_drive_opts = {
     .name = "drive",
@@ -143,6 +154,10 @@ static void prepare_imgs(void)
     make_temp(s_local_disk);
     make_temp(s_active_disk);
     make_temp(s_hidden_disk);
+    make_temp(s2_local_disk);
+    make_temp(s2_active_disk);
+    make_temp(s2_hidden_disk);
+    make_temp(o_base_disk);
 
     /* Primary */
     bdrv_img_create(p_local_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
@@ -155,6 +170,16 @@ static void prepare_imgs(void)
                     BDRV_O_RDWR, true, &error_abort);
     bdrv_img_create(s_hidden_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
                     BDRV_O_RDWR, true, &error_abort);
+    bdrv_img_create(s2_local_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+    bdrv_img_create(s2_active_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+    bdrv_img_create(s2_hidden_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    /* replication-overlay */
+    bdrv_img_create(o_base_disk, "qcow2", NULL, NULL, NULL, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
 }
 
 static void cleanup_imgs(void)
@@ -166,6 +191,12 @@ static void cleanup_imgs(void)
     unlink(s_local_disk);
     unlink(s_active_disk);
     unlink(s_hidden_disk);
+    unlink(s2_local_disk);
+    unlink(s2_active_disk);
+    unlink(s2_hidden_disk);
+
+    /* replication-overlay */
+    unlink(o_base_disk);
 }
 
 static BlockBackend *start_primary(void)
@@ -288,17 +319,18 @@ static void test_primary_get_error_all(void)
     teardown_primary();
 }
 
-static BlockBackend *start_secondary(void)
+static void start_secondary_local_disk(const char *local_id,
+                                       const char *local_disk)
 {
     QemuOpts *opts;
     QDict *qdict;
     BlockBackend *blk;
     char *cmdline;
 
-    /* add s_local_disk and forge S_LOCAL_DISK_ID */
+    /* add local_disk and forge local_id */
     cmdline = g_strdup_printf("file.filename=%s,driver=qcow2,"
                               "file.locking=off",
-                              s_local_disk);
+                              local_disk);
     opts = qemu_opts_parse_noisily(&qemu_drive_opts, cmdline, false);
     g_free(cmdline);
 
@@ -308,25 +340,22 @@ static BlockBackend *start_secondary(void)
 
     blk = blk_new_open(NULL, NULL, qdict, BDRV_O_RDWR, &error_abort);
     assert(blk);
-    monitor_add_blk(blk, S_LOCAL_DISK_ID, &error_abort);
+    monitor_add_blk(blk, local_id, &error_abort);
 
     /* format s_local_disk with pattern "0x11" */
     test_blk_write(blk, 0x11, 0, IMG_SIZE, false);
 
     qemu_opts_del(opts);
+}
+
+/* add the replication driver described by cmdline and forge id */
+static BlockBackend *start_secondary_top(const char *id, const char *cmdline)
+{
+    QemuOpts *opts;
+    QDict *qdict;
+    BlockBackend *blk;
 
-    /* add S_(ACTIVE/HIDDEN)_DISK and forge S_ID */
-    cmdline = g_strdup_printf("driver=replication,mode=secondary,top-id=%s,"
-                              "file.driver=qcow2,file.file.filename=%s,"
-                              "file.file.locking=off,"
-                              "file.backing.driver=qcow2,"
-                              "file.backing.file.filename=%s,"
-                              "file.backing.file.locking=off,"
-                              "file.backing.backing=%s"
-                              , S_ID, s_active_disk, s_hidden_disk
-                              , S_LOCAL_DISK_ID);
     opts = qemu_opts_parse_noisily(&qemu_drive_opts, cmdline, false);
-    g_free(cmdline);
 
     qdict = qemu_opts_to_qdict(opts, NULL);
     qdict_set_default_str(qdict, BDRV_OPT_CACHE_DIRECT, "off");
@@ -334,21 +363,54 @@ static BlockBackend *start_secondary(void)
 
     blk = blk_new_open(NULL, NULL, qdict, BDRV_O_RDWR, &error_abort);
     assert(blk);
-    monitor_add_blk(blk, S_ID, &error_abort);
+    monitor_add_blk(blk, id, &error_abort);
 
     qemu_opts_del(opts);
 
     return blk;
 }
 
-static void teardown_secondary(void)
+static BlockBackend *start_secondary_disks(const char *id,
+                                          const char *local_id,
+                                          const char *local_disk,
+                                          const char *active_disk,
+                                          const char *hidden_disk)
+{
+    BlockBackend *blk;
+    char *cmdline;
+
+    start_secondary_local_disk(local_id, local_disk);
+
+    /* add active_disk and hidden_disk and forge id */
+    cmdline = g_strdup_printf("driver=replication,mode=secondary,top-id=%s,"
+                              "file.driver=qcow2,file.file.filename=%s,"
+                              "file.file.locking=off,"
+                              "file.backing.driver=qcow2,"
+                              "file.backing.file.filename=%s,"
+                              "file.backing.file.locking=off,"
+                              "file.backing.backing=%s"
+                              , id, active_disk, hidden_disk
+                              , local_id);
+    blk = start_secondary_top(id, cmdline);
+    g_free(cmdline);
+
+    return blk;
+}
+
+static BlockBackend *start_secondary(void)
+{
+    return start_secondary_disks(S_ID, S_LOCAL_DISK_ID, s_local_disk,
+                                 s_active_disk, s_hidden_disk);
+}
+
+static void teardown_secondary_disks(const char *id, const char *local_id)
 {
     /* only need to destroy two BBs */
     BlockBackend *blk;
     AioContext *ctx;
 
-    /* remove S_LOCAL_DISK_ID */
-    blk = blk_by_name(S_LOCAL_DISK_ID);
+    /* remove the local disk */
+    blk = blk_by_name(local_id);
     assert(blk);
 
     ctx = blk_get_aio_context(blk);
@@ -357,8 +419,8 @@ static void teardown_secondary(void)
     blk_unref(blk);
     aio_context_release(ctx);
 
-    /* remove S_ID */
-    blk = blk_by_name(S_ID);
+    /* remove the top disk */
+    blk = blk_by_name(id);
     assert(blk);
 
     ctx = blk_get_aio_context(blk);
@@ -368,6 +430,11 @@ static void teardown_secondary(void)
     aio_context_release(ctx);
 }
 
+static void teardown_secondary(void)
+{
+    teardown_secondary_disks(S_ID, S_LOCAL_DISK_ID);
+}
+
 static void test_secondary_read(void)
 {
     BlockBackend *blk;
@@ -549,6 +616,253 @@ static void test_secondary_get_error_all(void)
 }
 #endif
 
+static BlockBackend *open_drive(const char *cmdline)
+{
+    BlockBackend *blk;
+    QemuOpts *opts;
+    QDict *qdict;
+
+    opts = qemu_opts_parse_noisily(&qemu_drive_opts, cmdline, false);
+    qdict = qemu_opts_to_qdict(opts, NULL);
+    qdict_set_default_str(qdict, BDRV_OPT_CACHE_DIRECT, "off");
+    qdict_set_default_str(qdict, BDRV_OPT_CACHE_NO_FLUSH, "off");
+
+    blk = blk_new_open(NULL, NULL, qdict, BDRV_O_RDWR, &error_abort);
+    g_assert(blk);
+
+    qemu_opts_del(opts);
+
+    return blk;
+}
+
+/*
+ * Unlike test_blk_read(), check that every byte in the range matches, so
+ * that reading the base where the overlay was expected is caught whatever
+ * the two patterns are.
+ */
+static void overlay_check_read(BlockBackend *blk, int pattern,
+                               int64_t offset, int64_t count)
+{
+    uint8_t *buf = g_malloc(count);
+    int64_t i;
+
+    g_assert_cmpint(blk_pread(blk, offset, count, buf, 0), ==, 0);
+    for (i = 0; i < count; i++) {
+        g_assert_cmphex(buf[i], ==, pattern);
+    }
+
+    g_free(buf);
+}
+
+static BlockBackend *open_overlay_base(int pattern)
+{
+    BlockBackend *blk;
+    char *cmdline;
+
+    /* write pattern to the base (0, IMG_SIZE) */
+    cmdline = g_strdup_printf("driver=qcow2,file.filename=%s,"
+                              "file.locking=off", o_base_disk);
+    blk = open_drive(cmdline);
+    g_free(cmdline);
+    test_blk_write(blk, pattern, 0, IMG_SIZE, false);
+
+    return blk;
+}
+
+static BlockBackend *start_overlay(void)
+{
+    BlockBackend *blk;
+    char *cmdline;
+
+    cmdline = g_strdup_printf("driver=replication-overlay,size=%d,"
+                              "backing.driver=qcow2,"
+                              "backing.file.filename=%s,"
+                              "backing.file.locking=off"
+                              , IMG_SIZE, o_base_disk);
+    blk = open_drive(cmdline);
+    g_free(cmdline);
+
+    return blk;
+}
+
+static void test_overlay_read_write(void)
+{
+    BlockBackend *base_blk, *blk;
+
+    base_blk = open_overlay_base(0x11);
+    blk = start_overlay();
+
+    /* nothing written to the overlay yet, reads fall through to the base */
+    overlay_check_read(blk, 0x11, 0, IMG_SIZE);
+
+    /*
+     * write 0x22 to the overlay (IMG_SIZE / 4, IMG_SIZE / 2), unaligned to
+     * the overlay clusters at both ends
+     */
+    test_blk_write(blk, 0x22, IMG_SIZE / 4 + 512, IMG_SIZE / 4 - 1024,
+                   false);
+
+    overlay_check_read(blk, 0x11, 0, IMG_SIZE / 4 + 512);
+    overlay_check_read(blk, 0x22, IMG_SIZE / 4 + 512, IMG_SIZE / 4 - 1024);
+    overlay_check_read(blk, 0x11, IMG_SIZE / 2 - 512, IMG_SIZE / 2 + 512);
+
+    /* the write landed in the overlay only, the base is untouched */
+    overlay_check_read(base_blk, 0x11, 0, IMG_SIZE);
+
+    blk_unref(blk);
+    blk_unref(base_blk);
+}
+
+static void test_overlay_make_empty(void)
+{
+    BlockBackend *base_blk, *blk;
+
+    base_blk = open_overlay_base(0x11);
+    blk = start_overlay();
+
+    /* dirty enough clusters that the old map is freed off-thread */
+    test_blk_write(blk, 0x33, 0, IMG_SIZE / 2, false);
+    overlay_check_read(blk, 0x33, 0, IMG_SIZE / 2);
+
+    /* a checkpoint discards everything written since the last one */
+    g_assert_cmpint(blk_make_empty(blk, &error_abort), ==, 0);
+    overlay_check_read(blk, 0x11, 0, IMG_SIZE);
+
+    /* the overlay is usable again after being emptied */
+    test_blk_write(blk, 0x44, 0, 4096, false);
+    g_assert_cmpint(blk_make_empty(blk, &error_abort), ==, 0);
+    overlay_check_read(blk, 0x11, 0, IMG_SIZE);
+
+    blk_unref(blk);
+    blk_unref(base_blk);
+}
+
+#ifndef _WIN32
+/*
+ * Checkpoint two secondary disks in an iothread at once.  The checkpoints
+ * run concurrently in coroutines of the main loop, without the AioContext
+ * of the disks held.
+ */
+static void test_secondary_iothread_checkpoint(void)
+{
+    IOThread *iothread = iothread_new();
+    AioContext *ctx = iothread_get_aio_context(iothread);
+    const char *ids[] = { S_ID, S2_ID };
+    const char *local_ids[] = { S_LOCAL_DISK_ID, S2_LOCAL_DISK_ID };
+    BlockBackend *top_blk[2], *local_blk[2];
+    uint8_t *buf = g_malloc(IMG_SIZE / 2);
+    int i;
+
+    top_blk[0] = start_secondary();
+    top_blk[1] = start_secondary_disks(S2_ID, S2_LOCAL_DISK_ID, s2_local_disk,
+                                       s2_active_disk, s2_hidden_disk);
+
+    for (i = 0; i < 2; i++) {
+        local_blk[i] = blk_by_name(local_ids[i]);
+        /* the local disk shares its node with the top disk and follows it */
+        blk_set_aio_context(top_blk[i], ctx, &error_abort);
+    }
+
+    aio_context_acquire(ctx);
+    replication_start_all(REPLICATION_MODE_SECONDARY, &error_abort);
+
+    for (i = 0; i < 2; i++) {
+        /* write 0x22 to the local disk (IMG_SIZE / 2, IMG_SIZE) */
+        memset(buf, 0x22, IMG_SIZE / 2);
+        g_assert_cmpint(blk_pwrite(local_blk[i], IMG_SIZE / 2, IMG_SIZE / 2,
+                                   buf, 0), ==, 0);
+
+        /* write 0x33 to the active disk (0, IMG_SIZE / 2) */
+        memset(buf, 0x33, IMG_SIZE / 2);
+        g_assert_cmpint(blk_pwrite(top_blk[i], 0, IMG_SIZE / 2, buf, 0),
+                        ==, 0);
+
+        /* the backup job keeps the old data in the hidden disk */
+        overlay_check_read(top_blk[i], 0x33, 0, IMG_SIZE / 2);
+        overlay_check_read(top_blk[i], 0x11, IMG_SIZE / 2, IMG_SIZE / 2);
+    }
+    aio_context_release(ctx);
+
+    replication_do_checkpoint_all(&error_abort);
+
+    aio_context_acquire(ctx);
+    for (i = 0; i < 2; i++) {
+        /* both the active and the hidden disk are empty again */
+        overlay_check_read(top_blk[i], 0x11, 0, IMG_SIZE / 2);
+        overlay_check_read(top_blk[i], 0x22, IMG_SIZE / 2, IMG_SIZE / 2);
+    }
+
+    /* unblock top_bs */
+    replication_stop_all(true, &error_abort);
+
+    for (i = 0; i < 2; i++) {
+        blk_set_aio_context(top_blk[i], qemu_get_aio_context(), &error_abort);
+    }
+    aio_context_release(ctx);
+
+    for (i = 0; i < 2; i++) {
+        teardown_secondary_disks(ids[i], local_ids[i]);
+    }
+
+    iothread_join(iothread);
+    g_free(buf);
+}
+
+/* replication-overlay as both the active and the hidden disk */
+static BlockBackend *start_secondary_overlay(void)
+{
+    BlockBackend *blk;
+    char *cmdline;
+
+    start_secondary_local_disk(S_LOCAL_DISK_ID, s_local_disk);
+
+    cmdline = g_strdup_printf("driver=replication,mode=secondary,top-id=%s,"
+                              "file.driver=replication-overlay,file.size=%d,"
+                              "file.backing.driver=replication-overlay,"
+                              "file.backing.size=%d,"
+                              "file.backing.backing=%s"
+                              , S_ID, IMG_SIZE, IMG_SIZE, S_LOCAL_DISK_ID);
+    blk = start_secondary_top(S_ID, cmdline);
+    g_free(cmdline);
+
+    return blk;
+}
+
+static void test_secondary_overlay(void)
+{
+    BlockBackend *top_blk, *local_blk;
+
+    top_blk = start_secondary_overlay();
+    replication_start_all(REPLICATION_MODE_SECONDARY, &error_abort);
+
+    /* write 0x22 to s_local_disk (IMG_SIZE / 2, IMG_SIZE) */
+    local_blk = blk_by_name(S_LOCAL_DISK_ID);
+    test_blk_write(local_blk, 0x22, IMG_SIZE / 2, IMG_SIZE / 2, false);
+
+    /* replication will backup s_local_disk to the hidden overlay */
+    overlay_check_read(top_blk, 0x11, IMG_SIZE / 2, IMG_SIZE / 2);
+
+    /* write 0x33 to the active overlay (0, IMG_SIZE / 2) */
+    test_blk_write(top_blk, 0x33, 0, IMG_SIZE / 2, false);
+    overlay_check_read(top_blk, 0x33, 0, IMG_SIZE / 2);
+
+    /* the checkpoint empties both overlays */
+    replication_do_checkpoint_all(&error_abort);
+    overlay_check_read(top_blk, 0x11, 0, IMG_SIZE / 2);
+    overlay_check_read(top_blk, 0x22, IMG_SIZE / 2, IMG_SIZE / 2);
+
+    /* write 0x44 to the active overlay (0, IMG_SIZE / 2) */
+    test_blk_write(top_blk, 0x44, 0, IMG_SIZE / 2, false);
+
+    /* do failover (active commit) */
+    replication_stop_all(true, &error_abort);
+    overlay_check_read(top_blk, 0x44, 0, IMG_SIZE / 2);
+    overlay_check_read(top_blk, 0x22, IMG_SIZE / 2, IMG_SIZE / 2);
+
+    teardown_secondary();
+}
+#endif
+
 static void sigabrt_handler(int signo)
 {
     cleanup_imgs();
@@ -578,6 +892,10 @@ int main(int argc, char **argv)
     s_local_disk = g_strdup_printf("%s/s_local_disk.XXXXXX", tmpdir);
     s_active_disk = g_strdup_printf("%s/s_active_disk.XXXXXX", tmpdir);
     s_hidden_disk = g_strdup_printf("%s/s_hidden_disk.XXXXXX", tmpdir);
+    s2_local_disk = g_strdup_printf("%s/s2_local_disk.XXXXXX", tmpdir);
+    s2_active_disk = g_strdup_printf("%s/s2_active_disk.XXXXXX", tmpdir);
+    s2_hidden_disk = g_strdup_printf("%s/s2_hidden_disk.XXXXXX", tmpdir);
+    o_base_disk = g_strdup_printf("%s/o_base_disk.XXXXXX", tmpdir);
     qemu_init_main_loop(&error_fatal);
     bdrv_init();
 
@@ -608,8 +926,18 @@ int main(int argc, char **argv)
                     test_secondary_do_checkpoint);
     g_test_add_func("/replication/secondary/get_error_all",
                     test_secondary_get_error_all);
+    g_test_add_func("/replication/secondary/iothread_checkpoint",
+                    test_secondary_iothread_checkpoint);
+    g_test_add_func("/replication/secondary/overlay",
+                    test_secondary_overlay);
 #endif
 
+    /* replication-overlay */
+    g_test_add_func("/replication/overlay/read_write",
+                    test_overlay_read_write);
+    g_test_add_func("/replication/overlay/make_empty",
+                    test_overlay_make_empty);
+
     ret = g_test_run();
 
     cleanup_imgs();
@@ -618,6 +946,10 @@ int main(int argc, char **argv)
     g_free(s_local_disk);
     g_free(s_active_disk);
     g_free(s_hidden_disk);
+    g_free(s2_local_disk);
+    g_free(s2_active_disk);
+    g_free(s2_hidden_disk);
+    g_free(o_base_disk);
 
     return ret;
 }
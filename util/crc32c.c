@@ -105,11 +105,71 @@ static const uint32_t crc32c_table[256] = {
 };
 
 
-uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+static uint32_t crc32c_int(uint32_t crc, const uint8_t *data,
+                           unsigned int length)
 {
     while (length--) {
         crc = crc32c_table[(crc ^ *data++) & 0xFFL] ^ (crc >> 8);
     }
-    return crc^0xffffffff;
+    return crc;
+}
+
+#if defined(CONFIG_CPUID_H) && defined(__x86_64__)
+#include "qemu/cpuid.h"
+#include <nmmintrin.h>
+
+/* The SSE4.2 crc32 instruction uses the same polynomial */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    uint64_t crc64 = crc;
+
+    for (; length >= 8; length -= 8, data += 8) {
+        uint64_t val;
+
+        memcpy(&val, data, sizeof(val));
+        crc64 = _mm_crc32_u64(crc64, val);
+    }
+
+    crc = crc64;
+    while (length--) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+static uint32_t (*crc32c_accel)(uint32_t, const uint8_t *,
+                                unsigned int) = crc32c_int;
+
+static void __attribute__((constructor)) crc32c_init_accel(void)
+{
+    unsigned int a, b, c, d;
+
+    if (__get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSE4_2)) {
+        crc32c_accel = crc32c_sse42;
+    }
+}
+
+bool test_crc32c_next_accel(void)
+{
+    /* crc32c_int is the last one, there is nothing left to test after it */
+    if (crc32c_accel == crc32c_int) {
+        return false;
+    }
+    crc32c_accel = crc32c_int;
+    return true;
+}
+#else
+#define crc32c_accel crc32c_int
+
+bool test_crc32c_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length)
+{
+    return crc32c_accel(crc, data, length) ^ 0xffffffff;
 }
 